@@ -0,0 +1,47 @@
+#ifndef	_CDEFLATE_H
+#define	_CDEFLATE_H
+
+#include <sys/types.h>
+#include "libcbuf.h"
+
+/*
+ * Streaming compression of buffer queues, as raw deflate (RFC 1951).  A
+ * stream compresses or decompresses in one direction only, and keeps its
+ * dictionary for its whole lifetime, so that a series of small, similar
+ * messages compresses well.
+ *
+ * Output is appended directly to the tail of the destination queue, which
+ * must hold buffers ready for gets.  When more room is needed, a buffer of
+ * "bufsz" bytes is obtained from "getbuf".
+ */
+typedef struct cdeflate cdeflate_t;
+
+typedef int cdeflate_buf_func_t(size_t sz, cbuf_t **cbufp);
+
+typedef enum cdeflate_flush {
+	CDEFLATE_FLUSH_NONE = 0,
+	CDEFLATE_FLUSH_SYNC,		/* peer may decode everything so far */
+	CDEFLATE_FLUSH_FINISH		/* end of stream */
+} cdeflate_flush_t;
+
+extern int cdeflate_alloc(cdeflate_t **cdp, boolean_t decompress);
+extern void cdeflate_free(cdeflate_t *cd);
+
+/*
+ * Compress "len" bytes from "buf" onto "out".  The number of compressed
+ * bytes added to the queue is stored in "producedp".
+ */
+extern int cdeflate_compress(cdeflate_t *cd, const void *buf, size_t len,
+    cdeflate_flush_t flush, cbufq_t *out, cdeflate_buf_func_t *getbuf,
+    size_t bufsz, size_t *producedp);
+
+/*
+ * Decompress data from the front of "in" onto "out", until "in" is empty or
+ * "max" bytes have been produced.  Consumed input is discarded from "in".
+ * Corrupt input fails with EPROTO.
+ */
+extern int cdeflate_decompress(cdeflate_t *cd, cbufq_t *in, cbufq_t *out,
+    size_t max, cdeflate_buf_func_t *getbuf, size_t bufsz,
+    size_t *consumedp, size_t *producedp);
+
+#endif	/* !_CDEFLATE_H */
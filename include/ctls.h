@@ -0,0 +1,40 @@
+#ifndef	_CTLS_H
+#define	_CTLS_H
+
+#include <sys/types.h>
+#include "libcbuf.h"
+
+/*
+ * TLS sessions for cserver connections.  The handshake is run in user space
+ * by the TLS library.  Where the platform supports kernel TLS, the session
+ * keys are then handed to the kernel, and the socket may be read and written
+ * directly; otherwise records are processed with ctls_read() and
+ * ctls_write(), which have the same semantics as cbuf_sys_read() and
+ * cbufq_sys_write().
+ */
+typedef struct ctls_ctx ctls_ctx_t;
+typedef struct ctls ctls_t;
+
+extern int ctls_ctx_alloc(ctls_ctx_t **ctxp, const char *certfile,
+    const char *keyfile);
+extern void ctls_ctx_free(ctls_ctx_t *ctx);
+
+extern int ctls_alloc(ctls_t **ctlsp, ctls_ctx_t *ctx, int fd);
+extern void ctls_free(ctls_t *ctls);
+
+/*
+ * Advance the handshake.  Returns 0 once it is complete.  If the socket must
+ * become readable or writable first, -1 is returned with errno set to EAGAIN,
+ * and the cloop event to wait for is stored in "eventp".
+ */
+extern int ctls_handshake(ctls_t *ctls, int *eventp);
+extern boolean_t ctls_kernel(ctls_t *ctls);
+
+extern int ctls_read(ctls_t *ctls, cbuf_t *cbuf, size_t want,
+    size_t *actual);
+extern size_t ctls_pending(ctls_t *ctls);
+extern int ctls_write(ctls_t *ctls, cbufq_t *cbufq, size_t want,
+    size_t *actual);
+extern void ctls_close_notify(ctls_t *ctls);
+
+#endif	/* !_CTLS_H */
@@ -47,6 +47,13 @@ extern int custr_alloc_buf(custr_t **, void *, size_t);
 extern int custr_appendc(custr_t *, char);
 extern int custr_append(custr_t *, const char *);
 
+/*
+ * Append "len" bytes from "buf", which may include NUL characters.  These
+ * are counted by custr_len(), though the string returned by custr_cstr()
+ * will appear to end at the first of them.
+ */
+extern int custr_append_buf(custr_t *, const void *, size_t);
+
 /*
  * Append a format string and arguments as though the contents were being parsed
  * through snprintf. Returns 0 on success and -1 otherwise.  The dynamic string
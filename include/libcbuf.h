@@ -3,6 +3,8 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <sys/types.h>
+#include <time.h>
 #include "custr.h"
 
 /*
@@ -14,6 +16,7 @@
 
 typedef struct cbuf cbuf_t;
 typedef struct cbufq cbufq_t;
+typedef struct cbuf_pool cbuf_pool_t;
 
 /*
  * Create and free buffers.  At creation, the position is 0 and the limit is
@@ -22,6 +25,40 @@ typedef struct cbufq cbufq_t;
 extern int cbuf_alloc(cbuf_t **cbufp, size_t capacity);
 extern void cbuf_free(cbuf_t *cbuf);
 
+/*
+ * File-backed buffers.  cbuf_alloc_file() creates a buffer that describes
+ * "len" bytes of the file "fd", starting at offset "off", without reading
+ * them into memory.  The buffer holds its own duplicate of the descriptor.
+ * File-backed buffers are read-only, cannot be duplicated, and may only be
+ * consumed with cbuf_sys_write(), which uses sendfile(3EXT) to move the data
+ * directly from the file to the output descriptor.
+ */
+extern int cbuf_alloc_file(cbuf_t **cbufp, int fd, off_t off, size_t len);
+
+/*
+ * Buffer pools.  A pool caches freed buffers in power-of-two size classes
+ * from "min_size" to "max_size", keeping at most "max_cached" idle buffers
+ * in each class.  cbuf_pool_get() returns a buffer with at least the
+ * requested capacity, which goes back to the pool when passed to
+ * cbuf_free().  Requests larger than the largest class are satisfied with
+ * an ordinary allocation.  Every buffer obtained from a pool must be freed
+ * before the pool itself.
+ */
+extern int cbuf_pool_alloc(cbuf_pool_t **poolp, size_t min_size,
+    size_t max_size, unsigned int max_cached);
+extern void cbuf_pool_free(cbuf_pool_t *pool);
+extern int cbuf_pool_get(cbuf_pool_t *pool, size_t capacity, cbuf_t **cbufp);
+
+/*
+ * Create a new buffer that refers to the same backing store as "cbuf", with
+ * the same position and limit, but without copying the data.  Once a buffer
+ * has been duplicated, the original and all of its duplicates become
+ * read-only.  Each must still be freed with cbuf_free(); the backing store
+ * is released when the last of them is freed.
+ */
+extern int cbuf_dup(cbuf_t *cbuf, cbuf_t **dupp);
+extern boolean_t cbuf_readonly(cbuf_t *cbuf);
+
 extern int cbuf_extend(cbuf_t *cbuf, size_t new_capacity);
 extern int cbuf_shrink(cbuf_t *cbuf);
 
@@ -37,7 +74,7 @@ extern size_t cbuf_available(cbuf_t *cbuf);
 
 /*
  * Number of unused bytes; i.e., number of bytes from current limit to
- * capacity.
+ * capacity.  A read-only buffer has no unused bytes.
  */
 extern size_t cbuf_unused(cbuf_t *cbuf);
 
@@ -87,6 +124,16 @@ extern void cbuf_resume(cbuf_t *cbuf);
  */
 extern void cbuf_compact(cbuf_t *cbuf);
 
+/*
+ * Direct access to the unused region between the limit and the capacity, for
+ * producers that wish to fill the buffer in place.  Once "len" bytes have
+ * been written at the pointer returned by cbuf_unused_ptr(), a call to
+ * cbuf_limit_extend() advances the limit so that those bytes are available
+ * to subsequent gets.
+ */
+extern void *cbuf_unused_ptr(cbuf_t *cbuf);
+extern int cbuf_limit_extend(cbuf_t *cbuf, size_t len);
+
 typedef enum cbuf_order {
 	CBUF_ORDER_BIG_ENDIAN = 1,
 	CBUF_ORDER_LITTLE_ENDIAN
@@ -118,18 +165,32 @@ extern int cbuf_put_i16(cbuf_t *cbuf, int16_t val);
 extern int cbuf_put_i32(cbuf_t *cbuf, int32_t val);
 extern int cbuf_put_i64(cbuf_t *cbuf, int64_t val);
 
-#if 0
+/*
+ * Obtain a pointer to "length" bytes of data, starting "offset" bytes past
+ * the current position, without consuming them.
+ */
 extern int cbuf_get_ptr(cbuf_t *cbuf, size_t offset, size_t length, void **val);
 
 #define	CBUF_GET_PTR(cbuf, offset, valpp) \
 	cbuf_get_ptr(cbuf, offset, sizeof (**valpp), (void **)valpp)
-#endif
 
 #define	CBUF_SYSREAD_ENTIRE		0
 
 extern int cbuf_sys_read(cbuf_t *cbuf, int fd, size_t want, size_t *actual);
 extern int cbuf_sys_write(cbuf_t *cbuf, int fd, size_t want, size_t *actual);
 
+/*
+ * Receive timestamps.  cbuf_sys_recv() reads from a socket as
+ * cbuf_sys_read() does, and also stores in "tsp" the time (CLOCK_REALTIME)
+ * at which the kernel received the data, if the platform has SO_TIMESTAMPNS
+ * and it is enabled on the socket; otherwise "tsp" is zeroed.  A buffer
+ * remembers the arrival time of the first data received into it, which
+ * cbuf_rxtime() returns, or zero if it is not known.
+ */
+extern int cbuf_sys_recv(cbuf_t *cbuf, int fd, size_t want, size_t *actual,
+    struct timespec *tsp);
+extern void cbuf_rxtime(cbuf_t *cbuf, struct timespec *tsp);
+
 extern size_t cbuf_copy(cbuf_t *, cbuf_t *);
 
 extern void cbuf_dump(cbuf_t *cbuf, FILE *fp);
@@ -137,6 +198,39 @@ extern void cbufq_dump(cbufq_t *cbufq, FILE *fp);
 
 extern int cbufq_pullup(cbufq_t *cbufq, size_t min_contig);
 
+/*
+ * Replace a read-only buffer at the head of the queue with a private copy of
+ * its remaining data, so that it may be modified.
+ */
+extern int cbufq_unshare(cbufq_t *cbufq);
+
+/*
+ * Find the first occurrence of "pat", starting "start" bytes into the data
+ * in the queue.  The pattern may span buffers.  On success, the offset of
+ * the match is stored in "offp"; if there is no match, -1 is returned with
+ * errno set to ENOENT.
+ */
+extern int cbufq_search(cbufq_t *cbufq, size_t start, const void *pat,
+    size_t patlen, size_t *offp);
+
+/*
+ * Consume "len" bytes from the front of the queue, freeing any buffers that
+ * are emptied as a result.
+ */
+extern int cbufq_discard(cbufq_t *cbufq, size_t len);
+
+/*
+ * Write as much of the queue as possible to "fd" with a single writev(2),
+ * gathering up to CBUFQ_IOV_MAX buffers.  A file-backed buffer is written on
+ * its own once it reaches the head of the queue.  At most "want" bytes are
+ * written, or as many as possible if "want" is CBUF_SYSREAD_ENTIRE.  Written
+ * data is consumed, and any buffers emptied as a result are freed.
+ */
+#define	CBUFQ_IOV_MAX			16
+
+extern int cbufq_sys_write(cbufq_t *cbufq, int fd, size_t want,
+    size_t *actual);
+
 /*
  * BUFFER QUEUES
  */
@@ -144,11 +238,26 @@ extern int cbufq_pullup(cbufq_t *cbufq, size_t min_contig);
 extern int cbufq_alloc(cbufq_t **);
 extern void cbufq_free(cbufq_t *);
 
+/*
+ * Initialise and tear down a queue embedded in another object, for callers
+ * that can see libcbuf_impl.h.
+ */
+extern void cbufq_init(cbufq_t *);
+extern void cbufq_fini(cbufq_t *);
+
 extern void cbufq_enq(cbufq_t *, cbuf_t *);
+extern void cbufq_move(cbufq_t *dst, cbufq_t *src);
 extern cbuf_t *cbufq_deq(cbufq_t *);
 extern cbuf_t *cbufq_peek(cbufq_t *);
 extern cbuf_t *cbufq_peek_tail(cbufq_t *);
 
+/*
+ * Walk the buffers in the queue.  Unlike cbufq_peek(), these routines do not
+ * compact the buffers they return.
+ */
+extern cbuf_t *cbufq_first(cbufq_t *);
+extern cbuf_t *cbufq_next(cbufq_t *, cbuf_t *);
+
 extern size_t cbufq_available(cbufq_t *);
 extern size_t cbufq_count(cbufq_t *);
 
@@ -5,6 +5,14 @@
 
 #include <sys/list.h>
 
+/*
+ * Backing store shared between several buffers by cbuf_dup().
+ */
+typedef struct cbuf_shared {
+	unsigned int cbsh_refcnt;
+	uint8_t *cbsh_base;
+} cbuf_shared_t;
+
 struct cbuf {
 	uint8_t *cbuf_data;
 	size_t cbuf_capacity;
@@ -14,6 +22,14 @@ struct cbuf {
 
 	cbuf_order_t cbuf_order;
 
+	cbuf_shared_t *cbuf_shared;	/* shared backing store, or NULL */
+	cbuf_pool_t *cbuf_pool;		/* pool to return to, or NULL */
+
+	int cbuf_fd;			/* file-backed buffer, or -1 */
+	off_t cbuf_fdoff;		/* file offset of index 0 */
+
+	struct timespec cbuf_rxtime;	/* kernel arrival time, or zero */
+
 	list_node_t cbuf_link;		/* cbufq_t linkage */
 };
 
@@ -23,6 +39,23 @@ struct cbufq {
 	list_t cbufq_bufs;		/* queue of cbuf_t */
 };
 
+#define	CBUF_POOL_MAX_CLASSES	16
+
+typedef struct cbuf_pool_class {
+	size_t cbpc_size;
+	unsigned int cbpc_ncached;
+	list_t cbpc_free;		/* list of cbuf_t */
+} cbuf_pool_class_t;
+
+struct cbuf_pool {
+	unsigned int cbp_nclasses;
+	unsigned int cbp_max_cached;
+	cbuf_pool_class_t cbp_classes[CBUF_POOL_MAX_CLASSES];
+};
+
+#define	CBUF_IS_FILE(cbuf)	((cbuf)->cbuf_fd != -1)
+
 extern int cbuf_safe_add(size_t *, size_t, size_t);
+extern boolean_t cbuf_pool_put(cbuf_pool_t *, cbuf_t *);
 
 #endif	/* !_LIBCBUF_IMPL_H */
@@ -1,6 +1,9 @@
 #ifndef	_LIBCLOOP_H
 #define	_LIBCLOOP_H
 
+#include <sys/types.h>
+#include <sys/socket.h>
+
 typedef enum cloop_ent_cb_type {
 	CLOOP_CB_READ = 1,
 	CLOOP_CB_WRITE = 2,
@@ -18,10 +21,13 @@ typedef enum cloop_ent_type {
 typedef enum cserver_type {
 	CSERVER_TYPE_NONE = 0,
 	CSERVER_TYPE_TCP = 1,
+	CSERVER_TYPE_UNIX = 2,
+	CSERVER_TYPE_UDP = 3,
 } cserver_type_t;
 
 typedef enum cserver_cb_type {
 	CSERVER_CB_INCOMING = 1,
+	CSERVER_CB_DATAGRAM,
 } cserver_cb_type_t;
 
 typedef enum cconn_cb_type {
@@ -29,6 +35,9 @@ typedef enum cconn_cb_type {
 	CCONN_CB_ERROR,
 	CCONN_CB_END,
 	CCONN_CB_CLOSE,
+	CCONN_CB_DRAIN,
+	CCONN_CB_OVERFLOW,
+	CCONN_CB_CONNECTED,
 } cconn_cb_type_t;
 
 typedef struct cloop cloop_t;
@@ -44,15 +53,45 @@ extern void cloop_free(cloop_t *cloop);
 
 extern int cloop_run(cloop_t *cloop, unsigned int *again);
 
+/*
+ * Receive delay.  Where the kernel timestamps received stream data (see
+ * cso_timestamp), each read on a connection records how long the data had
+ * been waiting since it arrived, which grows when the loop is overloaded.
+ * Bucket "i" of the histogram counts delays of less than 2^i microseconds
+ * that did not fit in an earlier bucket; the last bucket also counts
+ * everything longer.  Where there are no such timestamps, cloop_rxdelay()
+ * fails with ENOTSUP, rather than report a histogram that is always empty.
+ */
+#define	CLOOP_RXDELAY_BUCKETS	24
+
+typedef struct cloop_rxdelay {
+	uint64_t clr_buckets[CLOOP_RXDELAY_BUCKETS];
+	uint64_t clr_count;
+	uint64_t clr_sum;			/* nanoseconds */
+} cloop_rxdelay_t;
+
+extern int cloop_rxdelay(cloop_t *cloop, cloop_rxdelay_t *clr);
+
 extern int cloop_ent_alloc(cloop_ent_t **clent);
 extern void cloop_ent_free(cloop_ent_t *clent);
 
+/*
+ * An entity may be embedded in a larger object, whose owner can see
+ * libcloop_impl.h.  cloop_ent_init() prepares one in place.  Once
+ * cloop_ent_free() has been called on it and the loop has finished with it,
+ * "release" is called, after which the memory may be reused.
+ */
+typedef void cloop_ent_release_t(cloop_ent_t *);
+
+extern void cloop_ent_init(cloop_ent_t *clent, cloop_ent_release_t *release);
+
 extern void *cloop_ent_data(cloop_ent_t *clent);
 extern void cloop_ent_data_set(cloop_ent_t *clent, void *data);
 
 extern void cloop_ent_on(cloop_ent_t *clent, int event, cloop_ent_cb_t *func);
 
 extern void cloop_ent_want(cloop_ent_t *clent, int event);
+extern void cloop_ent_unwant(cloop_ent_t *clent, int event);
 
 extern void cloop_attach_ent(cloop_t *cloop, cloop_ent_t *clent, int fd);
 extern int cloop_attach_ent_timer(cloop_t *cloop, cloop_ent_t *clent, int interval);
@@ -74,29 +113,419 @@ extern void cserver_free(cserver_t *csrv);
  */
 extern void cserver_close(cserver_t *);
 
+/*
+ * A NULL "ipaddr" listens on all IPv6 and IPv4 addresses.
+ */
 extern int cserver_listen_tcp(cserver_t *, cloop_t *, const char *ipaddr,
     const char *port);
+extern int cserver_listen_unix(cserver_t *, cloop_t *, const char *path);
+
+/*
+ * Datagram servers.  Each datagram received is delivered to the
+ * CSERVER_CB_DATAGRAM callback, during which its contents and source address
+ * may be retrieved; cserver_datagram_take() keeps the buffer beyond the
+ * callback.  Sends are batched, and are flushed when the batch fills, when
+ * the callback returns, or by cserver_flush().  The callback may close or
+ * free the server; a free takes effect once the callback returns.
+ */
+extern int cserver_listen_udp(cserver_t *, cloop_t *, const char *ipaddr,
+    const char *port);
+extern int cserver_datagram(cserver_t *, void **ptrp, size_t *lenp);
+extern const struct sockaddr *cserver_datagram_addr(cserver_t *,
+    socklen_t *lenp);
+extern int cserver_datagram_take(cserver_t *, cbuf_t **cbufp);
+extern int cserver_sendto(cserver_t *, const struct sockaddr *to,
+    socklen_t tolen, const void *buf, size_t len);
+extern int cserver_reply(cserver_t *, const void *buf, size_t len);
+extern int cserver_flush(cserver_t *);
 
 extern void cserver_destroy(cserver_t *);
 extern void cserver_abort(cserver_t *);
 
 extern int cserver_accept(cserver_t *, cconn_t **);
 
+/*
+ * TLS.  Once a certificate and key (PEM files) are set on a stream server,
+ * each connection it accepts completes a TLS handshake before any data is
+ * delivered.  Where the kernel supports it, records are then encrypted and
+ * decrypted in the kernel, so that sends and receives take the same path as
+ * they would without TLS; cconn_tls() reports which is in use.  A client
+ * that has not completed the handshake within ten seconds of being accepted
+ * is disconnected.
+ */
+typedef enum cconn_tls {
+	CCONN_TLS_NONE = 0,
+	CCONN_TLS_USER,
+	CCONN_TLS_KERNEL,
+} cconn_tls_t;
+
+extern int cserver_tls_set(cserver_t *, const char *certfile,
+    const char *keyfile);
+extern cconn_tls_t cconn_tls(cconn_t *);
+
 extern void cserver_on(cserver_t *, int, cserver_cb_t *);
 
+/*
+ * Socket options.  The backlog, buffer sizes, TCP_DEFER_ACCEPT and
+ * TCP_FASTOPEN are applied to the listen socket, and so must be set before
+ * one of the cserver_listen_*() functions is called; the rest are applied to
+ * each connection as it is accepted.  A zero value leaves the system default
+ * in place.  Options the platform does not support are ignored.
+ *
+ * A profile fills in a complete set of options: CSERVER_PROFILE_DEFAULT is
+ * what a new server uses; CSERVER_PROFILE_LOW_LATENCY suits small
+ * request/response traffic; CSERVER_PROFILE_BULK suits large transfers.
+ * Receive timestamps (see cloop_rxdelay()) cost a control message on every
+ * read, so no profile enables them.  They need SO_TIMESTAMPNS, and so are
+ * not available on illumos, which timestamps only datagrams.
+ */
+typedef struct cserver_opts {
+	int cso_backlog;
+	int cso_rcvbuf;				/* SO_RCVBUF, bytes */
+	int cso_sndbuf;				/* SO_SNDBUF, bytes */
+	boolean_t cso_keepalive;
+	int cso_keepidle;			/* seconds */
+	int cso_keepcnt;
+	int cso_keepintvl;			/* seconds */
+	boolean_t cso_nodelay;			/* TCP_NODELAY */
+	int cso_notsent_lowat;			/* TCP_NOTSENT_LOWAT, bytes */
+	int cso_defer_accept;			/* TCP_DEFER_ACCEPT, seconds */
+	int cso_fastopen;			/* TCP_FASTOPEN queue length */
+	int cso_user_timeout;			/* TCP_USER_TIMEOUT, ms */
+	boolean_t cso_timestamp;		/* SO_TIMESTAMPNS */
+} cserver_opts_t;
+
+typedef enum cserver_profile {
+	CSERVER_PROFILE_DEFAULT = 0,
+	CSERVER_PROFILE_LOW_LATENCY,
+	CSERVER_PROFILE_BULK,
+} cserver_profile_t;
+
+extern int cserver_opts_profile(cserver_opts_t *, cserver_profile_t);
+extern void cserver_opts_get(cserver_t *, cserver_opts_t *);
+extern int cserver_opts_set(cserver_t *, const cserver_opts_t *);
+
+/*
+ * Send queue limits.  Once a connection has more than "hiwat" bytes queued,
+ * or the server as a whole has more than its limit, sends fail with EAGAIN
+ * and CCONN_CB_DRAIN is delivered when the queue falls to "lowat".  The
+ * server-wide limit is only rechecked as each connection writes out its own
+ * queue, so a connection with nothing queued that was refused because of it
+ * must retry on its own schedule.
+ */
+extern void cserver_send_watermarks_set(cserver_t *, size_t lowat,
+    size_t hiwat);
+extern void cserver_send_limit_set(cserver_t *, size_t limit);
+
+/*
+ * Receive limits.  A peer that sends a line longer than "max_line" is
+ * disconnected, with CCONN_CB_OVERFLOW delivered in place of
+ * CCONN_CB_ERROR.  Once "max_buffered" bytes are waiting to be consumed, we
+ * stop reading from the socket until the consumer catches up.
+ */
+extern void cserver_recv_limits_set(cserver_t *, size_t max_line,
+    size_t max_buffered);
+
+/*
+ * Every connection has an id that is unique within the process.  Open
+ * connections accepted by a server may be found by id or by remote address
+ * (for IPv4 and IPv6 peers), and visited with cserver_walk(), whose callback
+ * may safely close connections.
+ */
+typedef int cserver_walk_cb_t(cconn_t *, void *);
+
+extern uint64_t cconn_id(cconn_t *);
+extern cconn_t *cserver_lookup_id(cserver_t *, uint64_t id);
+extern cconn_t *cserver_lookup_addr(cserver_t *, const struct sockaddr *,
+    socklen_t);
+extern int cserver_walk(cserver_t *, cserver_walk_cb_t *, void *);
+extern size_t cserver_connection_count(cserver_t *);
+
+/*
+ * Per-connection accounting.  "ccs_busy" is the time, in nanoseconds, spent
+ * handling socket events for the connection, which includes framing and the
+ * consumer's callbacks.  cserver_top() fills "top" with up to "n" open
+ * connections having the largest values of the given statistic, in
+ * descending order, and returns the number found.  The connection pointers
+ * are only valid until control returns to the event loop.
+ */
+typedef struct cconn_stats {
+	uint64_t ccs_bytes_in;
+	uint64_t ccs_bytes_out;
+	uint64_t ccs_frames_in;
+	uint64_t ccs_sends;
+	uint64_t ccs_recvq_max;			/* high-water marks */
+	uint64_t ccs_sendq_max;
+	uint64_t ccs_syscalls;
+	uint64_t ccs_busy;
+} cconn_stats_t;
+
+typedef enum cconn_stat {
+	CCONN_STAT_BYTES_IN = 1,
+	CCONN_STAT_BYTES_OUT,
+	CCONN_STAT_FRAMES_IN,
+	CCONN_STAT_SENDS,
+	CCONN_STAT_RECVQ_MAX,
+	CCONN_STAT_SENDQ_MAX,
+	CCONN_STAT_SYSCALLS,
+	CCONN_STAT_BUSY,
+} cconn_stat_t;
+
+typedef struct cconn_top {
+	cconn_t *cct_conn;
+	uint64_t cct_value;
+} cconn_top_t;
+
+extern const cconn_stats_t *cconn_stats(cconn_t *);
+extern int cserver_top(cserver_t *, cconn_stat_t, cconn_top_t *top,
+    unsigned int n);
+
+/*
+ * Priority classes.  Data sent as CCONN_PRIO_CONTROL is written ahead of
+ * normal data already queued, as soon as the message being written has been
+ * finished, so that heartbeats and other short control messages are not held
+ * up behind bulk data.  Each normal send is a message, except that sends
+ * made while the connection is corked form one message that ends when the
+ * last cork is removed.  Normal data still makes progress while control
+ * messages keep coming.  Each class is sent in order, and control sends are
+ * refused (with EAGAIN) only once control data alone reaches the high
+ * watermark.  On a compressed connection, everything is sent in order.
+ */
+typedef enum cconn_prio {
+	CCONN_PRIO_NORMAL = 0,
+	CCONN_PRIO_CONTROL
+} cconn_prio_t;
+
+typedef boolean_t cserver_filter_t(cconn_t *);
+typedef void cserver_sent_t(cconn_t *);
+
+extern int cserver_broadcast(cserver_t *, cbuf_t *, cserver_filter_t *);
+extern int cserver_broadcast_prio(cserver_t *, cbuf_t *, cserver_filter_t *,
+    cconn_prio_t, cserver_sent_t *);
+
 typedef void cconn_cb_t(cconn_t *, int);
 
 extern void cconn_on(cconn_t *, int, cconn_cb_t *);
 
+extern int cconn_connect(cloop_t *cloop, const char *host, const char *port,
+    cconn_t **ccnp);
+
+/*
+ * Framing.  A framer examines the receive queue and reports the extent of the
+ * next frame: "cfr_hdr" bytes of header, "cfr_len" bytes of payload and then
+ * "cfr_trail" bytes of trailer.  If the queue does not yet hold a complete
+ * frame, the framer fails with EAGAIN, leaving in "cfr_len" the number of
+ * payload bytes it knows the frame must have.  The structure is zeroed after
+ * each frame is consumed, and otherwise preserved between calls so that a
+ * framer may resume its scan.  Any other error tears down the connection.
+ *
+ * Connections use newline framing by default.  The length framer reads a
+ * "width" byte (2 or 4) length prefix in the given byte order.  Frames are
+ * delivered in place by cconn_frame(), and the data remains valid until
+ * cconn_next() is called.
+ */
+typedef struct cconn_frame {
+	size_t cfr_hdr;
+	size_t cfr_len;
+	size_t cfr_trail;
+} cconn_frame_t;
+
+typedef int cconn_framer_t(cbufq_t *recvq, void *arg, cconn_frame_t *cfr);
+
+extern void cconn_framer_set(cconn_t *ccn, cconn_framer_t *func, void *arg);
+extern void cconn_framing_newline(cconn_t *ccn);
+extern int cconn_framing_delimiter(cconn_t *ccn, const void *delim,
+    size_t len);
+extern int cconn_framing_length(cconn_t *ccn, unsigned int width,
+    unsigned int order);
+
+extern int cconn_frame(cconn_t *ccn, void **ptrp, size_t *lenp);
 extern custr_t *cconn_line(cconn_t *ccn);
 extern int cconn_send(cconn_t *ccn, custr_t *cu);
+extern int cconn_send_prio(cconn_t *ccn, custr_t *cu, cconn_prio_t prio);
+
+/*
+ * Zero-copy sends.  cconn_send_reserve() returns a pointer to at least
+ * "min_len" contiguous bytes of send queue memory; the producer writes its
+ * output there and then calls cconn_send_commit() with the number of bytes
+ * actually used.  The reservation is only valid until the next call into
+ * the connection or the event loop.  cconn_send_cbuf() transfers ownership
+ * of a buffer that is ready for gets to the send queue without copying it.
+ */
+extern int cconn_send_reserve(cconn_t *ccn, size_t min_len, void **ptrp,
+    size_t *availp);
+extern int cconn_send_commit(cconn_t *ccn, size_t used);
+extern int cconn_send_cbuf(cconn_t *ccn, cbuf_t *cbuf);
+extern int cconn_send_cbuf_prio(cconn_t *ccn, cbuf_t *cbuf,
+    cconn_prio_t prio);
+extern int cconn_send_file(cconn_t *ccn, int fd, off_t off, size_t len);
+
+/*
+ * Pipelining.  Normally a connection delivers one frame at a time, and the
+ * next is not delivered until cconn_next() is called.  Once pipelining is
+ * enabled, a frame may instead be taken with cconn_defer() and answered
+ * later, while further frames are delivered; up to "depth" requests may be
+ * outstanding.  The response to each request is built with cconn_req_send(),
+ * and is sent when cconn_req_done() has been called for it and for every
+ * earlier request, so that responses go out in request order.  Data sent
+ * directly on the connection is not held back behind pending responses, but
+ * a FIN from cconn_fin() is: it is sent once the last response has gone, and
+ * further direct sends fail with EPIPE in the meantime.
+ */
+typedef struct cconn_req cconn_req_t;
+
+extern void cconn_pipeline(cconn_t *ccn, unsigned int depth);
+extern int cconn_defer(cconn_t *ccn, cconn_req_t **reqp);
+extern cconn_t *cconn_req_conn(cconn_req_t *req);
+extern void cconn_req_frame(cconn_req_t *req, void **ptrp, size_t *lenp);
+extern int cconn_req_send(cconn_req_t *req, const void *buf, size_t len);
+extern void cconn_req_done(cconn_req_t *req);
+
+/*
+ * Compression.  Once both ends have agreed to it, cconn_compress() switches
+ * the connection to a raw deflate stream in each direction, starting with
+ * sends made after the call and with data received after the current frame.
+ * Each send is flushed, unless the connection is corked, so that the peer
+ * can decode it on arrival.  File sends are not supported on a compressed
+ * connection.  A send that fails for want of memory once compression is on
+ * cannot be retried, and the connection is closed with CCONN_CB_ERROR.
+ */
+extern int cconn_compress(cconn_t *ccn);
+
+/*
+ * Relaying.  cconn_relay() joins two connections, so that everything received
+ * on each is sent on the other.  When one side reaches end-of-file, the other
+ * is shut down for writing once the data before it has been sent, and the
+ * pair close once both directions have finished; if either fails, the other
+ * is aborted.  A side is not read while its peer has more than its high
+ * watermark queued.  If a frame is available when the relay starts, it is
+ * consumed, and everything received after it is relayed.  Where splice(2) is
+ * available, data that needs no TLS or compression processing passes
+ * between the sockets through a pipe, without being copied into user space.
+ */
+extern int cconn_relay(cconn_t *a, cconn_t *b);
+
+/*
+ * Corking holds back sends until cconn_uncork(), so that a response made of
+ * several sends is written in full segments.  Corks nest.
+ */
+extern int cconn_cork(cconn_t *ccn);
+extern int cconn_uncork(cconn_t *ccn);
+
+extern void cconn_send_watermarks_set(cconn_t *ccn, size_t lowat,
+    size_t hiwat);
+extern size_t cconn_send_queued(cconn_t *ccn);
+
+extern void cconn_recv_limits_set(cconn_t *ccn, size_t max_line,
+    size_t max_buffered);
 extern void cconn_next(cconn_t *ccn);
 extern int cconn_fin(cconn_t *ccn);
 extern int cconn_abort(cconn_t *ccn);
 
+/*
+ * A held connection is not freed, even once it has closed, until the hold is
+ * released.
+ */
+extern void cconn_hold(cconn_t *ccn);
+extern void cconn_rele(cconn_t *ccn);
+
 extern void *cconn_data(cconn_t *ccn);
 extern void cconn_data_set(cconn_t *ccn, void *data);
 
 extern const char *cconn_remote_addr_str(cconn_t *ccn);
 
+/*
+ * Connection pools.  Requests to a destination are spread over up to
+ * "max_conns" connections, with up to "max_inflight" requests pipelined on
+ * each; see cpool_request() for the delivery of replies.
+ */
+typedef struct cpool cpool_t;
+typedef void cpool_cb_t(void *arg, cconn_t *ccn, int err);
+
+extern int cpool_alloc(cpool_t **cpp, cloop_t *cloop, unsigned int max_conns,
+    unsigned int max_inflight);
+extern void cpool_free(cpool_t *cp);
+extern int cpool_request(cpool_t *cp, const char *host, const char *port,
+    const void *buf, size_t len, cpool_cb_t *cb, void *arg);
+
+/*
+ * Stream multiplexing.  cmux_alloc() takes over a connection, replacing its
+ * framing, callbacks and consumer data, and carries any number of streams
+ * over it; "client" is B_TRUE on the side that opened the connection.  Either
+ * side may open a stream with cmux_open(), and the peer learns of it through
+ * CMUX_CB_STREAM when the first message arrives.  Messages of up to
+ * CMUX_MSG_MAX bytes are delivered whole, in order within a stream, through
+ * CMUX_CB_DATA; cmux_stream_msg() returns the message during the callback.
+ *
+ * Each stream has its own flow control window.  A paused stream holds what
+ * arrives until it is resumed, and the peer stops sending on it once the
+ * window is full.  cmux_stream_send() fails with EAGAIN once too much is
+ * queued on the stream, and CMUX_CB_WRITABLE follows when there is room
+ * again.  Streams with data to send take turns on the connection.
+ *
+ * cmux_stream_fin() ends the stream in our direction, once queued messages
+ * have been sent, and CMUX_CB_END reports the end of the peer's direction.
+ * The stream closes when both directions have ended, or when either side
+ * resets it (CMUX_CB_RESET reports a reset by the peer, the loss of the
+ * connection, or that queued messages were dropped because the peer ended
+ * the connection before granting the window they needed).  CMUX_CB_CLOSE
+ * is always the last callback for a stream, and for the multiplexer itself,
+ * which goes away with its connection.
+ */
+typedef struct cmux cmux_t;
+typedef struct cmux_stream cmux_stream_t;
+
+typedef enum cmux_cb_type {
+	CMUX_CB_STREAM = 1,
+	CMUX_CB_DATA,
+	CMUX_CB_WRITABLE,
+	CMUX_CB_END,
+	CMUX_CB_RESET,
+	CMUX_CB_CLOSE,
+} cmux_cb_type_t;
+
+#define	CMUX_MSG_MAX		(64 * 1024)
+
+typedef void cmux_cb_t(cmux_t *, cmux_stream_t *, int);
+typedef void cmux_stream_cb_t(cmux_stream_t *, int);
+
+extern int cmux_alloc(cmux_t **cmxp, cconn_t *ccn, boolean_t client);
+extern void cmux_on(cmux_t *cmx, int event, cmux_cb_t *func);
+extern cconn_t *cmux_conn(cmux_t *cmx);
+extern void *cmux_data(cmux_t *cmx);
+extern void cmux_data_set(cmux_t *cmx, void *data);
+extern void cmux_close(cmux_t *cmx);
+extern void cmux_abort(cmux_t *cmx);
+
+extern int cmux_open(cmux_t *cmx, cmux_stream_t **cmsp);
+extern void cmux_stream_on(cmux_stream_t *cms, int event,
+    cmux_stream_cb_t *func);
+extern uint32_t cmux_stream_id(cmux_stream_t *cms);
+extern cmux_t *cmux_stream_mux(cmux_stream_t *cms);
+extern void *cmux_stream_data(cmux_stream_t *cms);
+extern void cmux_stream_data_set(cmux_stream_t *cms, void *data);
+extern int cmux_stream_send(cmux_stream_t *cms, const void *buf, size_t len);
+extern int cmux_stream_msg(cmux_stream_t *cms, void **ptrp, size_t *lenp);
+extern void cmux_stream_pause(cmux_stream_t *cms);
+extern void cmux_stream_resume(cmux_stream_t *cms);
+extern int cmux_stream_fin(cmux_stream_t *cms);
+extern void cmux_stream_reset(cmux_stream_t *cms);
+
+/*
+ * HTTP.  A handler answers HTTP/1.1 GET and HEAD requests for a fixed set of
+ * paths, such as health checks and metrics, on connections attached to it
+ * with chttp_attach(); connections are kept alive, and pipelined requests
+ * are answered in order.  The response for each path is rendered once, by
+ * chttp_set(), and shared by every request for it until it is set again.
+ * Other paths are answered with 404.  Other methods, and requests with a
+ * body, are answered with an error, after which the connection is shut down.
+ */
+typedef struct chttp chttp_t;
+
+extern int chttp_alloc(chttp_t **chp);
+extern void chttp_free(chttp_t *ch);
+extern int chttp_set(chttp_t *ch, const char *path, const char *content_type,
+    const void *body, size_t len);
+extern int chttp_attach(chttp_t *ch, cconn_t *ccn);
+
 #endif	/* !_LIBCLOOP_H */
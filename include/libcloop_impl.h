@@ -6,7 +6,9 @@
 
 struct cloop {
 	list_t cloop_ents;
+	list_t cloop_reassoc;			/* entities to reassociate */
 	int cloop_port;
+	cloop_rxdelay_t cloop_rxdelay;
 };
 
 struct cloop_ent {
@@ -24,13 +26,17 @@ struct cloop_ent {
 	cloop_ent_cb_t *clent_on_hup;
 	cloop_ent_cb_t *clent_on_err;
 	cloop_ent_cb_t *clent_on_timer;
+	cloop_ent_release_t *clent_release;	/* embedded entities only */
 
 	void *clent_data;
 
 	cloop_t *clent_loop;
 	list_node_t clent_link;
+	list_node_t clent_reassoc_link;
 };
 
+extern void cloop_rxdelay_record(cloop_t *cloop, uint64_t nsec);
+
 #if 0
 #define	CLOOP_ENT_FIELDS						\
 	cloop_ent_type_t clent_type;					\
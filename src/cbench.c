@@ -0,0 +1,263 @@
+/*
+ * cbench: measure the memory cost of idle connections.
+ *
+ * A large number of loopback connections are opened to a cserver in this
+ * process, and one heartbeat is exchanged on each.  Once every connection is
+ * idle again, the growth in resident set size is reported per connection.
+ * The client end of each connection is a bare socket, which costs kernel
+ * memory but (almost) nothing in our address space.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <err.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <procfs.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/debug.h>
+#include <errno.h>
+#include <inttypes.h>
+
+#include "libcbuf.h"
+#include "libcloop.h"
+
+/*
+ * Every client socket takes an ephemeral port on the one loopback address,
+ * and the ephemeral range (32768-65535 by default) must also leave room for
+ * anything else running on the machine.  Larger runs need the range widened
+ * with ipadm(1M) first, and "-n" to ask for more.
+ */
+#define	CBENCH_CONNS		10000
+#define	CBENCH_ADDR		"127.0.0.1"
+#define	CBENCH_PORT		"5599"
+
+/*
+ * Connections are opened in batches small enough to fit in the listen
+ * backlog, so that a blocking connect(3SOCKET) completes at once.
+ */
+#define	CBENCH_BATCH		500
+
+static const char cbench_hb[] = "{\"type\":\"heartbeat\"}\n";
+
+static cserver_t *csrv;
+static custr_t *reply;
+static unsigned long naccepted;
+static unsigned long nlines;
+
+static void
+cbench_on_line(cconn_t *ccn, int event)
+{
+	VERIFY(event == CCONN_CB_LINE_AVAILABLE);
+
+	cconn_next(ccn);
+	nlines++;
+
+	if (cconn_send(ccn, reply) != 0) {
+		warn("cconn_send");
+		(void) cconn_abort(ccn);
+	}
+}
+
+static void
+cbench_on_incoming(cserver_t *srv, int event)
+{
+	cconn_t *ccn;
+
+	VERIFY(event == CSERVER_CB_INCOMING);
+
+	while (cserver_accept(srv, &ccn) == 0) {
+		cconn_on(ccn, CCONN_CB_LINE_AVAILABLE, cbench_on_line);
+		naccepted++;
+	}
+	if (errno != EAGAIN) {
+		warn("cserver_accept");
+	}
+}
+
+static int
+cbench_queued(cconn_t *ccn, void *arg)
+{
+	size_t *total = arg;
+
+	*total += cconn_send_queued(ccn);
+	return (0);
+}
+
+static size_t
+cbench_rss(void)
+{
+	psinfo_t psi;
+	int fd;
+
+	if ((fd = open("/proc/self/psinfo", O_RDONLY)) < 0) {
+		err(1, "open /proc/self/psinfo");
+	}
+	if (read(fd, &psi, sizeof (psi)) != sizeof (psi)) {
+		err(1, "read /proc/self/psinfo");
+	}
+	VERIFY0(close(fd));
+
+	return ((size_t)psi.pr_rssize * 1024);
+}
+
+static void
+cbench_run_until(cloop_t *cloop, unsigned long *count, unsigned long want)
+{
+	unsigned int again;
+
+	while (*count < want) {
+		if (cloop_run(cloop, &again) != 0 || !again) {
+			errx(1, "event loop stopped");
+		}
+	}
+}
+
+static int
+cbench_connect(const struct sockaddr_in *sin)
+{
+	int fd;
+
+	if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+		err(1, "socket");
+	}
+	if (connect(fd, (struct sockaddr *)sin, sizeof (*sin)) != 0) {
+		err(1, "connect");
+	}
+
+	return (fd);
+}
+
+int
+main(int argc, char *argv[])
+{
+	unsigned long nconns = CBENCH_CONNS;
+	const char *addr = CBENCH_ADDR;
+	const char *port = CBENCH_PORT;
+	struct sockaddr_in sin;
+	struct rlimit rl;
+	cloop_t *cloop;
+	size_t rss_before, rss_after, queued;
+	unsigned int again;
+	int *fds;
+	int c;
+
+	while ((c = getopt(argc, argv, "a:n:p:")) != -1) {
+		switch (c) {
+		case 'a':
+			addr = optarg;
+			break;
+		case 'n':
+			if ((nconns = strtoul(optarg, NULL, 10)) == 0) {
+				errx(1, "invalid connection count: %s", optarg);
+			}
+			break;
+		case 'p':
+			port = optarg;
+			break;
+		default:
+			fprintf(stderr, "usage: cbench [-a addr] [-p port] "
+			    "[-n conns]\n");
+			return (2);
+		}
+	}
+
+	/*
+	 * Each connection has a descriptor at both ends.
+	 */
+	if (getrlimit(RLIMIT_NOFILE, &rl) != 0) {
+		err(1, "getrlimit");
+	}
+	if (rl.rlim_cur < 2 * nconns + 64) {
+		rl.rlim_cur = 2 * nconns + 64;
+		if (rl.rlim_max != RLIM_INFINITY && rl.rlim_cur > rl.rlim_max) {
+			errx(1, "%lu connections need %lu descriptors; the "
+			    "limit is %lu", nconns, (unsigned long)rl.rlim_cur,
+			    (unsigned long)rl.rlim_max);
+		}
+		if (setrlimit(RLIMIT_NOFILE, &rl) != 0) {
+			err(1, "setrlimit");
+		}
+	}
+
+	bzero(&sin, sizeof (sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons((in_port_t)atoi(port));
+	if (inet_pton(AF_INET, addr, &sin.sin_addr) != 1) {
+		errx(1, "invalid address: %s", addr);
+	}
+
+	if ((fds = calloc(nconns, sizeof (*fds))) == NULL) {
+		err(1, "calloc");
+	}
+
+	if (custr_alloc(&reply) != 0 ||
+	    custr_append(reply, "{\"type\":\"ok\"}\n") != 0) {
+		err(1, "custr");
+	}
+
+	if (cloop_alloc(&cloop) != 0) {
+		err(1, "cloop_alloc");
+	}
+	if (cserver_alloc(&csrv) != 0) {
+		err(1, "cserver_alloc");
+	}
+	cserver_on(csrv, CSERVER_CB_INCOMING, cbench_on_incoming);
+	if (cserver_listen_tcp(csrv, cloop, addr, port) != 0) {
+		err(1, "cserver_listen_tcp");
+	}
+
+	rss_before = cbench_rss();
+
+	for (unsigned long i = 0; i < nconns; i++) {
+		fds[i] = cbench_connect(&sin);
+
+		if ((i + 1) % CBENCH_BATCH == 0 || i + 1 == nconns) {
+			cbench_run_until(cloop, &naccepted, i + 1);
+		}
+	}
+
+	/*
+	 * Send one heartbeat on every connection, and wait for each to be
+	 * answered and for the answers to be written out.
+	 */
+	for (unsigned long i = 0; i < nconns; i++) {
+		if (write(fds[i], cbench_hb, sizeof (cbench_hb) - 1) !=
+		    (ssize_t)(sizeof (cbench_hb) - 1)) {
+			err(1, "write");
+		}
+	}
+	cbench_run_until(cloop, &nlines, nconns);
+	for (;;) {
+		queued = 0;
+		(void) cserver_walk(csrv, cbench_queued, &queued);
+		if (queued == 0) {
+			break;
+		}
+		if (cloop_run(cloop, &again) != 0 || !again) {
+			errx(1, "event loop stopped");
+		}
+	}
+
+	rss_after = cbench_rss();
+
+	printf("connections:       %lu\n", nconns);
+	printf("rss before:        %zu KB\n", rss_before / 1024);
+	printf("rss idle:          %zu KB\n", rss_after / 1024);
+	printf("bytes/connection:  %zu\n", rss_after > rss_before ?
+	    (rss_after - rss_before) / nconns : 0);
+
+	for (unsigned long i = 0; i < nconns; i++) {
+		VERIFY0(close(fds[i]));
+	}
+	free(fds);
+	cserver_free(csrv);
+	cloop_free(cloop);
+	custr_free(reply);
+	return (0);
+}
@@ -3,12 +3,18 @@
 #include <stddef.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include <errno.h>
 #include <sys/debug.h>
 #include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/time.h>
 #include <netinet/in.h>
 #include <inttypes.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/sendfile.h>
 #include <libcmdutils.h>
 
 #include "libcbuf_impl.h"
@@ -40,6 +46,7 @@ cbuf_alloc(cbuf_t **cbufp, size_t capacity)
 	cbuf->cbuf_limit = cbuf->cbuf_capacity;
 	cbuf->cbuf_position = 0;
 	cbuf->cbuf_order = CBUF_ORDER_BIG_ENDIAN;
+	cbuf->cbuf_fd = -1;
 
 	if ((cbuf->cbuf_data = malloc(cbuf->cbuf_capacity)) == NULL) {
 		free(cbuf);
@@ -50,6 +57,36 @@ cbuf_alloc(cbuf_t **cbufp, size_t capacity)
 	return (0);
 }
 
+int
+cbuf_alloc_file(cbuf_t **cbufp, int fd, off_t off, size_t len)
+{
+	cbuf_t *cbuf;
+
+	*cbufp = NULL;
+
+	if (off < 0) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	if ((cbuf = calloc(1, sizeof (*cbuf))) == NULL) {
+		return (-1);
+	}
+	cbuf->cbuf_capacity = len;
+	cbuf->cbuf_limit = len;
+	cbuf->cbuf_position = 0;
+	cbuf->cbuf_order = CBUF_ORDER_BIG_ENDIAN;
+	cbuf->cbuf_fdoff = off;
+
+	if ((cbuf->cbuf_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0)) < 0) {
+		free(cbuf);
+		return (-1);
+	}
+
+	*cbufp = cbuf;
+	return (0);
+}
+
 void
 cbuf_free(cbuf_t *cbuf)
 {
@@ -59,10 +96,82 @@ cbuf_free(cbuf_t *cbuf)
 
 	VERIFY(!list_link_active(&cbuf->cbuf_link));
 
-	free(cbuf->cbuf_data);
+	if (cbuf->cbuf_pool != NULL && cbuf_pool_put(cbuf->cbuf_pool, cbuf)) {
+		return;
+	}
+
+	if (CBUF_IS_FILE(cbuf)) {
+		VERIFY0(close(cbuf->cbuf_fd));
+	}
+
+	if (cbuf->cbuf_shared != NULL) {
+		cbuf_shared_t *cbsh = cbuf->cbuf_shared;
+
+		VERIFY(cbsh->cbsh_refcnt > 0);
+		if (--cbsh->cbsh_refcnt == 0) {
+			free(cbsh->cbsh_base);
+			free(cbsh);
+		}
+	} else {
+		free(cbuf->cbuf_data);
+	}
 	free(cbuf);
 }
 
+int
+cbuf_dup(cbuf_t *cbuf, cbuf_t **dupp)
+{
+	cbuf_t *dup;
+
+	*dupp = NULL;
+
+	if (CBUF_IS_FILE(cbuf)) {
+		errno = ENOTSUP;
+		return (-1);
+	}
+
+	if (cbuf->cbuf_shared == NULL) {
+		cbuf_shared_t *cbsh;
+
+		if ((cbsh = calloc(1, sizeof (*cbsh))) == NULL) {
+			return (-1);
+		}
+		cbsh->cbsh_refcnt = 1;
+		cbsh->cbsh_base = cbuf->cbuf_data;
+
+		/*
+		 * The bytes beyond the limit are no longer available for
+		 * puts, so hide them from the original buffer as well.
+		 */
+		cbuf->cbuf_capacity = cbuf->cbuf_limit;
+		cbuf->cbuf_shared = cbsh;
+		cbuf->cbuf_pool = NULL;
+	}
+
+	if ((dup = calloc(1, sizeof (*dup))) == NULL) {
+		return (-1);
+	}
+	dup->cbuf_data = cbuf->cbuf_data;
+	dup->cbuf_capacity = cbuf->cbuf_limit;
+	dup->cbuf_limit = cbuf->cbuf_limit;
+	dup->cbuf_position = cbuf->cbuf_position;
+	dup->cbuf_order = cbuf->cbuf_order;
+	dup->cbuf_rxtime = cbuf->cbuf_rxtime;
+	dup->cbuf_shared = cbuf->cbuf_shared;
+	dup->cbuf_shared->cbsh_refcnt++;
+	dup->cbuf_fd = -1;
+
+	*dupp = dup;
+	return (0);
+}
+
+boolean_t
+cbuf_readonly(cbuf_t *cbuf)
+{
+	return (cbuf->cbuf_shared != NULL || CBUF_IS_FILE(cbuf) ? B_TRUE :
+	    B_FALSE);
+}
+
 int
 cbuf_extend(cbuf_t *cbuf, size_t new_capacity)
 {
@@ -72,12 +181,21 @@ cbuf_extend(cbuf_t *cbuf, size_t new_capacity)
 		return (0);
 	}
 
+	if (cbuf_readonly(cbuf)) {
+		errno = EROFS;
+		return (-1);
+	}
+
 	if ((new_data = realloc(cbuf->cbuf_data, new_capacity)) == NULL) {
 		return (-1);
 	}
 
+	/*
+	 * The buffer is no longer the size of any pool class.
+	 */
 	cbuf->cbuf_data = new_data;
 	cbuf->cbuf_capacity = new_capacity;
+	cbuf->cbuf_pool = NULL;
 
 	return (0);
 }
@@ -87,12 +205,18 @@ cbuf_shrink(cbuf_t *cbuf)
 {
 	void *new_data;
 
+	if (cbuf_readonly(cbuf)) {
+		errno = EROFS;
+		return (-1);
+	}
+
 	if ((new_data = realloc(cbuf->cbuf_data, cbuf->cbuf_limit)) == NULL) {
 		return (-1);
 	}
 
 	cbuf->cbuf_data = new_data;
 	cbuf->cbuf_capacity = cbuf->cbuf_limit;
+	cbuf->cbuf_pool = NULL;
 
 	return (0);
 }
@@ -127,6 +251,11 @@ cbuf_sys_read(cbuf_t *cbuf, int fd, size_t want, size_t *actual)
 	ssize_t rsz;
 	size_t pos = cbuf_position(cbuf);
 
+	if (cbuf_readonly(cbuf)) {
+		errno = EROFS;
+		return (-1);
+	}
+
 	if (want == CBUF_SYSREAD_ENTIRE) {
 		if ((want = cbuf_available(cbuf)) == 0) {
 			errno = ENOSPC;
@@ -152,7 +281,156 @@ cbuf_sys_read(cbuf_t *cbuf, int fd, size_t want, size_t *actual)
 }
 
 /*
- * Use write(2) to consume data from the buffer.
+ * Receive timestamps are only used where the kernel provides them for stream
+ * sockets.  illumos timestamps datagrams alone, and its msghdr has no
+ * msg_control unless the program is built for XPG4.2 sockets.
+ */
+#ifdef	SO_TIMESTAMPNS
+int
+cbuf_sys_recv(cbuf_t *cbuf, int fd, size_t want, size_t *actual,
+    struct timespec *tsp)
+{
+	union {
+		struct cmsghdr cm;
+		uint8_t buf[CMSG_SPACE(sizeof (struct timespec))];
+	} ctl;
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	size_t pos = cbuf_position(cbuf);
+	ssize_t rsz;
+
+	bzero(tsp, sizeof (*tsp));
+
+	if (cbuf_readonly(cbuf)) {
+		errno = EROFS;
+		return (-1);
+	}
+
+	if (want == CBUF_SYSREAD_ENTIRE) {
+		if ((want = cbuf_available(cbuf)) == 0) {
+			errno = ENOSPC;
+			return (-1);
+		}
+	} else if (want == 0) {
+		errno = EINVAL;
+		return (-1);
+	} else if (want > cbuf_available(cbuf)) {
+		errno = ENOSPC;
+		return (-1);
+	}
+
+	iov.iov_base = &cbuf->cbuf_data[pos];
+	iov.iov_len = want;
+	bzero(&msg, sizeof (msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctl.buf;
+	msg.msg_controllen = sizeof (ctl.buf);
+
+	if ((rsz = recvmsg(fd, &msg, 0)) < 0) {
+		return (-1);
+	}
+	VERIFY0(cbuf_position_set(cbuf, pos + rsz));
+
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+	    cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET &&
+		    cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+			bcopy(CMSG_DATA(cmsg), tsp, sizeof (*tsp));
+		}
+	}
+
+	if (rsz > 0 && cbuf->cbuf_rxtime.tv_sec == 0 &&
+	    cbuf->cbuf_rxtime.tv_nsec == 0) {
+		cbuf->cbuf_rxtime = *tsp;
+	}
+
+	if (actual != NULL) {
+		*actual = (size_t)rsz;
+	}
+	return (0);
+}
+#else	/* !SO_TIMESTAMPNS */
+int
+cbuf_sys_recv(cbuf_t *cbuf, int fd, size_t want, size_t *actual,
+    struct timespec *tsp)
+{
+	bzero(tsp, sizeof (*tsp));
+	return (cbuf_sys_read(cbuf, fd, want, actual));
+}
+#endif	/* SO_TIMESTAMPNS */
+
+void
+cbuf_rxtime(cbuf_t *cbuf, struct timespec *tsp)
+{
+	*tsp = cbuf->cbuf_rxtime;
+}
+
+/*
+ * Copy from a file-backed buffer to "fd" through a small bounce buffer, for
+ * descriptors that sendfile(3EXT) does not support.
+ */
+static ssize_t
+cbuf_sys_write_file_copy(cbuf_t *cbuf, int fd, off_t off, size_t want)
+{
+	uint8_t bounce[8192];
+	ssize_t rsz;
+
+	if (want > sizeof (bounce)) {
+		want = sizeof (bounce);
+	}
+
+	if ((rsz = pread(cbuf->cbuf_fd, bounce, want, off)) < 0) {
+		return (-1);
+	} else if (rsz == 0) {
+		/*
+		 * The file is shorter than it was when the buffer was created.
+		 */
+		errno = EIO;
+		return (-1);
+	}
+
+	return (write(fd, bounce, (size_t)rsz));
+}
+
+static ssize_t
+cbuf_sys_write_file(cbuf_t *cbuf, int fd, size_t pos, size_t want)
+{
+	off_t start = cbuf->cbuf_fdoff + (off_t)pos;
+	off_t off = start;
+	ssize_t wsz;
+
+	if ((wsz = sendfile(fd, cbuf->cbuf_fd, &off, want)) >= 0) {
+		if (wsz == 0) {
+			errno = EIO;
+			return (-1);
+		}
+		return (wsz);
+	}
+
+	if (off > start) {
+		/*
+		 * Some data was written before the error; report the partial
+		 * write, and let the next call encounter the error again.
+		 */
+		return ((ssize_t)(off - start));
+	}
+
+	switch (errno) {
+	case EINVAL:
+	case ENOSYS:
+	case EOPNOTSUPP:
+		return (cbuf_sys_write_file_copy(cbuf, fd, start, want));
+
+	default:
+		return (-1);
+	}
+}
+
+/*
+ * Use write(2) to consume data from the buffer.  Data in a file-backed
+ * buffer is sent directly from the file.
  */
 int
 cbuf_sys_write(cbuf_t *cbuf, int fd, size_t want, size_t *actual)
@@ -173,7 +451,12 @@ cbuf_sys_write(cbuf_t *cbuf, int fd, size_t want, size_t *actual)
 		return (-1);
 	}
 
-	if ((wsz = write(fd, &cbuf->cbuf_data[pos], want)) < 0) {
+	if (CBUF_IS_FILE(cbuf)) {
+		wsz = cbuf_sys_write_file(cbuf, fd, pos, want);
+	} else {
+		wsz = write(fd, &cbuf->cbuf_data[pos], want);
+	}
+	if (wsz < 0) {
 		return (-1);
 	}
 	VERIFY0(cbuf_position_set(cbuf, pos + wsz));
@@ -239,6 +522,10 @@ cbuf_available(cbuf_t *cbuf)
 size_t
 cbuf_unused(cbuf_t *cbuf)
 {
+	if (cbuf_readonly(cbuf)) {
+		return (0);
+	}
+
 	return (cbuf->cbuf_capacity - cbuf->cbuf_limit);
 }
 
@@ -279,12 +566,55 @@ cbuf_compact(cbuf_t *cbuf)
 		return;
 	}
 
+	if (CBUF_IS_FILE(cbuf)) {
+		cbuf->cbuf_fdoff += (off_t)start;
+		cbuf->cbuf_capacity -= start;
+		cbuf->cbuf_limit -= start;
+		cbuf->cbuf_position = 0;
+		return;
+	}
+
+	if (cbuf_readonly(cbuf)) {
+		/*
+		 * Other buffers may be reading from this backing store, so
+		 * rather than moving the data we move the start of the buffer.
+		 */
+		cbuf->cbuf_data += start;
+		cbuf->cbuf_capacity -= start;
+		cbuf->cbuf_limit -= start;
+		cbuf->cbuf_position = 0;
+		return;
+	}
+
 	memmove(&cbuf->cbuf_data[0], &cbuf->cbuf_data[start], copysz);
 	cbuf->cbuf_position = 0;
 	VERIFY3U(cbuf->cbuf_limit, >=, start);
 	cbuf->cbuf_limit -= start;
 }
 
+void *
+cbuf_unused_ptr(cbuf_t *cbuf)
+{
+	return (&cbuf->cbuf_data[cbuf->cbuf_limit]);
+}
+
+int
+cbuf_limit_extend(cbuf_t *cbuf, size_t len)
+{
+	if (cbuf_readonly(cbuf)) {
+		errno = EROFS;
+		return (-1);
+	}
+
+	if (len > cbuf_unused(cbuf)) {
+		errno = EOVERFLOW;
+		return (-1);
+	}
+
+	cbuf->cbuf_limit += len;
+	return (0);
+}
+
 /*
  * Copy bytes from "from", starting at "position" and advancing until "limit"
  * is reached.  The bytes will be copied into "to", starting at "position", and
@@ -297,6 +627,10 @@ cbuf_copy(cbuf_t *cbuf_from, cbuf_t *cbuf_to)
 	size_t dstsz = cbuf_available(cbuf_to);
 	size_t copysz;
 
+	if (cbuf_readonly(cbuf_to) || CBUF_IS_FILE(cbuf_from)) {
+		return (0);
+	}
+
 	/*
 	 * Copy only as many bytes as will fit in the destination buffer.
 	 */
@@ -317,6 +651,10 @@ cbuf_copy(cbuf_t *cbuf_from, cbuf_t *cbuf_to)
 
 #define	CBUF_APPEND_COMMON(cbuf, val)					\
 	do {								\
+		if (cbuf_readonly(cbuf)) {				\
+			errno = EROFS;					\
+			return (-1);					\
+		}							\
 		if (cbuf_available(cbuf) < sizeof (val)) {		\
 			errno = ENOSPC;					\
 			return (-1);					\
@@ -361,9 +699,73 @@ cbuf_put_u64(cbuf_t *cbuf, uint64_t val)
 	CBUF_APPEND_COMMON(cbuf, val);
 }
 
+#define	CBUF_CONSUME_COMMON(cbuf, valp)					\
+	do {								\
+		if (CBUF_IS_FILE(cbuf)) {				\
+			errno = ENOTSUP;				\
+			return (-1);					\
+		}							\
+		if (cbuf_available(cbuf) < sizeof (*valp)) {		\
+			errno = ENOSPC;					\
+			return (-1);					\
+		}							\
+									\
+		memcpy(valp, &cbuf->cbuf_data[cbuf->cbuf_position],	\
+		    sizeof (*valp));					\
+									\
+		cbuf->cbuf_position += sizeof (*valp);			\
+		VERIFY(cbuf->cbuf_position <= cbuf->cbuf_limit);	\
+	} while (0)
+
+int
+cbuf_get_u8(cbuf_t *cbuf, uint8_t *val)
+{
+	CBUF_CONSUME_COMMON(cbuf, val);
+
+	return (0);
+}
+
+int
+cbuf_get_u16(cbuf_t *cbuf, uint16_t *val)
+{
+	CBUF_CONSUME_COMMON(cbuf, val);
+
+	if (cbuf->cbuf_order == CBUF_ORDER_BIG_ENDIAN) {
+		*val = ntohs(*val);
+	}
+	return (0);
+}
+
+int
+cbuf_get_u32(cbuf_t *cbuf, uint32_t *val)
+{
+	CBUF_CONSUME_COMMON(cbuf, val);
+
+	if (cbuf->cbuf_order == CBUF_ORDER_BIG_ENDIAN) {
+		*val = ntohl(*val);
+	}
+	return (0);
+}
+
+int
+cbuf_get_u64(cbuf_t *cbuf, uint64_t *val)
+{
+	CBUF_CONSUME_COMMON(cbuf, val);
+
+	if (cbuf->cbuf_order == CBUF_ORDER_BIG_ENDIAN) {
+		*val = ntohll(*val);
+	}
+	return (0);
+}
+
 int
 cbuf_get_char(cbuf_t *cbuf, char *val)
 {
+	if (CBUF_IS_FILE(cbuf)) {
+		errno = ENOTSUP;
+		return (-1);
+	}
+
 	if (cbuf_available(cbuf) < 1) {
 		errno = ENOSPC;
 		return (-1);
@@ -379,6 +781,11 @@ cbuf_get_char(cbuf_t *cbuf, char *val)
 int
 cbuf_put_string(cbuf_t *cbuf, custr_t *cu)
 {
+	if (cbuf_readonly(cbuf)) {
+		errno = EROFS;
+		return (-1);
+	}
+
 	if (cbuf_available(cbuf) < custr_len(cu)) {
 		errno = ENOSPC;
 		return (-1);
@@ -392,27 +799,28 @@ cbuf_put_string(cbuf_t *cbuf, custr_t *cu)
 	return (0);
 }
 
-#if 0
-void *
-cbuf_read_ptr(cbuf_t *cbuf, size_t sz)
+int
+cbuf_get_ptr(cbuf_t *cbuf, size_t offset, size_t length, void **val)
 {
-	size_t limit;
-
-	VERIFY(sz > 0);
+	size_t end;
 
-	if (cbuf_safe_add(&limit, cbuf_pos(cbuf, CBUF_POS_READ), sz) != 0) {
-		return (NULL);
+	if (CBUF_IS_FILE(cbuf)) {
+		errno = ENOTSUP;
+		return (-1);
 	}
 
-	if (limit < cbuf_pos(cbuf, CBUF_POS_END)) {
+	if (cbuf_safe_add(&end, offset, length) != 0) {
+		return (-1);
 	}
 
-	if (cbuf->cbuf_len < sz) {
-		errno = EIO;
-		return (NULL);
+	if (end > cbuf_available(cbuf)) {
+		errno = ENOSPC;
+		return (-1);
 	}
+
+	*val = &cbuf->cbuf_data[cbuf->cbuf_position + offset];
+	return (0);
 }
-#endif
 
 void
 cbuf_dump(cbuf_t *cbuf, FILE *fp)
@@ -422,6 +830,12 @@ cbuf_dump(cbuf_t *cbuf, FILE *fp)
 	fprintf(fp, "cbuf[%p]: pos %8u lim %8u cap %8u\n",
 	    cbuf, cbuf->cbuf_position, cbuf->cbuf_limit, cbuf->cbuf_capacity);
 
+	if (CBUF_IS_FILE(cbuf)) {
+		fprintf(fp, "    file: fd %d offset %lld\n\n", cbuf->cbuf_fd,
+		    (long long)cbuf->cbuf_fdoff);
+		return;
+	}
+
 	for (size_t i = 0; i < cbuf->cbuf_limit; i += per_row) {
 		fprintf(fp, "    %04x: ", i);
 		for (unsigned x = 0; x < per_row; x++) {
@@ -0,0 +1,139 @@
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <sys/debug.h>
+#include <sys/types.h>
+
+#include "libcbuf_impl.h"
+#include "libcbuf.h"
+
+int
+cbuf_pool_alloc(cbuf_pool_t **poolp, size_t min_size, size_t max_size,
+    unsigned int max_cached)
+{
+	cbuf_pool_t *pool;
+	size_t sz;
+
+	*poolp = NULL;
+
+	if (min_size == 0 || min_size > max_size) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	if ((pool = calloc(1, sizeof (*pool))) == NULL) {
+		return (-1);
+	}
+	pool->cbp_max_cached = max_cached;
+
+	for (sz = min_size; pool->cbp_nclasses < CBUF_POOL_MAX_CLASSES;
+	    sz *= 2) {
+		cbuf_pool_class_t *cbpc =
+		    &pool->cbp_classes[pool->cbp_nclasses++];
+
+		cbpc->cbpc_size = sz;
+		list_create(&cbpc->cbpc_free, sizeof (cbuf_t),
+		    offsetof(cbuf_t, cbuf_link));
+
+		if (sz >= max_size) {
+			break;
+		}
+	}
+
+	*poolp = pool;
+	return (0);
+}
+
+void
+cbuf_pool_free(cbuf_pool_t *pool)
+{
+	if (pool == NULL) {
+		return;
+	}
+
+	for (unsigned int i = 0; i < pool->cbp_nclasses; i++) {
+		cbuf_pool_class_t *cbpc = &pool->cbp_classes[i];
+		cbuf_t *cbuf;
+
+		while ((cbuf = list_remove_head(&cbpc->cbpc_free)) != NULL) {
+			cbuf->cbuf_pool = NULL;
+			cbuf_free(cbuf);
+		}
+		list_destroy(&cbpc->cbpc_free);
+	}
+
+	free(pool);
+}
+
+int
+cbuf_pool_get(cbuf_pool_t *pool, size_t capacity, cbuf_t **cbufp)
+{
+	cbuf_pool_class_t *cbpc = NULL;
+	cbuf_t *cbuf;
+
+	for (unsigned int i = 0; i < pool->cbp_nclasses; i++) {
+		if (pool->cbp_classes[i].cbpc_size >= capacity) {
+			cbpc = &pool->cbp_classes[i];
+			break;
+		}
+	}
+
+	if (cbpc == NULL) {
+		/*
+		 * This request is larger than our largest size class.
+		 */
+		return (cbuf_alloc(cbufp, capacity));
+	}
+
+	if ((cbuf = list_remove_head(&cbpc->cbpc_free)) != NULL) {
+		VERIFY(cbpc->cbpc_ncached > 0);
+		cbpc->cbpc_ncached--;
+
+		cbuf_clear(cbuf);
+		cbuf->cbuf_order = CBUF_ORDER_BIG_ENDIAN;
+		bzero(&cbuf->cbuf_rxtime, sizeof (cbuf->cbuf_rxtime));
+		*cbufp = cbuf;
+		return (0);
+	}
+
+	if (cbuf_alloc(&cbuf, cbpc->cbpc_size) != 0) {
+		*cbufp = NULL;
+		return (-1);
+	}
+	cbuf->cbuf_pool = pool;
+
+	*cbufp = cbuf;
+	return (0);
+}
+
+/*
+ * Called by cbuf_free() for a buffer that came from a pool.  Returns B_TRUE
+ * if the pool has taken the buffer back, or B_FALSE if the caller should
+ * free it.
+ */
+boolean_t
+cbuf_pool_put(cbuf_pool_t *pool, cbuf_t *cbuf)
+{
+	VERIFY(cbuf->cbuf_shared == NULL);
+
+	for (unsigned int i = 0; i < pool->cbp_nclasses; i++) {
+		cbuf_pool_class_t *cbpc = &pool->cbp_classes[i];
+
+		if (cbpc->cbpc_size != cbuf->cbuf_capacity) {
+			continue;
+		}
+
+		if (cbpc->cbpc_ncached >= pool->cbp_max_cached) {
+			return (B_FALSE);
+		}
+
+		cbpc->cbpc_ncached++;
+		list_insert_head(&cbpc->cbpc_free, cbuf);
+		return (B_TRUE);
+	}
+
+	return (B_FALSE);
+}
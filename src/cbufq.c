@@ -6,12 +6,21 @@
 #include <errno.h>
 #include <sys/debug.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <inttypes.h>
 
 #include "libcbuf_impl.h"
 #include "libcbuf.h"
 
+void
+cbufq_init(cbufq_t *cbufq)
+{
+	cbufq->cbufq_count = 0;
+	list_create(&cbufq->cbufq_bufs, sizeof (cbuf_t), offsetof(cbuf_t,
+	    cbuf_link));
+}
+
 int
 cbufq_alloc(cbufq_t **cbufqp)
 {
@@ -22,9 +31,7 @@ cbufq_alloc(cbufq_t **cbufqp)
 	if ((cbufq = calloc(1, sizeof (*cbufq))) == NULL) {
 		return (-1);
 	}
-
-	list_create(&cbufq->cbufq_bufs, sizeof (cbuf_t), offsetof(cbuf_t,
-	    cbuf_link));
+	cbufq_init(cbufq);
 
 	*cbufqp = cbufq;
 	return (0);
@@ -36,35 +43,41 @@ cbufq_count(cbufq_t *cbufq)
 	return (cbufq->cbufq_count);
 }
 
+/*
+ * Free any buffers left in a queue initialised with cbufq_init().
+ */
 void
-cbufq_free(cbufq_t *cbufq)
+cbufq_fini(cbufq_t *cbufq)
 {
 	cbuf_t *cbuf;
 
-	if (cbufq == NULL) {
-		return;
-	}
-
-	/*
-	 * Free any buffers left in the queue.
-	 */
 	while ((cbuf = list_remove_head(&cbufq->cbufq_bufs)) != NULL) {
 		cbuf_free(cbuf);
 	}
+	cbufq->cbufq_count = 0;
+	list_destroy(&cbufq->cbufq_bufs);
+}
 
+void
+cbufq_free(cbufq_t *cbufq)
+{
+	if (cbufq == NULL) {
+		return;
+	}
+
+	cbufq_fini(cbufq);
 	free(cbufq);
 }
 
 void
 cbufq_enq(cbufq_t *cbufq, cbuf_t *cbuf)
 {
-	VERIFY(!list_link_active(&cbuf->cbuf_link));
-
 	/*
-	 * Ensure that either "cbuf_flip()", "cbuf_rewind()" or "cbuf_compact()"
-	 * has been called on this buffer before insertion in the queue.
+	 * The buffer must be ready for gets.  Its data runs from the current
+	 * position to the limit, and need not have been compacted first, as
+	 * readers of the queue start at the position.
 	 */
-	VERIFY(cbuf_position(cbuf) == 0);
+	VERIFY(!list_link_active(&cbuf->cbuf_link));
 
 	if (list_is_empty(&cbufq->cbufq_bufs)) {
 		VERIFY(cbufq->cbufq_count == 0);
@@ -76,6 +89,17 @@ cbufq_enq(cbufq_t *cbufq, cbuf_t *cbuf)
 	list_insert_tail(&cbufq->cbufq_bufs, cbuf);
 }
 
+/*
+ * Move every buffer in "src" to the tail of "dst", leaving "src" empty.
+ */
+void
+cbufq_move(cbufq_t *dst, cbufq_t *src)
+{
+	list_move_tail(&dst->cbufq_bufs, &src->cbufq_bufs);
+	dst->cbufq_count += src->cbufq_count;
+	src->cbufq_count = 0;
+}
+
 static cbuf_t *
 cbufq_deq_common(cbufq_t *cbufq, int remove)
 {
@@ -131,6 +155,17 @@ cbufq_peek_tail(cbufq_t *cbufq)
 	return (tail);
 }
 
+cbuf_t *
+cbufq_first(cbufq_t *cbufq)
+{
+	return (list_head(&cbufq->cbufq_bufs));
+}
+
+cbuf_t *
+cbufq_next(cbufq_t *cbufq, cbuf_t *cbuf)
+{
+	return (list_next(&cbufq->cbufq_bufs, cbuf));
+}
 
 size_t
 cbufq_available(cbufq_t *cbufq)
@@ -198,6 +233,17 @@ top:
 		return (0);
 	}
 
+	if (cbuf_readonly(cbuf0)) {
+		/*
+		 * We cannot append to a shared buffer, so make a private copy
+		 * of it first.
+		 */
+		if (cbufq_unshare(cbufq) != 0) {
+			return (-1);
+		}
+		cbuf0 = list_head(&cbufq->cbufq_bufs);
+	}
+
 	VERIFY0(cbuf_safe_add(&sz, cbuf_available(cbuf0), cbuf_unused(cbuf0)));
 	if (min_contig > sz) {
 		/*
@@ -205,7 +251,8 @@ top:
 		 * allow for the requested minimum contiguous length.  Extend
 		 * the buffer.
 		 */
-		if (cbuf_extend(cbuf0, min_contig - cbuf_position(cbuf0)) != 0) {
+		if (cbuf_safe_add(&sz, cbuf_position(cbuf0), min_contig) != 0 ||
+		    cbuf_extend(cbuf0, sz) != 0) {
 			return (-1);
 		}
 	}
@@ -235,6 +282,161 @@ top:
 	goto top;
 }
 
+int
+cbufq_unshare(cbufq_t *cbufq)
+{
+	cbuf_t *head, *copy;
+	size_t avail;
+
+	if ((head = list_head(&cbufq->cbufq_bufs)) == NULL ||
+	    !cbuf_readonly(head)) {
+		return (0);
+	}
+
+	avail = cbuf_available(head);
+	if (cbuf_alloc(&copy, avail > 0 ? avail : 1) != 0) {
+		return (-1);
+	}
+	cbuf_byteorder_set(copy, cbuf_byteorder(head));
+
+	VERIFY3U(cbuf_copy(head, copy), ==, avail);
+	cbuf_flip(copy);
+
+	list_insert_after(&cbufq->cbufq_bufs, head, copy);
+	list_remove(&cbufq->cbufq_bufs, head);
+	cbuf_free(head);
+
+	return (0);
+}
+
+/*
+ * Check for a match of the pattern which begins at offset "idx" in "cbuf"
+ * and may continue into the buffers that follow it.
+ */
+static boolean_t
+cbufq_match_at(cbufq_t *cbufq, cbuf_t *cbuf, size_t idx, const uint8_t *pat,
+    size_t patlen)
+{
+	while (patlen > 0 && cbuf != NULL) {
+		if (idx >= cbuf_available(cbuf)) {
+			idx -= cbuf_available(cbuf);
+			cbuf = list_next(&cbufq->cbufq_bufs, cbuf);
+			continue;
+		}
+
+		if (cbuf->cbuf_data[cbuf->cbuf_position + idx] != *pat) {
+			return (B_FALSE);
+		}
+
+		idx++;
+		pat++;
+		patlen--;
+	}
+
+	return (patlen == 0 ? B_TRUE : B_FALSE);
+}
+
+static const uint8_t *
+cbufq_memfind(const uint8_t *buf, size_t len, const uint8_t *pat,
+    size_t patlen)
+{
+	while (len >= patlen) {
+		const uint8_t *p;
+
+		if ((p = memchr(buf, pat[0], len - patlen + 1)) == NULL) {
+			return (NULL);
+		}
+
+		if (memcmp(p, pat, patlen) == 0) {
+			return (p);
+		}
+
+		len -= (size_t)(p + 1 - buf);
+		buf = p + 1;
+	}
+
+	return (NULL);
+}
+
+int
+cbufq_search(cbufq_t *cbufq, size_t start, const void *pat, size_t patlen,
+    size_t *offp)
+{
+	size_t base = 0;
+
+	if (patlen == 0) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	for (cbuf_t *cbuf = list_head(&cbufq->cbufq_bufs); cbuf != NULL;
+	    cbuf = list_next(&cbufq->cbufq_bufs, cbuf)) {
+		const uint8_t *data = &cbuf->cbuf_data[cbuf->cbuf_position];
+		size_t avail = cbuf_available(cbuf);
+		size_t from = start > base ? start - base : 0;
+		const uint8_t *p;
+
+		if (from >= avail) {
+			base += avail;
+			continue;
+		}
+
+		/*
+		 * Look for a match contained entirely within this buffer.
+		 */
+		if ((p = cbufq_memfind(&data[from], avail - from, pat,
+		    patlen)) != NULL) {
+			*offp = base + (size_t)(p - data);
+			return (0);
+		}
+
+		/*
+		 * Look for a match that begins near the end of this buffer
+		 * and continues into the next one.
+		 */
+		size_t i = avail >= patlen - 1 ? avail - (patlen - 1) : 0;
+		for (i = i > from ? i : from; i < avail; i++) {
+			if (cbufq_match_at(cbufq, cbuf, i, pat, patlen)) {
+				*offp = base + i;
+				return (0);
+			}
+		}
+
+		base += avail;
+	}
+
+	errno = ENOENT;
+	return (-1);
+}
+
+int
+cbufq_discard(cbufq_t *cbufq, size_t len)
+{
+	cbuf_t *head;
+
+	while (len > 0) {
+		size_t avail;
+
+		if ((head = list_head(&cbufq->cbufq_bufs)) == NULL) {
+			errno = EIO;
+			return (-1);
+		}
+
+		if ((avail = cbuf_available(head)) > len) {
+			VERIFY0(cbuf_position_set(head, cbuf_position(head) +
+			    len));
+			return (0);
+		}
+
+		len -= avail;
+		list_remove(&cbufq->cbufq_bufs, head);
+		cbufq->cbufq_count--;
+		cbuf_free(head);
+	}
+
+	return (0);
+}
+
 void
 cbufq_dump(cbufq_t *cbufq, FILE *fp)
 {
@@ -248,3 +450,78 @@ cbufq_dump(cbufq_t *cbufq, FILE *fp)
 	}
 	fprintf(fp, "cbufq[%p]: end\n\n", cbufq);
 }
+
+int
+cbufq_sys_write(cbufq_t *cbufq, int fd, size_t want, size_t *actual)
+{
+	struct iovec iov[CBUFQ_IOV_MAX];
+	int iovcnt = 0;
+	ssize_t wsz;
+	cbuf_t *cbuf;
+	size_t len;
+
+	*actual = 0;
+
+	/*
+	 * Discard any empty buffers at the head of the queue.
+	 */
+	while ((cbuf = list_head(&cbufq->cbufq_bufs)) != NULL &&
+	    cbuf_available(cbuf) == 0) {
+		list_remove(&cbufq->cbufq_bufs, cbuf);
+		cbufq->cbufq_count--;
+		cbuf_free(cbuf);
+	}
+
+	if (cbuf != NULL && CBUF_IS_FILE(cbuf)) {
+		if (want > cbuf_available(cbuf)) {
+			want = CBUF_SYSREAD_ENTIRE;
+		}
+		if (cbuf_sys_write(cbuf, fd, want, actual) != 0) {
+			return (-1);
+		}
+
+		if (cbuf_available(cbuf) == 0) {
+			list_remove(&cbufq->cbufq_bufs, cbuf);
+			cbufq->cbufq_count--;
+			cbuf_free(cbuf);
+		}
+		return (0);
+	}
+
+	for (; cbuf != NULL && iovcnt < CBUFQ_IOV_MAX;
+	    cbuf = list_next(&cbufq->cbufq_bufs, cbuf)) {
+		if (CBUF_IS_FILE(cbuf)) {
+			break;
+		}
+
+		if ((len = cbuf_available(cbuf)) == 0) {
+			continue;
+		}
+
+		if (want != CBUF_SYSREAD_ENTIRE && len >= want) {
+			iov[iovcnt].iov_base = cbuf->cbuf_data +
+			    cbuf->cbuf_position;
+			iov[iovcnt].iov_len = want;
+			iovcnt++;
+			break;
+		}
+
+		iov[iovcnt].iov_base = cbuf->cbuf_data + cbuf->cbuf_position;
+		iov[iovcnt].iov_len = len;
+		iovcnt++;
+		if (want != CBUF_SYSREAD_ENTIRE) {
+			want -= len;
+		}
+	}
+
+	if (iovcnt == 0) {
+		return (0);
+	}
+
+	if ((wsz = writev(fd, iov, iovcnt)) < 0) {
+		return (-1);
+	}
+
+	*actual = (size_t)wsz;
+	return (cbufq_discard(cbufq, (size_t)wsz));
+}
@@ -0,0 +1,254 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/debug.h>
+#include <sys/types.h>
+
+#include <zlib.h>
+
+#include "libcbuf.h"
+#include "cdeflate.h"
+
+/*
+ * Output buffers with less than this much room are not worth appending to.
+ */
+#define	CDEFLATE_MIN_ROOM	64
+
+/*
+ * A small window and compression memory keep the per-connection cost down
+ * to about 40KB for a compressor, at little cost in ratio for the short
+ * lines we carry.
+ */
+#define	CDEFLATE_WINDOW_BITS	12
+#define	CDEFLATE_MEM_LEVEL	5
+
+struct cdeflate {
+	z_stream cd_z;
+	boolean_t cd_decompress;
+	boolean_t cd_ended;			/* stream end seen or sent */
+	boolean_t cd_full;			/* output may be pending */
+};
+
+int
+cdeflate_alloc(cdeflate_t **cdp, boolean_t decompress)
+{
+	cdeflate_t *cd;
+	int r;
+
+	*cdp = NULL;
+
+	if ((cd = calloc(1, sizeof (*cd))) == NULL) {
+		return (-1);
+	}
+	cd->cd_decompress = decompress;
+
+	/*
+	 * Negative window sizes select raw deflate, without the zlib header
+	 * and checksum.
+	 */
+	if (decompress) {
+		r = inflateInit2(&cd->cd_z, -CDEFLATE_WINDOW_BITS);
+	} else {
+		r = deflateInit2(&cd->cd_z, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+		    -CDEFLATE_WINDOW_BITS, CDEFLATE_MEM_LEVEL,
+		    Z_DEFAULT_STRATEGY);
+	}
+	if (r != Z_OK) {
+		free(cd);
+		errno = ENOMEM;
+		return (-1);
+	}
+
+	*cdp = cd;
+	return (0);
+}
+
+void
+cdeflate_free(cdeflate_t *cd)
+{
+	if (cd == NULL) {
+		return;
+	}
+
+	if (cd->cd_decompress) {
+		(void) inflateEnd(&cd->cd_z);
+	} else {
+		(void) deflateEnd(&cd->cd_z);
+	}
+	free(cd);
+}
+
+/*
+ * Point the stream's output at the unused space in the buffer at the tail of
+ * "out", appending a new buffer if there is not enough of it.
+ */
+static int
+cdeflate_out(cdeflate_t *cd, cbufq_t *out, cdeflate_buf_func_t *getbuf,
+    size_t bufsz, cbuf_t **cbufp)
+{
+	cbuf_t *cbuf;
+	size_t room;
+
+	if ((cbuf = cbufq_peek_tail(out)) == NULL ||
+	    cbuf_unused(cbuf) < CDEFLATE_MIN_ROOM) {
+		if (getbuf(bufsz, &cbuf) != 0) {
+			return (-1);
+		}
+		cbuf_flip(cbuf);
+		cbufq_enq(out, cbuf);
+	}
+
+	room = cbuf_unused(cbuf);
+	cd->cd_z.next_out = cbuf_unused_ptr(cbuf);
+	cd->cd_z.avail_out = room > UINT_MAX ? UINT_MAX : (uInt)room;
+	*cbufp = cbuf;
+	return (0);
+}
+
+/*
+ * Make the bytes the stream wrote into "cbuf" available for gets.
+ */
+static size_t
+cdeflate_out_done(cdeflate_t *cd, cbuf_t *cbuf)
+{
+	size_t used = (uint8_t *)cd->cd_z.next_out -
+	    (uint8_t *)cbuf_unused_ptr(cbuf);
+
+	VERIFY0(cbuf_limit_extend(cbuf, used));
+	return (used);
+}
+
+int
+cdeflate_compress(cdeflate_t *cd, const void *buf, size_t len,
+    cdeflate_flush_t flush, cbufq_t *out, cdeflate_buf_func_t *getbuf,
+    size_t bufsz, size_t *producedp)
+{
+	int zflush = flush == CDEFLATE_FLUSH_FINISH ? Z_FINISH :
+	    flush == CDEFLATE_FLUSH_SYNC ? Z_SYNC_FLUSH : Z_NO_FLUSH;
+	size_t produced = 0;
+	cbuf_t *cbuf;
+	int r;
+
+	*producedp = 0;
+
+	if (cd->cd_decompress || cd->cd_ended || len > UINT_MAX) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	cd->cd_z.next_in = (Bytef *)buf;
+	cd->cd_z.avail_in = (uInt)len;
+
+	/*
+	 * When flushing, deflate() is finished only once it returns without
+	 * filling the output buffer.
+	 */
+	do {
+		if (cdeflate_out(cd, out, getbuf, bufsz, &cbuf) != 0) {
+			*producedp = produced;
+			return (-1);
+		}
+		r = deflate(&cd->cd_z, zflush);
+		produced += cdeflate_out_done(cd, cbuf);
+		VERIFY(r == Z_OK || r == Z_BUF_ERROR || r == Z_STREAM_END);
+	} while (cd->cd_z.avail_in > 0 || (zflush != Z_NO_FLUSH &&
+	    cd->cd_z.avail_out == 0 && r != Z_STREAM_END));
+
+	if (r == Z_STREAM_END) {
+		cd->cd_ended = B_TRUE;
+	}
+
+	*producedp = produced;
+	return (0);
+}
+
+int
+cdeflate_decompress(cdeflate_t *cd, cbufq_t *in, cbufq_t *out, size_t max,
+    cdeflate_buf_func_t *getbuf, size_t bufsz, size_t *consumedp,
+    size_t *producedp)
+{
+	size_t consumed = 0;
+	size_t produced = 0;
+	int ret = 0;
+
+	if (!cd->cd_decompress) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	while (produced < max) {
+		cbuf_t *head, *cbuf;
+		size_t avail, used;
+		void *ptr;
+		int r;
+
+		for (head = cbufq_first(in); head != NULL &&
+		    cbuf_available(head) == 0; head = cbufq_next(in, head)) {
+			continue;
+		}
+		if (head == NULL && !cd->cd_full) {
+			break;
+		}
+
+		if (head != NULL && cd->cd_ended) {
+			/*
+			 * The peer sent more data after the end of the
+			 * stream.
+			 */
+			errno = EPROTO;
+			ret = -1;
+			break;
+		}
+
+		/*
+		 * If the last call filled its output buffer, the stream may
+		 * have more to produce even without further input.
+		 */
+		if (head != NULL) {
+			avail = cbuf_available(head);
+			VERIFY0(cbuf_get_ptr(head, 0, avail, &ptr));
+		} else {
+			avail = 0;
+			ptr = NULL;
+		}
+		cd->cd_z.next_in = ptr;
+		cd->cd_z.avail_in = avail > UINT_MAX ? UINT_MAX : (uInt)avail;
+
+		if (cdeflate_out(cd, out, getbuf, bufsz, &cbuf) != 0) {
+			ret = -1;
+			break;
+		}
+		if (cd->cd_z.avail_out > max - produced) {
+			cd->cd_z.avail_out = (uInt)(max - produced);
+		}
+
+		r = inflate(&cd->cd_z, Z_SYNC_FLUSH);
+		cd->cd_full = cd->cd_z.avail_out == 0 ? B_TRUE : B_FALSE;
+		produced += cdeflate_out_done(cd, cbuf);
+		used = avail - cd->cd_z.avail_in;
+		if (used > 0) {
+			VERIFY0(cbufq_discard(in, used));
+			consumed += used;
+		}
+
+		if (r == Z_STREAM_END) {
+			cd->cd_ended = B_TRUE;
+		} else if (r == Z_BUF_ERROR) {
+			/*
+			 * No progress was possible: the input holds only part
+			 * of a block.
+			 */
+			break;
+		} else if (r != Z_OK) {
+			errno = r == Z_MEM_ERROR ? ENOMEM : EPROTO;
+			ret = -1;
+			break;
+		}
+	}
+
+	*consumedp = consumed;
+	*producedp = produced;
+	return (ret);
+}
@@ -0,0 +1,473 @@
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <err.h>
+#include <sys/debug.h>
+#include <sys/types.h>
+
+#include <sys/list.h>
+
+#include "libcbuf.h"
+#include "libcloop.h"
+
+/*
+ * HTTP
+ *
+ * Only what load balancer health checks and metrics scrapers need is
+ * supported: GET and HEAD requests without a body, for a fixed set of paths.
+ * The request head, up to the blank line, is one frame for the delimiter
+ * framer, and is parsed in place.  Every response is rendered in advance
+ * into a buffer, and each request is answered by queueing a shared reference
+ * to it, so that a request costs no allocation beyond the reference and no
+ * copy at all.  Each resource has one buffer holding the full response, and
+ * one holding only its header for HEAD requests.
+ *
+ * Requests are answered as they are framed, so pipelined requests are
+ * answered in order.  If the send queue is full, the current request is left
+ * in place until CCONN_CB_DRAIN.  Connections persist unless the client asks
+ * otherwise, uses HTTP/1.0, or sends something we cannot answer safely; in
+ * those cases the connection is shut down after the response.
+ */
+
+/*
+ * The largest request head, and the most pipelined request data buffered.
+ */
+#define	CHTTP_HEAD_MAX		8192
+#define	CHTTP_RECV_MAX		(8 * CHTTP_HEAD_MAX)
+
+typedef struct chttp_resp {
+	cbuf_t *cr_full;
+	cbuf_t *cr_head;
+} chttp_resp_t;
+
+typedef struct chttp_res {
+	char *chr_path;
+	chttp_resp_t chr_resp;
+	list_node_t chr_link;
+} chttp_res_t;
+
+typedef enum chttp_err {
+	CHTTP_E_BAD_REQUEST = 0,
+	CHTTP_E_NOT_FOUND,
+	CHTTP_E_METHOD,
+	CHTTP_E_NOT_IMPL,
+	CHTTP_E_VERSION,
+	CHTTP_E_COUNT
+} chttp_err_t;
+
+static const struct {
+	int che_status;
+	const char *che_reason;
+	boolean_t che_close;
+} chttp_errors[CHTTP_E_COUNT] = {
+	{ 400,	"Bad Request",			B_TRUE },
+	{ 404,	"Not Found",			B_FALSE },
+	{ 405,	"Method Not Allowed",		B_TRUE },
+	{ 501,	"Not Implemented",		B_TRUE },
+	{ 505,	"HTTP Version Not Supported",	B_TRUE },
+};
+
+struct chttp {
+	list_t ch_resources;			/* list of chttp_res_t */
+	chttp_resp_t ch_errors[CHTTP_E_COUNT];
+};
+
+static void
+chttp_resp_free(chttp_resp_t *cr)
+{
+	cbuf_free(cr->cr_full);
+	cbuf_free(cr->cr_head);
+	cr->cr_full = cr->cr_head = NULL;
+}
+
+static int
+chttp_render(chttp_resp_t *cr, int status, const char *reason,
+    const char *extra, const char *content_type, const void *body,
+    size_t len)
+{
+	custr_t *cu;
+	int r = -1;
+
+	bzero(cr, sizeof (*cr));
+
+	if (custr_alloc(&cu) != 0) {
+		return (-1);
+	}
+
+	if (custr_append_printf(cu, "HTTP/1.1 %d %s\r\n"
+	    "Content-Type: %s\r\n"
+	    "Content-Length: %zu\r\n"
+	    "Cache-Control: no-cache\r\n"
+	    "%s\r\n", status, reason, content_type, len, extra) != 0 ||
+	    cbuf_alloc(&cr->cr_head, custr_len(cu)) != 0 ||
+	    cbuf_alloc(&cr->cr_full, custr_len(cu) + len) != 0) {
+		goto out;
+	}
+
+	VERIFY0(cbuf_put_string(cr->cr_head, cu));
+	cbuf_flip(cr->cr_head);
+
+	VERIFY0(cbuf_put_string(cr->cr_full, cu));
+	cbuf_flip(cr->cr_full);
+	if (len > 0) {
+		bcopy(body, cbuf_unused_ptr(cr->cr_full), len);
+		VERIFY0(cbuf_limit_extend(cr->cr_full, len));
+	}
+	r = 0;
+
+out:
+	if (r != 0) {
+		chttp_resp_free(cr);
+	}
+	custr_free(cu);
+	return (r);
+}
+
+int
+chttp_alloc(chttp_t **chp)
+{
+	chttp_t *ch;
+	char body[64];
+
+	*chp = NULL;
+
+	if ((ch = calloc(1, sizeof (*ch))) == NULL) {
+		return (-1);
+	}
+	list_create(&ch->ch_resources, sizeof (chttp_res_t),
+	    offsetof(chttp_res_t, chr_link));
+
+	for (int i = 0; i < CHTTP_E_COUNT; i++) {
+		(void) snprintf(body, sizeof (body), "%s\n",
+		    chttp_errors[i].che_reason);
+		if (chttp_render(&ch->ch_errors[i], chttp_errors[i].che_status,
+		    chttp_errors[i].che_reason, i == CHTTP_E_METHOD ?
+		    "Allow: GET, HEAD\r\nConnection: close\r\n" :
+		    chttp_errors[i].che_close ? "Connection: close\r\n" : "",
+		    "text/plain", body, strlen(body)) != 0) {
+			chttp_free(ch);
+			return (-1);
+		}
+	}
+
+	*chp = ch;
+	return (0);
+}
+
+/*
+ * Connections attached to the handler must be closed, or their server freed,
+ * before the handler is freed.
+ */
+void
+chttp_free(chttp_t *ch)
+{
+	chttp_res_t *chr;
+
+	if (ch == NULL) {
+		return;
+	}
+
+	while ((chr = list_remove_head(&ch->ch_resources)) != NULL) {
+		chttp_resp_free(&chr->chr_resp);
+		free(chr->chr_path);
+		free(chr);
+	}
+	list_destroy(&ch->ch_resources);
+
+	for (int i = 0; i < CHTTP_E_COUNT; i++) {
+		chttp_resp_free(&ch->ch_errors[i]);
+	}
+	free(ch);
+}
+
+static chttp_res_t *
+chttp_lookup(chttp_t *ch, const char *path, size_t len)
+{
+	for (chttp_res_t *chr = list_head(&ch->ch_resources); chr != NULL;
+	    chr = list_next(&ch->ch_resources, chr)) {
+		if (strlen(chr->chr_path) == len &&
+		    strncmp(chr->chr_path, path, len) == 0) {
+			return (chr);
+		}
+	}
+
+	return (NULL);
+}
+
+/*
+ * Set the content of "path", replacing what was there.  Responses already
+ * queued keep the content they were sent with.
+ */
+int
+chttp_set(chttp_t *ch, const char *path, const char *content_type,
+    const void *body, size_t len)
+{
+	chttp_resp_t cr;
+	chttp_res_t *chr;
+
+	if (path[0] != '/') {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	if (chttp_render(&cr, 200, "OK", "", content_type, body, len) != 0) {
+		return (-1);
+	}
+
+	if ((chr = chttp_lookup(ch, path, strlen(path))) == NULL) {
+		if ((chr = calloc(1, sizeof (*chr))) == NULL ||
+		    (chr->chr_path = strdup(path)) == NULL) {
+			free(chr);
+			chttp_resp_free(&cr);
+			return (-1);
+		}
+		list_insert_tail(&ch->ch_resources, chr);
+	} else {
+		chttp_resp_free(&chr->chr_resp);
+	}
+
+	chr->chr_resp = cr;
+	return (0);
+}
+
+/*
+ * Return the next CRLF-terminated line in [*pp, end), and advance *pp past
+ * it.
+ */
+static const char *
+chttp_line(const char **pp, const char *end, size_t *lenp)
+{
+	const char *line = *pp;
+	const char *p;
+
+	for (p = line; p < end && !(p[0] == '\r' && p + 1 < end &&
+	    p[1] == '\n'); p++) {
+		continue;
+	}
+
+	*lenp = p - line;
+	*pp = p < end ? p + 2 : end;
+	return (line);
+}
+
+/*
+ * Is "tok" one of the comma-separated tokens in the header value?
+ */
+static boolean_t
+chttp_has_token(const char *val, size_t len, const char *tok)
+{
+	size_t toklen = strlen(tok);
+	const char *end = val + len;
+
+	while (val < end) {
+		const char *p;
+		size_t n;
+
+		while (val < end && (*val == ' ' || *val == '\t' ||
+		    *val == ',')) {
+			val++;
+		}
+		for (p = val; p < end && *p != ','; p++) {
+			continue;
+		}
+		for (n = p - val; n > 0 && (val[n - 1] == ' ' ||
+		    val[n - 1] == '\t'); n--) {
+			continue;
+		}
+
+		if (n == toklen && strncasecmp(val, tok, n) == 0) {
+			return (B_TRUE);
+		}
+		val = p;
+	}
+
+	return (B_FALSE);
+}
+
+#define	CHTTP_IS(p, len, s)	\
+	((len) == sizeof (s) - 1 && strncmp((p), (s), (len)) == 0)
+#define	CHTTP_IS_CASE(p, len, s)	\
+	((len) == sizeof (s) - 1 && strncasecmp((p), (s), (len)) == 0)
+
+/*
+ * Parse a request head, and choose the response.  "headp" is set for HEAD
+ * requests, and "closep" if the connection should be shut down after the
+ * response.
+ */
+static chttp_resp_t *
+chttp_parse(chttp_t *ch, const char *req, size_t len, boolean_t *headp,
+    boolean_t *closep)
+{
+	const char *end = req + len;
+	const char *line, *method, *target, *version, *p;
+	size_t llen, mlen, tlen, vlen;
+	boolean_t fin = B_FALSE;
+	chttp_res_t *chr;
+
+	*headp = B_FALSE;
+	*closep = B_TRUE;
+
+	/*
+	 * Clients may send empty lines between requests.
+	 */
+	do {
+		line = chttp_line(&req, end, &llen);
+	} while (llen == 0 && req < end);
+
+	/*
+	 * The request line is "method SP target SP version".
+	 */
+	method = line;
+	for (p = line; p < line + llen && *p != ' '; p++) {
+		continue;
+	}
+	mlen = p - method;
+	target = p + 1;
+	for (p = target; p < line + llen && *p != ' '; p++) {
+		continue;
+	}
+	if (p >= line + llen || target >= p) {
+		return (&ch->ch_errors[CHTTP_E_BAD_REQUEST]);
+	}
+	tlen = p - target;
+	version = p + 1;
+	vlen = line + llen - version;
+
+	if (CHTTP_IS(version, vlen, "HTTP/1.0")) {
+		fin = B_TRUE;
+	} else if (!CHTTP_IS(version, vlen, "HTTP/1.1")) {
+		return (&ch->ch_errors[vlen > 5 &&
+		    strncmp(version, "HTTP/", 5) == 0 ?
+		    CHTTP_E_VERSION : CHTTP_E_BAD_REQUEST]);
+	}
+
+	/*
+	 * We cannot skip a request body, so a request with one is refused
+	 * and the connection closed.
+	 */
+	while (req < end) {
+		const char *name, *val;
+		size_t nlen;
+
+		name = chttp_line(&req, end, &llen);
+		for (p = name; p < name + llen && *p != ':'; p++) {
+			continue;
+		}
+		if (p >= name + llen || p == name) {
+			return (&ch->ch_errors[CHTTP_E_BAD_REQUEST]);
+		}
+		nlen = p - name;
+		for (val = p + 1; val < name + llen && (*val == ' ' ||
+		    *val == '\t'); val++) {
+			continue;
+		}
+
+		if (CHTTP_IS_CASE(name, nlen, "Connection")) {
+			if (chttp_has_token(val, name + llen - val, "close")) {
+				fin = B_TRUE;
+			}
+		} else if (CHTTP_IS_CASE(name, nlen, "Content-Length")) {
+			if (!CHTTP_IS(val, (size_t)(name + llen - val), "0")) {
+				return (&ch->ch_errors[CHTTP_E_BAD_REQUEST]);
+			}
+		} else if (CHTTP_IS_CASE(name, nlen, "Transfer-Encoding")) {
+			return (&ch->ch_errors[CHTTP_E_NOT_IMPL]);
+		}
+	}
+
+	if (CHTTP_IS(method, mlen, "HEAD")) {
+		*headp = B_TRUE;
+	} else if (!CHTTP_IS(method, mlen, "GET")) {
+		return (&ch->ch_errors[CHTTP_E_METHOD]);
+	}
+
+	/*
+	 * The query string is ignored.
+	 */
+	for (p = target; p < target + tlen && *p != '?'; p++) {
+		continue;
+	}
+	*closep = fin;
+	if ((chr = chttp_lookup(ch, target, p - target)) == NULL) {
+		return (&ch->ch_errors[CHTTP_E_NOT_FOUND]);
+	}
+
+	return (&chr->chr_resp);
+}
+
+static void
+chttp_on_request(cconn_t *ccn, int event)
+{
+	chttp_t *ch = cconn_data(ccn);
+	chttp_resp_t *cr;
+	boolean_t head, fin;
+	cbuf_t *dup;
+	char *req;
+	size_t len;
+
+	VERIFY(event == CCONN_CB_LINE_AVAILABLE || event == CCONN_CB_DRAIN);
+
+	/*
+	 * On CCONN_CB_DRAIN, a request is only waiting if its response did not
+	 * fit in the send queue.
+	 */
+	if (cconn_frame(ccn, (void **)&req, &len) != 0) {
+		return;
+	}
+
+	cr = chttp_parse(ch, req, len, &head, &fin);
+	if (cbuf_dup(head ? cr->cr_head : cr->cr_full, &dup) != 0) {
+		warn("chttp response");
+		(void) cconn_abort(ccn);
+		return;
+	}
+
+	if (cconn_send_cbuf(ccn, dup) != 0) {
+		cbuf_free(dup);
+		if (errno == EAGAIN) {
+			return;
+		}
+
+		/*
+		 * Requests that follow one we have closed after are ignored.
+		 */
+		if (errno != EPIPE) {
+			(void) cconn_abort(ccn);
+			return;
+		}
+	} else if (fin) {
+		(void) cconn_fin(ccn);
+	}
+
+	cconn_next(ccn);
+}
+
+static void
+chttp_on_end(cconn_t *ccn, int event)
+{
+	VERIFY(event == CCONN_CB_END);
+
+	(void) cconn_fin(ccn);
+}
+
+/*
+ * Answer HTTP requests on "ccn", which must not yet have received any data.
+ * The connection's framing, limits, callbacks and consumer data are replaced.
+ */
+int
+chttp_attach(chttp_t *ch, cconn_t *ccn)
+{
+	if (cconn_framing_delimiter(ccn, "\r\n\r\n", 4) != 0) {
+		return (-1);
+	}
+	cconn_recv_limits_set(ccn, CHTTP_HEAD_MAX, CHTTP_RECV_MAX);
+
+	cconn_data_set(ccn, ch);
+	cconn_on(ccn, CCONN_CB_LINE_AVAILABLE, chttp_on_request);
+	cconn_on(ccn, CCONN_CB_DRAIN, chttp_on_request);
+	cconn_on(ccn, CCONN_CB_END, chttp_on_end);
+	return (0);
+}
@@ -5,8 +5,10 @@
 #include <poll.h>
 #include <port.h>
 #include <err.h>
+#include <errno.h>
 #include <sys/debug.h>
 #include <strings.h>
+#include <sys/socket.h>
 
 #include <sys/list.h>
 
@@ -15,6 +17,7 @@
 #include "libcloop_impl.h"
 
 static void cloop_ent_free_impl(cloop_ent_t *clent);
+static void cloop_ent_reassoc(cloop_ent_t *clent);
 
 int
 cloop_alloc(cloop_t **cloopp)
@@ -36,6 +39,8 @@ cloop_alloc(cloop_t **cloopp)
 
 	list_create(&cloop->cloop_ents, sizeof (cloop_ent_t),
 	    offsetof(cloop_ent_t, clent_link));
+	list_create(&cloop->cloop_reassoc, sizeof (cloop_ent_t),
+	    offsetof(cloop_ent_t, clent_reassoc_link));
 
 	*cloopp = cloop;
 	return (0);
@@ -51,11 +56,42 @@ cloop_free(cloop_t *cloop)
 	free(cloop);
 }
 
+void
+cloop_rxdelay_record(cloop_t *cloop, uint64_t nsec)
+{
+	cloop_rxdelay_t *clr = &cloop->cloop_rxdelay;
+	uint64_t usec = nsec / 1000;
+	unsigned int i;
+
+	for (i = 0; i < CLOOP_RXDELAY_BUCKETS - 1 && usec >= (1ULL << i);
+	    i++) {
+		continue;
+	}
+
+	clr->clr_buckets[i]++;
+	clr->clr_count++;
+	clr->clr_sum += nsec;
+}
+
+int
+cloop_rxdelay(cloop_t *cloop, cloop_rxdelay_t *clr)
+{
+#ifdef	SO_TIMESTAMPNS
+	*clr = cloop->cloop_rxdelay;
+	return (0);
+#else
+	bzero(clr, sizeof (*clr));
+	errno = ENOTSUP;
+	return (-1);
+#endif
+}
+
 int
 cloop_run(cloop_t *cloop, unsigned int *again)
 {
 	int port = cloop->cloop_port;
 	port_event_t pe;
+	cloop_ent_t *clent;
 
 	if (list_is_empty(&cloop->cloop_ents)) {
 		*again = 0;
@@ -64,8 +100,12 @@ cloop_run(cloop_t *cloop, unsigned int *again)
 		*again = 1;
 	}
 
-	for (cloop_ent_t *clent = list_head(&cloop->cloop_ents); clent != NULL;
-	    clent = list_next(&cloop->cloop_ents, clent)) {
+	/*
+	 * Only entities whose interest has changed, or whose association was
+	 * consumed by an event, are visited here; with many idle connections,
+	 * that is a small fraction of the whole.
+	 */
+	while ((clent = list_remove_head(&cloop->cloop_reassoc)) != NULL) {
 		uintptr_t o;
 
 		if (!clent->clent_reassoc) {
@@ -76,7 +116,14 @@ cloop_run(cloop_t *cloop, unsigned int *again)
 		o = (uintptr_t)clent->clent_fd;
 
 		if (clent->clent_events == 0) {
-			VERIFY0(port_dissociate(port, PORT_SOURCE_FD, o));
+			/*
+			 * The association may already have been consumed by
+			 * an event we have not yet retrieved.
+			 */
+			if (port_dissociate(port, PORT_SOURCE_FD, o) != 0 &&
+			    errno != ENOENT) {
+				err(1, "port_dissociate");
+			}
 			continue;
 		}
 
@@ -92,10 +139,10 @@ cloop_run(cloop_t *cloop, unsigned int *again)
 
 	switch (pe.portev_source) {
 	case PORT_SOURCE_FD: {
-		cloop_ent_t *clent = pe.portev_user;
+		clent = pe.portev_user;
 		VERIFY(clent->clent_type == CLOOP_ENT_TYPE_FD);
 		VERIFY(clent->clent_fd == (int)pe.portev_object);
-		clent->clent_reassoc = 1;
+		cloop_ent_reassoc(clent);
 
 		/*
 		 * We mark this entity as processing to defer destroys until
@@ -150,7 +197,7 @@ cloop_run(cloop_t *cloop, unsigned int *again)
 	} break;
 
 	case PORT_SOURCE_TIMER: {
-		cloop_ent_t *clent = pe.portev_user;
+		clent = pe.portev_user;
 		VERIFY(clent->clent_type == CLOOP_ENT_TYPE_TIMER);
 
 		clent->clent_active = 1;
@@ -204,16 +251,23 @@ cloop_ent_alloc(cloop_ent_t **clentp)
 
 	*clentp = NULL;
 
-	if ((clent = calloc(1, sizeof (*clent))) == NULL) {
+	if ((clent = malloc(sizeof (*clent))) == NULL) {
 		return (-1);
 	}
-
-	clent->clent_fd = -1;
+	cloop_ent_init(clent, NULL);
 
 	*clentp = clent;
 	return (0);
 }
 
+void
+cloop_ent_init(cloop_ent_t *clent, cloop_ent_release_t *release)
+{
+	bzero(clent, sizeof (*clent));
+	clent->clent_fd = -1;
+	clent->clent_release = release;
+}
+
 static void
 cloop_ent_free_impl(cloop_ent_t *clent)
 {
@@ -223,6 +277,9 @@ cloop_ent_free_impl(cloop_ent_t *clent)
 
 	if (clent->clent_loop != NULL) {
 		list_remove(&clent->clent_loop->cloop_ents, clent);
+		if (list_link_active(&clent->clent_reassoc_link)) {
+			list_remove(&clent->clent_loop->cloop_reassoc, clent);
+		}
 		clent->clent_loop = NULL;
 	}
 
@@ -236,6 +293,11 @@ cloop_ent_free_impl(cloop_ent_t *clent)
 		clent->clent_fd = -1;
 	}
 
+	if (clent->clent_release != NULL) {
+		clent->clent_release(clent);
+		return;
+	}
+
 	free(clent);
 }
 
@@ -278,6 +340,9 @@ cloop_attach_ent(cloop_t *cloop, cloop_ent_t *clent, int fd)
 	clent->clent_fd = fd;
 	clent->clent_loop = cloop;
 	list_insert_tail(&cloop->cloop_ents, clent);
+	if (clent->clent_reassoc) {
+		list_insert_tail(&cloop->cloop_reassoc, clent);
+	}
 }
 
 int
@@ -312,6 +377,19 @@ cloop_attach_ent_timer(cloop_t *cloop, cloop_ent_t *clent, int interval)
 	return (0);
 }
 
+/*
+ * Mark the entity for (re)association with the port before the next wait.
+ */
+static void
+cloop_ent_reassoc(cloop_ent_t *clent)
+{
+	clent->clent_reassoc = 1;
+	if (clent->clent_loop != NULL &&
+	    !list_link_active(&clent->clent_reassoc_link)) {
+		list_insert_tail(&clent->clent_loop->cloop_reassoc, clent);
+	}
+}
+
 void
 cloop_ent_want(cloop_ent_t *clent, int event)
 {
@@ -331,7 +409,34 @@ cloop_ent_want(cloop_ent_t *clent, int event)
 
 	if ((clent->clent_events & e) != e) {
 		clent->clent_events |= e;
-		clent->clent_reassoc = 1;
+		cloop_ent_reassoc(clent);
+	}
+}
+
+/*
+ * Stop waiting for an event that was previously requested with
+ * cloop_ent_want(); e.g., once a send queue has been written out directly.
+ */
+void
+cloop_ent_unwant(cloop_ent_t *clent, int event)
+{
+	int e = 0;
+
+	switch (event) {
+	case CLOOP_CB_READ:
+		e = POLLIN;
+		break;
+	case CLOOP_CB_WRITE:
+		e = POLLOUT;
+		break;
+	default:
+		fprintf(stderr, "cloop_ent_unwant: invalid event %x\n", event);
+		abort();
+	}
+
+	if ((clent->clent_events & e) != 0) {
+		clent->clent_events &= ~e;
+		cloop_ent_reassoc(clent);
 	}
 }
 
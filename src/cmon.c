@@ -20,6 +20,8 @@
 #include <sys/debug.h>
 #include <errno.h>
 #include <sys/time.h>
+#include <inttypes.h>
+#include <umem.h>
 
 #include <sys/list.h>
 
@@ -30,22 +32,49 @@
 #include "libcloop.h"
 
 #define	LISTEN_PORT	"5757"
+#define	LISTEN_HTTP_PORT	"5758"
+
+#define	CMON_JSON_RESERVE	512
 
 static cserver_t *csrv;
+static cserver_t *csrv_unix;
 static custr_t *scratch;
-static int cmon_next_id = 1;
 static nvlist_t *nvl_hbmsg;
-
-list_t cmon_list;
+static hrtime_t cmon_start;
+
+/*
+ * Load balancer health checks and metrics scrapers speak HTTP, on a port of
+ * their own.  The responses are rendered once a second.
+ */
+static cserver_t *csrv_http;
+static chttp_t *http;
+static cloop_t *cmon_loop;
+
+/*
+ * If an upstream collector is configured, a summary is forwarded to it every
+ * CMON_SUMMARY_INTERVAL seconds.  The collector is another cmon, which
+ * sends no reply, so summaries are sent without waiting for one on a
+ * connection of our own.  It is opened again for the next summary if it
+ * closes.
+ */
+#define	CMON_SUMMARY_INTERVAL	10
+
+static cconn_t *upstream;
+static const char *upstream_addr;
+static const char *upstream_port;
 
 typedef struct cmon {
-	int cmon_id;
+	uint64_t cmon_id;
 	cconn_t *cmon_conn;
-	list_node_t cmon_link;
 	hrtime_t cmon_last_recv;
 	hrtime_t cmon_last_send;
+	boolean_t cmon_hb_due;
+	boolean_t cmon_hb_sent;			/* in the current broadcast */
+	boolean_t cmon_admin;			/* on the local socket */
 } cmon_t;
 
+static umem_cache_t *cmon_cache;
+
 void
 cmon_on_close(cconn_t *ccn, int event)
 {
@@ -53,10 +82,9 @@ cmon_on_close(cconn_t *ccn, int event)
 
 	VERIFY(event == CCONN_CB_CLOSE);
 
-	fprintf(stderr, "[%p]<%3d> closed\n", ccn, cmon->cmon_id);
+	fprintf(stderr, "[%p]<%3" PRIu64 "> closed\n", ccn, cmon->cmon_id);
 
-	list_remove(&cmon_list, cmon);
-	free(cmon);
+	umem_cache_free(cmon_cache, cmon);
 }
 
 void
@@ -66,7 +94,8 @@ cmon_on_end(cconn_t *ccn, int event)
 
 	VERIFY(event == CCONN_CB_END);
 
-	fprintf(stderr, "[%p]<%3d> read side ended\n", ccn, cmon->cmon_id);
+	fprintf(stderr, "[%p]<%3" PRIu64 "> read side ended\n", ccn,
+	    cmon->cmon_id);
 
 	cconn_fin(ccn);
 }
@@ -74,16 +103,52 @@ cmon_on_end(cconn_t *ccn, int event)
 int
 cmon_send_json(cconn_t *ccn, nvlist_t *nvl)
 {
-	int r;
 	cmon_t *cmon = cconn_data(ccn);
+	size_t want = CMON_JSON_RESERVE;
+	custr_t *cu;
+	void *ptr;
+	size_t avail;
+	int r;
 
-	custr_reset(scratch);
-	if (cmon_nvlist_to_json(nvl, scratch) != 0 ||
-	    custr_appendc(scratch, '\n') != 0) {
+	/*
+	 * Serialise the message directly into send queue memory.  If it does
+	 * not fit in the region we were given, ask for a larger one and try
+	 * again.
+	 */
+	for (;;) {
+		if (cconn_send_reserve(ccn, want, &ptr, &avail) != 0) {
+			return (-1);
+		}
+		if (custr_alloc_buf(&cu, ptr, avail) != 0) {
+			(void) cconn_send_commit(ccn, 0);
+			return (-1);
+		}
+
+		if ((r = cmon_nvlist_to_json(nvl, cu)) == 0) {
+			r = custr_appendc(cu, '\n');
+		}
+		if (r == 0 || errno != EOVERFLOW) {
+			break;
+		}
+
+		/*
+		 * Give back the region before reserving a larger one, so that
+		 * it is not left behind on the queue.
+		 */
+		custr_free(cu);
+		(void) cconn_send_commit(ccn, 0);
+		want = avail * 2;
+	}
+
+	if (r != 0) {
+		custr_free(cu);
+		(void) cconn_send_commit(ccn, 0);
 		return (-1);
 	}
 
-	if ((r = cconn_send(ccn, scratch)) != 0) {
+	r = cconn_send_commit(ccn, custr_len(cu));
+	custr_free(cu);
+	if (r != 0) {
 		return (r);
 	}
 
@@ -91,10 +156,82 @@ cmon_send_json(cconn_t *ccn, nvlist_t *nvl)
 	return (0);
 }
 
+/*
+ * Report the connections with the largest values of a statistic, for
+ * "top <statistic> [count]".
+ */
+#define	CMON_TOP_DEFAULT	10
+#define	CMON_TOP_MAX		100
+
+static const struct {
+	const char *cts_name;
+	cconn_stat_t cts_stat;
+} cmon_top_stats[] = {
+	{ "bytes_in",		CCONN_STAT_BYTES_IN },
+	{ "bytes_out",		CCONN_STAT_BYTES_OUT },
+	{ "frames_in",		CCONN_STAT_FRAMES_IN },
+	{ "sends",		CCONN_STAT_SENDS },
+	{ "recvq_max",		CCONN_STAT_RECVQ_MAX },
+	{ "sendq_max",		CCONN_STAT_SENDQ_MAX },
+	{ "syscalls",		CCONN_STAT_SYSCALLS },
+	{ "busy",		CCONN_STAT_BUSY },
+	{ NULL,			0 }
+};
+
+static void
+cmon_top_server(cserver_t *srv, cconn_stat_t stat, unsigned int n)
+{
+	cconn_top_t top[CMON_TOP_MAX];
+	int count;
+
+	if ((count = cserver_top(srv, stat, top, n)) < 0) {
+		return;
+	}
+
+	for (int i = 0; i < count; i++) {
+		custr_append_printf(scratch, "%8" PRIu64 " %-40s %" PRIu64 "\n",
+		    cconn_id(top[i].cct_conn),
+		    cconn_remote_addr_str(top[i].cct_conn), top[i].cct_value);
+	}
+}
+
+static void
+cmon_top(const char *args)
+{
+	char name[32];
+	unsigned int n = CMON_TOP_DEFAULT;
+	int i;
+
+	if (sscanf(args, "%31s %u", name, &n) < 1 || n > CMON_TOP_MAX) {
+		custr_append(scratch, "usage: top <statistic> [count]\n");
+		return;
+	}
+
+	for (i = 0; cmon_top_stats[i].cts_name != NULL; i++) {
+		if (strcmp(cmon_top_stats[i].cts_name, name) == 0) {
+			break;
+		}
+	}
+	if (cmon_top_stats[i].cts_name == NULL) {
+		custr_append(scratch, "statistics:");
+		for (i = 0; cmon_top_stats[i].cts_name != NULL; i++) {
+			custr_append_printf(scratch, " %s",
+			    cmon_top_stats[i].cts_name);
+		}
+		custr_appendc(scratch, '\n');
+		return;
+	}
+
+	cmon_top_server(csrv, cmon_top_stats[i].cts_stat, n);
+	if (csrv_unix != NULL) {
+		cmon_top_server(csrv_unix, cmon_top_stats[i].cts_stat, n);
+	}
+}
+
 void
 cmon_on_json(cconn_t *ccn, cmon_t *cmon, nvlist_t *nvl)
 {
-	fprintf(stderr, "[%p]<%3d> JSON:\n", ccn, cmon->cmon_id);
+	fprintf(stderr, "[%p]<%3" PRIu64 "> JSON:\n", ccn, cmon->cmon_id);
 	nvlist_print(stderr, nvl);
 }
 
@@ -107,35 +244,36 @@ cmon_on_line(cconn_t *ccn, int event)
 
 	VERIFY(event == CCONN_CB_LINE_AVAILABLE);
 
-	custr_t *cu = cconn_line(ccn);
-	if (cu == NULL || custr_len(cu) < 1) {
+	char *line;
+	size_t len;
+	if (cconn_frame(ccn, (void **)&line, &len) != 0 || len < 1) {
 		cconn_next(ccn);
 		return;
 	}
 
-	fprintf(stderr, "[%p]<%3d> input: %s\n", ccn, cmon->cmon_id,
-	    custr_cstr(cu));
+	fprintf(stderr, "[%p]<%3" PRIu64 "> input: %s\n", ccn, cmon->cmon_id,
+	    line);
 
 	custr_reset(scratch);
 
-	if (custr_cstr(cu)[0] == '{') {
+	if (line[0] == '{') {
 		nvlist_parse_json_error_t nje = { 0 };
 		nvlist_t *nvl;
 
 		/*
 		 * This is a JSON input line.
 		 */
-		if (nvlist_parse_json(custr_cstr(cu), custr_len(cu),
-		    &nvl, NVJSON_FORCE_INTEGER, &nje) != 0) {
-			fprintf(stderr, "[%p]<%3d> JSON error: %s\n", ccn,
-			    cmon->cmon_id, nje.nje_message);
+		if (nvlist_parse_json(line, len, &nvl, NVJSON_FORCE_INTEGER,
+		    &nje) != 0) {
+			fprintf(stderr, "[%p]<%3" PRIu64 "> JSON error: %s\n",
+			    ccn, cmon->cmon_id, nje.nje_message);
 			cconn_abort(ccn);
 			return;
 		}
 
 		cmon_on_json(ccn, cmon, nvl);
 
-	} else if (strcmp(custr_cstr(cu), "json") == 0) {
+	} else if (strcmp(line, "json") == 0) {
 		nvlist_t *nvl = NULL;
 
 		if (nvlist_alloc(&nvl, NV_UNIQUE_NAME, 0) != 0) {
@@ -148,10 +286,65 @@ cmon_on_line(cconn_t *ccn, int event)
 
 		cmon_send_json(ccn, nvl);
 		nvlist_free(nvl);
+	} else if (strncmp(line, "kill ", 5) == 0 && !cmon->cmon_admin) {
+		/*
+		 * Anyone can reach the TCP port, so connections may only be
+		 * killed by local users with access to the Unix socket.
+		 */
+		custr_append(scratch, "kill: only accepted on the local "
+		    "socket\n");
+		if (cconn_send(ccn, scratch) == 0) {
+			cmon->cmon_last_send = gethrtime();
+		}
+	} else if (strncmp(line, "kill ", 5) == 0) {
+		char *end;
+		uint64_t id;
+		cconn_t *victim = NULL;
+
+		errno = 0;
+		id = strtoull(line + 5, &end, 10);
+		if (errno == 0 && *end == '\0') {
+			if ((victim = cserver_lookup_id(csrv, id)) == NULL &&
+			    csrv_unix != NULL) {
+				victim = cserver_lookup_id(csrv_unix, id);
+			}
+		}
+
+		if (victim == ccn) {
+			cconn_abort(ccn);
+			return;
+		}
+
+		if (victim != NULL && cconn_abort(victim) == 0) {
+			custr_append_printf(scratch, "killed %" PRIu64 "\n",
+			    id);
+		} else {
+			custr_append_printf(scratch, "no such connection: %s\n",
+			    line + 5);
+		}
+		if (cconn_send(ccn, scratch) == 0) {
+			cmon->cmon_last_send = gethrtime();
+		}
+	} else if (strcmp(line, "compress") == 0) {
+		/*
+		 * The reply is the last thing we send uncompressed, and the
+		 * client compresses everything after this line.
+		 */
+		custr_append(scratch, "compress ok\n");
+		if (cconn_send(ccn, scratch) != 0 || cconn_compress(ccn) != 0) {
+			cconn_abort(ccn);
+			return;
+		}
+		cmon->cmon_last_send = gethrtime();
+	} else if (strncmp(line, "top ", 4) == 0) {
+		cmon_top(line + 4);
+		if (cconn_send(ccn, scratch) == 0) {
+			cmon->cmon_last_send = gethrtime();
+		}
 	} else {
 		custr_append(scratch, "my responses are limited, you must ask "
 		    "the right questions\n");
-		custr_append_printf(scratch, "unknown: %s\n", custr_cstr(cu));
+		custr_append_printf(scratch, "unknown: %s\n", line);
 		if (cconn_send(ccn, scratch) == 0) {
 			cmon->cmon_last_send = gethrtime();
 		}
@@ -175,14 +368,15 @@ cmon_on_incoming(cserver_t *csrv, int event)
 			return;
 		}
 
-		cmon_t *cmon = calloc(1, sizeof (*cmon));
+		cmon_t *cmon = umem_cache_alloc(cmon_cache, UMEM_DEFAULT);
 		if (cmon == NULL) {
 			cconn_abort(ccn);
 			continue;
 		}
-		cmon->cmon_id = cmon_next_id++;
-		list_insert_tail(&cmon_list, cmon);
+		bzero(cmon, sizeof (*cmon));
+		cmon->cmon_id = cconn_id(ccn);
 		cmon->cmon_conn = ccn;
+		cmon->cmon_admin = csrv == csrv_unix ? B_TRUE : B_FALSE;
 		cconn_data_set(ccn, cmon);
 		cmon->cmon_last_send = cmon->cmon_last_recv = gethrtime();
 
@@ -190,35 +384,329 @@ cmon_on_incoming(cserver_t *csrv, int event)
 		cconn_on(ccn, CCONN_CB_CLOSE, cmon_on_close);
 		cconn_on(ccn, CCONN_CB_END, cmon_on_end);
 
-		fprintf(stderr, "[%p]<%3d> accepted: %s\n", ccn, cmon->cmon_id,
-		    cconn_remote_addr_str(ccn));
+		fprintf(stderr, "[%p]<%3" PRIu64 "> accepted: %s\n", ccn,
+		    cmon->cmon_id, cconn_remote_addr_str(ccn));
 	}
 }
 
-void
-cmon_on_timer(cloop_ent_t *clent, int event)
+static void
+cmon_on_http_incoming(cserver_t *srv, int event)
 {
-	VERIFY(event == CLOOP_CB_TIMER);
+	cconn_t *ccn;
+
+	VERIFY(event == CSERVER_CB_INCOMING);
+
+	while (cserver_accept(srv, &ccn) == 0) {
+		if (chttp_attach(http, ccn) != 0) {
+			warn("chttp_attach");
+			(void) cconn_abort(ccn);
+		}
+	}
+	if (errno != EAGAIN) {
+		warn("cserver_accept");
+	}
+}
 
+typedef struct cmon_totals {
+	cconn_stats_t cmt_stats;
+	uint64_t cmt_queued;
+} cmon_totals_t;
+
+static int
+cmon_sum(cconn_t *ccn, void *arg)
+{
+	cmon_totals_t *cmt = arg;
+	const cconn_stats_t *ccs = cconn_stats(ccn);
+
+	cmt->cmt_stats.ccs_bytes_in += ccs->ccs_bytes_in;
+	cmt->cmt_stats.ccs_bytes_out += ccs->ccs_bytes_out;
+	cmt->cmt_stats.ccs_frames_in += ccs->ccs_frames_in;
+	cmt->cmt_stats.ccs_sends += ccs->ccs_sends;
+	cmt->cmt_stats.ccs_syscalls += ccs->ccs_syscalls;
+	cmt->cmt_queued += cconn_send_queued(ccn);
+	return (0);
+}
+
+/*
+ * Render the metrics in the Prometheus text format.  Traffic figures are
+ * summed over the agent connections that are open now.
+ */
+static void
+cmon_render_metrics(hrtime_t now)
+{
+	cmon_totals_t cmt;
+
+	bzero(&cmt, sizeof (cmt));
+	(void) cserver_walk(csrv, cmon_sum, &cmt);
+	if (csrv_unix != NULL) {
+		(void) cserver_walk(csrv_unix, cmon_sum, &cmt);
+	}
+
+	custr_reset(scratch);
+	custr_append_printf(scratch,
+	    "# TYPE cmon_uptime_seconds gauge\n"
+	    "cmon_uptime_seconds %" PRId64 "\n"
+	    "# TYPE cmon_connections gauge\n"
+	    "cmon_connections{listener=\"tcp\"} %zu\n",
+	    (now - cmon_start) / 1000000000LL,
+	    cserver_connection_count(csrv));
+	if (csrv_unix != NULL) {
+		custr_append_printf(scratch,
+		    "cmon_connections{listener=\"unix\"} %zu\n",
+		    cserver_connection_count(csrv_unix));
+	}
+	custr_append_printf(scratch,
+	    "cmon_connections{listener=\"http\"} %zu\n"
+	    "# TYPE cmon_open_bytes_in gauge\n"
+	    "cmon_open_bytes_in %" PRIu64 "\n"
+	    "# TYPE cmon_open_bytes_out gauge\n"
+	    "cmon_open_bytes_out %" PRIu64 "\n"
+	    "# TYPE cmon_open_frames_in gauge\n"
+	    "cmon_open_frames_in %" PRIu64 "\n"
+	    "# TYPE cmon_open_sends gauge\n"
+	    "cmon_open_sends %" PRIu64 "\n"
+	    "# TYPE cmon_open_syscalls gauge\n"
+	    "cmon_open_syscalls %" PRIu64 "\n"
+	    "# TYPE cmon_send_queued_bytes gauge\n"
+	    "cmon_send_queued_bytes %" PRIu64 "\n",
+	    cserver_connection_count(csrv_http),
+	    cmt.cmt_stats.ccs_bytes_in, cmt.cmt_stats.ccs_bytes_out,
+	    cmt.cmt_stats.ccs_frames_in, cmt.cmt_stats.ccs_sends,
+	    cmt.cmt_stats.ccs_syscalls, cmt.cmt_queued);
+
+	/*
+	 * The time data waited in the kernel before the loop read it, with
+	 * buckets in seconds.  This is left out where the kernel does not
+	 * timestamp stream data, as an empty histogram would read as no
+	 * delay at all.
+	 */
+	cloop_rxdelay_t clr;
+	uint64_t cum = 0;
+
+	if (cloop_rxdelay(cmon_loop, &clr) == 0) {
+		custr_append(scratch,
+		    "# TYPE cmon_rx_delay_seconds histogram\n");
+		for (int i = 0; i < CLOOP_RXDELAY_BUCKETS - 1; i++) {
+			cum += clr.clr_buckets[i];
+			custr_append_printf(scratch,
+			    "cmon_rx_delay_seconds_bucket{le=\"%g\"} %" PRIu64
+			    "\n", (double)(1ULL << i) / 1000000, cum);
+		}
+		custr_append_printf(scratch,
+		    "cmon_rx_delay_seconds_bucket{le=\"+Inf\"} %" PRIu64 "\n"
+		    "cmon_rx_delay_seconds_sum %.9f\n"
+		    "cmon_rx_delay_seconds_count %" PRIu64 "\n",
+		    clr.clr_count, (double)clr.clr_sum / 1000000000,
+		    clr.clr_count);
+	}
+
+	if (chttp_set(http, "/metrics", "text/plain; version=0.0.4",
+	    custr_cstr(scratch), custr_len(scratch)) != 0) {
+		warn("metrics");
+	}
+}
+
+static boolean_t
+cmon_hb_filter(cconn_t *ccn)
+{
+	cmon_t *cmon = cconn_data(ccn);
+
+	return (cmon->cmon_hb_due);
+}
+
+/*
+ * The broadcast calls this only for connections on which the heartbeat was
+ * queued, so those that are backed up, or that it failed for, are left to be
+ * tried again on the next tick.
+ */
+static void
+cmon_hb_sent(cconn_t *ccn)
+{
+	cmon_t *cmon = cconn_data(ccn);
+
+	cmon->cmon_hb_sent = B_TRUE;
+}
+
+/*
+ * The collector treats us as one of its agents, and sends us heartbeats,
+ * which are of no interest.
+ */
+static void
+cmon_upstream_on_line(cconn_t *ccn, int event)
+{
+	VERIFY(event == CCONN_CB_LINE_AVAILABLE);
+
+	cconn_next(ccn);
+}
+
+static void
+cmon_upstream_on_end(cconn_t *ccn, int event)
+{
+	VERIFY(event == CCONN_CB_END);
+
+	(void) cconn_fin(ccn);
+}
+
+static void
+cmon_upstream_on_error(cconn_t *ccn, int event)
+{
+	VERIFY(event == CCONN_CB_ERROR);
+
+	warnx("upstream %s port %s: connection failed", upstream_addr,
+	    upstream_port);
+}
+
+static void
+cmon_upstream_on_close(cconn_t *ccn, int event)
+{
+	VERIFY(event == CCONN_CB_CLOSE);
+
+	if (upstream == ccn) {
+		upstream = NULL;
+	}
+}
+
+static void
+cmon_send_summary(hrtime_t now)
+{
+	nvlist_t *nvl;
+	uint32_t nconns;
+
+	nconns = cserver_connection_count(csrv);
+	if (csrv_unix != NULL) {
+		nconns += cserver_connection_count(csrv_unix);
+	}
+
+	if (upstream == NULL) {
+		if (cconn_connect(cmon_loop, upstream_addr, upstream_port,
+		    &upstream) != 0) {
+			warn("upstream %s port %s", upstream_addr,
+			    upstream_port);
+			return;
+		}
+		cconn_on(upstream, CCONN_CB_LINE_AVAILABLE,
+		    cmon_upstream_on_line);
+		cconn_on(upstream, CCONN_CB_END, cmon_upstream_on_end);
+		cconn_on(upstream, CCONN_CB_ERROR, cmon_upstream_on_error);
+		cconn_on(upstream, CCONN_CB_CLOSE, cmon_upstream_on_close);
+	}
+
+	if (nvlist_alloc(&nvl, NV_UNIQUE_NAME, 0) != 0) {
+		warn("nvlist_alloc");
+		return;
+	}
+
+	custr_reset(scratch);
+	if (nvlist_add_string(nvl, "type", "summary") != 0 ||
+	    nvlist_add_uint64(nvl, "hrtime", now) != 0 ||
+	    nvlist_add_uint32(nvl, "connections", nconns) != 0 ||
+	    cmon_nvlist_to_json(nvl, scratch) != 0 ||
+	    custr_appendc(scratch, '\n') != 0 ||
+	    cconn_send(upstream, scratch) != 0) {
+		warn("upstream summary");
+	}
+	nvlist_free(nvl);
+}
+
+typedef struct cmon_tick {
+	hrtime_t ct_now;
+	boolean_t ct_hb_due;
+} cmon_tick_t;
+
+static int
+cmon_check(cconn_t *ccn, void *arg)
+{
 	static hrtime_t recv_timeout = 24 * 1000000000LL;
 	static hrtime_t send_hb_interval = 5 * 1000000000LL;
 
+	cmon_tick_t *ct = arg;
+	cmon_t *cmon = cconn_data(ccn);
+
+	if ((ct->ct_now - cmon->cmon_last_recv) > recv_timeout) {
+		cconn_abort(ccn);
+		return (0);
+	}
+
+	if ((ct->ct_now - cmon->cmon_last_send) > send_hb_interval) {
+		cmon->cmon_hb_due = ct->ct_hb_due = B_TRUE;
+	}
+	return (0);
+}
+
+/*
+ * Once the heartbeat has been broadcast, or has failed, clear the flags set
+ * for it.  Only a connection that was actually sent the heartbeat counts as
+ * having been sent something; the rest are due again on the next tick.
+ */
+static int
+cmon_hb_done(cconn_t *ccn, void *arg)
+{
+	cmon_tick_t *ct = arg;
+	cmon_t *cmon = cconn_data(ccn);
+
+	if (cmon->cmon_hb_sent) {
+		cmon->cmon_last_send = ct->ct_now;
+	}
+	cmon->cmon_hb_due = B_FALSE;
+	cmon->cmon_hb_sent = B_FALSE;
+	return (0);
+}
+
+void
+cmon_on_timer(cloop_ent_t *clent, int event)
+{
+	VERIFY(event == CLOOP_CB_TIMER);
+
 	hrtime_t now = gethrtime();
+	static unsigned int ticks = 0;
+
+	if (upstream_addr != NULL && ++ticks % CMON_SUMMARY_INTERVAL == 0) {
+		cmon_send_summary(now);
+	}
+
+	cmon_render_metrics(now);
+
+	cmon_tick_t tick = { .ct_now = now, .ct_hb_due = B_FALSE };
+	(void) cserver_walk(csrv, cmon_check, &tick);
+	if (csrv_unix != NULL) {
+		(void) cserver_walk(csrv_unix, cmon_check, &tick);
+	}
+
+	if (!tick.ct_hb_due) {
+		return;
+	}
+
+	/*
+	 * Serialise the heartbeat once, and share the resultant buffer
+	 * between every connection that is due for one.
+	 */
+	cbuf_t *cbuf;
 	nvlist_add_uint64(nvl_hbmsg, "hrtime", now);
 	nvlist_add_int64(nvl_hbmsg, "time", time(NULL));
+	custr_reset(scratch);
+	if (cmon_nvlist_to_json(nvl_hbmsg, scratch) != 0 ||
+	    custr_appendc(scratch, '\n') != 0 ||
+	    cbuf_alloc(&cbuf, custr_len(scratch)) != 0) {
+		warn("heartbeat");
+		goto done;
+	}
+	VERIFY0(cbuf_put_string(cbuf, scratch));
+	cbuf_flip(cbuf);
 
-	cmon_t *cmon, *cmon_next;
-	for (cmon = list_head(&cmon_list); cmon != NULL; cmon = cmon_next) {
-		cmon_next = list_next(&cmon_list, cmon);
-
-		if ((now - cmon->cmon_last_recv) > recv_timeout) {
-			cconn_abort(cmon->cmon_conn);
-			continue;
-		}
+	if (cserver_broadcast_prio(csrv, cbuf, cmon_hb_filter,
+	    CCONN_PRIO_CONTROL, cmon_hb_sent) != 0) {
+		warn("cserver_broadcast");
+	}
+	if (csrv_unix != NULL && cserver_broadcast_prio(csrv_unix, cbuf,
+	    cmon_hb_filter, CCONN_PRIO_CONTROL, cmon_hb_sent) != 0) {
+		warn("cserver_broadcast");
+	}
+	cbuf_free(cbuf);
 
-		if ((now - cmon->cmon_last_send) > send_hb_interval) {
-			cmon_send_json(cmon->cmon_conn, nvl_hbmsg);
-		}
+done:
+	(void) cserver_walk(csrv, cmon_hb_done, &tick);
+	if (csrv_unix != NULL) {
+		(void) cserver_walk(csrv_unix, cmon_hb_done, &tick);
 	}
 }
 
@@ -234,11 +722,10 @@ main(int argc, char *argv[])
 		err(1, "nvlist");
 	}
 
-	list_create(&cmon_list, sizeof (cmon_t), offsetof(cmon_t, cmon_link));
-
 	if (cloop_alloc(&cloop) != 0) {
 		err(1, "cloop_alloc");
 	}
+	cmon_loop = cloop;
 
 	if (cloop_ent_alloc(&cltimer) != 0) {
 		err(1, "cloop_ent_alloc");
@@ -251,16 +738,94 @@ main(int argc, char *argv[])
 	if (custr_alloc(&scratch) != 0) {
 		err(1, "custr_alloc");
 	}
+	if ((cmon_cache = umem_cache_create("cmon", sizeof (cmon_t), 0, NULL,
+	    NULL, NULL, NULL, NULL, 0)) == NULL) {
+		err(1, "umem_cache_create");
+	}
 
 	if (cserver_alloc(&csrv) != 0) {
 		err(1, "cserver_alloc");
 	}
 	cserver_on(csrv, CSERVER_CB_INCOMING, cmon_on_incoming);
 
-	if (cserver_listen_tcp(csrv, cloop, "0.0.0.0", LISTEN_PORT) != 0) {
+	/*
+	 * Agents exchange short heartbeats and queries, which should not be
+	 * held back to fill segments.  Where the platform allows, /metrics
+	 * reports how long their data waits before it is read.
+	 */
+	cserver_opts_t opts;
+	VERIFY0(cserver_opts_profile(&opts, CSERVER_PROFILE_LOW_LATENCY));
+	opts.cso_timestamp = B_TRUE;
+	VERIFY0(cserver_opts_set(csrv, &opts));
+
+	/*
+	 * Agents on untrusted networks may be required to use TLS.
+	 */
+	const char *tls_cert, *tls_key;
+	if ((tls_cert = getenv("CMON_TLS_CERT")) != NULL) {
+		if ((tls_key = getenv("CMON_TLS_KEY")) == NULL) {
+			tls_key = tls_cert;
+		}
+		if (cserver_tls_set(csrv, tls_cert, tls_key) != 0) {
+			err(1, "cserver_tls_set");
+		}
+	}
+
+	if (cserver_listen_tcp(csrv, cloop, NULL, LISTEN_PORT) != 0) {
+		err(1, "cserver_listen");
+	}
+	fprintf(stderr, "LISTENING ON PORT %s%s\n", LISTEN_PORT,
+	    tls_cert != NULL ? " (TLS)" : "");
+
+	/*
+	 * Health checks and metrics.
+	 */
+	const char *http_port;
+	if ((http_port = getenv("CMON_HTTP_PORT")) == NULL) {
+		http_port = LISTEN_HTTP_PORT;
+	}
+	cmon_start = gethrtime();
+	if (chttp_alloc(&http) != 0 ||
+	    chttp_set(http, "/health", "text/plain", "ok\n", 3) != 0) {
+		err(1, "chttp");
+	}
+	if (cserver_alloc(&csrv_http) != 0) {
+		err(1, "cserver_alloc");
+	}
+	cserver_on(csrv_http, CSERVER_CB_INCOMING, cmon_on_http_incoming);
+	VERIFY0(cserver_opts_set(csrv_http, &opts));
+	if (cserver_listen_tcp(csrv_http, cloop, NULL, http_port) != 0) {
 		err(1, "cserver_listen");
 	}
-	fprintf(stderr, "LISTENING ON PORT %s\n", LISTEN_PORT);
+	fprintf(stderr, "LISTENING ON PORT %s (HTTP)\n", http_port);
+
+	/*
+	 * Summaries may be forwarded to an upstream collector.
+	 */
+	if ((upstream_addr = getenv("CMON_UPSTREAM_ADDR")) != NULL) {
+		if ((upstream_port = getenv("CMON_UPSTREAM_PORT")) == NULL) {
+			upstream_port = LISTEN_PORT;
+		}
+	}
+
+	/*
+	 * Local agents may also connect over a Unix domain socket.  Only
+	 * there are administrative commands, such as "kill", accepted, so
+	 * the socket's file permissions decide who may use them.
+	 */
+	const char *upath;
+	if ((upath = getenv("CMON_UNIX_PATH")) != NULL) {
+		if (cserver_alloc(&csrv_unix) != 0) {
+			err(1, "cserver_alloc");
+		}
+		cserver_on(csrv_unix, CSERVER_CB_INCOMING, cmon_on_incoming);
+
+		if (cserver_listen_unix(csrv_unix, cloop, upath) != 0) {
+			err(1, "cserver_listen_unix");
+		}
+		fprintf(stderr, "LISTENING ON %s\n", upath);
+	}
+	cmon_render_metrics(gethrtime());
 
 	for (;;) {
 		unsigned int again = 0;
@@ -275,7 +840,13 @@ main(int argc, char *argv[])
 		}
 	}
 
+	if (upstream != NULL) {
+		(void) cconn_abort(upstream);
+	}
+	cserver_free(csrv_http);
+	chttp_free(http);
 	cserver_free(csrv);
+	cserver_free(csrv_unix);
 	cloop_free(cloop);
 	custr_free(scratch);
 	nvlist_free(nvl_hbmsg);
@@ -0,0 +1,1202 @@
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <err.h>
+#include <sys/debug.h>
+#include <sys/types.h>
+#include <arpa/inet.h>
+
+#include <sys/list.h>
+
+#include "libcbuf.h"
+#include "libcloop.h"
+
+/*
+ * STREAM MULTIPLEXING
+ *
+ * Each message sent on a stream travels in a frame of its own, using the
+ * connection's length framing:
+ *
+ *	uint32_t length		of what follows, big-endian
+ *	uint8_t type		CMUX_T_*
+ *	uint32_t id		stream id, big-endian
+ *	payload
+ *
+ * Streams opened by the side that made the connection have odd ids, and
+ * those opened by the other side even ids, so that both may open streams
+ * without coordination.  A stream comes into being at the peer with the
+ * first DATA or FIN frame sent on it.
+ *
+ * Flow control is per stream.  Each message costs its length plus
+ * CMUX_HDRSZ against the receiver's window of CMUX_WINDOW bytes, and the
+ * receiver returns credit in WINDOW frames as messages are consumed.  A
+ * sender never exceeds the window, so a paused stream never holds more than
+ * CMUX_WINDOW bytes.
+ *
+ * Messages wait in per-stream queues.  Streams that have something to send,
+ * and the window to send it, take turns of one message each.  Only a little
+ * data is queued on the connection at a time, so that a stream with a lot
+ * to send cannot get far ahead of the others; when the connection refuses a
+ * write, we wait for CCONN_CB_DRAIN.  WINDOW frames are sent as control
+ * messages, ahead of any data, but a FIN must follow the data before it and
+ * waits its turn.  An RST follows whatever is already on the connection, so
+ * that the peer never sees data for a stream after it has been reset.
+ */
+
+#define	CMUX_HDRSZ		5
+#define	CMUX_FRAME_HDRSZ	(sizeof (uint32_t) + CMUX_HDRSZ)
+#define	CMUX_COST(len)		((len) + CMUX_HDRSZ)
+
+#define	CMUX_WINDOW		(256 * 1024)
+
+/*
+ * Credit is returned once a quarter of the window has been consumed.
+ */
+#define	CMUX_WINDOW_UPDATE	(CMUX_WINDOW / 4)
+
+/*
+ * Sends on a stream fail with EAGAIN while this much is queued on it, and
+ * CMUX_CB_WRITABLE is delivered once half of it has been sent.
+ */
+#define	CMUX_STREAM_SENDQ_MAX	(256 * 1024)
+
+/*
+ * Send queue watermarks for the connection.
+ */
+#define	CMUX_CONN_LOWAT		(16 * 1024)
+#define	CMUX_CONN_HIWAT		(64 * 1024)
+#define	CMUX_CONN_RECV_MAX	(4 * (CMUX_FRAME_HDRSZ + CMUX_MSG_MAX))
+
+#define	CMUX_HASH_SIZE		64
+
+typedef enum cmux_frame_type {
+	CMUX_T_DATA = 1,
+	CMUX_T_WINDOW,
+	CMUX_T_FIN,
+	CMUX_T_RST
+} cmux_frame_type_t;
+
+struct cmux_stream {
+	uint32_t cms_id;
+	cmux_t *cms_mux;
+	void *cms_data;
+
+	cbufq_t *cms_sendq;			/* messages not yet sent */
+	size_t cms_sendq_bytes;
+	size_t cms_send_window;			/* credit from the peer */
+	boolean_t cms_send_blocked;		/* EAGAIN returned to sender */
+	boolean_t cms_fin_queued;
+	boolean_t cms_fin_sent;
+	boolean_t cms_ready;			/* on cmx_ready */
+	list_node_t cms_ready_link;
+
+	cbufq_t *cms_recvq;			/* messages held while paused */
+	size_t cms_recv_window;			/* credit the peer has left */
+	size_t cms_recv_consumed;		/* not yet returned */
+	boolean_t cms_paused;
+	boolean_t cms_recv_end;			/* FIN received */
+	boolean_t cms_end_delivered;
+	boolean_t cms_delivering;		/* in CMUX_CB_DATA */
+	void *cms_msg_ptr;
+	size_t cms_msg_len;
+
+	unsigned int cms_holds;
+	boolean_t cms_closed;
+	list_node_t cms_link;			/* cmx_streams */
+	cmux_stream_t *cms_hash_next;
+
+	cmux_stream_cb_t *cms_on_data;
+	cmux_stream_cb_t *cms_on_writable;
+	cmux_stream_cb_t *cms_on_end;
+	cmux_stream_cb_t *cms_on_reset;
+	cmux_stream_cb_t *cms_on_close;
+};
+
+/*
+ * An RST that the connection refused, to be sent on CCONN_CB_DRAIN.  The
+ * stream itself is gone by then.
+ */
+typedef struct cmux_rst {
+	uint32_t cmr_id;
+	list_node_t cmr_link;
+} cmux_rst_t;
+
+struct cmux {
+	cconn_t *cmx_conn;			/* NULL once closed */
+	void *cmx_data;
+	boolean_t cmx_client;
+	uint32_t cmx_next_id;
+	uint32_t cmx_peer_last;			/* highest id the peer opened */
+	list_t cmx_streams;			/* list of cmux_stream_t */
+	cmux_stream_t *cmx_hash[CMUX_HASH_SIZE];
+	list_t cmx_ready;			/* streams that may send */
+	size_t cmx_sendq_bytes;			/* over all streams */
+	list_t cmx_resets;			/* list of cmux_rst_t */
+	boolean_t cmx_closing;
+	boolean_t cmx_peer_end;			/* no more frames will arrive */
+	unsigned int cmx_holds;
+
+	cmux_cb_t *cmx_on_stream;
+	cmux_cb_t *cmx_on_close;
+};
+
+static void cmux_pump(cmux_t *cmx);
+
+static void
+cmux_hold(cmux_t *cmx)
+{
+	cmx->cmx_holds++;
+}
+
+static void
+cmux_rele(cmux_t *cmx)
+{
+	VERIFY3U(cmx->cmx_holds, >, 0);
+	if (--cmx->cmx_holds > 0 || cmx->cmx_conn != NULL) {
+		return;
+	}
+
+	VERIFY(list_is_empty(&cmx->cmx_streams));
+	VERIFY(list_is_empty(&cmx->cmx_ready));
+	VERIFY(list_is_empty(&cmx->cmx_resets));
+	list_destroy(&cmx->cmx_streams);
+	list_destroy(&cmx->cmx_ready);
+	list_destroy(&cmx->cmx_resets);
+	free(cmx);
+}
+
+static void
+cmux_stream_hold(cmux_stream_t *cms)
+{
+	cms->cms_holds++;
+}
+
+static void
+cmux_stream_rele(cmux_stream_t *cms)
+{
+	VERIFY3U(cms->cms_holds, >, 0);
+	if (--cms->cms_holds > 0 || !cms->cms_closed) {
+		return;
+	}
+
+	cbufq_free(cms->cms_sendq);
+	cbufq_free(cms->cms_recvq);
+	free(cms);
+}
+
+static void
+cmux_proto_error(cmux_t *cmx, const char *msg)
+{
+	if (cmx->cmx_conn == NULL) {
+		return;
+	}
+
+	warnx("cmux %s: %s", cconn_remote_addr_str(cmx->cmx_conn), msg);
+	(void) cconn_abort(cmx->cmx_conn);
+}
+
+/*
+ * Queue a frame on the connection, behind any data already there.
+ */
+static int
+cmux_write(cmux_t *cmx, cmux_frame_type_t type, uint32_t id, const void *buf,
+    size_t len)
+{
+	uint8_t *p;
+	size_t avail;
+	uint32_t v;
+
+	if (cmx->cmx_conn == NULL) {
+		errno = EPIPE;
+		return (-1);
+	}
+
+	if (cconn_send_reserve(cmx->cmx_conn, CMUX_FRAME_HDRSZ + len,
+	    (void **)&p, &avail) != 0) {
+		return (-1);
+	}
+
+	v = htonl((uint32_t)(CMUX_HDRSZ + len));
+	bcopy(&v, p, sizeof (v));
+	p[sizeof (v)] = (uint8_t)type;
+	v = htonl(id);
+	bcopy(&v, p + sizeof (v) + 1, sizeof (v));
+	if (len > 0) {
+		bcopy(buf, p + CMUX_FRAME_HDRSZ, len);
+	}
+
+	return (cconn_send_commit(cmx->cmx_conn, CMUX_FRAME_HDRSZ + len));
+}
+
+/*
+ * Send a WINDOW frame ahead of queued data.  These are small, and control
+ * sends are refused only when control data has backed up to the high
+ * watermark, or on a compressed connection, where everything is sent in
+ * order.  The caller may retry a refused send on CCONN_CB_DRAIN; any other
+ * failure aborts the connection.
+ */
+static int
+cmux_write_ctl(cmux_t *cmx, cmux_frame_type_t type, uint32_t id,
+    uint32_t arg)
+{
+	uint8_t frame[CMUX_FRAME_HDRSZ + sizeof (uint32_t)];
+	size_t len = type == CMUX_T_WINDOW ? sizeof (frame) : CMUX_FRAME_HDRSZ;
+	cbuf_t *cbuf;
+	uint32_t v;
+
+	if (cmx->cmx_conn == NULL) {
+		errno = EPIPE;
+		return (-1);
+	}
+
+	v = htonl((uint32_t)(len - sizeof (v)));
+	bcopy(&v, frame, sizeof (v));
+	frame[sizeof (v)] = (uint8_t)type;
+	v = htonl(id);
+	bcopy(&v, frame + sizeof (v) + 1, sizeof (v));
+	v = htonl(arg);
+	bcopy(&v, frame + CMUX_FRAME_HDRSZ, sizeof (v));
+
+	if (cbuf_alloc(&cbuf, len) != 0) {
+		goto fail;
+	}
+	cbuf_flip(cbuf);
+	bcopy(frame, cbuf_unused_ptr(cbuf), len);
+	VERIFY0(cbuf_limit_extend(cbuf, len));
+
+	if (cconn_send_cbuf_prio(cmx->cmx_conn, cbuf,
+	    CCONN_PRIO_CONTROL) != 0) {
+		cbuf_free(cbuf);
+		if (errno == EAGAIN) {
+			return (-1);
+		}
+		goto fail;
+	}
+	return (0);
+
+fail:
+	warn("cmux control frame");
+	(void) cconn_abort(cmx->cmx_conn);
+	return (-1);
+}
+
+/*
+ * Queue an RST frame behind everything already on the connection.  If the
+ * connection refuses it, or earlier ones are still waiting, it is kept until
+ * CCONN_CB_DRAIN.  Any other failure aborts the connection.
+ */
+static void
+cmux_write_rst(cmux_t *cmx, uint32_t id)
+{
+	cmux_rst_t *cmr;
+
+	if (cmx->cmx_conn == NULL) {
+		return;
+	}
+
+	if (list_is_empty(&cmx->cmx_resets)) {
+		if (cmux_write(cmx, CMUX_T_RST, id, NULL, 0) == 0) {
+			return;
+		}
+		if (errno != EAGAIN) {
+			goto fail;
+		}
+	}
+
+	if ((cmr = calloc(1, sizeof (*cmr))) == NULL) {
+		goto fail;
+	}
+	cmr->cmr_id = id;
+	list_insert_tail(&cmx->cmx_resets, cmr);
+	return;
+
+fail:
+	warn("cmux reset");
+	(void) cconn_abort(cmx->cmx_conn);
+}
+
+/*
+ * Send the RST frames that the connection refused earlier, in order.
+ */
+static void
+cmux_rst_flush(cmux_t *cmx)
+{
+	cmux_rst_t *cmr;
+
+	while (cmx->cmx_conn != NULL &&
+	    (cmr = list_head(&cmx->cmx_resets)) != NULL) {
+		if (cmux_write(cmx, CMUX_T_RST, cmr->cmr_id, NULL, 0) != 0) {
+			if (errno != EAGAIN) {
+				warn("cmux reset");
+				(void) cconn_abort(cmx->cmx_conn);
+			}
+			return;
+		}
+		list_remove(&cmx->cmx_resets, cmr);
+		free(cmr);
+	}
+}
+
+static cmux_stream_t *
+cmux_lookup(cmux_t *cmx, uint32_t id)
+{
+	cmux_stream_t *cms;
+
+	for (cms = cmx->cmx_hash[id % CMUX_HASH_SIZE]; cms != NULL &&
+	    cms->cms_id != id; cms = cms->cms_hash_next) {
+		continue;
+	}
+
+	return (cms);
+}
+
+static int
+cmux_stream_alloc(cmux_t *cmx, uint32_t id, cmux_stream_t **cmsp)
+{
+	cmux_stream_t *cms;
+
+	if ((cms = calloc(1, sizeof (*cms))) == NULL) {
+		return (-1);
+	}
+
+	if (cbufq_alloc(&cms->cms_sendq) != 0 ||
+	    cbufq_alloc(&cms->cms_recvq) != 0) {
+		cbufq_free(cms->cms_sendq);
+		free(cms);
+		return (-1);
+	}
+
+	cms->cms_id = id;
+	cms->cms_mux = cmx;
+	cms->cms_send_window = CMUX_WINDOW;
+	cms->cms_recv_window = CMUX_WINDOW;
+
+	list_insert_tail(&cmx->cmx_streams, cms);
+	cms->cms_hash_next = cmx->cmx_hash[id % CMUX_HASH_SIZE];
+	cmx->cmx_hash[id % CMUX_HASH_SIZE] = cms;
+
+	*cmsp = cms;
+	return (0);
+}
+
+/*
+ * Take the stream out of the multiplexer and deliver its final callbacks.
+ * The stream is freed once the last hold is released.
+ */
+static void
+cmux_stream_closed(cmux_stream_t *cms, boolean_t reset)
+{
+	cmux_t *cmx = cms->cms_mux;
+	cmux_stream_t **cmsp;
+
+	if (cms->cms_closed) {
+		return;
+	}
+	cms->cms_closed = B_TRUE;
+
+	list_remove(&cmx->cmx_streams, cms);
+	for (cmsp = &cmx->cmx_hash[cms->cms_id % CMUX_HASH_SIZE];
+	    *cmsp != cms; cmsp = &(*cmsp)->cms_hash_next) {
+		VERIFY3P(*cmsp, !=, NULL);
+	}
+	*cmsp = cms->cms_hash_next;
+	if (cms->cms_ready) {
+		list_remove(&cmx->cmx_ready, cms);
+		cms->cms_ready = B_FALSE;
+	}
+	VERIFY3U(cmx->cmx_sendq_bytes, >=, cms->cms_sendq_bytes);
+	cmx->cmx_sendq_bytes -= cms->cms_sendq_bytes;
+
+	cmux_stream_hold(cms);
+	if (reset && cms->cms_on_reset != NULL) {
+		cms->cms_on_reset(cms, CMUX_CB_RESET);
+	}
+	if (cms->cms_on_close != NULL) {
+		cms->cms_on_close(cms, CMUX_CB_CLOSE);
+	}
+	cmux_stream_rele(cms);
+}
+
+/*
+ * Discard the stream's unsent messages, tell the peer, and close it.
+ * CMUX_CB_RESET is delivered first if "reset" is set.
+ */
+static void
+cmux_stream_abandon(cmux_stream_t *cms, boolean_t reset)
+{
+	cbuf_t *cbuf;
+
+	/*
+	 * A failure to queue the RST aborts the connection, which closes
+	 * the stream.
+	 */
+	cmux_stream_hold(cms);
+	while ((cbuf = cbufq_deq(cms->cms_sendq)) != NULL) {
+		cbuf_free(cbuf);
+	}
+	cmux_write_rst(cms->cms_mux, cms->cms_id);
+	cmux_stream_closed(cms, reset);
+	cmux_stream_rele(cms);
+}
+
+/*
+ * Once the peer has ended the connection, no window update can arrive, and
+ * a stream whose next message does not fit its window would keep the
+ * connection open forever.  Reset those streams instead.
+ */
+static void
+cmux_reset_starved(cmux_t *cmx)
+{
+	cmux_stream_t *cms;
+
+again:
+	for (cms = list_head(&cmx->cmx_streams); cms != NULL;
+	    cms = list_next(&cmx->cmx_streams, cms)) {
+		if (!cms->cms_ready && cbufq_count(cms->cms_sendq) != 0) {
+			cmux_stream_abandon(cms, B_TRUE);
+			goto again;
+		}
+	}
+}
+
+static void
+cmux_stream_check_done(cmux_stream_t *cms)
+{
+	if (cms->cms_fin_sent && cms->cms_end_delivered) {
+		cmux_stream_closed(cms, B_FALSE);
+	}
+}
+
+/*
+ * Put the stream on the ready list if its next message (or its FIN) may be
+ * sent, and take it off otherwise.
+ */
+static void
+cmux_stream_sched(cmux_stream_t *cms)
+{
+	cmux_t *cmx = cms->cms_mux;
+	boolean_t ready;
+	cbuf_t *head;
+
+	if (cms->cms_closed) {
+		ready = B_FALSE;
+	} else if ((head = cbufq_peek(cms->cms_sendq)) != NULL) {
+		ready = cms->cms_send_window >=
+		    CMUX_COST(cbuf_available(head)) ? B_TRUE : B_FALSE;
+	} else {
+		ready = cms->cms_fin_queued && !cms->cms_fin_sent ?
+		    B_TRUE : B_FALSE;
+	}
+
+	if (ready && !cms->cms_ready) {
+		list_insert_tail(&cmx->cmx_ready, cms);
+		cms->cms_ready = B_TRUE;
+	} else if (!ready && cms->cms_ready) {
+		list_remove(&cmx->cmx_ready, cms);
+		cms->cms_ready = B_FALSE;
+	}
+}
+
+/*
+ * Send one message (or the FIN) from each ready stream in turn, until the
+ * connection will take no more.
+ */
+static void
+cmux_pump(cmux_t *cmx)
+{
+	cmux_stream_t *cms;
+	cbuf_t *cbuf;
+	size_t len;
+	void *ptr;
+
+	cmux_hold(cmx);
+	while (cmx->cmx_conn != NULL &&
+	    (cms = list_head(&cmx->cmx_ready)) != NULL) {
+		if ((cbuf = cbufq_peek(cms->cms_sendq)) != NULL) {
+			len = cbuf_available(cbuf);
+			ptr = NULL;
+			if (len > 0) {
+				VERIFY0(cbuf_get_ptr(cbuf, 0, len, &ptr));
+			}
+			if (cmux_write(cmx, CMUX_T_DATA, cms->cms_id, ptr,
+			    len) != 0) {
+				break;
+			}
+
+			VERIFY3P(cbufq_deq(cms->cms_sendq), ==, cbuf);
+			cbuf_free(cbuf);
+			cms->cms_send_window -= CMUX_COST(len);
+			cms->cms_sendq_bytes -= len;
+			cmx->cmx_sendq_bytes -= len;
+		} else {
+			if (cmux_write(cmx, CMUX_T_FIN, cms->cms_id, NULL,
+			    0) != 0) {
+				break;
+			}
+			cms->cms_fin_sent = B_TRUE;
+		}
+
+		/*
+		 * Go to the back of the line.
+		 */
+		list_remove(&cmx->cmx_ready, cms);
+		cms->cms_ready = B_FALSE;
+		cmux_stream_sched(cms);
+
+		cmux_stream_hold(cms);
+		if (cms->cms_fin_sent) {
+			cmux_stream_check_done(cms);
+		} else if (cms->cms_send_blocked &&
+		    cms->cms_sendq_bytes <= CMUX_STREAM_SENDQ_MAX / 2) {
+			cms->cms_send_blocked = B_FALSE;
+			if (cms->cms_on_writable != NULL) {
+				cms->cms_on_writable(cms, CMUX_CB_WRITABLE);
+			}
+		}
+		cmux_stream_rele(cms);
+	}
+
+	if (cmx->cmx_conn != NULL && cms != NULL && errno != EAGAIN) {
+		warn("cmux send");
+		(void) cconn_abort(cmx->cmx_conn);
+	}
+
+	if (cmx->cmx_conn != NULL && cmx->cmx_peer_end) {
+		cmux_reset_starved(cmx);
+	}
+
+	/*
+	 * Once everything has been sent, a closing multiplexer shuts down the
+	 * connection.
+	 */
+	if (cmx->cmx_conn != NULL && cmx->cmx_closing &&
+	    cmx->cmx_sendq_bytes == 0 && list_is_empty(&cmx->cmx_ready) &&
+	    list_is_empty(&cmx->cmx_resets)) {
+		(void) cconn_fin(cmx->cmx_conn);
+	}
+	cmux_rele(cmx);
+}
+
+/*
+ * Return credit to the peer for consumed messages.  If the update cannot be
+ * queued now, it is retried on CCONN_CB_DRAIN.
+ */
+static void
+cmux_stream_credit_flush(cmux_stream_t *cms)
+{
+	if (cms->cms_recv_consumed < CMUX_WINDOW_UPDATE || cms->cms_recv_end ||
+	    cmux_write_ctl(cms->cms_mux, CMUX_T_WINDOW, cms->cms_id,
+	    (uint32_t)cms->cms_recv_consumed) != 0) {
+		return;
+	}
+
+	cms->cms_recv_window += cms->cms_recv_consumed;
+	cms->cms_recv_consumed = 0;
+}
+
+static void
+cmux_stream_credit(cmux_stream_t *cms, size_t len)
+{
+	cms->cms_recv_consumed += CMUX_COST(len);
+	cmux_stream_credit_flush(cms);
+}
+
+static void
+cmux_stream_deliver_one(cmux_stream_t *cms, void *ptr, size_t len)
+{
+	cms->cms_delivering = B_TRUE;
+	cms->cms_msg_ptr = ptr;
+	cms->cms_msg_len = len;
+	if (cms->cms_on_data != NULL) {
+		cms->cms_on_data(cms, CMUX_CB_DATA);
+	}
+	cms->cms_delivering = B_FALSE;
+	cms->cms_msg_ptr = NULL;
+	cms->cms_msg_len = 0;
+
+	if (!cms->cms_closed) {
+		cmux_stream_credit(cms, len);
+	}
+}
+
+/*
+ * Deliver messages held while the stream was paused, followed by the end of
+ * the stream if the peer has sent it.  The caller must hold the stream.
+ */
+static void
+cmux_stream_deliver(cmux_stream_t *cms)
+{
+	cbuf_t *cbuf;
+	size_t len;
+	void *ptr;
+
+	while (!cms->cms_paused && !cms->cms_closed &&
+	    (cbuf = cbufq_deq(cms->cms_recvq)) != NULL) {
+		len = cbuf_available(cbuf);
+		ptr = NULL;
+		if (len > 0) {
+			VERIFY0(cbuf_get_ptr(cbuf, 0, len, &ptr));
+		}
+		cmux_stream_deliver_one(cms, ptr, len);
+		cbuf_free(cbuf);
+	}
+
+	if (cms->cms_paused || cms->cms_closed || !cms->cms_recv_end ||
+	    cms->cms_end_delivered || cbufq_count(cms->cms_recvq) > 0) {
+		return;
+	}
+
+	cms->cms_end_delivered = B_TRUE;
+	if (cms->cms_on_end != NULL) {
+		cms->cms_on_end(cms, CMUX_CB_END);
+	}
+	if (!cms->cms_closed) {
+		cmux_stream_check_done(cms);
+	}
+}
+
+static void
+cmux_stream_input(cmux_stream_t *cms, void *ptr, size_t len)
+{
+	cmux_t *cmx = cms->cms_mux;
+	cbuf_t *cbuf;
+
+	if (cms->cms_recv_end) {
+		cmux_proto_error(cmx, "data after end of stream");
+		return;
+	}
+	if (CMUX_COST(len) > cms->cms_recv_window) {
+		cmux_proto_error(cmx, "stream window exceeded");
+		return;
+	}
+	cms->cms_recv_window -= CMUX_COST(len);
+
+	if (!cms->cms_paused && cbufq_count(cms->cms_recvq) == 0) {
+		cmux_stream_deliver_one(cms, ptr, len);
+		return;
+	}
+
+	/*
+	 * The frame goes away with cconn_next(), so keep a copy.
+	 */
+	if (cbuf_alloc(&cbuf, len > 0 ? len : 1) != 0) {
+		warn("cmux receive");
+		(void) cconn_abort(cmx->cmx_conn);
+		return;
+	}
+	cbuf_flip(cbuf);
+	if (len > 0) {
+		bcopy(ptr, cbuf_unused_ptr(cbuf), len);
+	}
+	VERIFY0(cbuf_limit_extend(cbuf, len));
+	cbufq_enq(cms->cms_recvq, cbuf);
+}
+
+/*
+ * Find the stream a frame belongs to.  An id the peer has not used before
+ * opens a new stream; frames for streams that have since closed are
+ * dropped.
+ */
+static cmux_stream_t *
+cmux_input_stream(cmux_t *cmx, cmux_frame_type_t type, uint32_t id)
+{
+	uint32_t parity = cmx->cmx_client ? 0 : 1;
+	cmux_stream_t *cms;
+
+	if ((cms = cmux_lookup(cmx, id)) != NULL) {
+		return (cms);
+	}
+
+	if ((type != CMUX_T_DATA && type != CMUX_T_FIN) ||
+	    (id & 1) != parity || id <= cmx->cmx_peer_last) {
+		return (NULL);
+	}
+
+	if (cmux_stream_alloc(cmx, id, &cms) != 0) {
+		warn("cmux stream");
+		(void) cconn_abort(cmx->cmx_conn);
+		return (NULL);
+	}
+	cmx->cmx_peer_last = id;
+
+	/*
+	 * The consumer installs the stream's callbacks, or resets it.
+	 */
+	cmux_stream_hold(cms);
+	if (cmx->cmx_on_stream != NULL) {
+		cmx->cmx_on_stream(cmx, cms, CMUX_CB_STREAM);
+	} else {
+		cmux_stream_reset(cms);
+	}
+	if (cms->cms_closed) {
+		cmux_stream_rele(cms);
+		return (NULL);
+	}
+	cmux_stream_rele(cms);
+
+	return (cms);
+}
+
+static void
+cmux_input(cmux_t *cmx, cmux_frame_type_t type, uint32_t id, void *ptr,
+    size_t len)
+{
+	cmux_stream_t *cms;
+	uint32_t incr;
+
+	if (type < CMUX_T_DATA || type > CMUX_T_RST) {
+		cmux_proto_error(cmx, "unknown frame type");
+		return;
+	}
+
+	if ((cms = cmux_input_stream(cmx, type, id)) == NULL) {
+		return;
+	}
+
+	cmux_stream_hold(cms);
+	switch (type) {
+	case CMUX_T_DATA:
+		cmux_stream_input(cms, ptr, len);
+		break;
+
+	case CMUX_T_WINDOW:
+		if (len != sizeof (incr)) {
+			cmux_proto_error(cmx, "bad window update");
+			break;
+		}
+		bcopy(ptr, &incr, sizeof (incr));
+		incr = ntohl(incr);
+		if (incr > CMUX_WINDOW - cms->cms_send_window) {
+			cmux_proto_error(cmx, "window overflow");
+			break;
+		}
+		cms->cms_send_window += incr;
+		cmux_stream_sched(cms);
+		cmux_pump(cmx);
+		break;
+
+	case CMUX_T_FIN:
+		if (cms->cms_recv_end) {
+			cmux_proto_error(cmx, "duplicate end of stream");
+			break;
+		}
+		cms->cms_recv_end = B_TRUE;
+		cmux_stream_deliver(cms);
+		break;
+
+	case CMUX_T_RST:
+		cmux_stream_closed(cms, B_TRUE);
+		break;
+	}
+	cmux_stream_rele(cms);
+}
+
+static void
+cmux_on_frame(cconn_t *ccn, int event)
+{
+	cmux_t *cmx = cconn_data(ccn);
+	uint8_t *p;
+	size_t len;
+	uint32_t id;
+
+	VERIFY(event == CCONN_CB_LINE_AVAILABLE);
+
+	if (cconn_frame(ccn, (void **)&p, &len) != 0 || len < CMUX_HDRSZ) {
+		cmux_proto_error(cmx, "short frame");
+		return;
+	}
+	bcopy(p + 1, &id, sizeof (id));
+	id = ntohl(id);
+
+	/*
+	 * Consumers may close streams, or the whole connection, from their
+	 * callbacks.
+	 */
+	cmux_hold(cmx);
+	cconn_hold(ccn);
+	cmux_input(cmx, (cmux_frame_type_t)p[0], id, p + CMUX_HDRSZ,
+	    len - CMUX_HDRSZ);
+	cconn_next(ccn);
+	cconn_rele(ccn);
+	cmux_rele(cmx);
+}
+
+static void
+cmux_on_drain(cconn_t *ccn, int event)
+{
+	cmux_t *cmx = cconn_data(ccn);
+	cmux_stream_t *cms;
+
+	VERIFY(event == CCONN_CB_DRAIN);
+
+	/*
+	 * A failed update aborts the connection, which closes every stream.
+	 */
+	cmux_hold(cmx);
+	cmux_rst_flush(cmx);
+	for (cms = list_head(&cmx->cmx_streams); cms != NULL;
+	    cms = list_next(&cmx->cmx_streams, cms)) {
+		cmux_stream_credit_flush(cms);
+		if (cmx->cmx_conn == NULL) {
+			break;
+		}
+	}
+	cmux_pump(cmx);
+	cmux_rele(cmx);
+}
+
+/*
+ * The peer will send nothing more.  Finish sending what we have, and then
+ * shut down the connection; any stream that is still open when it closes is
+ * reset.
+ */
+static void
+cmux_on_end(cconn_t *ccn, int event)
+{
+	cmux_t *cmx = cconn_data(ccn);
+
+	VERIFY(event == CCONN_CB_END);
+
+	cmx->cmx_closing = B_TRUE;
+	cmx->cmx_peer_end = B_TRUE;
+	cmux_pump(cmx);
+}
+
+static void
+cmux_on_close(cconn_t *ccn, int event)
+{
+	cmux_t *cmx = cconn_data(ccn);
+	cmux_stream_t *cms;
+	cmux_rst_t *cmr;
+
+	VERIFY(event == CCONN_CB_CLOSE);
+
+	cmux_hold(cmx);
+	cmx->cmx_conn = NULL;
+	cconn_data_set(ccn, NULL);
+
+	while ((cmr = list_remove_head(&cmx->cmx_resets)) != NULL) {
+		free(cmr);
+	}
+	while ((cms = list_head(&cmx->cmx_streams)) != NULL) {
+		cmux_stream_closed(cms, B_TRUE);
+	}
+
+	if (cmx->cmx_on_close != NULL) {
+		cmx->cmx_on_close(cmx, NULL, CMUX_CB_CLOSE);
+	}
+	cmux_rele(cmx);
+}
+
+/*
+ * Carry streams over "ccn".  This may be called before the first frame has
+ * arrived, or while the last frame before the switch is available, in which
+ * case the caller then calls cconn_next() as usual.
+ */
+int
+cmux_alloc(cmux_t **cmxp, cconn_t *ccn, boolean_t client)
+{
+	cmux_t *cmx;
+
+	*cmxp = NULL;
+
+	if ((cmx = calloc(1, sizeof (*cmx))) == NULL) {
+		return (-1);
+	}
+
+	if (cconn_framing_length(ccn, sizeof (uint32_t),
+	    CBUF_ORDER_BIG_ENDIAN) != 0) {
+		free(cmx);
+		return (-1);
+	}
+	cconn_recv_limits_set(ccn, CMUX_HDRSZ + CMUX_MSG_MAX,
+	    CMUX_CONN_RECV_MAX);
+	cconn_send_watermarks_set(ccn, CMUX_CONN_LOWAT, CMUX_CONN_HIWAT);
+
+	cmx->cmx_conn = ccn;
+	cmx->cmx_client = client;
+	cmx->cmx_next_id = client ? 1 : 2;
+	list_create(&cmx->cmx_streams, sizeof (cmux_stream_t),
+	    offsetof(cmux_stream_t, cms_link));
+	list_create(&cmx->cmx_ready, sizeof (cmux_stream_t),
+	    offsetof(cmux_stream_t, cms_ready_link));
+	list_create(&cmx->cmx_resets, sizeof (cmux_rst_t),
+	    offsetof(cmux_rst_t, cmr_link));
+
+	cconn_data_set(ccn, cmx);
+	cconn_on(ccn, CCONN_CB_LINE_AVAILABLE, cmux_on_frame);
+	cconn_on(ccn, CCONN_CB_DRAIN, cmux_on_drain);
+	cconn_on(ccn, CCONN_CB_END, cmux_on_end);
+	cconn_on(ccn, CCONN_CB_CLOSE, cmux_on_close);
+
+	*cmxp = cmx;
+	return (0);
+}
+
+void
+cmux_on(cmux_t *cmx, int event, cmux_cb_t *func)
+{
+	switch ((cmux_cb_type_t)event) {
+	case CMUX_CB_STREAM:
+		cmx->cmx_on_stream = func;
+		return;
+
+	case CMUX_CB_CLOSE:
+		cmx->cmx_on_close = func;
+		return;
+
+	default:
+		break;
+	}
+
+	warnx("unknown cmux cb %d\n", event);
+	abort();
+}
+
+cconn_t *
+cmux_conn(cmux_t *cmx)
+{
+	return (cmx->cmx_conn);
+}
+
+void *
+cmux_data(cmux_t *cmx)
+{
+	return (cmx->cmx_data);
+}
+
+void
+cmux_data_set(cmux_t *cmx, void *data)
+{
+	cmx->cmx_data = data;
+}
+
+/*
+ * Stop opening streams, and shut down the connection once everything queued
+ * on the streams has been sent.
+ */
+void
+cmux_close(cmux_t *cmx)
+{
+	cmx->cmx_closing = B_TRUE;
+	cmux_pump(cmx);
+}
+
+void
+cmux_abort(cmux_t *cmx)
+{
+	if (cmx->cmx_conn != NULL) {
+		(void) cconn_abort(cmx->cmx_conn);
+	}
+}
+
+int
+cmux_open(cmux_t *cmx, cmux_stream_t **cmsp)
+{
+	*cmsp = NULL;
+
+	if (cmx->cmx_conn == NULL || cmx->cmx_closing) {
+		errno = EPIPE;
+		return (-1);
+	}
+	if (cmx->cmx_next_id > UINT32_MAX - 2) {
+		errno = ENOSPC;
+		return (-1);
+	}
+
+	if (cmux_stream_alloc(cmx, cmx->cmx_next_id, cmsp) != 0) {
+		return (-1);
+	}
+	cmx->cmx_next_id += 2;
+	return (0);
+}
+
+void
+cmux_stream_on(cmux_stream_t *cms, int event, cmux_stream_cb_t *func)
+{
+	switch ((cmux_cb_type_t)event) {
+	case CMUX_CB_DATA:
+		cms->cms_on_data = func;
+		return;
+
+	case CMUX_CB_WRITABLE:
+		cms->cms_on_writable = func;
+		return;
+
+	case CMUX_CB_END:
+		cms->cms_on_end = func;
+		return;
+
+	case CMUX_CB_RESET:
+		cms->cms_on_reset = func;
+		return;
+
+	case CMUX_CB_CLOSE:
+		cms->cms_on_close = func;
+		return;
+
+	default:
+		break;
+	}
+
+	warnx("unknown cmux stream cb %d\n", event);
+	abort();
+}
+
+uint32_t
+cmux_stream_id(cmux_stream_t *cms)
+{
+	return (cms->cms_id);
+}
+
+cmux_t *
+cmux_stream_mux(cmux_stream_t *cms)
+{
+	return (cms->cms_mux);
+}
+
+void *
+cmux_stream_data(cmux_stream_t *cms)
+{
+	return (cms->cms_data);
+}
+
+void
+cmux_stream_data_set(cmux_stream_t *cms, void *data)
+{
+	cms->cms_data = data;
+}
+
+/*
+ * Send "len" bytes as one message.  If no other stream is waiting and the
+ * window allows, the message goes straight onto the connection; otherwise a
+ * copy waits its turn on the stream.
+ */
+int
+cmux_stream_send(cmux_stream_t *cms, const void *buf, size_t len)
+{
+	cmux_t *cmx = cms->cms_mux;
+	cbuf_t *cbuf;
+
+	if (cms->cms_closed || cms->cms_fin_queued || cmx->cmx_conn == NULL) {
+		errno = EPIPE;
+		return (-1);
+	}
+	if (len > CMUX_MSG_MAX) {
+		errno = EMSGSIZE;
+		return (-1);
+	}
+	if (cmx->cmx_peer_end && cms->cms_send_window < CMUX_COST(len)) {
+		errno = EPIPE;
+		return (-1);
+	}
+	if (cms->cms_sendq_bytes >= CMUX_STREAM_SENDQ_MAX) {
+		cms->cms_send_blocked = B_TRUE;
+		errno = EAGAIN;
+		return (-1);
+	}
+
+	if (list_is_empty(&cmx->cmx_ready) &&
+	    cbufq_count(cms->cms_sendq) == 0 &&
+	    cms->cms_send_window >= CMUX_COST(len)) {
+		if (cmux_write(cmx, CMUX_T_DATA, cms->cms_id, buf, len) == 0) {
+			cms->cms_send_window -= CMUX_COST(len);
+			return (0);
+		}
+		if (errno != EAGAIN) {
+			return (-1);
+		}
+	}
+
+	if (cbuf_alloc(&cbuf, len > 0 ? len : 1) != 0) {
+		return (-1);
+	}
+	cbuf_flip(cbuf);
+	if (len > 0) {
+		bcopy(buf, cbuf_unused_ptr(cbuf), len);
+	}
+	VERIFY0(cbuf_limit_extend(cbuf, len));
+	cbufq_enq(cms->cms_sendq, cbuf);
+	cms->cms_sendq_bytes += len;
+	cmx->cmx_sendq_bytes += len;
+
+	cmux_stream_sched(cms);
+	return (0);
+}
+
+/*
+ * Obtain the message being delivered.  The data is only valid during the
+ * CMUX_CB_DATA callback.
+ */
+int
+cmux_stream_msg(cmux_stream_t *cms, void **ptrp, size_t *lenp)
+{
+	if (!cms->cms_delivering) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	*ptrp = cms->cms_msg_ptr;
+	*lenp = cms->cms_msg_len;
+	return (0);
+}
+
+void
+cmux_stream_pause(cmux_stream_t *cms)
+{
+	cms->cms_paused = B_TRUE;
+}
+
+void
+cmux_stream_resume(cmux_stream_t *cms)
+{
+	cmux_t *cmx = cms->cms_mux;
+
+	if (!cms->cms_paused) {
+		return;
+	}
+	cms->cms_paused = B_FALSE;
+
+	cmux_hold(cmx);
+	cmux_stream_hold(cms);
+	cmux_stream_deliver(cms);
+	cmux_stream_rele(cms);
+	cmux_rele(cmx);
+}
+
+/*
+ * Finish sending on the stream.  The peer sees the end of the stream after
+ * every message already sent.
+ */
+int
+cmux_stream_fin(cmux_stream_t *cms)
+{
+	cmux_t *cmx = cms->cms_mux;
+
+	if (cms->cms_closed || cms->cms_fin_queued) {
+		errno = EPIPE;
+		return (-1);
+	}
+	cms->cms_fin_queued = B_TRUE;
+
+	cmux_stream_sched(cms);
+	cmux_pump(cmx);
+	return (0);
+}
+
+/*
+ * Abandon the stream in both directions.  Messages not yet sent are
+ * discarded, and CMUX_CB_CLOSE is delivered before this returns.
+ */
+void
+cmux_stream_reset(cmux_stream_t *cms)
+{
+	if (cms->cms_closed) {
+		return;
+	}
+
+	cmux_stream_abandon(cms, B_FALSE);
+}
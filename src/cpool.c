@@ -0,0 +1,435 @@
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <err.h>
+#include <sys/debug.h>
+#include <sys/types.h>
+
+#include <sys/list.h>
+
+#include "libcbuf.h"
+#include "libcloop.h"
+
+/*
+ * CONNECTION POOL
+ *
+ * Requests are sent to a destination over one of a set of connections kept
+ * open to it.  Each request produces exactly one reply frame, and replies
+ * arrive in the order their requests were sent, so several requests may be
+ * outstanding on a connection at once.  A request is sent on the idle
+ * connection, if there is one; otherwise a new connection is opened, up to
+ * the per-destination limit, and beyond that the least busy connection with
+ * room in its pipeline is used.  If every connection is full, the request
+ * waits in the pool until a reply makes room.
+ */
+
+typedef struct cpool_dest cpool_dest_t;
+
+typedef struct cpool_req {
+	cpool_cb_t *cpr_cb;
+	void *cpr_arg;
+	cbuf_t *cpr_cbuf;			/* data, while waiting */
+	list_node_t cpr_link;
+} cpool_req_t;
+
+typedef struct cpool_conn {
+	cconn_t *cpc_conn;
+	cpool_dest_t *cpc_dest;
+	list_t cpc_inflight;			/* list of cpool_req_t */
+	unsigned int cpc_ninflight;
+	boolean_t cpc_connected;
+	list_node_t cpc_link;
+} cpool_conn_t;
+
+struct cpool_dest {
+	char *cpd_host;
+	char *cpd_port;
+	cpool_t *cpd_pool;
+	list_t cpd_conns;			/* list of cpool_conn_t */
+	unsigned int cpd_nconns;
+	list_t cpd_waiting;			/* list of cpool_req_t */
+	list_node_t cpd_link;
+};
+
+struct cpool {
+	cloop_t *cp_loop;
+	unsigned int cp_max_conns;
+	unsigned int cp_max_inflight;
+	boolean_t cp_closing;
+	list_t cp_dests;			/* list of cpool_dest_t */
+};
+
+static void cpool_dispatch(cpool_dest_t *cpd);
+
+static void
+cpool_req_fail(cpool_req_t *cpr, int e)
+{
+	cpr->cpr_cb(cpr->cpr_arg, NULL, e);
+	cbuf_free(cpr->cpr_cbuf);
+	free(cpr);
+}
+
+static void
+cpool_on_connected(cconn_t *ccn, int event)
+{
+	cpool_conn_t *cpc = cconn_data(ccn);
+
+	VERIFY(event == CCONN_CB_CONNECTED);
+
+	cpc->cpc_connected = B_TRUE;
+}
+
+static void
+cpool_on_reply(cconn_t *ccn, int event)
+{
+	cpool_conn_t *cpc = cconn_data(ccn);
+	cpool_dest_t *cpd = cpc->cpc_dest;
+	cpool_req_t *cpr;
+
+	VERIFY(event == CCONN_CB_LINE_AVAILABLE);
+
+	if ((cpr = list_remove_head(&cpc->cpc_inflight)) == NULL) {
+		warnx("cpool: unsolicited reply from %s",
+		    cconn_remote_addr_str(ccn));
+		(void) cconn_abort(ccn);
+		return;
+	}
+	cpc->cpc_ninflight--;
+
+	/*
+	 * Consuming the reply may deliver further replies, or close the
+	 * connection, before cconn_next() returns.
+	 */
+	cconn_hold(ccn);
+	cpr->cpr_cb(cpr->cpr_arg, ccn, 0);
+	free(cpr);
+	cconn_next(ccn);
+
+	cpool_dispatch(cpd);
+	cconn_rele(ccn);
+}
+
+static void
+cpool_on_end(cconn_t *ccn, int event)
+{
+	VERIFY(event == CCONN_CB_END);
+
+	(void) cconn_fin(ccn);
+}
+
+static void
+cpool_on_drain(cconn_t *ccn, int event)
+{
+	cpool_conn_t *cpc = cconn_data(ccn);
+
+	VERIFY(event == CCONN_CB_DRAIN);
+
+	cpool_dispatch(cpc->cpc_dest);
+}
+
+static void
+cpool_on_close(cconn_t *ccn, int event)
+{
+	cpool_conn_t *cpc = cconn_data(ccn);
+	cpool_dest_t *cpd = cpc->cpc_dest;
+	cpool_req_t *cpr;
+	int e = cpc->cpc_connected ? ECONNRESET : ECONNREFUSED;
+
+	VERIFY(event == CCONN_CB_CLOSE);
+
+	list_remove(&cpd->cpd_conns, cpc);
+	cpd->cpd_nconns--;
+	cconn_data_set(ccn, NULL);
+
+	while ((cpr = list_remove_head(&cpc->cpc_inflight)) != NULL) {
+		cpool_req_fail(cpr, e);
+	}
+
+	if (!cpc->cpc_connected && cpd->cpd_nconns == 0) {
+		/*
+		 * The destination is not reachable, so there is no point
+		 * trying again for the requests that are waiting.
+		 */
+		while ((cpr = list_remove_head(&cpd->cpd_waiting)) != NULL) {
+			cpool_req_fail(cpr, e);
+		}
+	} else {
+		cpool_dispatch(cpd);
+	}
+
+	list_destroy(&cpc->cpc_inflight);
+	free(cpc);
+}
+
+static cpool_conn_t *
+cpool_conn_open(cpool_dest_t *cpd)
+{
+	cpool_conn_t *cpc;
+	cconn_t *ccn;
+
+	if ((cpc = calloc(1, sizeof (*cpc))) == NULL) {
+		return (NULL);
+	}
+
+	if (cconn_connect(cpd->cpd_pool->cp_loop, cpd->cpd_host, cpd->cpd_port,
+	    &ccn) != 0) {
+		free(cpc);
+		return (NULL);
+	}
+
+	cpc->cpc_conn = ccn;
+	cpc->cpc_dest = cpd;
+	list_create(&cpc->cpc_inflight, sizeof (cpool_req_t),
+	    offsetof(cpool_req_t, cpr_link));
+	list_insert_tail(&cpd->cpd_conns, cpc);
+	cpd->cpd_nconns++;
+
+	cconn_data_set(ccn, cpc);
+	cconn_on(ccn, CCONN_CB_CONNECTED, cpool_on_connected);
+	cconn_on(ccn, CCONN_CB_LINE_AVAILABLE, cpool_on_reply);
+	cconn_on(ccn, CCONN_CB_END, cpool_on_end);
+	cconn_on(ccn, CCONN_CB_DRAIN, cpool_on_drain);
+	cconn_on(ccn, CCONN_CB_CLOSE, cpool_on_close);
+
+	return (cpc);
+}
+
+/*
+ * Choose a connection for the next request to this destination, opening a
+ * new one if every existing connection is busy and we are below the limit.
+ */
+static cpool_conn_t *
+cpool_conn_pick(cpool_dest_t *cpd)
+{
+	cpool_t *cp = cpd->cpd_pool;
+	cpool_conn_t *best = NULL;
+	cpool_conn_t *cpc;
+
+	for (cpc = list_head(&cpd->cpd_conns); cpc != NULL;
+	    cpc = list_next(&cpd->cpd_conns, cpc)) {
+		if (cpc->cpc_ninflight >= cp->cp_max_inflight) {
+			continue;
+		}
+
+		if (best == NULL || cpc->cpc_ninflight < best->cpc_ninflight) {
+			best = cpc;
+		}
+	}
+
+	if ((best == NULL || best->cpc_ninflight > 0) &&
+	    cpd->cpd_nconns < cp->cp_max_conns &&
+	    (cpc = cpool_conn_open(cpd)) != NULL) {
+		return (cpc);
+	}
+
+	return (best);
+}
+
+static int
+cpool_conn_send(cpool_conn_t *cpc, cpool_req_t *cpr, const void *buf,
+    size_t len)
+{
+	void *ptr;
+	size_t avail;
+
+	if (cconn_send_reserve(cpc->cpc_conn, len, &ptr, &avail) != 0) {
+		return (-1);
+	}
+	bcopy(buf, ptr, len);
+	if (cconn_send_commit(cpc->cpc_conn, len) != 0) {
+		return (-1);
+	}
+
+	list_insert_tail(&cpc->cpc_inflight, cpr);
+	cpc->cpc_ninflight++;
+	return (0);
+}
+
+/*
+ * Send as many waiting requests as there is now room for.
+ */
+static void
+cpool_dispatch(cpool_dest_t *cpd)
+{
+	cpool_req_t *cpr;
+	cpool_conn_t *cpc;
+
+	if (cpd->cpd_pool->cp_closing) {
+		return;
+	}
+
+	while ((cpr = list_head(&cpd->cpd_waiting)) != NULL) {
+		size_t len = cbuf_available(cpr->cpr_cbuf);
+		void *ptr;
+
+		VERIFY0(cbuf_get_ptr(cpr->cpr_cbuf, 0, len, &ptr));
+
+		if ((cpc = cpool_conn_pick(cpd)) == NULL ||
+		    cpool_conn_send(cpc, cpr, ptr, len) != 0) {
+			return;
+		}
+
+		list_remove(&cpd->cpd_waiting, cpr);
+		cbuf_free(cpr->cpr_cbuf);
+		cpr->cpr_cbuf = NULL;
+	}
+}
+
+static cpool_dest_t *
+cpool_dest_lookup(cpool_t *cp, const char *host, const char *port)
+{
+	cpool_dest_t *cpd;
+
+	for (cpd = list_head(&cp->cp_dests); cpd != NULL;
+	    cpd = list_next(&cp->cp_dests, cpd)) {
+		if (strcmp(cpd->cpd_host, host) == 0 &&
+		    strcmp(cpd->cpd_port, port) == 0) {
+			return (cpd);
+		}
+	}
+
+	if ((cpd = calloc(1, sizeof (*cpd))) == NULL) {
+		return (NULL);
+	}
+
+	if ((cpd->cpd_host = strdup(host)) == NULL ||
+	    (cpd->cpd_port = strdup(port)) == NULL) {
+		free(cpd->cpd_host);
+		free(cpd);
+		return (NULL);
+	}
+	cpd->cpd_pool = cp;
+	list_create(&cpd->cpd_conns, sizeof (cpool_conn_t),
+	    offsetof(cpool_conn_t, cpc_link));
+	list_create(&cpd->cpd_waiting, sizeof (cpool_req_t),
+	    offsetof(cpool_req_t, cpr_link));
+	list_insert_tail(&cp->cp_dests, cpd);
+
+	return (cpd);
+}
+
+/*
+ * Send the request in "buf" to the given destination.  The callback is
+ * invoked exactly once: either with the connection, while its reply is
+ * available through cconn_frame(), or with a NULL connection and an error
+ * number if the request could not be completed.  The callback must not call
+ * cconn_next() or close the connection.
+ */
+int
+cpool_request(cpool_t *cp, const char *host, const char *port,
+    const void *buf, size_t len, cpool_cb_t *cb, void *arg)
+{
+	cpool_dest_t *cpd;
+	cpool_conn_t *cpc;
+	cpool_req_t *cpr;
+
+	if (cp->cp_closing) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	if ((cpd = cpool_dest_lookup(cp, host, port)) == NULL ||
+	    (cpr = calloc(1, sizeof (*cpr))) == NULL) {
+		return (-1);
+	}
+	cpr->cpr_cb = cb;
+	cpr->cpr_arg = arg;
+
+	if (list_is_empty(&cpd->cpd_waiting) &&
+	    (cpc = cpool_conn_pick(cpd)) != NULL &&
+	    cpool_conn_send(cpc, cpr, buf, len) == 0) {
+		return (0);
+	}
+
+	if (cpd->cpd_nconns == 0) {
+		/*
+		 * We could not open a connection to this destination.
+		 */
+		free(cpr);
+		return (-1);
+	}
+
+	/*
+	 * Keep a copy of the request until there is room for it.
+	 */
+	if (cbuf_alloc(&cpr->cpr_cbuf, len > 0 ? len : 1) != 0) {
+		free(cpr);
+		return (-1);
+	}
+	cbuf_flip(cpr->cpr_cbuf);
+	bcopy(buf, cbuf_unused_ptr(cpr->cpr_cbuf), len);
+	VERIFY0(cbuf_limit_extend(cpr->cpr_cbuf, len));
+	list_insert_tail(&cpd->cpd_waiting, cpr);
+
+	return (0);
+}
+
+/*
+ * Create a pool that keeps at most "max_conns" connections open to each
+ * destination, with at most "max_inflight" requests outstanding on each.
+ */
+int
+cpool_alloc(cpool_t **cpp, cloop_t *cloop, unsigned int max_conns,
+    unsigned int max_inflight)
+{
+	cpool_t *cp;
+
+	*cpp = NULL;
+
+	if (max_conns == 0 || max_inflight == 0) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	if ((cp = calloc(1, sizeof (*cp))) == NULL) {
+		return (-1);
+	}
+	cp->cp_loop = cloop;
+	cp->cp_max_conns = max_conns;
+	cp->cp_max_inflight = max_inflight;
+	list_create(&cp->cp_dests, sizeof (cpool_dest_t),
+	    offsetof(cpool_dest_t, cpd_link));
+
+	*cpp = cp;
+	return (0);
+}
+
+/*
+ * Close every connection in the pool.  Outstanding requests fail with
+ * ECANCELED (or the error from their connection) before this returns.
+ */
+void
+cpool_free(cpool_t *cp)
+{
+	cpool_dest_t *cpd;
+	cpool_conn_t *cpc;
+	cpool_req_t *cpr;
+
+	if (cp == NULL) {
+		return;
+	}
+
+	cp->cp_closing = B_TRUE;
+
+	while ((cpd = list_remove_head(&cp->cp_dests)) != NULL) {
+		while ((cpc = list_head(&cpd->cpd_conns)) != NULL) {
+			VERIFY0(cconn_abort(cpc->cpc_conn));
+		}
+
+		while ((cpr = list_remove_head(&cpd->cpd_waiting)) != NULL) {
+			cpool_req_fail(cpr, ECANCELED);
+		}
+
+		list_destroy(&cpd->cpd_conns);
+		list_destroy(&cpd->cpd_waiting);
+		free(cpd->cpd_host);
+		free(cpd->cpd_port);
+		free(cpd);
+	}
+
+	list_destroy(&cp->cp_dests);
+	free(cp);
+}
@@ -8,9 +8,15 @@
 #include <strings.h>
 #include <unistd.h>
 #include <signal.h>
+#include <fcntl.h>
 #include <ctype.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/filio.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
@@ -19,22 +25,132 @@
 #include <port.h>
 #include <sys/debug.h>
 #include <errno.h>
+#include <umem.h>
 
 #include <sys/list.h>
 
 #include <json-nvlist.h>
 #include <nvpair_json.h>
 
+#include "libcbuf_impl.h"
 #include "libcbuf.h"
+#include "libcloop_impl.h"
 #include "libcloop.h"
+#include "ctls.h"
+#include "cdeflate.h"
 
 #define	LISTEN_PORT	"5757"
 
+/*
+ * Send queue memory is allocated in chunks of at least this size, so that
+ * successive small messages are packed into the same buffer.
+ */
+#define	CCONN_SEND_CHUNK	16384
+
+/*
+ * Where splice(2) is available, relayed data that needs no TLS or compression
+ * processing moves between the two sockets through a pipe, at most this much
+ * at a time.
+ */
+#ifdef	SPLICE_F_MOVE
+#define	CCONN_HAVE_SPLICE
+#endif
+#define	CCONN_RELAY_SPLICE_MAX	(64 * 1024)
+
+/*
+ * Control messages are written ahead of other queued data, at message
+ * boundaries.  So that a stream of them cannot starve everything else, once
+ * CCONN_CTL_BURST bytes of control data have been written in a row while
+ * other data waits, the next write comes from the normal queue.
+ */
+#define	CCONN_CTL_BURST		(64 * 1024)
+
+/*
+ * The ends of up to this many messages on the normal queue are remembered.
+ * Once that many are waiting to be written, the newest is moved out to the
+ * end of each message that follows, and they are written as one.
+ */
+#define	CCONN_SENDQ_MARKS	32
+
+/*
+ * Default send queue watermarks.  Once a connection has more than
+ * CCONN_SEND_HIWAT bytes queued, further sends fail with EAGAIN until the
+ * queue has drained below CCONN_SEND_LOWAT.
+ */
+#define	CCONN_SEND_HIWAT	(1024 * 1024)
+#define	CCONN_SEND_LOWAT	(256 * 1024)
+
+/*
+ * Default receive limits.  A connection that sends a line longer than
+ * CCONN_RECV_MAX_LINE is disconnected, and we stop reading from a socket
+ * once CCONN_RECV_MAX bytes are waiting in its receive queue.
+ */
+#define	CCONN_RECV_MAX_LINE	(64 * 1024)
+#define	CCONN_RECV_MAX		(256 * 1024)
+
+/*
+ * Receive buffers are drawn from a pool shared by all connections.  Each
+ * connection starts out reading into buffers of CCONN_RECV_BUFSZ_MIN bytes,
+ * and doubles the size (up to CCONN_RECV_BUFSZ_MAX) whenever a read fills
+ * the buffer.  A connection whose reads use only a small fraction of the
+ * buffer falls back towards the minimum size.
+ */
+#define	CCONN_RECV_BUFSZ_MIN	2048
+#define	CCONN_RECV_BUFSZ_MAX	(64 * 1024)
+#define	CCONN_POOL_MAX_CACHED	256
+
+static cbuf_pool_t *cconn_pool = NULL;
+
+/*
+ * Datagram servers receive (and send) up to CSERVER_DGRAM_BATCH datagrams
+ * per system call, and perform at most CSERVER_DGRAM_ROUNDS receive calls
+ * for each readiness event so that other entities in the loop are not
+ * starved.  Datagrams larger than CSERVER_DGRAM_BUFSZ are dropped.
+ */
+#define	CSERVER_DGRAM_BATCH	64
+#define	CSERVER_DGRAM_ROUNDS	16
+#define	CSERVER_DGRAM_BUFSZ	(8 * 1024)
+#define	CSERVER_DGRAM_RCVBUF	(4 * 1024 * 1024)
+
+/*
+ * While a connection is corked, writes are held back until at least this much
+ * data is queued, so that a response made up of several sends goes out in
+ * full segments.
+ */
+#define	CCONN_CORK_BATCH	CCONN_SEND_CHUNK
+
+/*
+ * The longest delimiter accepted by cconn_framing_delimiter().
+ */
+#define	CCONN_DELIM_MAX		16
+
 boolean_t cserver_debug = B_FALSE;
 
-int keepidle = 1;
-int keepcnt = 15;
-int keepintvl = 1;
+/*
+ * Socket option defaults.  Keepalives are aggressive, so that a vanished
+ * peer is noticed within seconds.
+ */
+#define	CSERVER_BACKLOG		1000
+#define	CSERVER_KEEPIDLE	1
+#define	CSERVER_KEEPCNT		15
+#define	CSERVER_KEEPINTVL	1
+
+/*
+ * The low latency profile keeps little unsent data in the kernel, so that
+ * a newly queued reply is not stuck behind it, and gives up on a peer that
+ * has not acknowledged data within 10 seconds.  The bulk profile trades
+ * memory for throughput on high bandwidth-delay paths.
+ */
+#define	CSERVER_LOWLAT_NOTSENT	(16 * 1024)
+#define	CSERVER_LOWLAT_TIMEOUT	10000
+#define	CSERVER_LOWLAT_FASTOPEN	256
+#define	CSERVER_BULK_BUFSZ	(4 * 1024 * 1024)
+
+/*
+ * A TLS client that has not finished its handshake within this many seconds
+ * of being accepted is disconnected.  Servers with TLS check once a second.
+ */
+#define	CCONN_HANDSHAKE_TIMEOUT	10
 
 /*
  * EVENT ORDERING:
@@ -57,10 +173,125 @@ int keepintvl = 1;
  *	  |        |
  *	  V        V
  *	CCONN_CB_CLOSE (socket closed)
+ *
+ * Connections made with cconn_connect() deliver CCONN_CB_CONNECTED once
+ * established, before any other event; if the attempt fails, only
+ * CCONN_CB_ERROR and CCONN_CB_CLOSE are delivered.
+ *
+ * If a send has failed with EAGAIN because the send queue was above its
+ * high watermark, CCONN_CB_DRAIN will be delivered once the queue drops
+ * below the low watermark.  This may happen at any point prior to
+ * CCONN_CB_CLOSE.
+ *
+ * If the connection is being torn down because the remote peer exceeded the
+ * maximum line length, CCONN_CB_OVERFLOW is delivered in place of
+ * CCONN_CB_ERROR.
+ *
+ * Data queued by the consumer during a callback is written directly to the
+ * socket once the callback returns, rather than waiting for the next trip
+ * through the event loop.  A connection may not be freed while it is held
+ * (see cconn_hold()); if it closes in the meantime, the free is deferred
+ * until the last hold is released.
+ */
+
+/*
+ * Parameters for the built-in framers.
+ */
+typedef struct cconn_fparam {
+	uint8_t cfp_delim[CCONN_DELIM_MAX];
+	size_t cfp_delim_len;
+	unsigned int cfp_width;
+	unsigned int cfp_order;
+} cconn_fparam_t;
+
+typedef struct cserver_dgram {
+	cbuf_t *cdg_cbuf;
+	struct sockaddr_storage cdg_addr;
+	socklen_t cdg_addrlen;
+	boolean_t cdg_trunc;
+} cserver_dgram_t;
+
+/*
+ * A batch of datagrams, along with the message headers used to pass them to
+ * the kernel.  Where recvmmsg(3SOCKET) and sendmmsg(3SOCKET) are not
+ * available, the batch is processed one datagram at a time.
+ */
+#ifdef	MSG_WAITFORONE
+#define	CSERVER_HAVE_MMSG
+#define	CDB_HDR(cdb, i)		(&(cdb)->cdb_msgs[(i)].msg_hdr)
+#else
+#define	CDB_HDR(cdb, i)		(&(cdb)->cdb_msgs[(i)])
+#endif
+
+typedef struct cserver_dgram_batch {
+	unsigned int cdb_count;
+	cserver_dgram_t cdb_dgrams[CSERVER_DGRAM_BATCH];
+	struct iovec cdb_iov[CSERVER_DGRAM_BATCH];
+#ifdef	CSERVER_HAVE_MMSG
+	struct mmsghdr cdb_msgs[CSERVER_DGRAM_BATCH];
+#else
+	struct msghdr cdb_msgs[CSERVER_DGRAM_BATCH];
+#endif
+} cserver_dgram_batch_t;
+
+/*
+ * Connections are indexed by id and by remote address in chained hash tables,
+ * which double in size as they fill.  Each table threads its chains through
+ * a different link pointer in the connection, found at "cht_off".
+ */
+#define	CCONN_HT_MIN		64
+
+typedef struct cconn_htable {
+	cconn_t **cht_buckets;
+	size_t cht_nbuckets;			/* always a power of two */
+	size_t cht_count;
+	size_t cht_off;
+	uint64_t (*cht_hash)(cconn_t *);
+} cconn_htable_t;
+
+/*
+ * A remote address in a form that can be hashed and compared directly.
+ * IPv4-mapped IPv6 addresses are stored as IPv4.
+ */
+typedef struct cconn_addr_key {
+	sa_family_t cak_family;
+	in_port_t cak_port;
+	uint8_t cak_addr[16];
+} cconn_addr_key_t;
+
+static uint64_t cconn_next_id = 1;
+
+/*
+ * Connection objects are aligned to a cache line, and come from a cache
+ * created on first use.
+ */
+#define	CCONN_ALIGN		64
+
+static umem_cache_t *cconn_cache;
+
+/*
+ * Received data is decompressed once the switch to compression has taken
+ * effect, at the end of the frame in which it was negotiated.
  */
+#define	CCONN_ZIN(ccn)	((ccn)->ccn_zin != NULL && !(ccn)->ccn_zin_pending)
+
+/*
+ * A request taken from a pipelined connection with cconn_defer().  Its
+ * response is collected in a queue of its own, and moves to the connection's
+ * send queue once it and every earlier request are done.
+ */
+struct cconn_req {
+	cconn_t *ccr_conn;
+	cbuf_t *ccr_frame;
+	cbufq_t *ccr_sendq;
+	boolean_t ccr_done;
+	list_node_t ccr_link;
+};
 
 typedef enum cconn_state {
 	CCONN_ST_PRE_CONNECTION = 1,
+	CCONN_ST_CONNECTING,
+	CCONN_ST_HANDSHAKE,
 	CCONN_ST_WAITING_FOR_LINE,
 	CCONN_ST_LINE_AVAILABLE,
 	CCONN_ST_READ_EOF,
@@ -68,30 +299,115 @@ typedef enum cconn_state {
 	CCONN_ST_CLOSED,
 } cconn_state_t;
 
+/*
+ * Large enough for any address cconn_addr_format() produces: a UNIX socket
+ * path, which need not be terminated, is longer than any IPv6 address.
+ */
+#define	CCONN_ADDRSTRLEN	\
+	(sizeof (((struct sockaddr_un *)0)->sun_path) + 1)
+
+/*
+ * Connections are allocated from a umem cache, in one cache-line aligned
+ * object that embeds the cloop entity and both buffer queues.  The members
+ * used on every read and write come first.
+ */
 struct cconn {
+	uint64_t ccn_id;
 	cserver_t *ccn_server;
 	cconn_state_t ccn_state;
 
-	cloop_ent_t *ccn_clent;
-	struct sockaddr_storage ccn_remote_addr;
-	char *ccn_remote_addr_str;
+	cloop_ent_t *ccn_clent;			/* &ccn_ent until closed */
+	ctls_t *ccn_tls;			/* TLS session, or NULL */
 
-	custr_t *ccn_input;
+	cconn_framer_t *ccn_framer;
+	void *ccn_framer_arg;
+	cconn_fparam_t ccn_fparam;
+	cconn_frame_t ccn_frame;		/* current frame */
+	void *ccn_frame_ptr;
 
-	cbufq_t *ccn_recvq;
+	cbufq_t ccn_recvq;
 	boolean_t ccn_recvq_end;
-	cbufq_t *ccn_sendq;
+	size_t ccn_recvq_bytes;			/* unconsumed received bytes */
+	size_t ccn_recv_max;
+	size_t ccn_recv_max_line;
+	boolean_t ccn_recv_overflow;
+	size_t ccn_recv_bufsz;			/* next receive buffer size */
+	boolean_t ccn_recv_bulk;		/* last read filled buffer */
+	cbufq_t ccn_sendq;
+	cbuf_t *ccn_sendq_resv;			/* outstanding reservation */
+	cbufq_t ccn_sendq_ctl;			/* CCONN_PRIO_CONTROL sends */
+	size_t ccn_sendq_ctl_bytes;
+	size_t ccn_sendq_ctl_run;		/* written while others wait */
+	cbufq_t *ccn_sendq_cur;			/* queue last written from */
+	boolean_t ccn_sendq_partial;		/* ... must be continued */
+	uint64_t ccn_sendq_out;			/* normal bytes written */
+	uint64_t ccn_sendq_marks[CCONN_SENDQ_MARKS]; /* ... at message ends */
+	unsigned int ccn_sendq_mark0;
+	unsigned int ccn_sendq_nmarks;
 	boolean_t ccn_sendq_end;
 	boolean_t ccn_sendq_flushed;
+	size_t ccn_sendq_bytes;			/* bytes queued for send */
+	size_t ccn_sendq_hiwat;
+	size_t ccn_sendq_lowat;
+	boolean_t ccn_sendq_blocked;		/* EAGAIN returned to sender */
+	unsigned int ccn_cork;			/* cconn_cork() depth */
+	boolean_t ccn_nodelay;			/* TCP_NODELAY has been set */
+	boolean_t ccn_timestamp;		/* SO_TIMESTAMPNS is set */
+
+	cdeflate_t *ccn_zout;			/* compressing sends */
+	cbuf_t *ccn_zstage;			/* reservations, uncompressed */
+	boolean_t ccn_zout_pending;		/* input not yet flushed */
+	boolean_t ccn_zout_failed;		/* output lost; must close */
+	cdeflate_t *ccn_zin;			/* decompressing receives */
+	boolean_t ccn_zin_pending;		/* from the next frame */
+	cbufq_t *ccn_zrecvq;			/* received, not decompressed */
+	size_t ccn_zrecvq_bytes;
+
+	unsigned int ccn_pipeline;		/* max. deferred requests */
+	unsigned int ccn_nreqs;
+	boolean_t ccn_fin_held;			/* FIN waits for ccn_reqs */
+	list_t ccn_reqs;			/* list of cconn_req_t */
+
+	cconn_t *ccn_relay;			/* cconn_relay() peer */
+	boolean_t ccn_relay_blocked;		/* waiting for peer to drain */
+#ifdef	CCONN_HAVE_SPLICE
+	boolean_t ccn_relay_splice;		/* to the peer through a pipe */
+	int ccn_relay_pipe[2];
+	size_t ccn_relay_piped;			/* bytes in the pipe */
+#endif
+
+	unsigned int ccn_holds;
+	boolean_t ccn_destroy_deferred;
+	boolean_t ccn_ent_busy;			/* ccn_ent not released */
+	boolean_t ccn_free_pending;		/* free on ccn_ent release */
 
 	cconn_cb_t *ccn_on_line_available;
 	cconn_cb_t *ccn_on_end;
 	cconn_cb_t *ccn_on_error;
 	cconn_cb_t *ccn_on_close;
+	cconn_cb_t *ccn_on_drain;
+	cconn_cb_t *ccn_on_overflow;
+	cconn_cb_t *ccn_on_connected;
+
+	cconn_stats_t ccn_stats;
 
 	list_node_t ccn_link;			/* cserver linkage */
+	boolean_t ccn_indexed;			/* in the id table */
+	boolean_t ccn_addr_indexed;		/* in the address table */
+	cconn_addr_key_t ccn_addr_key;
+	cconn_t *ccn_id_next;			/* hash chains */
+	cconn_t *ccn_addr_next;
 
 	void *ccn_data;
+
+	/*
+	 * Members used rarely, or only at setup and teardown:
+	 */
+	cloop_ent_t ccn_ent;
+	hrtime_t ccn_accepted;			/* for the handshake timeout */
+	custr_t *ccn_input;			/* for cconn_line() */
+	struct sockaddr_storage ccn_remote_addr;
+	char ccn_remote_addr_str[CCONN_ADDRSTRLEN];	/* lazy */
 };
 
 struct cserver {
@@ -101,22 +417,64 @@ struct cserver {
 	cloop_ent_t *csrv_listen;
 
 	struct sockaddr_storage csrv_addr;
+	ctls_ctx_t *csrv_tls;			/* TLS for new connections */
+	cloop_ent_t *csrv_hs_timer;		/* handshake timeouts */
+	cserver_opts_t csrv_opts;
 
 	list_t csrv_connections;		/* list of cconn_t */
+	cconn_htable_t csrv_by_id;
+	cconn_htable_t csrv_by_addr;
+
+	size_t csrv_sendq_bytes;		/* total over all connections */
+	size_t csrv_sendq_limit;
+	size_t csrv_sendq_hiwat;		/* defaults for new connections */
+	size_t csrv_sendq_lowat;
+	size_t csrv_recv_max;			/* defaults for new connections */
+	size_t csrv_recv_max_line;
+
+	cserver_dgram_batch_t *csrv_rx;		/* datagram servers only */
+	cserver_dgram_batch_t *csrv_tx;
+	cserver_dgram_t *csrv_dgram;		/* datagram being delivered */
+	boolean_t csrv_active;			/* in cserver_on_datagrams() */
+	boolean_t csrv_destroy;			/* free once no longer active */
 
 	/*
 	 * Callbacks:
 	 */
 	cserver_cb_t *csrv_on_incoming;
+	cserver_cb_t *csrv_on_datagram;
 };
 
 static void cconn_destroy(cconn_t *ccn);
+static cconn_framer_t cconn_framer_delimiter;
+static cconn_framer_t cconn_framer_length;
 static void ccn_handle_incoming_data(cconn_t *ccn);
+static cloop_ent_cb_t cserver_on_datagrams;
+static cloop_ent_cb_t cserver_on_dgram_write;
+static cloop_ent_cb_t cserver_on_dgram_error;
+static void cserver_dgram_batch_free(cserver_dgram_batch_t *cdb);
+static void cconn_flush(cconn_t *ccn);
+static void cconn_htable_remove(cconn_htable_t *cht, cconn_t *ccn);
+static void cconn_connect_done(cconn_t *ccn);
+static void cconn_read(cconn_t *ccn);
+static int cconn_send_deflate(cconn_t *ccn, const void *buf, size_t len,
+    cdeflate_flush_t flush);
+static int cconn_buf_get(size_t sz, cbuf_t **cbufp);
+static boolean_t cconn_relay_full(cconn_t *ccn);
+static void cconn_relay_forward(cconn_t *ccn);
+static void cconn_relay_resume(cconn_t *ccn);
+static void cconn_relay_break(cconn_t *ccn);
+#ifdef	CCONN_HAVE_SPLICE
+static void cconn_relay_splice_in(cconn_t *ccn);
+static void cconn_relay_splice_out(cconn_t *ccn);
+#endif
 
 static char *
 cconn_state_name(cconn_state_t s)
 {
 	return (s == CCONN_ST_PRE_CONNECTION ? "PRE_CONNECTION" :
+	    s == CCONN_ST_CONNECTING ? "CONNECTING" :
+	    s == CCONN_ST_HANDSHAKE ? "HANDSHAKE" :
 	    s == CCONN_ST_WAITING_FOR_LINE ? "WAITING_FOR_LINE" :
 	    s == CCONN_ST_LINE_AVAILABLE ? "LINE_AVAILABLE" :
 	    s == CCONN_ST_READ_EOF ? "READ_EOF" :
@@ -137,18 +495,71 @@ cconn_data_set(cconn_t *ccn, void *data)
 	ccn->ccn_data = data;
 }
 
-static struct sockaddr_in *
-cserver_sockaddr_in(cserver_t *csrv)
+/*
+ * Prevent the connection from being freed, even if it is closed, until a
+ * matching call to cconn_rele().
+ */
+void
+cconn_hold(cconn_t *ccn)
+{
+	ccn->ccn_holds++;
+}
+
+void
+cconn_rele(cconn_t *ccn)
 {
-	VERIFY(csrv->csrv_type == CSERVER_TYPE_TCP);
+	VERIFY3U(ccn->ccn_holds, >, 0);
 
-	return ((struct sockaddr_in *)&csrv->csrv_addr);
+	if (--ccn->ccn_holds == 0 && ccn->ccn_destroy_deferred) {
+		cconn_destroy(ccn);
+	}
 }
 
-static struct sockaddr_in *
-cconn_sockaddr_in(cconn_t *ccn)
+/*
+ * Format a socket address for display.  IPv4 peers of a dual-stack listener
+ * are reported with their IPv4 address.
+ */
+static int
+cconn_addr_format(const struct sockaddr_storage *ss, char *buf, size_t len)
 {
-	return ((struct sockaddr_in *)&ccn->ccn_remote_addr);
+	const struct sockaddr_in *sin;
+	const struct sockaddr_in6 *sin6;
+	const struct sockaddr_un *sunp;
+
+	switch (ss->ss_family) {
+	case AF_INET:
+		sin = (const struct sockaddr_in *)ss;
+		if (inet_ntop(AF_INET, &sin->sin_addr, buf, len) == NULL) {
+			return (-1);
+		}
+		return (0);
+
+	case AF_INET6:
+		sin6 = (const struct sockaddr_in6 *)ss;
+		if (IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr)) {
+			if (inet_ntop(AF_INET, &sin6->sin6_addr.s6_addr[12],
+			    buf, len) == NULL) {
+				return (-1);
+			}
+		} else if (inet_ntop(AF_INET6, &sin6->sin6_addr, buf,
+		    len) == NULL) {
+			return (-1);
+		}
+		return (0);
+
+	case AF_UNIX:
+		/*
+		 * Connecting sockets are generally unnamed.
+		 */
+		sunp = (const struct sockaddr_un *)ss;
+		(void) snprintf(buf, len, "%.*s", (int)sizeof (sunp->sun_path),
+		    sunp->sun_path[0] != '\0' ? sunp->sun_path : "unix");
+		return (0);
+
+	default:
+		errno = EAFNOSUPPORT;
+		return (-1);
+	}
 }
 
 void
@@ -181,7 +592,9 @@ top:
 	switch (nstate) {
 	case CCONN_ST_ERROR:
 		VERIFY(ostate != CCONN_ST_CLOSED);
-		if (ccn->ccn_on_error != NULL) {
+		if (ccn->ccn_recv_overflow && ccn->ccn_on_overflow != NULL) {
+			ccn->ccn_on_overflow(ccn, CCONN_CB_OVERFLOW);
+		} else if (ccn->ccn_on_error != NULL) {
 			ccn->ccn_on_error(ccn, CCONN_CB_ERROR);
 		}
 		nstate = CCONN_ST_CLOSED;
@@ -206,6 +619,8 @@ top:
 
 	case CCONN_ST_WAITING_FOR_LINE:
 		VERIFY(ostate == CCONN_ST_PRE_CONNECTION ||
+		    ostate == CCONN_ST_CONNECTING ||
+		    ostate == CCONN_ST_HANDSHAKE ||
 		    ostate == CCONN_ST_LINE_AVAILABLE);
 
 		/*
@@ -230,6 +645,25 @@ top:
 		}
 		return;
 
+	case CCONN_ST_CONNECTING:
+		VERIFY(ostate == CCONN_ST_PRE_CONNECTION);
+
+		/*
+		 * The socket becomes writable once the connection attempt
+		 * has completed, whether or not it succeeded.
+		 */
+		cloop_ent_want(ccn->ccn_clent, CLOOP_CB_WRITE);
+		return;
+
+	case CCONN_ST_HANDSHAKE:
+		VERIFY(ostate == CCONN_ST_PRE_CONNECTION);
+
+		/*
+		 * The client speaks first.
+		 */
+		cloop_ent_want(ccn->ccn_clent, CLOOP_CB_READ);
+		return;
+
 	case CCONN_ST_PRE_CONNECTION:
 		abort();
 		return;
@@ -242,6 +676,8 @@ int
 cconn_fin(cconn_t *ccn)
 {
 	switch (ccn->ccn_state) {
+	case CCONN_ST_CONNECTING:
+	case CCONN_ST_HANDSHAKE:
 	case CCONN_ST_LINE_AVAILABLE:
 	case CCONN_ST_WAITING_FOR_LINE:
 	case CCONN_ST_READ_EOF:
@@ -252,6 +688,20 @@ cconn_fin(cconn_t *ccn)
 		return (-1);
 	}
 
+	if (!list_is_empty(&ccn->ccn_reqs)) {
+		/*
+		 * The responses to deferred requests must go out first.
+		 * cconn_req_done() sends the FIN after the last of them.
+		 */
+		ccn->ccn_fin_held = B_TRUE;
+		return (0);
+	}
+
+	if (ccn->ccn_zout != NULL && !ccn->ccn_sendq_end &&
+	    cconn_send_deflate(ccn, NULL, 0, CDEFLATE_FLUSH_FINISH) != 0) {
+		return (-1);
+	}
+
 	ccn->ccn_sendq_end = B_TRUE;
 	cloop_ent_want(ccn->ccn_clent, CLOOP_CB_WRITE);
 	return (0);
@@ -261,6 +711,8 @@ int
 cconn_abort(cconn_t *ccn)
 {
 	switch (ccn->ccn_state) {
+	case CCONN_ST_CONNECTING:
+	case CCONN_ST_HANDSHAKE:
 	case CCONN_ST_LINE_AVAILABLE:
 	case CCONN_ST_WAITING_FOR_LINE:
 	case CCONN_ST_READ_EOF:
@@ -287,12 +739,14 @@ cconn_abort(cconn_t *ccn)
 	return (0);
 }
 
-int
-cconn_send(cconn_t *ccn, custr_t *cu)
+static int
+cconn_send_check_prio(cconn_t *ccn, cconn_prio_t prio)
 {
-	cbuf_t *cbuf;
+	size_t queued;
 
 	switch (ccn->ccn_state) {
+	case CCONN_ST_CONNECTING:
+	case CCONN_ST_HANDSHAKE:
 	case CCONN_ST_LINE_AVAILABLE:
 	case CCONN_ST_WAITING_FOR_LINE:
 	case CCONN_ST_READ_EOF:
@@ -303,736 +757,4274 @@ cconn_send(cconn_t *ccn, custr_t *cu)
 		return (-1);
 	}
 
-	if (ccn->ccn_sendq_end) {
+	if (ccn->ccn_sendq_end || ccn->ccn_fin_held || ccn->ccn_zout_failed) {
 		errno = EPIPE;
 		return (-1);
 	}
 
-	if (cbuf_alloc(&cbuf, custr_len(cu)) != 0) {
+	/*
+	 * Control messages are limited separately, so that they may still be
+	 * sent when the connection is backed up with other data.
+	 */
+	queued = prio == CCONN_PRIO_CONTROL ? ccn->ccn_sendq_ctl_bytes :
+	    ccn->ccn_sendq_bytes;
+	if ((ccn->ccn_sendq_hiwat != 0 && queued >= ccn->ccn_sendq_hiwat) ||
+	    (ccn->ccn_server != NULL && ccn->ccn_server->csrv_sendq_limit != 0 &&
+	    ccn->ccn_server->csrv_sendq_bytes >=
+	    ccn->ccn_server->csrv_sendq_limit)) {
+		/*
+		 * The consumer must wait for CCONN_CB_DRAIN before sending
+		 * anything else.
+		 */
+		ccn->ccn_sendq_blocked = B_TRUE;
+		errno = EAGAIN;
 		return (-1);
 	}
 
-	VERIFY0(cbuf_put_string(cbuf, cu));
-	cbuf_flip(cbuf);
-	cbufq_enq(ccn->ccn_sendq, cbuf);
-	cloop_ent_want(ccn->ccn_clent, CLOOP_CB_WRITE);
 	return (0);
 }
 
-custr_t *
-cconn_line(cconn_t *ccn)
+static int
+cconn_send_check(cconn_t *ccn)
 {
-	if (ccn->ccn_state != CCONN_ST_LINE_AVAILABLE) {
-		return (NULL);
+	return (cconn_send_check_prio(ccn, CCONN_PRIO_NORMAL));
+}
+
+/*
+ * Ask to be told when the socket is writable, unless the connection is corked
+ * and we have not yet accumulated enough data to make a write worthwhile.
+ */
+static void
+cconn_want_write(cconn_t *ccn)
+{
+	if (ccn->ccn_cork > 0 && ccn->ccn_sendq_bytes < CCONN_CORK_BATCH) {
+		return;
 	}
 
-	return (ccn->ccn_input);
+	cloop_ent_want(ccn->ccn_clent, CLOOP_CB_WRITE);
 }
 
-void
-cconn_next(cconn_t *ccn)
+static void
+cconn_sendq_add(cconn_t *ccn, size_t len)
 {
-	if (ccn->ccn_state != CCONN_ST_LINE_AVAILABLE) {
-		return;
+	ccn->ccn_stats.ccs_sends++;
+	ccn->ccn_sendq_bytes += len;
+	if (ccn->ccn_sendq_bytes > ccn->ccn_stats.ccs_sendq_max) {
+		ccn->ccn_stats.ccs_sendq_max = ccn->ccn_sendq_bytes;
+	}
+	if (ccn->ccn_server != NULL) {
+		ccn->ccn_server->csrv_sendq_bytes += len;
 	}
+}
 
-	custr_reset(ccn->ccn_input);
-	cconn_advance_state(ccn, CCONN_ST_WAITING_FOR_LINE);
+static void
+cconn_sendq_remove(cconn_t *ccn, size_t len)
+{
+	VERIFY3U(ccn->ccn_sendq_bytes, >=, len);
+	ccn->ccn_sendq_bytes -= len;
+	if (ccn->ccn_server != NULL) {
+		VERIFY3U(ccn->ccn_server->csrv_sendq_bytes, >=, len);
+		ccn->ccn_server->csrv_sendq_bytes -= len;
+	}
 }
 
 /*
- * XXX This routine currently copies bytes from the incoming buffer queue
- * into a custr_t until it finds a linefeed.  This could be so much
- * better than it is.
+ * Record the end of the normal queue as the end of a message, at which
+ * control messages may be written.  While the connection is corked, the
+ * message is still being built, and ends when the last cork is removed.
  */
 static void
-ccn_handle_incoming_data(cconn_t *ccn)
+cconn_sendq_mark(cconn_t *ccn)
 {
-	cbuf_t *head;
+	uint64_t end = ccn->ccn_sendq_out +
+	    (ccn->ccn_sendq_bytes - ccn->ccn_sendq_ctl_bytes);
+	unsigned int n = ccn->ccn_sendq_nmarks;
+	unsigned int last;
 
-	if (ccn->ccn_state == CCONN_ST_LINE_AVAILABLE) {
-		/*
-		 * We already have a line available.  Do nothing for now.
-		 */
+	if (ccn->ccn_cork > 0) {
 		return;
 	}
 
-	while ((head = cbufq_peek(ccn->ccn_recvq)) != NULL) {
-		char val;
-
-		if (cbuf_available(head) < 1) {
-			cbuf_free(cbufq_deq(ccn->ccn_recvq));
-			continue;
-		}
-
-		VERIFY0(cbuf_get_char(head, &val));
-
-		if (val == '\n') {
-			cconn_advance_state(ccn, CCONN_ST_LINE_AVAILABLE);
+	if (n > 0) {
+		last = (ccn->ccn_sendq_mark0 + n - 1) % CCONN_SENDQ_MARKS;
+		if (ccn->ccn_sendq_marks[last] == end) {
 			return;
 		}
-
-		if (custr_appendc(ccn->ccn_input, val) != 0) {
-			warn("custr_appendc");
-			cconn_advance_state(ccn, CCONN_ST_ERROR);
+		if (n == CCONN_SENDQ_MARKS) {
+			ccn->ccn_sendq_marks[last] = end;
 			return;
 		}
 	}
 
-	/*
-	 * We have run out of buffers in the receive queue.
-	 */
-	if (ccn->ccn_recvq_end) {
-		/*
-		 * We have also hit EOF on the read side of the socket.
-		 * Inform our consumer that there will be no more data.
-		 */
-		cconn_advance_state(ccn, CCONN_ST_READ_EOF);
-	} else {
-		/*
-		 * As far as we know, there is more data to come.  Request
-		 * additional reads.
-		 */
-		cloop_ent_want(ccn->ccn_clent, CLOOP_CB_READ);
-	}
+	ccn->ccn_sendq_marks[(ccn->ccn_sendq_mark0 + n) %
+	    CCONN_SENDQ_MARKS] = end;
+	ccn->ccn_sendq_nmarks++;
 }
 
-void
-cconn_on_hangup(cloop_ent_t *clent, int ev)
+/*
+ * Determine whether a consumer that was refused by cconn_send() should now
+ * be told that the send queue has drained.
+ */
+static boolean_t
+cconn_sendq_drained(cconn_t *ccn)
 {
-	cconn_t *ccn = cloop_ent_data(clent);
+	cserver_t *csrv = ccn->ccn_server;
 
-	VERIFY(ev == CLOOP_CB_HANGUP);
+	if (!ccn->ccn_sendq_blocked ||
+	    ccn->ccn_sendq_bytes > ccn->ccn_sendq_lowat) {
+		return (B_FALSE);
+	}
 
-	if (cserver_debug) {
-		fprintf(stderr, "CCONN[%p] HANGUP\n", ccn);
+	if (csrv != NULL && csrv->csrv_sendq_limit != 0 &&
+	    csrv->csrv_sendq_bytes >= csrv->csrv_sendq_limit) {
+		return (B_FALSE);
 	}
-	cconn_advance_state(ccn, CCONN_ST_ERROR);
+
+	ccn->ccn_sendq_blocked = B_FALSE;
+	return (B_TRUE);
 }
 
-void
-cconn_on_error(cloop_ent_t *clent, int ev)
+/*
+ * Compress data onto the send queue.  Unless the connection is corked, the
+ * compressor is flushed so that the peer can decode everything sent so far.
+ */
+static int
+cconn_send_deflate(cconn_t *ccn, const void *buf, size_t len,
+    cdeflate_flush_t flush)
 {
-	cconn_t *ccn = cloop_ent_data(clent);
+	size_t produced;
+	int r;
 
-	VERIFY(ev == CLOOP_CB_ERROR);
+	if (flush == CDEFLATE_FLUSH_SYNC && ccn->ccn_cork > 0) {
+		flush = CDEFLATE_FLUSH_NONE;
+	}
 
-	if (cserver_debug) {
-		fprintf(stderr, "CCONN[%p] ERROR\n", ccn);
+	ccn->ccn_sendq_resv = NULL;
+	r = cdeflate_compress(ccn->ccn_zout, buf, len, flush,
+	    &ccn->ccn_sendq, cconn_buf_get, CCONN_SEND_CHUNK, &produced);
+
+	if (len > 0 || produced > 0) {
+		cconn_sendq_add(ccn, produced);
 	}
-	cconn_advance_state(ccn, CCONN_ST_ERROR);
+
+	if (r != 0) {
+		/*
+		 * The compressor may have taken some of the input before it
+		 * ran out of buffers, and cannot be wound back, so the caller
+		 * could not retry without sending that input twice.  The
+		 * connection is closed from cconn_flush(), as our caller may
+		 * still be using it.
+		 */
+		ccn->ccn_zout_failed = B_TRUE;
+		cloop_ent_want(ccn->ccn_clent, CLOOP_CB_WRITE);
+		return (-1);
+	}
+
+	if (flush != CDEFLATE_FLUSH_NONE) {
+		ccn->ccn_zout_pending = B_FALSE;
+		cconn_sendq_mark(ccn);
+	} else if (len > 0) {
+		ccn->ccn_zout_pending = B_TRUE;
+	}
+	if (produced > 0) {
+		cconn_want_write(ccn);
+	}
+	return (0);
 }
 
 void
-cconn_on_write(cloop_ent_t *clent, int ev)
+cconn_send_watermarks_set(cconn_t *ccn, size_t lowat, size_t hiwat)
 {
-	cconn_t *ccn = cloop_ent_data(clent);
+	ccn->ccn_sendq_lowat = lowat;
+	ccn->ccn_sendq_hiwat = hiwat;
+}
 
-	VERIFY(ev == CLOOP_CB_WRITE);
+size_t
+cconn_send_queued(cconn_t *ccn)
+{
+	return (ccn->ccn_sendq_bytes);
+}
 
-	if (cserver_debug) {
-		fprintf(stderr, "CCONN[%p] WRITE DATA\n", ccn);
+/*
+ * Reserve at least "min_len" contiguous bytes at the tail of the send queue.
+ * If the buffer at the tail of the queue does not have enough unused space,
+ * a new chunk is appended to the queue.  The reserved region is not visible
+ * to the socket until it is committed with cconn_send_commit().
+ */
+int
+cconn_send_reserve(cconn_t *ccn, size_t min_len, void **ptrp, size_t *availp)
+{
+	cbuf_t *cbuf;
+
+	if (cconn_send_check(ccn) != 0) {
+		return (-1);
 	}
 
-	boolean_t qempty = (cbufq_peek(ccn->ccn_sendq) == NULL);
-	if (qempty && !ccn->ccn_sendq_end) {
-		/*
-		 * Nothing to send.
-		 */
-		return;
+	if (min_len == 0) {
+		min_len = 1;
 	}
 
-	if (qempty) {
+	if (ccn->ccn_zout != NULL) {
 		/*
-		 * The outbound queue is empty _and_ we have no more data to
-		 * send.  Proceed with a FIN.
+		 * The producer writes into a staging buffer, which is
+		 * compressed into the send queue on commit.
 		 */
-		if (shutdown(cloop_ent_fd(clent), SHUT_WR) != 0) {
-			warn("shutdown(SHUT_WR)");
-			cconn_advance_state(ccn, CCONN_ST_ERROR);
-			return;
+		if ((cbuf = ccn->ccn_zstage) == NULL ||
+		    cbuf_capacity(cbuf) < min_len) {
+			if (cconn_buf_get(min_len > CCONN_SEND_CHUNK ?
+			    min_len : CCONN_SEND_CHUNK, &cbuf) != 0) {
+				return (-1);
+			}
+			cbuf_free(ccn->ccn_zstage);
+			ccn->ccn_zstage = cbuf;
 		}
-		ccn->ccn_sendq_flushed = B_TRUE;
+		cbuf_clear(cbuf);
+		cbuf_flip(cbuf);
 
-		if (ccn->ccn_state == CCONN_ST_READ_EOF) {
-			/*
-			 * If the read side has already shut down,
-			 * we can close the whole connection now.
-			 */
-			cconn_advance_state(ccn, CCONN_ST_CLOSED);
+	} else if ((cbuf = cbufq_peek_tail(&ccn->ccn_sendq)) == NULL ||
+	    cbuf_unused(cbuf) < min_len) {
+		/*
+		 * Chunks come from the buffer pool, and go back to it once
+		 * they have been written out.
+		 */
+		if (cconn_buf_get(min_len > CCONN_SEND_CHUNK ? min_len :
+		    CCONN_SEND_CHUNK, &cbuf) != 0) {
+			return (-1);
 		}
-		return;
-	}
 
-	cbuf_t *head;
-	while ((head = cbufq_peek(ccn->ccn_sendq)) != NULL) {
-		size_t actual = 0;
-		size_t want;
-
-		if ((want = cbuf_available(head)) < 1) {
-			cbuf_free(cbufq_deq(ccn->ccn_sendq));
-			continue;
-		}
-
-retry:
-		if (cbuf_sys_write(head, cloop_ent_fd(clent),
-		    CBUF_SYSREAD_ENTIRE, &actual) != 0) {
-			switch (errno) {
-			case EINTR:
-				goto retry;
-
-			case EAGAIN:
-				cloop_ent_want(clent, CLOOP_CB_WRITE);
-				return;
-
-			case ECONNRESET:
-				if (cserver_debug) {
-					fprintf(stderr, "CCONN[%p] "
-					    "ECONNRESET\n", ccn);
-				}
-				return;
-
-			default:
-				err(1, "cbuf_sys_write");
-			}
-		}
+		/*
+		 * The new chunk is empty, but must be ready for gets before
+		 * it may be placed in the queue.
+		 */
+		cbuf_flip(cbuf);
+		cbufq_enq(&ccn->ccn_sendq, cbuf);
 	}
 
-	cloop_ent_want(clent, CLOOP_CB_WRITE);
+	ccn->ccn_sendq_resv = cbuf;
+	*ptrp = cbuf_unused_ptr(cbuf);
+	*availp = cbuf_unused(cbuf);
+	return (0);
 }
 
-void
-cconn_on_read(cloop_ent_t *clent, int ev)
+/*
+ * Make "used" bytes of the most recent reservation available for sending.
+ * A commit of zero bytes abandons the reservation.
+ */
+int
+cconn_send_commit(cconn_t *ccn, size_t used)
 {
-	cconn_t *ccn = cloop_ent_data(clent);
-	cbuf_t *cbuf = NULL;
-	size_t actual = 0;
-	boolean_t new_cbuf = B_FALSE;
-
-	VERIFY(ev == CLOOP_CB_READ);
+	cbuf_t *cbuf = ccn->ccn_sendq_resv;
 
-	if (cserver_debug) {
-		fprintf(stderr, "CCONN[%p] READ DATA\n", ccn);
+	if (cbuf == NULL) {
+		errno = EINVAL;
+		return (-1);
 	}
+	ccn->ccn_sendq_resv = NULL;
 
-	/*
-	 * Check to see if we have space in the tail of the buffer queue:
-	 */
-	if ((cbuf = cbufq_peek_tail(ccn->ccn_recvq)) != NULL &&
-	    cbuf_unused(cbuf) > 64) {
-		cbuf_resume(cbuf);
-		VERIFY(cbuf_available(cbuf) > 64);
-	} else {
-		/*
-		 * Allocate a new buffer:
-		 */
-		new_cbuf = B_TRUE;
-		if (cbuf_alloc(&cbuf, 2048) != 0) {
-			err(1, "cbuf_alloc");
-		}
+	if (cbuf_limit_extend(cbuf, used) != 0) {
+		return (-1);
 	}
 
-retry:
-	if (cbuf_sys_read(cbuf, cloop_ent_fd(clent), CBUF_SYSREAD_ENTIRE,
-	    &actual) != 0) {
-		switch (errno) {
-		case EINTR:
-			goto retry;
-
-		case EAGAIN:
-			cloop_ent_want(clent, CLOOP_CB_READ);
-			goto out;
-
-		case ECONNRESET:
-			cconn_advance_state(ccn, CCONN_ST_ERROR);
-			goto out;
+	if (cbuf == ccn->ccn_zstage) {
+		void *ptr;
+		int r = 0;
 
-		default:
-			err(1, "cbuf_sys_read");
-		}
-	} else if (actual == 0) {
 		/*
-		 * Mark the receive queue as finished.  We will transition
-		 * to EOF once the line handling function has run out of
-		 * data.
+		 * The staging buffer is not kept between reservations, so
+		 * that an idle connection holds no buffers.
 		 */
-		ccn->ccn_recvq_end = B_TRUE;
-		if (cserver_debug) {
-			fprintf(stderr, "CCONN[%p] READ EOF\n", ccn);
+		if (used > 0) {
+			VERIFY0(cbuf_get_ptr(cbuf, 0, used, &ptr));
+			r = cconn_send_deflate(ccn, ptr, used,
+			    CDEFLATE_FLUSH_SYNC);
 		}
-	} else if (cserver_debug) {
-		fprintf(stderr, "CCONN[%p] READ %u BYTES\n", ccn, actual);
+		ccn->ccn_zstage = NULL;
+		cbuf_free(cbuf);
+		return (r);
 	}
 
-	cbuf_flip(cbuf);
-	if (new_cbuf) {
-		if (actual == 0) {
+	if (used > 0) {
+		cconn_sendq_add(ccn, used);
+		cconn_sendq_mark(ccn);
+		cconn_want_write(ccn);
+	} else if (ccn->ccn_sendq_bytes == 0) {
+		/*
+		 * Nothing is waiting to be sent, so the chunk allocated for
+		 * an abandoned reservation need not be kept.
+		 */
+		while ((cbuf = cbufq_deq(&ccn->ccn_sendq)) != NULL) {
 			cbuf_free(cbuf);
-		} else {
-			cbufq_enq(ccn->ccn_recvq, cbuf);
 		}
 	}
-
-	/*
-	 * Handle any new data that has arrived:
-	 */
-	ccn_handle_incoming_data(ccn);
-	return;
-
-out:
-	if (new_cbuf) {
-		cbuf_free(cbuf);
-	} else {
-		cbuf_flip(cbuf);
-	}
+	return (0);
 }
 
-static void
-cconn_destroy(cconn_t *ccn)
+/*
+ * Copy a control message onto its queue.  Control messages are packed into
+ * chunks, just as other sends are.
+ */
+static int
+cconn_send_ctl(cconn_t *ccn, const void *buf, size_t len)
 {
-	int e = errno;
-
-	if (ccn == NULL)
-		return;
+	cbuf_t *cbuf;
 
-	if (ccn->ccn_server != NULL) {
-		list_remove(&ccn->ccn_server->csrv_connections, ccn);
+	if (cconn_send_check_prio(ccn, CCONN_PRIO_CONTROL) != 0) {
+		return (-1);
 	}
 
-	cloop_ent_free(ccn->ccn_clent);
-	cbufq_free(ccn->ccn_recvq);
-	cbufq_free(ccn->ccn_sendq);
-	custr_free(ccn->ccn_input);
-	free(ccn->ccn_remote_addr_str);
-
-	free(ccn);
+	if ((cbuf = cbufq_peek_tail(&ccn->ccn_sendq_ctl)) == NULL ||
+	    cbuf_unused(cbuf) < len) {
+		if (cconn_buf_get(len > CCONN_SEND_CHUNK ? len :
+		    CCONN_SEND_CHUNK, &cbuf) != 0) {
+			return (-1);
+		}
+		cbuf_flip(cbuf);
+		cbufq_enq(&ccn->ccn_sendq_ctl, cbuf);
+	}
 
-	errno = e;
+	bcopy(buf, cbuf_unused_ptr(cbuf), len);
+	VERIFY0(cbuf_limit_extend(cbuf, len));
+	ccn->ccn_sendq_ctl_bytes += len;
+	cconn_sendq_add(ccn, len);
+	cconn_want_write(ccn);
+	return (0);
 }
 
-static int
-cconn_alloc(cconn_t **ccnp)
+/*
+ * Append an already-filled buffer to the send queue.  On success, the
+ * connection takes ownership of the buffer; on failure, the caller retains
+ * it.
+ */
+int
+cconn_send_cbuf_prio(cconn_t *ccn, cbuf_t *cbuf, cconn_prio_t prio)
 {
-	cconn_t *ccn = NULL;
+	/*
+	 * A compressed stream can only be sent in order.
+	 */
+	if (ccn->ccn_zout != NULL) {
+		prio = CCONN_PRIO_NORMAL;
+	}
 
-	if ((ccn = calloc(1, sizeof (*ccn))) == NULL) {
+	if (cconn_send_check_prio(ccn, prio) != 0) {
 		return (-1);
 	}
 
-	if (cloop_ent_alloc(&ccn->ccn_clent) != 0 ||
-	    cbufq_alloc(&ccn->ccn_recvq) != 0 ||
-	    cbufq_alloc(&ccn->ccn_sendq) != 0 ||
-	    custr_alloc(&ccn->ccn_input) != 0) {
-		cconn_destroy(ccn);
-		return (-1);
+	if (prio == CCONN_PRIO_CONTROL) {
+		size_t len = cbuf_available(cbuf);
+
+		cbufq_enq(&ccn->ccn_sendq_ctl, cbuf);
+		ccn->ccn_sendq_ctl_bytes += len;
+		cconn_sendq_add(ccn, len);
+		cconn_want_write(ccn);
+		return (0);
 	}
 
 	/*
-	 * Link the cloop entity and the connection object.
+	 * Any outstanding reservation is no longer at the tail of the queue.
 	 */
-	cloop_ent_data_set(ccn->ccn_clent, ccn);
+	ccn->ccn_sendq_resv = NULL;
 
-	/*
-	 * Install the appropriate cloop entity event callbacks.
-	 */
-	cloop_ent_on(ccn->ccn_clent, CLOOP_CB_HANGUP, cconn_on_hangup);
-	cloop_ent_on(ccn->ccn_clent, CLOOP_CB_READ, cconn_on_read);
-	cloop_ent_on(ccn->ccn_clent, CLOOP_CB_WRITE, cconn_on_write);
-	cloop_ent_on(ccn->ccn_clent, CLOOP_CB_ERROR, cconn_on_error);
+	if (ccn->ccn_zout != NULL) {
+		size_t len = cbuf_available(cbuf);
+		void *ptr;
 
-	/*
-	 * Set the connection to the pre-connection state:
-	 */
-	ccn->ccn_state = CCONN_ST_PRE_CONNECTION;
+		/*
+		 * This fails with ENOTSUP for file-backed buffers, which
+		 * cannot be compressed.
+		 */
+		if (cbuf_get_ptr(cbuf, 0, len, &ptr) != 0) {
+			return (-1);
+		}
+		if (cconn_send_deflate(ccn, ptr, len,
+		    CDEFLATE_FLUSH_SYNC) != 0) {
+			return (-1);
+		}
+		cbuf_free(cbuf);
+		return (0);
+	}
 
-	*ccnp = ccn;
+	cbufq_enq(&ccn->ccn_sendq, cbuf);
+	cconn_sendq_add(ccn, cbuf_available(cbuf));
+	cconn_sendq_mark(ccn);
+	cconn_want_write(ccn);
 	return (0);
 }
 
 int
-cserver_accept(cserver_t *csrv, cconn_t **ccnp)
+cconn_send_cbuf(cconn_t *ccn, cbuf_t *cbuf)
 {
-	cconn_t *ccn = NULL;
-	size_t sz;
-	int e;
-	int fd;
+	return (cconn_send_cbuf_prio(ccn, cbuf, CCONN_PRIO_NORMAL));
+}
 
-	if (cconn_alloc(&ccn) != 0) {
-		*ccnp = NULL;
+/*
+ * Queue "len" bytes of the file "fd", starting at offset "off", for sending.
+ * The data is sent directly from the file once everything queued before it
+ * has been written.  The connection keeps its own duplicate of the
+ * descriptor, so the caller may close "fd" at any time.
+ */
+int
+cconn_send_file(cconn_t *ccn, int fd, off_t off, size_t len)
+{
+	cbuf_t *cbuf;
+
+	if (cconn_send_check(ccn) != 0) {
 		return (-1);
 	}
 
-	sz = sizeof (ccn->ccn_remote_addr);
-retry:
-	if ((fd = accept4(cloop_ent_fd(csrv->csrv_listen),
-	    (struct sockaddr *)&ccn->ccn_remote_addr, &sz,
-	    SOCK_CLOEXEC | SOCK_NONBLOCK)) < 0) {
-		switch (errno) {
-		case EINTR:
-			goto retry;
-
-		case ECONNABORTED:
-		case EWOULDBLOCK:
-			/*
-			 * Not actionable.  Back to sleep.
-			 */
-			e = EWOULDBLOCK;
-			cloop_ent_want(csrv->csrv_listen, CLOOP_CB_READ);
-			goto fail;
-
-		default:
-			err(1, "accept4");
-		}
+	if (len == 0) {
+		return (0);
 	}
 
-	/*
-	 * Set socket options.
-	 */
-	int opt_on = 1;
-	if (setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &opt_on,
-	    sizeof (opt_on)) != 0) {
-		e = errno;
-		warn("could not set SO_KEEPALIVE");
-		goto fail;
+	if (ccn->ccn_zout != NULL) {
+		errno = ENOTSUP;
+		return (-1);
 	}
-	(void) setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &keepidle,
-	    sizeof (keepidle));
-	(void) setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &keepcnt,
-	    sizeof (keepcnt));
-	(void) setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &keepintvl,
-	    sizeof (keepintvl));
-
-	/*
-	 * We want to be notified when there are more incoming connections.
-	 */
-	cloop_ent_want(csrv->csrv_listen, CLOOP_CB_READ);
-
-	/*
-	 * Link this connection into the server connection list:
-	 */
-	ccn->ccn_server = csrv;
-	list_insert_tail(&csrv->csrv_connections, ccn);
 
-	/*
-	 * Attach our cloop entity to the event loop:
-	 */
-	cloop_attach_ent(csrv->csrv_loop, ccn->ccn_clent, fd);
-
-	/*
-	 * Mark this connection as waiting for incoming data.
-	 */
-	cconn_advance_state(ccn, CCONN_ST_WAITING_FOR_LINE);
-
-	ccn->ccn_remote_addr_str = strdup(inet_ntoa(cconn_sockaddr_in(
-	    ccn)->sin_addr));
-	if (cserver_debug) {
-		fprintf(stderr, "ACCEPTED (%s)\n", ccn->ccn_remote_addr_str);
+	if (cbuf_alloc_file(&cbuf, fd, off, len) != 0) {
+		return (-1);
 	}
 
-	*ccnp = ccn;
+	ccn->ccn_sendq_resv = NULL;
+	cbufq_enq(&ccn->ccn_sendq, cbuf);
+	cconn_sendq_add(ccn, len);
+	cconn_sendq_mark(ccn);
+	cconn_want_write(ccn);
 	return (0);
-
-fail:
-	cconn_destroy(ccn);
-	errno = e;
-	return (-1);
 }
 
-static void
-cserver_on_incoming(cloop_ent_t *clent, int event)
+int
+cconn_send_prio(cconn_t *ccn, custr_t *cu, cconn_prio_t prio)
 {
-	cserver_t *csrv = cloop_ent_data(clent);
+	void *ptr;
+	size_t avail;
+	size_t len = custr_len(cu);
 
-	VERIFY(event == CLOOP_CB_READ);
+	if (ccn->ccn_zout != NULL) {
+		prio = CCONN_PRIO_NORMAL;
+	}
 
+	if (len == 0) {
+		return (cconn_send_check_prio(ccn, prio));
+	}
 
-	if (csrv->csrv_on_incoming != NULL) {
-		/*
-		 * Report a possible incoming connection to our consumer.
-		 * Note that we do not rearm for read events; this happens
-		 * in cserver_accept().
-		 */
-		csrv->csrv_on_incoming(csrv, CSERVER_CB_INCOMING);
-	} else {
+	if (prio == CCONN_PRIO_CONTROL) {
+		return (cconn_send_ctl(ccn, custr_cstr(cu), len));
+	}
+
+	if (ccn->ccn_zout != NULL) {
 		/*
-		 * XXX Should we abort here?
+		 * Compress straight from the string, rather than copying it
+		 * into the staging buffer first.
 		 */
-		fprintf(stderr, "CSERVER[%p]: INCOMING WITH NO HANDLER!\n",
-		    csrv);
-		cloop_ent_want(clent, CLOOP_CB_READ);
+		if (cconn_send_check(ccn) != 0) {
+			return (-1);
+		}
+		ccn->ccn_sendq_resv = NULL;
+		return (cconn_send_deflate(ccn, custr_cstr(cu), len,
+		    CDEFLATE_FLUSH_SYNC));
+	}
+
+	if (cconn_send_reserve(ccn, len, &ptr, &avail) != 0) {
+		return (-1);
 	}
+
+	VERIFY3U(avail, >=, len);
+	bcopy(custr_cstr(cu), ptr, len);
+	return (cconn_send_commit(ccn, len));
 }
 
-const char *
-cconn_remote_addr_str(cconn_t *ccn)
+int
+cconn_send(cconn_t *ccn, custr_t *cu)
 {
-	return (ccn->ccn_remote_addr_str);
+	return (cconn_send_prio(ccn, cu, CCONN_PRIO_NORMAL));
 }
 
-void
-cconn_on(cconn_t *ccn, int event, cconn_cb_t *func)
+static void
+cconn_sockopt_tcp(cconn_t *ccn, int opt, int val)
 {
-	switch ((cconn_cb_type_t) event) {
-	case CCONN_CB_LINE_AVAILABLE:
-		ccn->ccn_on_line_available = func;
-		return;
-
-	case CCONN_CB_ERROR:
-		ccn->ccn_on_error = func;
-		return;
-
-	case CCONN_CB_END:
-		ccn->ccn_on_end = func;
-		return;
-
-	case CCONN_CB_CLOSE:
-		ccn->ccn_on_close = func;
-		return;
-	}
-
-	warnx("unknown cconn cb %d\n", event);
-	abort();
+	/*
+	 * These options only affect how data is packed into segments, so a
+	 * failure to set them is not fatal.
+	 */
+	ccn->ccn_stats.ccs_syscalls++;
+	(void) setsockopt(cloop_ent_fd(ccn->ccn_clent), IPPROTO_TCP, opt,
+	    &val, sizeof (val));
 }
 
-void
-cserver_on(cserver_t *csrv, int event, cserver_cb_t *func)
+/*
+ * While a connection is corked, sends are held back so that a response made
+ * up of several of them leaves in full segments.  Corks nest; once the last
+ * is removed, any queued data is written out and Nagle's algorithm is
+ * disabled so that the final partial segment is not delayed.  Data queued
+ * from within a callback is written when the callback returns, so a handler
+ * need not uncork before returning unless it wants the data to go out.
+ */
+int
+cconn_cork(cconn_t *ccn)
 {
-	switch (event) {
-	case CSERVER_CB_INCOMING:
-		csrv->csrv_on_incoming = func;
+	switch (ccn->ccn_state) {
+	case CCONN_ST_CONNECTING:
+	case CCONN_ST_HANDSHAKE:
+	case CCONN_ST_LINE_AVAILABLE:
+	case CCONN_ST_WAITING_FOR_LINE:
+	case CCONN_ST_READ_EOF:
 		break;
 
 	default:
-		warnx("unknown cserver cb %d\n", event);
-		abort();
-		break;
+		errno = EINVAL;
+		return (-1);
+	}
+
+	if (ccn->ccn_cork++ == 0) {
+#ifdef	TCP_CORK
+		cconn_sockopt_tcp(ccn, TCP_CORK, 1);
+#endif
 	}
+	return (0);
 }
 
-static void
-cserver_on_error(cloop_ent_t *clent, int event)
+int
+cconn_uncork(cconn_t *ccn)
 {
-	cserver_t *csrv = cloop_ent_data(clent);
+	if (ccn->ccn_cork == 0 || ccn->ccn_clent == NULL) {
+		errno = EINVAL;
+		return (-1);
+	}
 
-	VERIFY(event == CLOOP_CB_ERROR);
+	if (--ccn->ccn_cork > 0) {
+		return (0);
+	}
+
+	if (!ccn->ccn_nodelay) {
+		cconn_sockopt_tcp(ccn, TCP_NODELAY, 1);
+		ccn->ccn_nodelay = B_TRUE;
+	}
+#ifdef	TCP_CORK
+	cconn_sockopt_tcp(ccn, TCP_CORK, 0);
+#endif
 
 	/*
-	 * It's not clear why this would happen to us on a listen socket.
+	 * Compressed sends made while corked may still be held by the
+	 * compressor.
 	 */
-	fprintf(stderr, "CSERVER[%p]: ERROR!\n", csrv);
-	abort();
+	if (ccn->ccn_zout != NULL && ccn->ccn_zout_pending &&
+	    cconn_send_deflate(ccn, NULL, 0, CDEFLATE_FLUSH_SYNC) != 0) {
+		return (-1);
+	}
+	cconn_sendq_mark(ccn);
+
+	if (ccn->ccn_sendq_bytes > 0) {
+		cconn_want_write(ccn);
+	}
+	return (0);
 }
 
-static void
-cserver_on_hangup(cloop_ent_t *clent, int event)
+void
+cconn_recv_limits_set(cconn_t *ccn, size_t max_line, size_t max_buffered)
 {
-	cserver_t *csrv = cloop_ent_data(clent);
-
-	VERIFY(event == CLOOP_CB_HANGUP);
-
-	/*
-	 * It's not clear why this would happen to us on a listen socket.
-	 */
-	fprintf(stderr, "CSERVER[%p]: HANGUP!\n", csrv);
-	abort();
+	ccn->ccn_recv_max_line = max_line;
+	ccn->ccn_recv_max = max_buffered;
 }
 
-void
-cserver_free(cserver_t *csrv)
+/*
+ * Request more data from the socket, unless the remote peer has finished
+ * sending or the receive queue is already full.  Once the queue is full, we
+ * leave the data in the socket so that TCP flow control will push back on
+ * the sender.
+ */
+static void
+cconn_want_read(cconn_t *ccn)
 {
-	if (csrv == NULL) {
+	if (ccn->ccn_recvq_end) {
 		return;
 	}
 
-	cserver_close(csrv);
+	if (ccn->ccn_relay != NULL && cconn_relay_full(ccn)) {
+		/*
+		 * Data received on a relayed connection is queued on its
+		 * peer.  Leave it in the socket while the peer is backed up.
+		 */
+		ccn->ccn_relay_blocked = B_TRUE;
+		return;
+	}
 
-	/*
-	 * Destroy all connections.
-	 */
-	while (!list_is_empty(&csrv->csrv_connections)) {
-		cconn_destroy(list_head(&csrv->csrv_connections));
+	if (ccn->ccn_recv_max != 0 &&
+	    (ccn->ccn_recvq_bytes >= ccn->ccn_recv_max ||
+	    ccn->ccn_zrecvq_bytes >= ccn->ccn_recv_max)) {
+		return;
 	}
 
-	free(csrv);
+	if (ccn->ccn_tls != NULL && ctls_pending(ccn->ccn_tls) > 0) {
+		/*
+		 * The TLS library is holding data that it has already
+		 * decrypted, so the socket may never become readable.  The
+		 * socket is almost always writable, and cconn_on_write() will
+		 * read the pending data.
+		 */
+		cloop_ent_want(ccn->ccn_clent, CLOOP_CB_WRITE);
+		return;
+	}
+
+	cloop_ent_want(ccn->ccn_clent, CLOOP_CB_READ);
 }
 
-int
-cserver_alloc(cserver_t **csrvp)
+/*
+ * Built-in framers.
+ */
+static int
+cconn_framer_delimiter(cbufq_t *recvq, void *arg, cconn_frame_t *cfr)
 {
-	cserver_t *csrv = NULL;
-	cloop_ent_t *clent = NULL;
+	cconn_fparam_t *cfp = arg;
+	size_t dlen = cfp->cfp_delim_len;
+	size_t off, avail;
 
-	if (getenv("CSERVER_DEBUG") != NULL) {
-		cserver_debug = B_TRUE;
-	}
+	/*
+	 * On an earlier call we may have established that the delimiter
+	 * does not begin within the first "cfr_len" bytes; there is no need
+	 * to look there again.
+	 */
+	if (cbufq_search(recvq, cfr->cfr_len, cfp->cfp_delim, dlen,
+	    &off) != 0) {
+		if (errno != ENOENT) {
+			return (-1);
+		}
 
-	if ((csrv = calloc(1, sizeof (*csrv))) == NULL) {
+		if ((avail = cbufq_available(recvq)) >= dlen) {
+			cfr->cfr_len = avail - (dlen - 1);
+		}
+		errno = EAGAIN;
 		return (-1);
 	}
-	csrv->csrv_type = CSERVER_TYPE_NONE;
 
-	if (cloop_ent_alloc(&clent) != 0) {
-		free(csrv);
+	cfr->cfr_hdr = 0;
+	cfr->cfr_len = off;
+	cfr->cfr_trail = dlen;
+	return (0);
+}
+
+static int
+cconn_framer_length(cbufq_t *recvq, void *arg, cconn_frame_t *cfr)
+{
+	cconn_fparam_t *cfp = arg;
+	size_t avail = cbufq_available(recvq);
+	cbuf_t *head;
+	unsigned int order;
+	size_t pos;
+	int r;
+
+	if (avail < cfp->cfp_width) {
+		errno = EAGAIN;
 		return (-1);
 	}
 
 	/*
-	 * Create list of connection objects for this server:
+	 * Decode the length prefix without consuming it.
 	 */
-	list_create(&csrv->csrv_connections, sizeof (cconn_t),
-	    offsetof(cconn_t, ccn_link));
+	if (cbufq_pullup(recvq, cfp->cfp_width) != 0) {
+		return (-1);
+	}
+	head = cbufq_first(recvq);
+	pos = cbuf_position(head);
+	order = cbuf_byteorder(head);
+	cbuf_byteorder_set(head, cfp->cfp_order);
+	if (cfp->cfp_width == sizeof (uint16_t)) {
+		uint16_t len;
+
+		r = cbuf_get_u16(head, &len);
+		cfr->cfr_len = len;
+	} else {
+		uint32_t len;
 
-	/*
-	 * Link the listen server to the cloop entity:
-	 */
-	csrv->csrv_listen = clent;
-	cloop_ent_data_set(clent, csrv);
+		r = cbuf_get_u32(head, &len);
+		cfr->cfr_len = len;
+	}
+	cbuf_byteorder_set(head, order);
+	VERIFY0(cbuf_position_set(head, pos));
+	VERIFY0(r);
+
+	cfr->cfr_hdr = cfp->cfp_width;
+	cfr->cfr_trail = 0;
+	if (avail - cfp->cfp_width < cfr->cfr_len) {
+		errno = EAGAIN;
+		return (-1);
+	}
 
-	*csrvp = csrv;
 	return (0);
 }
 
-static int
-cserver_parse_ipv4addr(const char *ipaddr, const char *port,
-    struct sockaddr_in *addr)
+void
+cconn_framer_set(cconn_t *ccn, cconn_framer_t *func, void *arg)
 {
-	bzero(addr, sizeof (*addr));
-
-	addr->sin_family = AF_INET;
-	addr->sin_port = htons(atoi(port));
+	ccn->ccn_framer = func;
+	ccn->ccn_framer_arg = arg;
+	bzero(&ccn->ccn_frame, sizeof (ccn->ccn_frame));
+}
 
-	switch (inet_pton(AF_INET, ipaddr, &addr->sin_addr)) {
-	case 1:
-		return (0);
-	case 0:
-		warnx("inet_pton (%s) invalid address", ipaddr);
-		errno = EPROTO;
-		return (-1);
-	default:
-		warn("inet_pton (%s) failure", ipaddr);
+int
+cconn_framing_delimiter(cconn_t *ccn, const void *delim, size_t len)
+{
+	if (len == 0 || len > CCONN_DELIM_MAX) {
+		errno = EINVAL;
 		return (-1);
 	}
+
+	bcopy(delim, ccn->ccn_fparam.cfp_delim, len);
+	ccn->ccn_fparam.cfp_delim_len = len;
+	cconn_framer_set(ccn, cconn_framer_delimiter, &ccn->ccn_fparam);
+	return (0);
 }
 
-int
-cserver_listen_tcp(cserver_t *csrv, cloop_t *cloop, const char *ipaddr,
-    const char *port)
+void
+cconn_framing_newline(cconn_t *ccn)
 {
-	int e;
-	int sock = -1;
-	struct sockaddr_in addr;
+	VERIFY0(cconn_framing_delimiter(ccn, "\n", 1));
+}
 
-	if (csrv->csrv_type != CSERVER_TYPE_NONE) {
-		/*
-		 * This server is already listening.
-		 */
+int
+cconn_framing_length(cconn_t *ccn, unsigned int width, unsigned int order)
+{
+	if ((width != sizeof (uint16_t) && width != sizeof (uint32_t)) ||
+	    (order != CBUF_ORDER_BIG_ENDIAN &&
+	    order != CBUF_ORDER_LITTLE_ENDIAN)) {
 		errno = EINVAL;
 		return (-1);
 	}
 
-	/*
-	 * Create TCP listen socket.
-	 */
-	if ((sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
-	    0)) < 0) {
-		e = errno;
-		warn("socket failed");
-		goto fail;
-	}
+	ccn->ccn_fparam.cfp_width = width;
+	ccn->ccn_fparam.cfp_order = order;
+	cconn_framer_set(ccn, cconn_framer_length, &ccn->ccn_fparam);
+	return (0);
+}
 
-	/*
-	 * Set socket options.
-	 */
-	int opt_on = 1;
-	if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt_on,
-	    sizeof (opt_on)) != 0) {
-		warn("could not set SO_REUSEADDR");
-		goto fail;
+/*
+ * Obtain a pointer to the payload of the current frame.  The data remains
+ * in the receive queue and the pointer is valid until cconn_next() is
+ * called.  Where the framer consumes a trailer, such as a delimiter, the
+ * first byte of it is overwritten with a NUL so that text frames may be
+ * used as C strings.
+ */
+int
+cconn_frame(cconn_t *ccn, void **ptrp, size_t *lenp)
+{
+	if (ccn->ccn_state != CCONN_ST_LINE_AVAILABLE) {
+		errno = EINVAL;
+		return (-1);
 	}
 
-	/*
-	 * Set TCP Listen Address.
-	 */
-	if (cserver_parse_ipv4addr(ipaddr != NULL ? ipaddr : "0.0.0.0", port,
-	    &addr) != 0) {
-		e = errno;
-		warn("cserver_parse_ipv4addr failed");
-		goto fail;
+	*ptrp = ccn->ccn_frame_ptr;
+	*lenp = ccn->ccn_frame.cfr_len;
+	return (0);
+}
+
+/*
+ * Return a copy of the current frame in a dynamic string, which remains valid
+ * until cconn_next() is called.  Consumers that do not need their own copy of
+ * the data should use cconn_frame() instead.
+ */
+custr_t *
+cconn_line(cconn_t *ccn)
+{
+	if (ccn->ccn_state != CCONN_ST_LINE_AVAILABLE) {
+		return (NULL);
 	}
 
-	/*
-	 * Bind to the Listen Address.
-	 */
-	if (bind(sock, (struct sockaddr *)&addr, sizeof (addr)) != 0) {
-		e = errno;
-		warn("bind failed");
-		goto fail;
+	if (ccn->ccn_input == NULL && custr_alloc(&ccn->ccn_input) != 0) {
+		return (NULL);
 	}
 
 	/*
-	 * Listen.
+	 * The frame may contain NUL bytes, so it is copied by length.
 	 */
-	if (listen(sock, 1000) != 0) {
-		e = errno;
-		warn("listen failed");
-		goto fail;
+	custr_reset(ccn->ccn_input);
+	if (custr_append_buf(ccn->ccn_input, ccn->ccn_frame_ptr,
+	    ccn->ccn_frame.cfr_len) != 0) {
+		return (NULL);
 	}
 
-	/*
-	 * We were successful in establishing the listen socket.  Copy
-	 * the relevant data into the server object:
-	 */
-	csrv->csrv_type = CSERVER_TYPE_TCP;
-	*cserver_sockaddr_in(csrv) = addr;
+	return (ccn->ccn_input);
+}
 
-	/*
-	 * Register our callbacks:
-	 */
-	cloop_ent_t *clent = csrv->csrv_listen;
-	cloop_ent_on(clent, CLOOP_CB_READ, cserver_on_incoming);
-	cloop_ent_on(clent, CLOOP_CB_HANGUP, cserver_on_hangup);
-	cloop_ent_on(clent, CLOOP_CB_ERROR, cserver_on_error);
+void
+cconn_next(cconn_t *ccn)
+{
+	cconn_frame_t *cfr = &ccn->ccn_frame;
+	size_t total = cfr->cfr_hdr + cfr->cfr_len + cfr->cfr_trail;
 
-	/*
-	 * We want to be notified of incoming connections:
-	 */
-	cloop_ent_want(clent, CLOOP_CB_READ);
+	if (ccn->ccn_state != CCONN_ST_LINE_AVAILABLE) {
+		return;
+	}
 
 	/*
-	 * Attach the cloop entity to the loop:
+	 * Consume the frame from the receive queue.  Any buffers emptied in
+	 * the process go back to the pool, and once the queue is drained the
+	 * cconn_line() copy goes with them; while frames keep arriving it is
+	 * reused.
 	 */
-	csrv->csrv_loop = cloop;
-	cloop_attach_ent(cloop, clent, sock);
-	return (0);
+	VERIFY0(cbufq_discard(&ccn->ccn_recvq, total));
+	VERIFY3U(ccn->ccn_recvq_bytes, >=, total);
+	ccn->ccn_recvq_bytes -= total;
+	bzero(cfr, sizeof (*cfr));
+	ccn->ccn_frame_ptr = NULL;
+	if (ccn->ccn_recvq_bytes == 0) {
+		custr_free(ccn->ccn_input);
+		ccn->ccn_input = NULL;
+	}
 
-fail:
-	if (sock != -1) {
-		VERIFY0(close(sock));
+	if (ccn->ccn_zin_pending) {
+		/*
+		 * Everything after the frame in which compression was
+		 * negotiated is compressed.  What remains of the receive
+		 * queue moves to the (empty) compressed queue.
+		 */
+		VERIFY0(ccn->ccn_zrecvq_bytes);
+		cbufq_move(ccn->ccn_zrecvq, &ccn->ccn_recvq);
+		ccn->ccn_zrecvq_bytes = ccn->ccn_recvq_bytes;
+		ccn->ccn_recvq_bytes = 0;
+		ccn->ccn_zin_pending = B_FALSE;
 	}
-	errno = e;
-	return (-1);
-}
+
+	cconn_advance_state(ccn, CCONN_ST_WAITING_FOR_LINE);
+}
+
+static void
+cconn_overflow(cconn_t *ccn)
+{
+	if (cserver_debug) {
+		fprintf(stderr, "CCONN[%p] FRAME TOO LONG\n", ccn);
+	}
+	ccn->ccn_recv_overflow = B_TRUE;
+	cconn_advance_state(ccn, CCONN_ST_ERROR);
+}
+
+/*
+ * Decompress as much received data as will fit in the receive queue.
+ */
+static int
+cconn_inflate(cconn_t *ccn)
+{
+	size_t max = SIZE_MAX;
+	size_t consumed, produced;
+	int r;
+
+	if (ccn->ccn_recv_max != 0) {
+		if (ccn->ccn_recvq_bytes >= ccn->ccn_recv_max) {
+			return (0);
+		}
+		max = ccn->ccn_recv_max - ccn->ccn_recvq_bytes;
+	}
+
+	r = cdeflate_decompress(ccn->ccn_zin, ccn->ccn_zrecvq,
+	    &ccn->ccn_recvq, max, cconn_buf_get, ccn->ccn_recv_bufsz,
+	    &consumed, &produced);
+
+	VERIFY3U(ccn->ccn_zrecvq_bytes, >=, consumed);
+	ccn->ccn_zrecvq_bytes -= consumed;
+	ccn->ccn_recvq_bytes += produced;
+	if (ccn->ccn_recvq_bytes > ccn->ccn_stats.ccs_recvq_max) {
+		ccn->ccn_stats.ccs_recvq_max = ccn->ccn_recvq_bytes;
+	}
+	return (r);
+}
+
+/*
+ * Ask the framer to locate the next frame in the receive queue.  The frame
+ * is delivered in place: we only copy data if the frame spans more than one
+ * buffer, in which case it is pulled up into the first buffer.
+ */
+static void
+ccn_handle_incoming_data(cconn_t *ccn)
+{
+	cconn_frame_t *cfr = &ccn->ccn_frame;
+	cbuf_t *head;
+	size_t contig;
+	void *ptr;
+
+	if (ccn->ccn_state == CCONN_ST_LINE_AVAILABLE) {
+		/*
+		 * We already have a frame available.  Keep reading ahead
+		 * while there is room in the receive queue.
+		 */
+		cconn_want_read(ccn);
+		return;
+	}
+
+	if (ccn->ccn_pipeline != 0 && ccn->ccn_nreqs >= ccn->ccn_pipeline &&
+	    ccn->ccn_relay == NULL) {
+		/*
+		 * The pipeline is full.  Frames will be delivered again once
+		 * a request is done.
+		 */
+		cconn_want_read(ccn);
+		return;
+	}
+
+	if (CCONN_ZIN(ccn) && cconn_inflate(ccn) != 0) {
+		warn("cconn decompress");
+		cconn_advance_state(ccn, CCONN_ST_ERROR);
+		return;
+	}
+
+	if (ccn->ccn_relay != NULL) {
+		cconn_relay_forward(ccn);
+		return;
+	}
+
+	if (ccn->ccn_recvq_bytes == 0 || ccn->ccn_framer(&ccn->ccn_recvq,
+	    ccn->ccn_framer_arg, cfr) != 0) {
+		if (ccn->ccn_recvq_bytes != 0 && errno != EAGAIN) {
+			warn("cconn framer");
+			cconn_advance_state(ccn, CCONN_ST_ERROR);
+			return;
+		}
+
+		if ((ccn->ccn_recv_max_line != 0 &&
+		    cfr->cfr_len > ccn->ccn_recv_max_line) ||
+		    (ccn->ccn_recv_max != 0 &&
+		    ccn->ccn_recvq_bytes >= ccn->ccn_recv_max)) {
+			/*
+			 * Either the frame is too long, or it will not fit in
+			 * the receive queue and we would never finish it.
+			 */
+			cconn_overflow(ccn);
+			return;
+		}
+
+		if (ccn->ccn_recvq_end) {
+			/*
+			 * We have also hit EOF on the read side of the socket.
+			 * Inform our consumer that there will be no more data.
+			 */
+			cconn_advance_state(ccn, CCONN_ST_READ_EOF);
+		} else {
+			/*
+			 * As far as we know, there is more data to come.
+			 * Request additional reads.
+			 */
+			cconn_want_read(ccn);
+		}
+		return;
+	}
+
+	if (ccn->ccn_recv_max_line != 0 &&
+	    cfr->cfr_len > ccn->ccn_recv_max_line) {
+		cconn_overflow(ccn);
+		return;
+	}
+
+	/*
+	 * Make the header and payload, and the first byte of any trailer,
+	 * contiguous in the first buffer of the queue.
+	 */
+	contig = cfr->cfr_hdr + cfr->cfr_len + (cfr->cfr_trail > 0 ? 1 : 0);
+	if ((cfr->cfr_trail > 0 && cbufq_unshare(&ccn->ccn_recvq) != 0) ||
+	    cbufq_pullup(&ccn->ccn_recvq, contig) != 0) {
+		warn("cbufq_pullup");
+		cconn_advance_state(ccn, CCONN_ST_ERROR);
+		return;
+	}
+
+	head = cbufq_first(&ccn->ccn_recvq);
+	VERIFY0(cbuf_get_ptr(head, 0, contig, &ptr));
+	ccn->ccn_frame_ptr = (uint8_t *)ptr + cfr->cfr_hdr;
+	ccn->ccn_stats.ccs_frames_in++;
+	if (cfr->cfr_trail > 0) {
+		((uint8_t *)ccn->ccn_frame_ptr)[cfr->cfr_len] = '\0';
+	}
+
+	cconn_want_read(ccn);
+	cconn_advance_state(ccn, CCONN_ST_LINE_AVAILABLE);
+}
+
+void
+cconn_on_hangup(cloop_ent_t *clent, int ev)
+{
+	cconn_t *ccn = cloop_ent_data(clent);
+
+	VERIFY(ev == CLOOP_CB_HANGUP);
+
+	if (cserver_debug) {
+		fprintf(stderr, "CCONN[%p] HANGUP\n", ccn);
+	}
+	cconn_advance_state(ccn, CCONN_ST_ERROR);
+}
+
+void
+cconn_on_error(cloop_ent_t *clent, int ev)
+{
+	cconn_t *ccn = cloop_ent_data(clent);
+
+	VERIFY(ev == CLOOP_CB_ERROR);
+
+	if (cserver_debug) {
+		fprintf(stderr, "CCONN[%p] ERROR\n", ccn);
+	}
+	cconn_advance_state(ccn, CCONN_ST_ERROR);
+}
+
+/*
+ * An outbound connection attempt has completed.  Data queued while we were
+ * connecting is written once the consumer has been told.
+ */
+static void
+cconn_connect_done(cconn_t *ccn)
+{
+	int e = 0;
+	socklen_t sz = sizeof (e);
+
+	if (getsockopt(cloop_ent_fd(ccn->ccn_clent), SOL_SOCKET, SO_ERROR, &e,
+	    &sz) != 0) {
+		e = errno;
+	}
+
+	if (e != 0) {
+		if (cserver_debug) {
+			fprintf(stderr, "CCONN[%p] CONNECT FAILED: %s\n", ccn,
+			    strerror(e));
+		}
+		errno = e;
+		cconn_advance_state(ccn, CCONN_ST_ERROR);
+		return;
+	}
+
+	cconn_advance_state(ccn, CCONN_ST_WAITING_FOR_LINE);
+	if (ccn->ccn_on_connected != NULL) {
+		ccn->ccn_on_connected(ccn, CCONN_CB_CONNECTED);
+	}
+}
+
+/*
+ * Drive the TLS handshake on an accepted connection.  Once it completes, the
+ * connection proceeds as any other would, and anything the consumer queued
+ * in the meantime is written.
+ */
+static void
+cconn_tls_handshake(cconn_t *ccn)
+{
+	int ev;
+
+	if (ctls_handshake(ccn->ccn_tls, &ev) != 0) {
+		if (errno == EAGAIN) {
+			cloop_ent_unwant(ccn->ccn_clent, ev == CLOOP_CB_READ ?
+			    CLOOP_CB_WRITE : CLOOP_CB_READ);
+			cloop_ent_want(ccn->ccn_clent, ev);
+			return;
+		}
+
+		if (cserver_debug) {
+			fprintf(stderr, "CCONN[%p] TLS HANDSHAKE FAILED: %s\n",
+			    ccn, strerror(errno));
+		}
+		cconn_advance_state(ccn, CCONN_ST_ERROR);
+		return;
+	}
+
+	if (cserver_debug) {
+		fprintf(stderr, "CCONN[%p] TLS ESTABLISHED (%s)\n", ccn,
+		    ctls_kernel(ccn->ccn_tls) ? "kernel" : "user");
+	}
+	cconn_advance_state(ccn, CCONN_ST_WAITING_FOR_LINE);
+}
+
+static int
+cconn_write(cconn_t *ccn, cbufq_t *q, size_t want, size_t *actual)
+{
+	if (ccn->ccn_tls != NULL) {
+		return (ctls_write(ccn->ccn_tls, q, want, actual));
+	}
+
+	return (cbufq_sys_write(q, cloop_ent_fd(ccn->ccn_clent), want,
+	    actual));
+}
+
+/*
+ * Determine whether everything written from the normal queue so far ends at
+ * the end of a message.  Data that was not sent as messages, such as relayed
+ * data, may be interrupted once it has all been written.
+ */
+static boolean_t
+cconn_sendq_at_mark(cconn_t *ccn)
+{
+	if (ccn->ccn_sendq_nmarks > 0 &&
+	    ccn->ccn_sendq_marks[ccn->ccn_sendq_mark0] == ccn->ccn_sendq_out) {
+		return (B_TRUE);
+	}
+
+	return (ccn->ccn_sendq_bytes == ccn->ccn_sendq_ctl_bytes &&
+	    (ccn->ccn_cork == 0 || ccn->ccn_sendq_end) ? B_TRUE : B_FALSE);
+}
+
+/*
+ * Determine how much of the normal queue may be written before the end of
+ * the next message, so that waiting control messages can be written there.
+ * Returns CBUF_SYSREAD_ENTIRE if there is no need to stop.
+ */
+static size_t
+cconn_sendq_want(cconn_t *ccn)
+{
+	unsigned int i;
+	uint64_t mark;
+
+	if (ccn->ccn_sendq_ctl_bytes == 0) {
+		return (CBUF_SYSREAD_ENTIRE);
+	}
+
+	for (i = 0; i < ccn->ccn_sendq_nmarks; i++) {
+		mark = ccn->ccn_sendq_marks[(ccn->ccn_sendq_mark0 + i) %
+		    CCONN_SENDQ_MARKS];
+		if (mark > ccn->ccn_sendq_out) {
+			return ((size_t)(mark - ccn->ccn_sendq_out));
+		}
+	}
+
+	return (CBUF_SYSREAD_ENTIRE);
+}
+
+/*
+ * Choose the queue to write from next.  Once a message has been partly
+ * written, the rest of it must follow; messages may span buffers, so the
+ * normal queue is only left at the ends recorded by cconn_sendq_mark().
+ * Returns NULL if the rest of a message must be written next, but has not
+ * yet been sent.
+ */
+static cbufq_t *
+cconn_sendq_pick(cconn_t *ccn)
+{
+	boolean_t others = ccn->ccn_sendq_bytes > ccn->ccn_sendq_ctl_bytes;
+
+	if (ccn->ccn_sendq_partial) {
+		return (ccn->ccn_sendq_cur);
+	}
+
+	if (ccn->ccn_sendq_cur == &ccn->ccn_sendq &&
+	    !cconn_sendq_at_mark(ccn)) {
+		return (others ? &ccn->ccn_sendq : NULL);
+	}
+
+	if (ccn->ccn_sendq_ctl_bytes == 0 || (others &&
+	    ccn->ccn_sendq_ctl_run >= CCONN_CTL_BURST)) {
+		ccn->ccn_sendq_ctl_run = 0;
+		ccn->ccn_sendq_cur = &ccn->ccn_sendq;
+	} else {
+		ccn->ccn_sendq_cur = &ccn->ccn_sendq_ctl;
+	}
+
+	return (ccn->ccn_sendq_cur);
+}
+
+/*
+ * Account for "actual" bytes written from "q".  Control messages never span
+ * buffers, so a write from the control queue that ends part of the way
+ * through a buffer must be followed by the rest of it.
+ */
+static void
+cconn_sendq_wrote(cconn_t *ccn, cbufq_t *q, size_t actual)
+{
+	cbuf_t *cbuf;
+
+	cconn_sendq_remove(ccn, actual);
+	if (q == &ccn->ccn_sendq) {
+		ccn->ccn_sendq_out += actual;
+		while (ccn->ccn_sendq_nmarks > 0 &&
+		    ccn->ccn_sendq_marks[ccn->ccn_sendq_mark0] <
+		    ccn->ccn_sendq_out) {
+			ccn->ccn_sendq_mark0 = (ccn->ccn_sendq_mark0 + 1) %
+			    CCONN_SENDQ_MARKS;
+			ccn->ccn_sendq_nmarks--;
+		}
+		ccn->ccn_sendq_partial = B_FALSE;
+		return;
+	}
+
+	VERIFY3U(ccn->ccn_sendq_ctl_bytes, >=, actual);
+	ccn->ccn_sendq_ctl_bytes -= actual;
+	if (ccn->ccn_sendq_bytes > ccn->ccn_sendq_ctl_bytes) {
+		ccn->ccn_sendq_ctl_run += actual;
+	}
+
+	for (cbuf = cbufq_first(q); cbuf != NULL &&
+	    cbuf_available(cbuf) == 0; cbuf = cbufq_next(q, cbuf)) {
+		continue;
+	}
+	ccn->ccn_sendq_partial = cbuf != NULL && cbuf_position(cbuf) > 0 ?
+	    B_TRUE : B_FALSE;
+}
+
+/*
+ * Write out as much of the send queue as the socket will take, followed by a
+ * FIN if the consumer has finished sending.  The caller must hold the
+ * connection.
+ */
+static void
+cconn_flush(cconn_t *ccn)
+{
+	cloop_ent_t *clent = ccn->ccn_clent;
+	cbufq_t *q;
+	size_t actual;
+
+	VERIFY3U(ccn->ccn_holds, >, 0);
+
+	if (clent == NULL || ccn->ccn_state == CCONN_ST_CLOSED ||
+	    ccn->ccn_state == CCONN_ST_CONNECTING ||
+	    ccn->ccn_state == CCONN_ST_HANDSHAKE || ccn->ccn_sendq_flushed) {
+		return;
+	}
+
+	if (ccn->ccn_zout_failed) {
+		warnx("CCONN[%p] compression failed", ccn);
+		cconn_advance_state(ccn, CCONN_ST_ERROR);
+		return;
+	}
+
+	if (ccn->ccn_cork > 0 && !ccn->ccn_sendq_end &&
+	    ccn->ccn_sendq_bytes < CCONN_CORK_BATCH) {
+		/*
+		 * Wait for more data, or for the cork to be removed.
+		 */
+		return;
+	}
+
+	while (ccn->ccn_sendq_bytes > 0) {
+		if ((q = cconn_sendq_pick(ccn)) == NULL) {
+			/*
+			 * Control messages must wait for the rest of a
+			 * corked message to be sent.
+			 */
+			cloop_ent_unwant(clent, CLOOP_CB_WRITE);
+			goto out;
+		}
+		ccn->ccn_stats.ccs_syscalls++;
+		if (cconn_write(ccn, q, q == &ccn->ccn_sendq ?
+		    cconn_sendq_want(ccn) : CBUF_SYSREAD_ENTIRE,
+		    &actual) != 0) {
+			switch (errno) {
+			case EINTR:
+				continue;
+
+			case EAGAIN:
+				/*
+				 * The TLS library must be offered the same
+				 * data again.
+				 */
+				if (ccn->ccn_tls != NULL) {
+					ccn->ccn_sendq_partial = B_TRUE;
+				}
+				cloop_ent_want(clent, CLOOP_CB_WRITE);
+				goto out;
+
+			case ECONNRESET:
+				if (cserver_debug) {
+					fprintf(stderr, "CCONN[%p] "
+					    "ECONNRESET\n", ccn);
+				}
+				return;
+
+			default:
+				/*
+				 * Reading from a file-backed buffer can fail
+				 * for reasons that have nothing to do with
+				 * the socket.
+				 */
+				warn("cbufq_sys_write");
+				cconn_advance_state(ccn, CCONN_ST_ERROR);
+				return;
+			}
+		}
+
+		if (cserver_debug) {
+			fprintf(stderr, "CCONN[%p] WROTE %u BYTES\n", ccn,
+			    actual);
+		}
+		ccn->ccn_stats.ccs_bytes_out += actual;
+		cconn_sendq_wrote(ccn, q, actual);
+	}
+
+#ifdef	CCONN_HAVE_SPLICE
+	/*
+	 * Data relayed to us through a pipe follows whatever was queued
+	 * before it.
+	 */
+	if (ccn->ccn_relay != NULL && ccn->ccn_relay->ccn_relay_piped > 0) {
+		cconn_t *src = ccn->ccn_relay;
+
+		cconn_hold(src);
+		cconn_relay_splice_out(src);
+		cconn_rele(src);
+		if (ccn->ccn_state == CCONN_ST_CLOSED) {
+			return;
+		}
+		if (ccn->ccn_relay != NULL &&
+		    ccn->ccn_relay->ccn_relay_piped > 0) {
+			goto out;
+		}
+	}
+#endif
+
+	/*
+	 * Everything has been written, so there is no need to wait for the
+	 * socket to become writable.
+	 */
+	cloop_ent_unwant(clent, CLOOP_CB_WRITE);
+
+	if (ccn->ccn_sendq_end) {
+		/*
+		 * The outbound queue is empty _and_ we have no more data to
+		 * send.  Proceed with a FIN.
+		 */
+		if (ccn->ccn_tls != NULL) {
+			ctls_close_notify(ccn->ccn_tls);
+		}
+		ccn->ccn_stats.ccs_syscalls++;
+		if (shutdown(cloop_ent_fd(clent), SHUT_WR) != 0) {
+			warn("shutdown(SHUT_WR)");
+			cconn_advance_state(ccn, CCONN_ST_ERROR);
+			return;
+		}
+		ccn->ccn_sendq_flushed = B_TRUE;
+
+		if (ccn->ccn_state == CCONN_ST_READ_EOF) {
+			/*
+			 * If the read side has already shut down,
+			 * we can close the whole connection now.
+			 */
+			cconn_advance_state(ccn, CCONN_ST_CLOSED);
+		}
+		return;
+	}
+
+out:
+	cconn_relay_resume(ccn);
+	if (cconn_sendq_drained(ccn) && ccn->ccn_on_drain != NULL) {
+		ccn->ccn_on_drain(ccn, CCONN_CB_DRAIN);
+	}
+}
+
+void
+cconn_on_write(cloop_ent_t *clent, int ev)
+{
+	cconn_t *ccn = cloop_ent_data(clent);
+	hrtime_t start;
+
+	VERIFY(ev == CLOOP_CB_WRITE);
+
+	if (cserver_debug) {
+		fprintf(stderr, "CCONN[%p] WRITE DATA\n", ccn);
+	}
+
+	start = gethrtime();
+	cconn_hold(ccn);
+	if (ccn->ccn_state == CCONN_ST_CONNECTING) {
+		cconn_connect_done(ccn);
+	} else if (ccn->ccn_state == CCONN_ST_HANDSHAKE) {
+		cconn_tls_handshake(ccn);
+	} else if (ccn->ccn_tls != NULL && ctls_pending(ccn->ccn_tls) > 0) {
+		/*
+		 * See cconn_want_read().
+		 */
+		cconn_read(ccn);
+	}
+	cconn_flush(ccn);
+	ccn->ccn_stats.ccs_busy += gethrtime() - start;
+	cconn_rele(ccn);
+}
+
+/*
+ * Obtain a receive buffer sized for the traffic we have been seeing on this
+ * connection.  If the last read filled its buffer, the sender is likely
+ * streaming, so we ask the kernel how much data is waiting and size the
+ * buffer to take all of it in one read.
+ */
+static int
+cconn_buf_get(size_t sz, cbuf_t **cbufp)
+{
+	if (cconn_pool == NULL && cbuf_pool_alloc(&cconn_pool,
+	    CCONN_RECV_BUFSZ_MIN, CCONN_RECV_BUFSZ_MAX,
+	    CCONN_POOL_MAX_CACHED) != 0) {
+		return (cbuf_alloc(cbufp, sz));
+	}
+
+	return (cbuf_pool_get(cconn_pool, sz, cbufp));
+}
+
+static int
+cconn_recv_buf_alloc(cconn_t *ccn, size_t queued, cbuf_t **cbufp)
+{
+	size_t sz = ccn->ccn_recv_bufsz;
+	int pending;
+
+	if (ccn->ccn_recv_bulk) {
+		ccn->ccn_stats.ccs_syscalls++;
+		if (ioctl(cloop_ent_fd(ccn->ccn_clent), FIONREAD,
+		    &pending) == 0 && (size_t)pending > sz) {
+			sz = (size_t)pending;
+			if (sz > CCONN_RECV_BUFSZ_MAX) {
+				sz = CCONN_RECV_BUFSZ_MAX;
+			}
+		}
+	}
+
+	if (ccn->ccn_recv_max != 0 && sz > ccn->ccn_recv_max - queued) {
+		sz = ccn->ccn_recv_max - queued;
+	}
+
+	return (cconn_buf_get(sz, cbufp));
+}
+
+/*
+ * Record how long received data waited in the socket before we read it.
+ */
+static void
+cconn_rxdelay(cconn_t *ccn, const struct timespec *rxtime)
+{
+	struct timespec now;
+	int64_t delay;
+
+	if ((rxtime->tv_sec == 0 && rxtime->tv_nsec == 0) ||
+	    clock_gettime(CLOCK_REALTIME, &now) != 0) {
+		return;
+	}
+
+	/*
+	 * The clock may have been stepped back in the meantime.
+	 */
+	delay = (int64_t)(now.tv_sec - rxtime->tv_sec) * 1000000000LL +
+	    (now.tv_nsec - rxtime->tv_nsec);
+	cloop_rxdelay_record(ccn->ccn_clent->clent_loop,
+	    delay > 0 ? (uint64_t)delay : 0);
+}
+
+static void
+cconn_read(cconn_t *ccn)
+{
+	cloop_ent_t *clent = ccn->ccn_clent;
+	cbufq_t *q = &ccn->ccn_recvq;
+	size_t *qbytes = &ccn->ccn_recvq_bytes;
+	cbuf_t *cbuf = NULL;
+	size_t actual = 0;
+	size_t want;
+	boolean_t new_cbuf = B_FALSE;
+	boolean_t reset = B_FALSE;
+	struct timespec rxtime;
+
+	/*
+	 * Compressed data is read into a queue of its own, and is subject to
+	 * the same limit.
+	 */
+	if (CCONN_ZIN(ccn)) {
+		q = ccn->ccn_zrecvq;
+		qbytes = &ccn->ccn_zrecvq_bytes;
+	}
+
+#ifdef	CCONN_HAVE_SPLICE
+	if (ccn->ccn_relay_splice) {
+		cconn_relay_splice_in(ccn);
+		return;
+	}
+#endif
+
+	if (ccn->ccn_recv_max != 0 && *qbytes >= ccn->ccn_recv_max) {
+		/*
+		 * The receive queue is full.  We will ask for more data once
+		 * the consumer has made some progress.
+		 */
+		return;
+	}
+
+	/*
+	 * Check to see if we have space in the tail of the buffer queue.  If
+	 * the consumer is looking at a frame, that buffer may not be
+	 * compacted, so we must leave it alone.
+	 */
+	if ((q != &ccn->ccn_recvq ||
+	    ccn->ccn_state != CCONN_ST_LINE_AVAILABLE) &&
+	    (cbuf = cbufq_peek_tail(q)) != NULL &&
+	    cbuf_unused(cbuf) > 64) {
+		cbuf_resume(cbuf);
+		VERIFY(cbuf_available(cbuf) > 64);
+	} else {
+		/*
+		 * Allocate a new buffer:
+		 */
+		new_cbuf = B_TRUE;
+		if (cconn_recv_buf_alloc(ccn, *qbytes, &cbuf) != 0) {
+			err(1, "cconn_recv_buf_alloc");
+		}
+	}
+
+	/*
+	 * Read no more than will fit within the receive queue limit.
+	 */
+	want = cbuf_available(cbuf);
+	if (ccn->ccn_recv_max != 0 && want > ccn->ccn_recv_max - *qbytes) {
+		want = ccn->ccn_recv_max - *qbytes;
+	}
+
+retry:
+	ccn->ccn_stats.ccs_syscalls++;
+	if ((ccn->ccn_tls != NULL ? ctls_read(ccn->ccn_tls, cbuf, want,
+	    &actual) : ccn->ccn_timestamp ? cbuf_sys_recv(cbuf,
+	    cloop_ent_fd(clent), want, &actual, &rxtime) :
+	    cbuf_sys_read(cbuf, cloop_ent_fd(clent), want, &actual)) != 0) {
+		switch (errno) {
+		case EINTR:
+			goto retry;
+
+		case EAGAIN:
+			cloop_ent_want(clent, CLOOP_CB_READ);
+			goto out;
+
+		case ECONNRESET:
+			/*
+			 * The buffer may belong to the receive queue, so we
+			 * must put it back before tearing down the connection.
+			 */
+			reset = B_TRUE;
+			goto out;
+
+		default:
+			err(1, "cbuf_sys_read");
+		}
+	} else if (actual == 0) {
+		/*
+		 * Mark the receive queue as finished.  We will transition
+		 * to EOF once the line handling function has run out of
+		 * data.
+		 */
+		ccn->ccn_recvq_end = B_TRUE;
+		if (cserver_debug) {
+			fprintf(stderr, "CCONN[%p] READ EOF\n", ccn);
+		}
+	} else if (cserver_debug) {
+		fprintf(stderr, "CCONN[%p] READ %u BYTES\n", ccn, actual);
+	}
+	if (actual > 0 && ccn->ccn_timestamp && ccn->ccn_tls == NULL) {
+		cconn_rxdelay(ccn, &rxtime);
+	}
+	*qbytes += actual;
+	ccn->ccn_stats.ccs_bytes_in += actual;
+	if (*qbytes > ccn->ccn_stats.ccs_recvq_max) {
+		ccn->ccn_stats.ccs_recvq_max = *qbytes;
+	}
+
+	/*
+	 * Adjust the size of the next receive buffer based on how much of
+	 * this one we were able to fill.
+	 */
+	if (actual == want) {
+		ccn->ccn_recv_bulk = B_TRUE;
+		if (ccn->ccn_recv_bufsz < CCONN_RECV_BUFSZ_MAX) {
+			ccn->ccn_recv_bufsz *= 2;
+		}
+	} else {
+		ccn->ccn_recv_bulk = B_FALSE;
+		if (actual < ccn->ccn_recv_bufsz / 4 &&
+		    ccn->ccn_recv_bufsz > CCONN_RECV_BUFSZ_MIN) {
+			ccn->ccn_recv_bufsz /= 2;
+		}
+	}
+
+	cbuf_flip(cbuf);
+	if (new_cbuf) {
+		if (actual == 0) {
+			cbuf_free(cbuf);
+		} else {
+			cbufq_enq(q, cbuf);
+		}
+	}
+
+	/*
+	 * Handle any new data that has arrived:
+	 */
+	ccn_handle_incoming_data(ccn);
+	return;
+
+out:
+	if (new_cbuf) {
+		cbuf_free(cbuf);
+	} else {
+		cbuf_flip(cbuf);
+	}
+
+	if (reset) {
+		cconn_advance_state(ccn, CCONN_ST_ERROR);
+	}
+}
+
+void
+cconn_on_read(cloop_ent_t *clent, int ev)
+{
+	cconn_t *ccn = cloop_ent_data(clent);
+	hrtime_t start;
+
+	VERIFY(ev == CLOOP_CB_READ);
+
+	if (cserver_debug) {
+		fprintf(stderr, "CCONN[%p] READ DATA\n", ccn);
+	}
+
+	start = gethrtime();
+	cconn_hold(ccn);
+	if (ccn->ccn_state == CCONN_ST_HANDSHAKE) {
+		cconn_tls_handshake(ccn);
+	} else {
+		cconn_read(ccn);
+	}
+
+	/*
+	 * Anything the consumer queued while handling this data can most
+	 * likely be written now, without another trip through the event loop.
+	 */
+	cconn_flush(ccn);
+	ccn->ccn_stats.ccs_busy += gethrtime() - start;
+	cconn_rele(ccn);
+}
+
+static uint64_t
+cconn_hash_u64(uint64_t v)
+{
+	v ^= v >> 33;
+	v *= 0xff51afd7ed558ccdULL;
+	v ^= v >> 33;
+	return (v);
+}
+
+static uint64_t
+cconn_id_hash(cconn_t *ccn)
+{
+	return (cconn_hash_u64(ccn->ccn_id));
+}
+
+static uint64_t
+cconn_addr_key_hash(const cconn_addr_key_t *cak)
+{
+	const uint8_t *p = (const uint8_t *)cak;
+	uint64_t h = 0xcbf29ce484222325ULL;
+
+	/*
+	 * FNV-1a.
+	 */
+	for (size_t i = 0; i < sizeof (*cak); i++) {
+		h ^= p[i];
+		h *= 0x100000001b3ULL;
+	}
+	return (h);
+}
+
+static uint64_t
+cconn_addr_hash(cconn_t *ccn)
+{
+	return (cconn_addr_key_hash(&ccn->ccn_addr_key));
+}
+
+static int
+cconn_addr_key(const struct sockaddr *sa, socklen_t len,
+    cconn_addr_key_t *cak)
+{
+	const struct sockaddr_in *sin = (const struct sockaddr_in *)sa;
+	const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *)sa;
+
+	bzero(cak, sizeof (*cak));
+
+	if (sa->sa_family == AF_INET && len >= sizeof (*sin)) {
+		cak->cak_family = AF_INET;
+		cak->cak_port = sin->sin_port;
+		bcopy(&sin->sin_addr, cak->cak_addr, sizeof (sin->sin_addr));
+		return (0);
+	}
+
+	if (sa->sa_family == AF_INET6 && len >= sizeof (*sin6)) {
+		cak->cak_port = sin6->sin6_port;
+		if (IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr)) {
+			cak->cak_family = AF_INET;
+			bcopy(&sin6->sin6_addr.s6_addr[12], cak->cak_addr, 4);
+		} else {
+			cak->cak_family = AF_INET6;
+			bcopy(&sin6->sin6_addr, cak->cak_addr, 16);
+		}
+		return (0);
+	}
+
+	/*
+	 * Unix domain peers are generally unnamed, so there is nothing
+	 * useful to index.
+	 */
+	errno = EAFNOSUPPORT;
+	return (-1);
+}
+
+#define	CCONN_HT_NEXT(cht, ccn)	\
+	(*(cconn_t **)((uintptr_t)(ccn) + (cht)->cht_off))
+
+static int
+cconn_htable_init(cconn_htable_t *cht, size_t off,
+    uint64_t (*hash)(cconn_t *))
+{
+	if ((cht->cht_buckets = calloc(CCONN_HT_MIN,
+	    sizeof (cconn_t *))) == NULL) {
+		return (-1);
+	}
+	cht->cht_nbuckets = CCONN_HT_MIN;
+	cht->cht_count = 0;
+	cht->cht_off = off;
+	cht->cht_hash = hash;
+	return (0);
+}
+
+static cconn_t **
+cconn_htable_bucket(cconn_htable_t *cht, uint64_t h)
+{
+	return (&cht->cht_buckets[h & (cht->cht_nbuckets - 1)]);
+}
+
+static void
+cconn_htable_resize(cconn_htable_t *cht, size_t nbuckets)
+{
+	cconn_t **obuckets = cht->cht_buckets;
+	size_t onbuckets = cht->cht_nbuckets;
+
+	if ((cht->cht_buckets = calloc(nbuckets, sizeof (cconn_t *))) == NULL) {
+		/*
+		 * We can carry on with longer chains.
+		 */
+		cht->cht_buckets = obuckets;
+		return;
+	}
+	cht->cht_nbuckets = nbuckets;
+
+	for (size_t i = 0; i < onbuckets; i++) {
+		cconn_t *ccn, *next;
+
+		for (ccn = obuckets[i]; ccn != NULL; ccn = next) {
+			cconn_t **chain = cconn_htable_bucket(cht,
+			    cht->cht_hash(ccn));
+
+			next = CCONN_HT_NEXT(cht, ccn);
+			CCONN_HT_NEXT(cht, ccn) = *chain;
+			*chain = ccn;
+		}
+	}
+	free(obuckets);
+}
+
+static void
+cconn_htable_insert(cconn_htable_t *cht, cconn_t *ccn)
+{
+	cconn_t **chain;
+
+	if (cht->cht_count >= cht->cht_nbuckets * 2) {
+		cconn_htable_resize(cht, cht->cht_nbuckets * 2);
+	}
+
+	chain = cconn_htable_bucket(cht, cht->cht_hash(ccn));
+	CCONN_HT_NEXT(cht, ccn) = *chain;
+	*chain = ccn;
+	cht->cht_count++;
+}
+
+static void
+cconn_htable_remove(cconn_htable_t *cht, cconn_t *ccn)
+{
+	cconn_t **pp = cconn_htable_bucket(cht, cht->cht_hash(ccn));
+
+	while (*pp != ccn) {
+		VERIFY(*pp != NULL);
+		pp = &CCONN_HT_NEXT(cht, *pp);
+	}
+	*pp = CCONN_HT_NEXT(cht, ccn);
+	CCONN_HT_NEXT(cht, ccn) = NULL;
+	cht->cht_count--;
+}
+
+static void
+cconn_destroy(cconn_t *ccn)
+{
+	int e = errno;
+
+	if (ccn == NULL)
+		return;
+
+	/*
+	 * The connection can no longer be looked up, but it remains on the
+	 * server's list until the last hold is released, so that a walk
+	 * holding it can move on to the next connection.
+	 */
+	if (ccn->ccn_indexed) {
+		cconn_htable_remove(&ccn->ccn_server->csrv_by_id, ccn);
+		ccn->ccn_indexed = B_FALSE;
+	}
+	if (ccn->ccn_addr_indexed) {
+		cconn_htable_remove(&ccn->ccn_server->csrv_by_addr, ccn);
+		ccn->ccn_addr_indexed = B_FALSE;
+	}
+
+	cconn_relay_break(ccn);
+
+	if (ccn->ccn_holds > 0) {
+		ccn->ccn_destroy_deferred = B_TRUE;
+		errno = e;
+		return;
+	}
+
+	if (ccn->ccn_server != NULL) {
+		cconn_sendq_remove(ccn, ccn->ccn_sendq_bytes);
+		list_remove(&ccn->ccn_server->csrv_connections, ccn);
+		ccn->ccn_server = NULL;
+	}
+
+	/*
+	 * Each deferred request holds the connection.
+	 */
+	VERIFY(list_is_empty(&ccn->ccn_reqs));
+	list_destroy(&ccn->ccn_reqs);
+
+	ctls_free(ccn->ccn_tls);
+	cdeflate_free(ccn->ccn_zout);
+	cdeflate_free(ccn->ccn_zin);
+	cbufq_free(ccn->ccn_zrecvq);
+	cbuf_free(ccn->ccn_zstage);
+	cbufq_fini(&ccn->ccn_recvq);
+	cbufq_fini(&ccn->ccn_sendq);
+	cbufq_fini(&ccn->ccn_sendq_ctl);
+	custr_free(ccn->ccn_input);
+
+	/*
+	 * If the event loop is still dispatching an event for the entity, the
+	 * object is freed when the loop releases it.
+	 */
+	cloop_ent_free(ccn->ccn_clent);
+	ccn->ccn_clent = NULL;
+	if (ccn->ccn_ent_busy) {
+		ccn->ccn_free_pending = B_TRUE;
+	} else {
+		umem_cache_free(cconn_cache, ccn);
+	}
+
+	errno = e;
+}
+
+static void
+cconn_ent_release(cloop_ent_t *clent)
+{
+	cconn_t *ccn = cloop_ent_data(clent);
+
+	VERIFY3P(clent, ==, &ccn->ccn_ent);
+	ccn->ccn_ent_busy = B_FALSE;
+	if (ccn->ccn_free_pending) {
+		umem_cache_free(cconn_cache, ccn);
+	}
+}
+
+static int
+cconn_alloc(cconn_t **ccnp)
+{
+	cconn_t *ccn = NULL;
+
+	if (cconn_cache == NULL && (cconn_cache = umem_cache_create("cconn",
+	    sizeof (cconn_t), CCONN_ALIGN, NULL, NULL, NULL, NULL, NULL,
+	    0)) == NULL) {
+		return (-1);
+	}
+
+	if ((ccn = umem_cache_alloc(cconn_cache, UMEM_DEFAULT)) == NULL) {
+		errno = ENOMEM;
+		return (-1);
+	}
+	bzero(ccn, sizeof (*ccn));
+
+	cloop_ent_init(&ccn->ccn_ent, cconn_ent_release);
+	ccn->ccn_ent_busy = B_TRUE;
+	cbufq_init(&ccn->ccn_recvq);
+	cbufq_init(&ccn->ccn_sendq);
+	cbufq_init(&ccn->ccn_sendq_ctl);
+	ccn->ccn_sendq_cur = &ccn->ccn_sendq;
+
+	/*
+	 * Link the cloop entity and the connection object.
+	 */
+	ccn->ccn_clent = &ccn->ccn_ent;
+	cloop_ent_data_set(ccn->ccn_clent, ccn);
+	list_create(&ccn->ccn_reqs, sizeof (cconn_req_t),
+	    offsetof(cconn_req_t, ccr_link));
+
+	/*
+	 * Install the appropriate cloop entity event callbacks.
+	 */
+	cloop_ent_on(ccn->ccn_clent, CLOOP_CB_HANGUP, cconn_on_hangup);
+	cloop_ent_on(ccn->ccn_clent, CLOOP_CB_READ, cconn_on_read);
+	cloop_ent_on(ccn->ccn_clent, CLOOP_CB_WRITE, cconn_on_write);
+	cloop_ent_on(ccn->ccn_clent, CLOOP_CB_ERROR, cconn_on_error);
+
+	/*
+	 * Set the connection to the pre-connection state:
+	 */
+	ccn->ccn_state = CCONN_ST_PRE_CONNECTION;
+	ccn->ccn_id = cconn_next_id++;
+	ccn->ccn_recv_bufsz = CCONN_RECV_BUFSZ_MIN;
+	cconn_framing_newline(ccn);
+
+	*ccnp = ccn;
+	return (0);
+}
+
+int
+cserver_opts_profile(cserver_opts_t *opts, cserver_profile_t profile)
+{
+	bzero(opts, sizeof (*opts));
+	opts->cso_backlog = CSERVER_BACKLOG;
+	opts->cso_keepalive = B_TRUE;
+	opts->cso_keepidle = CSERVER_KEEPIDLE;
+	opts->cso_keepcnt = CSERVER_KEEPCNT;
+	opts->cso_keepintvl = CSERVER_KEEPINTVL;
+
+	switch (profile) {
+	case CSERVER_PROFILE_DEFAULT:
+		return (0);
+
+	case CSERVER_PROFILE_LOW_LATENCY:
+		opts->cso_nodelay = B_TRUE;
+		opts->cso_notsent_lowat = CSERVER_LOWLAT_NOTSENT;
+		opts->cso_fastopen = CSERVER_LOWLAT_FASTOPEN;
+		opts->cso_user_timeout = CSERVER_LOWLAT_TIMEOUT;
+		return (0);
+
+	case CSERVER_PROFILE_BULK:
+		opts->cso_rcvbuf = CSERVER_BULK_BUFSZ;
+		opts->cso_sndbuf = CSERVER_BULK_BUFSZ;
+		return (0);
+
+	default:
+		errno = EINVAL;
+		return (-1);
+	}
+}
+
+void
+cserver_opts_get(cserver_t *csrv, cserver_opts_t *opts)
+{
+	*opts = csrv->csrv_opts;
+}
+
+int
+cserver_opts_set(cserver_t *csrv, const cserver_opts_t *opts)
+{
+	if (opts->cso_backlog < 0 || opts->cso_rcvbuf < 0 ||
+	    opts->cso_sndbuf < 0 || opts->cso_keepidle < 0 ||
+	    opts->cso_keepcnt < 0 || opts->cso_keepintvl < 0 ||
+	    opts->cso_notsent_lowat < 0 || opts->cso_defer_accept < 0 ||
+	    opts->cso_fastopen < 0 || opts->cso_user_timeout < 0) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	csrv->csrv_opts = *opts;
+	return (0);
+}
+
+static void
+cserver_sockopt(int fd, int level, int opt, int val)
+{
+	(void) setsockopt(fd, level, opt, &val, sizeof (val));
+}
+
+/*
+ * Apply the options that belong on a listen socket.  Connections inherit
+ * their buffer sizes from it, and the receive buffer must be sized before
+ * listen(3SOCKET) for the TCP window scale to take account of it.
+ */
+static void
+cserver_opts_listen(const cserver_opts_t *opts, int sock, boolean_t tcp)
+{
+	if (opts->cso_rcvbuf != 0) {
+		cserver_sockopt(sock, SOL_SOCKET, SO_RCVBUF, opts->cso_rcvbuf);
+	}
+	if (opts->cso_sndbuf != 0) {
+		cserver_sockopt(sock, SOL_SOCKET, SO_SNDBUF, opts->cso_sndbuf);
+	}
+
+	if (!tcp) {
+		return;
+	}
+#ifdef	TCP_DEFER_ACCEPT
+	if (opts->cso_defer_accept != 0) {
+		cserver_sockopt(sock, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+		    opts->cso_defer_accept);
+	}
+#endif
+#ifdef	TCP_FASTOPEN
+	if (opts->cso_fastopen != 0) {
+		cserver_sockopt(sock, IPPROTO_TCP, TCP_FASTOPEN,
+		    opts->cso_fastopen);
+	}
+#endif
+}
+
+/*
+ * The backlog to pass to listen(3SOCKET).  As for the other options, zero
+ * means the system default, which listen() itself would take as a queue of
+ * no length at all.
+ */
+static int
+cserver_opts_backlog(const cserver_opts_t *opts)
+{
+	return (opts->cso_backlog != 0 ? opts->cso_backlog : SOMAXCONN);
+}
+
+/*
+ * Apply the per-connection options to a TCP socket.  Only a failure to
+ * enable keepalives is reported, as the others are merely tuning.
+ */
+static int
+cconn_opts_apply(cconn_t *ccn, const cserver_opts_t *opts, int fd)
+{
+	if (opts->cso_keepalive) {
+		int opt_on = 1;
+
+		if (setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &opt_on,
+		    sizeof (opt_on)) != 0) {
+			return (-1);
+		}
+		if (opts->cso_keepidle != 0) {
+			cserver_sockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE,
+			    opts->cso_keepidle);
+		}
+		if (opts->cso_keepcnt != 0) {
+			cserver_sockopt(fd, IPPROTO_TCP, TCP_KEEPCNT,
+			    opts->cso_keepcnt);
+		}
+		if (opts->cso_keepintvl != 0) {
+			cserver_sockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL,
+			    opts->cso_keepintvl);
+		}
+	}
+
+	if (opts->cso_nodelay) {
+		cserver_sockopt(fd, IPPROTO_TCP, TCP_NODELAY, 1);
+		ccn->ccn_nodelay = B_TRUE;
+	}
+#ifdef	TCP_NOTSENT_LOWAT
+	if (opts->cso_notsent_lowat != 0) {
+		cserver_sockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT,
+		    opts->cso_notsent_lowat);
+	}
+#endif
+#ifdef	TCP_USER_TIMEOUT
+	if (opts->cso_user_timeout != 0) {
+		cserver_sockopt(fd, IPPROTO_TCP, TCP_USER_TIMEOUT,
+		    opts->cso_user_timeout);
+	}
+#endif
+#ifdef	SO_TIMESTAMPNS
+	if (opts->cso_timestamp) {
+		int opt_on = 1;
+
+		ccn->ccn_timestamp = setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS,
+		    &opt_on, sizeof (opt_on)) == 0 ? B_TRUE : B_FALSE;
+	}
+#endif
+	return (0);
+}
+
+static int
+cserver_hs_expire(cconn_t *ccn, void *arg)
+{
+	hrtime_t now = *(hrtime_t *)arg;
+
+	if (ccn->ccn_state == CCONN_ST_HANDSHAKE && now - ccn->ccn_accepted >
+	    (hrtime_t)CCONN_HANDSHAKE_TIMEOUT * NANOSEC) {
+		if (cserver_debug) {
+			fprintf(stderr, "HANDSHAKE TIMEOUT (%s)\n",
+			    cconn_remote_addr_str(ccn));
+		}
+		(void) cconn_abort(ccn);
+	}
+	return (0);
+}
+
+static void
+cserver_on_hs_timer(cloop_ent_t *clent, int event)
+{
+	cserver_t *csrv = cloop_ent_data(clent);
+	hrtime_t now = gethrtime();
+
+	(void) cserver_walk(csrv, cserver_hs_expire, &now);
+}
+
+/*
+ * Start the timer that disconnects TLS clients which stall in the
+ * handshake, if it is not already running.
+ */
+static int
+cserver_hs_timer_start(cserver_t *csrv)
+{
+	cloop_ent_t *clent;
+
+	if (csrv->csrv_hs_timer != NULL) {
+		return (0);
+	}
+
+	if (cloop_ent_alloc(&clent) != 0) {
+		return (-1);
+	}
+	cloop_ent_data_set(clent, csrv);
+	cloop_ent_on(clent, CLOOP_CB_TIMER, cserver_on_hs_timer);
+	if (cloop_attach_ent_timer(csrv->csrv_loop, clent, 1) != 0) {
+		int e = errno;
+
+		cloop_ent_free(clent);
+		errno = e;
+		return (-1);
+	}
+
+	csrv->csrv_hs_timer = clent;
+	return (0);
+}
+
+int
+cserver_accept(cserver_t *csrv, cconn_t **ccnp)
+{
+	cconn_t *ccn = NULL;
+	socklen_t sz;
+	int e;
+	int fd;
+
+	if (csrv->csrv_type != CSERVER_TYPE_TCP &&
+	    csrv->csrv_type != CSERVER_TYPE_UNIX) {
+		*ccnp = NULL;
+		errno = EINVAL;
+		return (-1);
+	}
+
+	if (cconn_alloc(&ccn) != 0) {
+		*ccnp = NULL;
+		return (-1);
+	}
+
+	sz = sizeof (ccn->ccn_remote_addr);
+retry:
+	if ((fd = accept4(cloop_ent_fd(csrv->csrv_listen),
+	    (struct sockaddr *)&ccn->ccn_remote_addr, &sz,
+	    SOCK_CLOEXEC | SOCK_NONBLOCK)) < 0) {
+		switch (errno) {
+		case EINTR:
+			goto retry;
+
+		case ECONNABORTED:
+		case EWOULDBLOCK:
+			/*
+			 * Not actionable.  Back to sleep.
+			 */
+			e = EWOULDBLOCK;
+			cloop_ent_want(csrv->csrv_listen, CLOOP_CB_READ);
+			goto fail;
+
+		default:
+			err(1, "accept4");
+		}
+	}
+
+	/*
+	 * Set socket options.  These are only meaningful for TCP.
+	 */
+	if (csrv->csrv_type == CSERVER_TYPE_TCP &&
+	    cconn_opts_apply(ccn, &csrv->csrv_opts, fd) != 0) {
+		e = errno;
+		warn("could not set SO_KEEPALIVE");
+		VERIFY0(close(fd));
+		goto fail;
+	}
+
+	if (csrv->csrv_tls != NULL && ctls_alloc(&ccn->ccn_tls,
+	    csrv->csrv_tls, fd) != 0) {
+		e = errno;
+		warn("could not create TLS session");
+		VERIFY0(close(fd));
+		goto fail;
+	}
+
+	if (ccn->ccn_tls != NULL && cserver_hs_timer_start(csrv) != 0) {
+		e = errno;
+		warn("could not start the handshake timer");
+		VERIFY0(close(fd));
+		goto fail;
+	}
+	ccn->ccn_accepted = gethrtime();
+
+	/*
+	 * We want to be notified when there are more incoming connections.
+	 */
+	cloop_ent_want(csrv->csrv_listen, CLOOP_CB_READ);
+
+	/*
+	 * Link this connection into the server connection list:
+	 */
+	ccn->ccn_server = csrv;
+	list_insert_tail(&csrv->csrv_connections, ccn);
+	cconn_htable_insert(&csrv->csrv_by_id, ccn);
+	ccn->ccn_indexed = B_TRUE;
+	if (cconn_addr_key((struct sockaddr *)&ccn->ccn_remote_addr, sz,
+	    &ccn->ccn_addr_key) == 0) {
+		cconn_htable_insert(&csrv->csrv_by_addr, ccn);
+		ccn->ccn_addr_indexed = B_TRUE;
+	}
+	cconn_send_watermarks_set(ccn, csrv->csrv_sendq_lowat,
+	    csrv->csrv_sendq_hiwat);
+	cconn_recv_limits_set(ccn, csrv->csrv_recv_max_line,
+	    csrv->csrv_recv_max);
+
+	/*
+	 * Attach our cloop entity to the event loop:
+	 */
+	cloop_attach_ent(csrv->csrv_loop, ccn->ccn_clent, fd);
+
+	/*
+	 * Mark this connection as waiting for incoming data, or for the TLS
+	 * handshake to begin.
+	 */
+	if (ccn->ccn_tls != NULL) {
+		cconn_advance_state(ccn, CCONN_ST_HANDSHAKE);
+	} else {
+		cconn_advance_state(ccn, CCONN_ST_WAITING_FOR_LINE);
+	}
+
+	if (cserver_debug) {
+		fprintf(stderr, "ACCEPTED (%s)\n", cconn_remote_addr_str(ccn));
+	}
+
+	*ccnp = ccn;
+	return (0);
+
+fail:
+	cconn_destroy(ccn);
+	errno = e;
+	return (-1);
+}
+
+static void
+cserver_on_incoming(cloop_ent_t *clent, int event)
+{
+	cserver_t *csrv = cloop_ent_data(clent);
+
+	VERIFY(event == CLOOP_CB_READ);
+
+
+	if (csrv->csrv_on_incoming != NULL) {
+		/*
+		 * Report a possible incoming connection to our consumer.
+		 * Note that we do not rearm for read events; this happens
+		 * in cserver_accept().
+		 */
+		csrv->csrv_on_incoming(csrv, CSERVER_CB_INCOMING);
+	} else {
+		/*
+		 * XXX Should we abort here?
+		 */
+		fprintf(stderr, "CSERVER[%p]: INCOMING WITH NO HANDLER!\n",
+		    csrv);
+		cloop_ent_want(clent, CLOOP_CB_READ);
+	}
+}
+
+/*
+ * The address is only formatted when it is first asked for, as most
+ * connections never need it.
+ */
+const char *
+cconn_remote_addr_str(cconn_t *ccn)
+{
+	if (ccn->ccn_remote_addr_str[0] == '\0' &&
+	    cconn_addr_format(&ccn->ccn_remote_addr, ccn->ccn_remote_addr_str,
+	    sizeof (ccn->ccn_remote_addr_str)) != 0) {
+		ccn->ccn_remote_addr_str[0] = '\0';
+		return (NULL);
+	}
+
+	return (ccn->ccn_remote_addr_str);
+}
+
+void
+cconn_on(cconn_t *ccn, int event, cconn_cb_t *func)
+{
+	switch ((cconn_cb_type_t) event) {
+	case CCONN_CB_LINE_AVAILABLE:
+		ccn->ccn_on_line_available = func;
+		return;
+
+	case CCONN_CB_ERROR:
+		ccn->ccn_on_error = func;
+		return;
+
+	case CCONN_CB_END:
+		ccn->ccn_on_end = func;
+		return;
+
+	case CCONN_CB_CLOSE:
+		ccn->ccn_on_close = func;
+		return;
+
+	case CCONN_CB_DRAIN:
+		ccn->ccn_on_drain = func;
+		return;
+
+	case CCONN_CB_OVERFLOW:
+		ccn->ccn_on_overflow = func;
+		return;
+
+	case CCONN_CB_CONNECTED:
+		ccn->ccn_on_connected = func;
+		return;
+	}
+
+	warnx("unknown cconn cb %d\n", event);
+	abort();
+}
+
+void
+cserver_on(cserver_t *csrv, int event, cserver_cb_t *func)
+{
+	switch (event) {
+	case CSERVER_CB_INCOMING:
+		csrv->csrv_on_incoming = func;
+		break;
+
+	case CSERVER_CB_DATAGRAM:
+		csrv->csrv_on_datagram = func;
+		break;
+
+	default:
+		warnx("unknown cserver cb %d\n", event);
+		abort();
+		break;
+	}
+}
+
+static void
+cserver_on_error(cloop_ent_t *clent, int event)
+{
+	cserver_t *csrv = cloop_ent_data(clent);
+
+	VERIFY(event == CLOOP_CB_ERROR);
+
+	/*
+	 * It's not clear why this would happen to us on a listen socket.
+	 */
+	fprintf(stderr, "CSERVER[%p]: ERROR!\n", csrv);
+	abort();
+}
+
+static void
+cserver_on_hangup(cloop_ent_t *clent, int event)
+{
+	cserver_t *csrv = cloop_ent_data(clent);
+
+	VERIFY(event == CLOOP_CB_HANGUP);
+
+	/*
+	 * It's not clear why this would happen to us on a listen socket.
+	 */
+	fprintf(stderr, "CSERVER[%p]: HANGUP!\n", csrv);
+	abort();
+}
+
+void
+cserver_free(cserver_t *csrv)
+{
+	if (csrv == NULL) {
+		return;
+	}
+
+	cserver_close(csrv);
+
+	if (csrv->csrv_active) {
+		/*
+		 * We are within a datagram callback, and the receive batch
+		 * is still in use.  cserver_on_datagrams() will free the
+		 * server once the callback returns.
+		 */
+		csrv->csrv_destroy = B_TRUE;
+		return;
+	}
+
+	cloop_ent_free(csrv->csrv_hs_timer);
+
+	/*
+	 * Destroy all connections.
+	 */
+	cconn_t *ccn;
+	while ((ccn = list_head(&csrv->csrv_connections)) != NULL) {
+		VERIFY0(ccn->ccn_holds);
+		cconn_destroy(ccn);
+	}
+	free(csrv->csrv_by_id.cht_buckets);
+	free(csrv->csrv_by_addr.cht_buckets);
+
+	cserver_dgram_batch_free(csrv->csrv_rx);
+	cserver_dgram_batch_free(csrv->csrv_tx);
+	ctls_ctx_free(csrv->csrv_tls);
+	free(csrv);
+}
+
+int
+cserver_alloc(cserver_t **csrvp)
+{
+	cserver_t *csrv = NULL;
+	cloop_ent_t *clent = NULL;
+
+	if (getenv("CSERVER_DEBUG") != NULL) {
+		cserver_debug = B_TRUE;
+	}
+
+	if ((csrv = calloc(1, sizeof (*csrv))) == NULL) {
+		return (-1);
+	}
+	csrv->csrv_type = CSERVER_TYPE_NONE;
+	csrv->csrv_sendq_hiwat = CCONN_SEND_HIWAT;
+	csrv->csrv_sendq_lowat = CCONN_SEND_LOWAT;
+	csrv->csrv_recv_max = CCONN_RECV_MAX;
+	csrv->csrv_recv_max_line = CCONN_RECV_MAX_LINE;
+	VERIFY0(cserver_opts_profile(&csrv->csrv_opts,
+	    CSERVER_PROFILE_DEFAULT));
+
+	if (cloop_ent_alloc(&clent) != 0) {
+		free(csrv);
+		return (-1);
+	}
+
+	/*
+	 * Create list of connection objects for this server:
+	 */
+	list_create(&csrv->csrv_connections, sizeof (cconn_t),
+	    offsetof(cconn_t, ccn_link));
+	if (cconn_htable_init(&csrv->csrv_by_id, offsetof(cconn_t,
+	    ccn_id_next), cconn_id_hash) != 0 ||
+	    cconn_htable_init(&csrv->csrv_by_addr, offsetof(cconn_t,
+	    ccn_addr_next), cconn_addr_hash) != 0) {
+		free(csrv->csrv_by_id.cht_buckets);
+		cloop_ent_free(clent);
+		free(csrv);
+		return (-1);
+	}
+
+	/*
+	 * Link the listen server to the cloop entity:
+	 */
+	csrv->csrv_listen = clent;
+	cloop_ent_data_set(clent, csrv);
+
+	*csrvp = csrv;
+	return (0);
+}
+
+/*
+ * Parse an IPv4 or IPv6 address.  Addresses containing a colon are taken to
+ * be IPv6.
+ */
+static int
+cserver_parse_addr(const char *ipaddr, const char *port,
+    struct sockaddr_storage *addr, socklen_t *addrlen)
+{
+	struct sockaddr_in *sin = (struct sockaddr_in *)addr;
+	struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)addr;
+	void *dst;
+	int af;
+
+	bzero(addr, sizeof (*addr));
+
+	if (strchr(ipaddr, ':') != NULL) {
+		af = AF_INET6;
+		sin6->sin6_family = AF_INET6;
+		sin6->sin6_port = htons(atoi(port));
+		dst = &sin6->sin6_addr;
+		*addrlen = sizeof (*sin6);
+	} else {
+		af = AF_INET;
+		sin->sin_family = AF_INET;
+		sin->sin_port = htons(atoi(port));
+		dst = &sin->sin_addr;
+		*addrlen = sizeof (*sin);
+	}
+
+	switch (inet_pton(af, ipaddr, dst)) {
+	case 1:
+		return (0);
+	case 0:
+		warnx("inet_pton (%s) invalid address", ipaddr);
+		errno = EPROTO;
+		return (-1);
+	default:
+		warn("inet_pton (%s) failure", ipaddr);
+		return (-1);
+	}
+}
+
+/*
+ * Complete the setup of a listening server once "sock" is bound and
+ * listening.
+ */
+static void
+cserver_listen_common(cserver_t *csrv, cloop_t *cloop, int sock,
+    cserver_type_t type)
+{
+	csrv->csrv_type = type;
+
+	/*
+	 * Register our callbacks:
+	 */
+	cloop_ent_t *clent = csrv->csrv_listen;
+	cloop_ent_on(clent, CLOOP_CB_HANGUP, cserver_on_hangup);
+	if (type == CSERVER_TYPE_UDP) {
+		cloop_ent_on(clent, CLOOP_CB_READ, cserver_on_datagrams);
+		cloop_ent_on(clent, CLOOP_CB_WRITE, cserver_on_dgram_write);
+		cloop_ent_on(clent, CLOOP_CB_ERROR, cserver_on_dgram_error);
+	} else {
+		cloop_ent_on(clent, CLOOP_CB_READ, cserver_on_incoming);
+		cloop_ent_on(clent, CLOOP_CB_ERROR, cserver_on_error);
+	}
+
+	/*
+	 * We want to be notified of incoming connections:
+	 */
+	cloop_ent_want(clent, CLOOP_CB_READ);
+
+	/*
+	 * Attach the cloop entity to the loop:
+	 */
+	csrv->csrv_loop = cloop;
+	cloop_attach_ent(cloop, clent, sock);
+}
+
+/*
+ * Create a socket of the given type and bind it to an IPv4 or IPv6 address.
+ * If no address is provided, we bind to all IPv6 and IPv4 addresses with a
+ * single dual-stack socket, or to all IPv4 addresses if the system does not
+ * support IPv6.
+ */
+static int
+cserver_bind_inet(const char *ipaddr, const char *port, int type,
+    struct sockaddr_storage *addr)
+{
+	int e;
+	int sock = -1;
+	socklen_t addrlen;
+
+	if (cserver_parse_addr(ipaddr != NULL ? ipaddr : "::", port,
+	    addr, &addrlen) != 0) {
+		e = errno;
+		warn("cserver_parse_addr failed");
+		goto fail;
+	}
+
+	if ((sock = socket(addr->ss_family, type | SOCK_NONBLOCK |
+	    SOCK_CLOEXEC, 0)) < 0 && ipaddr == NULL &&
+	    errno == EAFNOSUPPORT) {
+		VERIFY0(cserver_parse_addr("0.0.0.0", port, addr, &addrlen));
+		sock = socket(AF_INET, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	}
+	if (sock < 0) {
+		e = errno;
+		warn("socket failed");
+		goto fail;
+	}
+
+	/*
+	 * Set socket options.
+	 */
+	int opt_on = 1;
+	if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt_on,
+	    sizeof (opt_on)) != 0) {
+		e = errno;
+		warn("could not set SO_REUSEADDR");
+		goto fail;
+	}
+
+	if (addr->ss_family == AF_INET6) {
+		/*
+		 * Accept IPv4 traffic as well, with IPv4-mapped addresses.
+		 */
+		int opt_off = 0;
+		if (setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, &opt_off,
+		    sizeof (opt_off)) != 0) {
+			e = errno;
+			warn("could not clear IPV6_V6ONLY");
+			goto fail;
+		}
+	}
+
+	/*
+	 * Bind to the Listen Address.
+	 */
+	if (bind(sock, (struct sockaddr *)addr, addrlen) != 0) {
+		e = errno;
+		warn("bind failed");
+		goto fail;
+	}
+
+	return (sock);
+
+fail:
+	if (sock != -1) {
+		VERIFY0(close(sock));
+	}
+	errno = e;
+	return (-1);
+}
+
+int
+cserver_listen_tcp(cserver_t *csrv, cloop_t *cloop, const char *ipaddr,
+    const char *port)
+{
+	int e;
+	int sock;
+	struct sockaddr_storage addr;
+
+	if (csrv->csrv_type != CSERVER_TYPE_NONE) {
+		/*
+		 * This server is already listening.
+		 */
+		errno = EINVAL;
+		return (-1);
+	}
+
+	if ((sock = cserver_bind_inet(ipaddr, port, SOCK_STREAM,
+	    &addr)) < 0) {
+		return (-1);
+	}
+
+	/*
+	 * Listen.
+	 */
+	cserver_opts_listen(&csrv->csrv_opts, sock, B_TRUE);
+	if (listen(sock, cserver_opts_backlog(&csrv->csrv_opts)) != 0) {
+		e = errno;
+		warn("listen failed");
+		VERIFY0(close(sock));
+		errno = e;
+		return (-1);
+	}
+
+	/*
+	 * We were successful in establishing the listen socket.  Copy
+	 * the relevant data into the server object:
+	 */
+	csrv->csrv_addr = addr;
+	cserver_listen_common(csrv, cloop, sock, CSERVER_TYPE_TCP);
+	return (0);
+}
+
+/*
+ * Receive a batch of datagrams into the receive slots.  Returns the number of
+ * datagrams received, which is zero if none were waiting.
+ */
+static int
+cserver_dgram_recv(cserver_t *csrv, cserver_dgram_batch_t *cdb)
+{
+	int fd = cloop_ent_fd(csrv->csrv_listen);
+	int n;
+
+	for (unsigned int i = 0; i < CSERVER_DGRAM_BATCH; i++) {
+		cserver_dgram_t *cdg = &cdb->cdb_dgrams[i];
+		struct msghdr *msg = CDB_HDR(cdb, i);
+
+		/*
+		 * Slots whose buffer was taken by the consumer are refilled
+		 * from the pool.
+		 */
+		if (cdg->cdg_cbuf == NULL && cconn_buf_get(CSERVER_DGRAM_BUFSZ,
+		    &cdg->cdg_cbuf) != 0) {
+			return (-1);
+		}
+		cbuf_clear(cdg->cdg_cbuf);
+		cbuf_flip(cdg->cdg_cbuf);
+
+		cdb->cdb_iov[i].iov_base = cbuf_unused_ptr(cdg->cdg_cbuf);
+		cdb->cdb_iov[i].iov_len = cbuf_unused(cdg->cdg_cbuf);
+
+		bzero(msg, sizeof (*msg));
+		msg->msg_name = &cdg->cdg_addr;
+		msg->msg_namelen = sizeof (cdg->cdg_addr);
+		msg->msg_iov = &cdb->cdb_iov[i];
+		msg->msg_iovlen = 1;
+	}
+
+#ifdef	CSERVER_HAVE_MMSG
+retry:
+	if ((n = recvmmsg(fd, cdb->cdb_msgs, CSERVER_DGRAM_BATCH, MSG_DONTWAIT,
+	    NULL)) < 0) {
+		switch (errno) {
+		case EINTR:
+			goto retry;
+		case EAGAIN:
+			return (0);
+		default:
+			return (-1);
+		}
+	}
+
+	for (int i = 0; i < n; i++) {
+		VERIFY0(cbuf_limit_extend(cdb->cdb_dgrams[i].cdg_cbuf,
+		    cdb->cdb_msgs[i].msg_len));
+	}
+#else
+	for (n = 0; n < CSERVER_DGRAM_BATCH; n++) {
+		ssize_t r;
+
+		if ((r = recvmsg(fd, CDB_HDR(cdb, n), 0)) < 0) {
+			if (errno == EINTR) {
+				n--;
+				continue;
+			}
+			if (errno == EAGAIN || n > 0) {
+				break;
+			}
+			return (-1);
+		}
+
+		VERIFY0(cbuf_limit_extend(cdb->cdb_dgrams[n].cdg_cbuf,
+		    (size_t)r));
+	}
+#endif
+
+	for (int i = 0; i < n; i++) {
+		cserver_dgram_t *cdg = &cdb->cdb_dgrams[i];
+		struct msghdr *msg = CDB_HDR(cdb, i);
+
+		cdg->cdg_addrlen = msg->msg_namelen;
+		cdg->cdg_trunc = (msg->msg_flags & MSG_TRUNC) != 0;
+	}
+
+	return (n);
+}
+
+static void
+cserver_on_datagrams(cloop_ent_t *clent, int event)
+{
+	cserver_t *csrv = cloop_ent_data(clent);
+	cserver_dgram_batch_t *cdb = csrv->csrv_rx;
+
+	VERIFY(event == CLOOP_CB_READ);
+
+	for (unsigned int round = 0; round < CSERVER_DGRAM_ROUNDS; round++) {
+		int n;
+
+		if ((n = cserver_dgram_recv(csrv, cdb)) < 0) {
+			warn("cserver_dgram_recv");
+			break;
+		}
+
+		for (int i = 0; i < n; i++) {
+			cserver_dgram_t *cdg = &cdb->cdb_dgrams[i];
+
+			if (cdg->cdg_trunc) {
+				if (cserver_debug) {
+					fprintf(stderr, "CSERVER[%p]: DROPPED "
+					    "OVERSIZE DATAGRAM\n", csrv);
+				}
+				continue;
+			}
+
+			if (csrv->csrv_on_datagram != NULL) {
+				csrv->csrv_dgram = cdg;
+				csrv->csrv_active = B_TRUE;
+				csrv->csrv_on_datagram(csrv,
+				    CSERVER_CB_DATAGRAM);
+				csrv->csrv_active = B_FALSE;
+				csrv->csrv_dgram = NULL;
+			}
+
+			if (csrv->csrv_destroy) {
+				/*
+				 * The consumer freed the server while we
+				 * were still using the batch.
+				 */
+				cserver_free(csrv);
+				return;
+			}
+
+			if (csrv->csrv_listen == NULL) {
+				/*
+				 * The consumer closed the server.
+				 */
+				return;
+			}
+		}
+
+		if (n < CSERVER_DGRAM_BATCH) {
+			break;
+		}
+	}
+
+	cloop_ent_want(clent, CLOOP_CB_READ);
+
+	/*
+	 * Send any replies queued by the consumer without waiting for another
+	 * trip through the event loop.
+	 */
+	(void) cserver_flush(csrv);
+}
+
+static void
+cserver_on_dgram_write(cloop_ent_t *clent, int event)
+{
+	cserver_t *csrv = cloop_ent_data(clent);
+
+	VERIFY(event == CLOOP_CB_WRITE);
+
+	(void) cserver_flush(csrv);
+}
+
+static void
+cserver_on_dgram_error(cloop_ent_t *clent, int event)
+{
+	cserver_t *csrv = cloop_ent_data(clent);
+	int e = 0;
+	socklen_t sz = sizeof (e);
+
+	VERIFY(event == CLOOP_CB_ERROR);
+
+	/*
+	 * An earlier datagram may have provoked an ICMP error from its
+	 * destination.  There is nobody to report it to, so just clear it.
+	 */
+	(void) getsockopt(cloop_ent_fd(clent), SOL_SOCKET, SO_ERROR, &e, &sz);
+	if (cserver_debug) {
+		fprintf(stderr, "CSERVER[%p]: SOCKET ERROR: %s\n", csrv,
+		    strerror(e));
+	}
+}
+
+static void
+cserver_dgram_batch_free(cserver_dgram_batch_t *cdb)
+{
+	if (cdb == NULL) {
+		return;
+	}
+
+	for (unsigned int i = 0; i < CSERVER_DGRAM_BATCH; i++) {
+		cbuf_free(cdb->cdb_dgrams[i].cdg_cbuf);
+	}
+	free(cdb);
+}
+
+/*
+ * Bind a datagram (UDP) server.  Each datagram that arrives is delivered to
+ * the CSERVER_CB_DATAGRAM callback.
+ */
+int
+cserver_listen_udp(cserver_t *csrv, cloop_t *cloop, const char *ipaddr,
+    const char *port)
+{
+	int sock;
+	struct sockaddr_storage addr;
+
+	if (csrv->csrv_type != CSERVER_TYPE_NONE) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	if ((csrv->csrv_rx = calloc(1, sizeof (*csrv->csrv_rx))) == NULL ||
+	    (csrv->csrv_tx = calloc(1, sizeof (*csrv->csrv_tx))) == NULL) {
+		goto fail;
+	}
+
+	if ((sock = cserver_bind_inet(ipaddr, port, SOCK_DGRAM, &addr)) < 0) {
+		goto fail;
+	}
+
+	/*
+	 * A larger receive buffer lets us ride out bursts between trips
+	 * through the event loop.
+	 */
+	cserver_opts_t opts = csrv->csrv_opts;
+	if (opts.cso_rcvbuf == 0) {
+		opts.cso_rcvbuf = CSERVER_DGRAM_RCVBUF;
+	}
+	cserver_opts_listen(&opts, sock, B_FALSE);
+
+	csrv->csrv_addr = addr;
+	cserver_listen_common(csrv, cloop, sock, CSERVER_TYPE_UDP);
+	return (0);
+
+fail:
+	free(csrv->csrv_rx);
+	free(csrv->csrv_tx);
+	csrv->csrv_rx = csrv->csrv_tx = NULL;
+	return (-1);
+}
+
+/*
+ * Access the datagram being delivered to the CSERVER_CB_DATAGRAM callback.
+ * The data and address are only valid until the callback returns.
+ */
+int
+cserver_datagram(cserver_t *csrv, void **ptrp, size_t *lenp)
+{
+	cserver_dgram_t *cdg = csrv->csrv_dgram;
+
+	if (cdg == NULL || cdg->cdg_cbuf == NULL) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	*lenp = cbuf_available(cdg->cdg_cbuf);
+	return (cbuf_get_ptr(cdg->cdg_cbuf, 0, *lenp, ptrp));
+}
+
+const struct sockaddr *
+cserver_datagram_addr(cserver_t *csrv, socklen_t *lenp)
+{
+	cserver_dgram_t *cdg = csrv->csrv_dgram;
+
+	if (cdg == NULL) {
+		errno = EINVAL;
+		return (NULL);
+	}
+
+	*lenp = cdg->cdg_addrlen;
+	return ((const struct sockaddr *)&cdg->cdg_addr);
+}
+
+/*
+ * Take ownership of the buffer holding the current datagram, so that it may
+ * be kept once the callback returns.
+ */
+int
+cserver_datagram_take(cserver_t *csrv, cbuf_t **cbufp)
+{
+	cserver_dgram_t *cdg = csrv->csrv_dgram;
+
+	if (cdg == NULL || cdg->cdg_cbuf == NULL) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	*cbufp = cdg->cdg_cbuf;
+	cdg->cdg_cbuf = NULL;
+	return (0);
+}
+
+/*
+ * Queue a datagram for sending to "to".  Datagrams are sent in batches: when
+ * the batch fills, when the datagram callback returns, or when the consumer
+ * calls cserver_flush().  If the batch is full and the socket will not take
+ * any more, this fails with EAGAIN.
+ */
+int
+cserver_sendto(cserver_t *csrv, const struct sockaddr *to, socklen_t tolen,
+    const void *buf, size_t len)
+{
+	cserver_dgram_batch_t *cdb = csrv->csrv_tx;
+	cserver_dgram_t *cdg;
+	cbuf_t *cbuf;
+
+	if (csrv->csrv_type != CSERVER_TYPE_UDP || csrv->csrv_listen == NULL ||
+	    tolen > sizeof (cdg->cdg_addr)) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	if (cdb->cdb_count == CSERVER_DGRAM_BATCH &&
+	    cserver_flush(csrv) != 0 && cdb->cdb_count == CSERVER_DGRAM_BATCH) {
+		return (-1);
+	}
+
+	if (cconn_buf_get(len, &cbuf) != 0) {
+		return (-1);
+	}
+	cbuf_clear(cbuf);
+	cbuf_flip(cbuf);
+	bcopy(buf, cbuf_unused_ptr(cbuf), len);
+	VERIFY0(cbuf_limit_extend(cbuf, len));
+
+	cdg = &cdb->cdb_dgrams[cdb->cdb_count++];
+	cdg->cdg_cbuf = cbuf;
+	bcopy(to, &cdg->cdg_addr, tolen);
+	cdg->cdg_addrlen = tolen;
+
+	if (cdb->cdb_count == CSERVER_DGRAM_BATCH) {
+		(void) cserver_flush(csrv);
+	}
+	return (0);
+}
+
+/*
+ * Reply to the sender of the datagram being delivered.
+ */
+int
+cserver_reply(cserver_t *csrv, const void *buf, size_t len)
+{
+	cserver_dgram_t *cdg = csrv->csrv_dgram;
+
+	if (cdg == NULL) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	return (cserver_sendto(csrv, (const struct sockaddr *)&cdg->cdg_addr,
+	    cdg->cdg_addrlen, buf, len));
+}
+
+/*
+ * Send any queued datagrams.  Datagrams that the kernel rejects outright
+ * (e.g., because the destination is unreachable) are dropped.  If the socket
+ * cannot take them all, we fail with EAGAIN and send the remainder when it
+ * becomes writable.
+ */
+int
+cserver_flush(cserver_t *csrv)
+{
+	cserver_dgram_batch_t *cdb = csrv->csrv_tx;
+	unsigned int sent = 0;
+	int fd;
+
+	if (cdb == NULL || cdb->cdb_count == 0) {
+		return (0);
+	}
+
+	if (csrv->csrv_listen == NULL) {
+		errno = EINVAL;
+		return (-1);
+	}
+	fd = cloop_ent_fd(csrv->csrv_listen);
+
+	for (unsigned int i = 0; i < cdb->cdb_count; i++) {
+		cserver_dgram_t *cdg = &cdb->cdb_dgrams[i];
+		struct msghdr *msg = CDB_HDR(cdb, i);
+		size_t len = cbuf_available(cdg->cdg_cbuf);
+
+		VERIFY0(cbuf_get_ptr(cdg->cdg_cbuf, 0, len,
+		    &cdb->cdb_iov[i].iov_base));
+		cdb->cdb_iov[i].iov_len = len;
+
+		bzero(msg, sizeof (*msg));
+		msg->msg_name = &cdg->cdg_addr;
+		msg->msg_namelen = cdg->cdg_addrlen;
+		msg->msg_iov = &cdb->cdb_iov[i];
+		msg->msg_iovlen = 1;
+	}
+
+	while (sent < cdb->cdb_count) {
+		int n;
+
+#ifdef	CSERVER_HAVE_MMSG
+		n = sendmmsg(fd, &cdb->cdb_msgs[sent], cdb->cdb_count - sent,
+		    MSG_DONTWAIT);
+#else
+		n = sendmsg(fd, CDB_HDR(cdb, sent), 0) < 0 ? -1 : 1;
+#endif
+		if (n >= 0) {
+			sent += n;
+			continue;
+		}
+
+		if (errno == EINTR) {
+			continue;
+		}
+		if (errno == EAGAIN) {
+			break;
+		}
+
+		/*
+		 * The first datagram in this call could not be sent.
+		 */
+		if (cserver_debug) {
+			fprintf(stderr, "CSERVER[%p]: DROPPED DATAGRAM: %s\n",
+			    csrv, strerror(errno));
+		}
+		cbuf_free(cdb->cdb_dgrams[sent].cdg_cbuf);
+		cdb->cdb_dgrams[sent].cdg_cbuf = NULL;
+		sent++;
+	}
+
+	for (unsigned int i = 0; i < sent; i++) {
+		cbuf_free(cdb->cdb_dgrams[i].cdg_cbuf);
+		cdb->cdb_dgrams[i].cdg_cbuf = NULL;
+	}
+	cdb->cdb_count -= sent;
+	if (cdb->cdb_count > 0) {
+		memmove(&cdb->cdb_dgrams[0], &cdb->cdb_dgrams[sent],
+		    cdb->cdb_count * sizeof (cserver_dgram_t));
+		for (unsigned int i = cdb->cdb_count; i < cdb->cdb_count + sent;
+		    i++) {
+			cdb->cdb_dgrams[i].cdg_cbuf = NULL;
+		}
+
+		cloop_ent_want(csrv->csrv_listen, CLOOP_CB_WRITE);
+		errno = EAGAIN;
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * Determine whether the socket at "addr" was left behind by a process that
+ * has gone away: nothing is listening on it, so a connection is refused.
+ * If the connection fails for any other reason, or succeeds, the socket may
+ * still be in use and must be left alone.
+ */
+static boolean_t
+cserver_unix_stale(const struct sockaddr_un *addr)
+{
+	boolean_t stale = B_FALSE;
+	int e = errno;
+	int sock;
+
+	if ((sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) >= 0) {
+		stale = connect(sock, (struct sockaddr *)addr,
+		    sizeof (*addr)) != 0 && errno == ECONNREFUSED ?
+		    B_TRUE : B_FALSE;
+		VERIFY0(close(sock));
+	}
+
+	errno = e;
+	return (stale);
+}
+
+/*
+ * Listen for stream connections on a Unix domain socket at "path".  A stale
+ * socket left at that path by a previous process is replaced; a socket that
+ * another process is listening on, and any other kind of file, is left
+ * alone.  The socket is removed again by cserver_close().
+ */
+int
+cserver_listen_unix(cserver_t *csrv, cloop_t *cloop, const char *path)
+{
+	int e;
+	int sock = -1;
+	struct sockaddr_un *sunp = (struct sockaddr_un *)&csrv->csrv_addr;
+	struct sockaddr_un addr;
+	struct stat st;
+	boolean_t retried = B_FALSE;
+
+	if (csrv->csrv_type != CSERVER_TYPE_NONE) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	bzero(&addr, sizeof (addr));
+	addr.sun_family = AF_UNIX;
+	if (strlcpy(addr.sun_path, path, sizeof (addr.sun_path)) >=
+	    sizeof (addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return (-1);
+	}
+
+	if ((sock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+	    0)) < 0) {
+		e = errno;
+		warn("socket failed");
+		goto fail;
+	}
+
+retry:
+	if (bind(sock, (struct sockaddr *)&addr, sizeof (addr)) != 0) {
+		e = errno;
+		if (e == EADDRINUSE && !retried && lstat(path, &st) == 0 &&
+		    S_ISSOCK(st.st_mode) && cserver_unix_stale(&addr) &&
+		    unlink(path) == 0) {
+			retried = B_TRUE;
+			goto retry;
+		}
+		warn("bind failed");
+		goto fail;
+	}
+
+	cserver_opts_listen(&csrv->csrv_opts, sock, B_FALSE);
+	if (listen(sock, cserver_opts_backlog(&csrv->csrv_opts)) != 0) {
+		e = errno;
+		warn("listen failed");
+		(void) unlink(path);
+		goto fail;
+	}
+
+	bcopy(&addr, sunp, sizeof (addr));
+	cserver_listen_common(csrv, cloop, sock, CSERVER_TYPE_UNIX);
+	return (0);
+
+fail:
+	if (sock != -1) {
+		VERIFY0(close(sock));
+	}
+	errno = e;
+	return (-1);
+}
+
+/*
+ * Begin a connection to the given IPv4 or IPv6 address.  The connection is
+ * returned immediately, and CCONN_CB_CONNECTED is delivered once it has been
+ * established; if it cannot be, CCONN_CB_ERROR is delivered instead.  Data
+ * may be sent before the connection completes, and is written once it does.
+ * Outbound connections do not belong to any server, and use the default
+ * send and receive limits.
+ */
+int
+cconn_connect(cloop_t *cloop, const char *host, const char *port,
+    cconn_t **ccnp)
+{
+	cconn_t *ccn;
+	cserver_opts_t opts;
+	socklen_t addrlen;
+	int fd = -1;
+	int e;
+
+	*ccnp = NULL;
+
+	if (cconn_alloc(&ccn) != 0) {
+		return (-1);
+	}
+
+	if (cserver_parse_addr(host, port, &ccn->ccn_remote_addr,
+	    &addrlen) != 0) {
+		e = errno;
+		goto fail;
+	}
+
+	if ((fd = socket(ccn->ccn_remote_addr.ss_family, SOCK_STREAM |
+	    SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+		e = errno;
+		goto fail;
+	}
+	VERIFY0(cserver_opts_profile(&opts, CSERVER_PROFILE_DEFAULT));
+	(void) cconn_opts_apply(ccn, &opts, fd);
+
+	/*
+	 * A non-blocking connect interrupted by a signal continues
+	 * asynchronously, just as if it were in progress.
+	 */
+	if (connect(fd, (struct sockaddr *)&ccn->ccn_remote_addr,
+	    addrlen) != 0 && errno != EINPROGRESS && errno != EINTR) {
+		e = errno;
+		goto fail;
+	}
+
+	cconn_send_watermarks_set(ccn, CCONN_SEND_LOWAT, CCONN_SEND_HIWAT);
+	cconn_recv_limits_set(ccn, CCONN_RECV_MAX_LINE, CCONN_RECV_MAX);
+
+	cloop_attach_ent(cloop, ccn->ccn_clent, fd);
+	cconn_advance_state(ccn, CCONN_ST_CONNECTING);
+
+	if (cserver_debug) {
+		fprintf(stderr, "CONNECTING (%s)\n",
+		    cconn_remote_addr_str(ccn));
+	}
+
+	*ccnp = ccn;
+	return (0);
+
+fail:
+	if (fd != -1) {
+		VERIFY0(close(fd));
+	}
+	cconn_destroy(ccn);
+	errno = e;
+	return (-1);
+}
+
+/*
+ * Set the send queue watermarks for connections subsequently accepted by
+ * this server, and the limit on the total number of bytes queued across all
+ * of its connections.  A value of zero disables the corresponding check.
+ */
+void
+cserver_send_watermarks_set(cserver_t *csrv, size_t lowat, size_t hiwat)
+{
+	csrv->csrv_sendq_lowat = lowat;
+	csrv->csrv_sendq_hiwat = hiwat;
+}
+
+void
+cserver_send_limit_set(cserver_t *csrv, size_t limit)
+{
+	csrv->csrv_sendq_limit = limit;
+}
+
+/*
+ * Set the maximum line length and the maximum number of received bytes
+ * buffered for connections subsequently accepted by this server.  A value of
+ * zero removes the corresponding limit.
+ */
+void
+cserver_recv_limits_set(cserver_t *csrv, size_t max_line, size_t max_buffered)
+{
+	csrv->csrv_recv_max_line = max_line;
+	csrv->csrv_recv_max = max_buffered;
+}
+
+/*
+ * Queue a shared reference to "cbuf" on the send queue of every connection
+ * for which "filter" returns B_TRUE, or on every connection if "filter" is
+ * NULL.  The data is not copied; each connection releases its reference once
+ * the buffer has been written.  The caller retains its own reference.
+ *
+ * Connections that cannot take the buffer now are skipped, and "sent" (if
+ * not NULL) is called for each connection on which it was queued.  If
+ * queueing failed for any reason other than a full send queue, the rest of
+ * the connections are still tried, and -1 is returned at the end.
+ */
+int
+cserver_broadcast_prio(cserver_t *csrv, cbuf_t *cbuf, cserver_filter_t *filter,
+    cconn_prio_t prio, cserver_sent_t *sent)
+{
+	int e = 0;
+
+	for (cconn_t *ccn = list_head(&csrv->csrv_connections); ccn != NULL;
+	    ccn = list_next(&csrv->csrv_connections, ccn)) {
+		cbuf_t *dup;
+
+		/*
+		 * The filter comes first, so that a connection it would skip
+		 * is not marked as blocked, and later sent CCONN_CB_DRAIN.
+		 */
+		if ((filter != NULL && !filter(ccn)) ||
+		    cconn_send_check_prio(ccn, ccn->ccn_zout != NULL ?
+		    CCONN_PRIO_NORMAL : prio) != 0) {
+			continue;
+		}
+
+		if (cbuf_dup(cbuf, &dup) != 0) {
+			e = errno;
+			continue;
+		}
+
+		/*
+		 * On a compressed connection, the data is copied into the
+		 * compressor, which can fail for want of memory.
+		 */
+		if (cconn_send_cbuf_prio(ccn, dup, prio) != 0) {
+			e = errno;
+			cbuf_free(dup);
+			continue;
+		}
+
+		if (sent != NULL) {
+			sent(ccn);
+		}
+	}
+
+	if (e != 0) {
+		errno = e;
+		return (-1);
+	}
+	return (0);
+}
+
+int
+cserver_broadcast(cserver_t *csrv, cbuf_t *cbuf, cserver_filter_t *filter)
+{
+	return (cserver_broadcast_prio(csrv, cbuf, filter, CCONN_PRIO_NORMAL,
+	    NULL));
+}
+
+/*
+ * Close the listen socket so as to stop accepting incoming connections.
+ */
+void
+cserver_close(cserver_t *csrv)
+{
+	if (csrv->csrv_listen == NULL)
+		return;
+
+	cloop_ent_free(csrv->csrv_listen);
+	csrv->csrv_listen = NULL;
+
+	if (csrv->csrv_type == CSERVER_TYPE_UNIX) {
+		(void) unlink(((struct sockaddr_un *)
+		    &csrv->csrv_addr)->sun_path);
+	}
+}
+
+static int
+cserver_abort_one(cconn_t *ccn, void *arg)
+{
+	(void) cconn_abort(ccn);
+	return (0);
+}
+
+void
+cserver_abort(cserver_t *csrv)
+{
+	/*
+	 * Abort all connections.
+	 */
+	(void) cserver_walk(csrv, cserver_abort_one, NULL);
+}
+
+uint64_t
+cconn_id(cconn_t *ccn)
+{
+	return (ccn->ccn_id);
+}
+
+size_t
+cserver_connection_count(cserver_t *csrv)
+{
+	return (csrv->csrv_by_id.cht_count);
+}
+
+/*
+ * Find the open connection with the given id, or with the given remote
+ * address.  These return NULL, with errno set to ENOENT, if there is no such
+ * connection.
+ */
+cconn_t *
+cserver_lookup_id(cserver_t *csrv, uint64_t id)
+{
+	cconn_htable_t *cht = &csrv->csrv_by_id;
+
+	for (cconn_t *ccn = *cconn_htable_bucket(cht, cconn_hash_u64(id));
+	    ccn != NULL; ccn = ccn->ccn_id_next) {
+		if (ccn->ccn_id == id) {
+			return (ccn);
+		}
+	}
+
+	errno = ENOENT;
+	return (NULL);
+}
+
+cconn_t *
+cserver_lookup_addr(cserver_t *csrv, const struct sockaddr *sa,
+    socklen_t len)
+{
+	cconn_htable_t *cht = &csrv->csrv_by_addr;
+	cconn_addr_key_t cak;
+
+	if (cconn_addr_key(sa, len, &cak) != 0) {
+		return (NULL);
+	}
+
+	for (cconn_t *ccn = *cconn_htable_bucket(cht,
+	    cconn_addr_key_hash(&cak)); ccn != NULL;
+	    ccn = ccn->ccn_addr_next) {
+		if (bcmp(&ccn->ccn_addr_key, &cak, sizeof (cak)) == 0) {
+			return (ccn);
+		}
+	}
+
+	errno = ENOENT;
+	return (NULL);
+}
+
+/*
+ * Call "func" for each open connection, until it returns something other
+ * than zero.  The callback may close any connection, including the one it
+ * was passed.
+ */
+int
+cserver_walk(cserver_t *csrv, cserver_walk_cb_t *func, void *arg)
+{
+	list_t *l = &csrv->csrv_connections;
+	cconn_t *ccn, *next;
+	int r = 0;
+
+	/*
+	 * We hold both the current connection and the next one, so that
+	 * neither can be freed (and thus removed from the list) while the
+	 * callback runs.
+	 */
+	if ((ccn = list_head(l)) != NULL) {
+		cconn_hold(ccn);
+	}
+
+	while (ccn != NULL) {
+		if ((next = list_next(l, ccn)) != NULL) {
+			cconn_hold(next);
+		}
+
+		if (ccn->ccn_state != CCONN_ST_CLOSED) {
+			r = func(ccn, arg);
+		}
+		cconn_rele(ccn);
+
+		if (r != 0) {
+			if (next != NULL) {
+				cconn_rele(next);
+			}
+			break;
+		}
+		ccn = next;
+	}
+
+	return (r);
+}
+
+const cconn_stats_t *
+cconn_stats(cconn_t *ccn)
+{
+	return (&ccn->ccn_stats);
+}
+
+static uint64_t
+cconn_stat_value(cconn_t *ccn, cconn_stat_t stat)
+{
+	const cconn_stats_t *ccs = &ccn->ccn_stats;
+
+	switch (stat) {
+	case CCONN_STAT_BYTES_IN:
+		return (ccs->ccs_bytes_in);
+	case CCONN_STAT_BYTES_OUT:
+		return (ccs->ccs_bytes_out);
+	case CCONN_STAT_FRAMES_IN:
+		return (ccs->ccs_frames_in);
+	case CCONN_STAT_SENDS:
+		return (ccs->ccs_sends);
+	case CCONN_STAT_RECVQ_MAX:
+		return (ccs->ccs_recvq_max);
+	case CCONN_STAT_SENDQ_MAX:
+		return (ccs->ccs_sendq_max);
+	case CCONN_STAT_SYSCALLS:
+		return (ccs->ccs_syscalls);
+	case CCONN_STAT_BUSY:
+		return (ccs->ccs_busy);
+	}
+
+	abort();
+}
+
+static void
+cserver_top_sift_down(cconn_top_t *top, unsigned int n, unsigned int i)
+{
+	for (;;) {
+		unsigned int min = i;
+		unsigned int l = 2 * i + 1;
+		unsigned int r = l + 1;
+		cconn_top_t t;
+
+		if (l < n && top[l].cct_value < top[min].cct_value) {
+			min = l;
+		}
+		if (r < n && top[r].cct_value < top[min].cct_value) {
+			min = r;
+		}
+		if (min == i) {
+			return;
+		}
+
+		t = top[i];
+		top[i] = top[min];
+		top[min] = t;
+		i = min;
+	}
+}
+
+/*
+ * The array is kept as a min-heap of the largest values seen so far, so
+ * each connection costs at most O(log n) and most cost a single comparison
+ * with the root.  The heap is sorted in place once the walk is complete.
+ */
+int
+cserver_top(cserver_t *csrv, cconn_stat_t stat, cconn_top_t *top,
+    unsigned int n)
+{
+	unsigned int count = 0;
+	unsigned int i;
+
+	if (stat < CCONN_STAT_BYTES_IN || stat > CCONN_STAT_BUSY) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	if (n == 0) {
+		return (0);
+	}
+
+	for (cconn_t *ccn = list_head(&csrv->csrv_connections); ccn != NULL;
+	    ccn = list_next(&csrv->csrv_connections, ccn)) {
+		uint64_t v;
+
+		if (ccn->ccn_state == CCONN_ST_CLOSED) {
+			continue;
+		}
+		v = cconn_stat_value(ccn, stat);
+
+		if (count < n) {
+			/*
+			 * The heap is not yet full; sift the new entry up.
+			 */
+			for (i = count++; i > 0 &&
+			    top[(i - 1) / 2].cct_value > v; i = (i - 1) / 2) {
+				top[i] = top[(i - 1) / 2];
+			}
+			top[i].cct_conn = ccn;
+			top[i].cct_value = v;
+		} else if (v > top[0].cct_value) {
+			top[0].cct_conn = ccn;
+			top[0].cct_value = v;
+			cserver_top_sift_down(top, n, 0);
+		}
+	}
+
+	/*
+	 * Repeatedly move the smallest remaining value to the end of the
+	 * array, leaving it in descending order.
+	 */
+	for (i = count; i > 1; i--) {
+		cconn_top_t t = top[0];
+
+		top[0] = top[i - 1];
+		top[i - 1] = t;
+		cserver_top_sift_down(top, i - 1, 0);
+	}
+
+	return ((int)count);
+}
+
+/*
+ * Terminate TLS on connections accepted from now on.
+ */
+int
+cserver_tls_set(cserver_t *csrv, const char *certfile, const char *keyfile)
+{
+	ctls_ctx_t *ctx;
+
+	if (csrv->csrv_type == CSERVER_TYPE_UDP) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	if (ctls_ctx_alloc(&ctx, certfile, keyfile) != 0) {
+		return (-1);
+	}
+
+	ctls_ctx_free(csrv->csrv_tls);
+	csrv->csrv_tls = ctx;
+	return (0);
+}
+
+cconn_tls_t
+cconn_tls(cconn_t *ccn)
+{
+	if (ccn->ccn_tls == NULL) {
+		return (CCONN_TLS_NONE);
+	}
+
+	return (ctls_kernel(ccn->ccn_tls) ? CCONN_TLS_KERNEL : CCONN_TLS_USER);
+}
+
+/*
+ * Switch the connection to compressed data in both directions.  This may only
+ * be called while a frame is available: sends made after the call are
+ * compressed, as is everything received after the current frame.
+ */
+int
+cconn_compress(cconn_t *ccn)
+{
+	if (ccn->ccn_state != CCONN_ST_LINE_AVAILABLE ||
+	    ccn->ccn_zout != NULL || ccn->ccn_sendq_end) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	if (cdeflate_alloc(&ccn->ccn_zout, B_FALSE) != 0 ||
+	    cdeflate_alloc(&ccn->ccn_zin, B_TRUE) != 0 ||
+	    cbufq_alloc(&ccn->ccn_zrecvq) != 0) {
+		cdeflate_free(ccn->ccn_zout);
+		cdeflate_free(ccn->ccn_zin);
+		ccn->ccn_zout = NULL;
+		ccn->ccn_zin = NULL;
+		return (-1);
+	}
+
+	/*
+	 * Control messages that have yet to be written must go out before
+	 * any compressed data.  If one is being written, the normal queue is
+	 * at the end of a message, and they go ahead of it; otherwise they
+	 * follow what is already queued.
+	 */
+	if (ccn->ccn_sendq_ctl_bytes > 0) {
+		size_t len = ccn->ccn_sendq_ctl_bytes;
+		unsigned int i;
+
+		if (ccn->ccn_sendq_cur == &ccn->ccn_sendq_ctl) {
+			cbufq_move(&ccn->ccn_sendq_ctl, &ccn->ccn_sendq);
+			for (i = 0; i < ccn->ccn_sendq_nmarks; i++) {
+				ccn->ccn_sendq_marks[(ccn->ccn_sendq_mark0 +
+				    i) % CCONN_SENDQ_MARKS] += len;
+			}
+			ccn->ccn_sendq_cur = &ccn->ccn_sendq;
+		}
+		cbufq_move(&ccn->ccn_sendq, &ccn->ccn_sendq_ctl);
+		ccn->ccn_sendq_ctl_bytes = 0;
+		ccn->ccn_sendq_ctl_run = 0;
+		cconn_sendq_mark(ccn);
+	}
+
+	ccn->ccn_sendq_resv = NULL;
+	ccn->ccn_zin_pending = B_TRUE;
+	return (0);
+}
+
+/*
+ * Allow up to "depth" requests to be deferred at once.  A depth of zero
+ * turns pipelining off, once any outstanding requests are done.
+ */
+void
+cconn_pipeline(cconn_t *ccn, unsigned int depth)
+{
+	ccn->ccn_pipeline = depth;
+}
+
+/*
+ * Take the current frame as a request to be answered later, and move on to
+ * the next frame.  The request has its own copy of the frame, and holds the
+ * connection until it is done.
+ */
+int
+cconn_defer(cconn_t *ccn, cconn_req_t **reqp)
+{
+	cconn_req_t *req;
+	size_t len = ccn->ccn_frame.cfr_len;
+
+	if (ccn->ccn_state != CCONN_ST_LINE_AVAILABLE ||
+	    ccn->ccn_pipeline == 0) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	if ((req = calloc(1, sizeof (*req))) == NULL) {
+		return (-1);
+	}
+
+	if (cconn_buf_get(len > 0 ? len : 1, &req->ccr_frame) != 0 ||
+	    cbufq_alloc(&req->ccr_sendq) != 0) {
+		cbuf_free(req->ccr_frame);
+		free(req);
+		return (-1);
+	}
+	cbuf_flip(req->ccr_frame);
+	bcopy(ccn->ccn_frame_ptr, cbuf_unused_ptr(req->ccr_frame), len);
+	VERIFY0(cbuf_limit_extend(req->ccr_frame, len));
+
+	req->ccr_conn = ccn;
+	cconn_hold(ccn);
+	list_insert_tail(&ccn->ccn_reqs, req);
+	ccn->ccn_nreqs++;
+
+	*reqp = req;
+	cconn_next(ccn);
+	return (0);
+}
+
+cconn_t *
+cconn_req_conn(cconn_req_t *req)
+{
+	return (req->ccr_conn);
+}
+
+void
+cconn_req_frame(cconn_req_t *req, void **ptrp, size_t *lenp)
+{
+	*lenp = cbuf_available(req->ccr_frame);
+	VERIFY0(cbuf_get_ptr(req->ccr_frame, 0, *lenp, ptrp));
+}
+
+/*
+ * Append to the response for a request.
+ */
+int
+cconn_req_send(cconn_req_t *req, const void *buf, size_t len)
+{
+	cconn_t *ccn = req->ccr_conn;
+	cbuf_t *cbuf;
+	size_t n;
+
+	if (req->ccr_done) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	if (ccn->ccn_state == CCONN_ST_CLOSED || ccn->ccn_sendq_end) {
+		errno = EPIPE;
+		return (-1);
+	}
+
+	while (len > 0) {
+		if ((cbuf = cbufq_peek_tail(req->ccr_sendq)) == NULL ||
+		    cbuf_unused(cbuf) == 0) {
+			if (cbuf_alloc(&cbuf, len > CCONN_SEND_CHUNK ? len :
+			    CCONN_SEND_CHUNK) != 0) {
+				return (-1);
+			}
+			cbuf_flip(cbuf);
+			cbufq_enq(req->ccr_sendq, cbuf);
+		}
+
+		n = len < cbuf_unused(cbuf) ? len : cbuf_unused(cbuf);
+		bcopy(buf, cbuf_unused_ptr(cbuf), n);
+		VERIFY0(cbuf_limit_extend(cbuf, n));
+		buf = (const uint8_t *)buf + n;
+		len -= n;
+	}
+
+	return (0);
+}
 
 /*
- * Close the listen socket so as to stop accepting incoming connections.
+ * Move the response for a request to the send queue.  The response goes out
+ * in full, even if this takes the queue past its high-water mark: the
+ * pipeline depth limits how much can be waiting.
  */
-void
-cserver_close(cserver_t *csrv)
+static void
+cconn_req_flush(cconn_t *ccn, cconn_req_t *req)
 {
-	if (csrv->csrv_listen == NULL)
+	size_t len = cbufq_available(req->ccr_sendq);
+	cbuf_t *cbuf;
+
+	if (ccn->ccn_state == CCONN_ST_CLOSED || ccn->ccn_sendq_end ||
+	    len == 0) {
 		return;
+	}
 
-	cloop_ent_free(csrv->csrv_listen);
-	csrv->csrv_listen = NULL;
+	ccn->ccn_sendq_resv = NULL;
+	if (ccn->ccn_zout != NULL) {
+		/*
+		 * Compression must happen in wire order.
+		 */
+		while ((cbuf = cbufq_first(req->ccr_sendq)) != NULL) {
+			void *ptr;
+			size_t avail = cbuf_available(cbuf);
+
+			VERIFY0(cbuf_get_ptr(cbuf, 0, avail, &ptr));
+			if (cconn_send_deflate(ccn, ptr, avail,
+			    CDEFLATE_FLUSH_SYNC) != 0) {
+				warn("cconn_send_deflate");
+				cconn_advance_state(ccn, CCONN_ST_ERROR);
+				return;
+			}
+			VERIFY0(cbufq_discard(req->ccr_sendq, avail));
+		}
+		return;
+	}
+
+	cbufq_move(&ccn->ccn_sendq, req->ccr_sendq);
+	cconn_sendq_add(ccn, len);
+	cconn_sendq_mark(ccn);
+	cconn_want_write(ccn);
 }
 
+/*
+ * Finish a request.  Its response, and those of any later requests that
+ * were waiting for it, are sent in the order the requests arrived.  The
+ * request may not be used again.
+ */
 void
-cserver_abort(cserver_t *csrv)
+cconn_req_done(cconn_req_t *req)
 {
+	cconn_t *ccn = req->ccr_conn;
+	unsigned int nrele = 0;
+
+	VERIFY(!req->ccr_done);
+	req->ccr_done = B_TRUE;
+
+	while ((req = list_head(&ccn->ccn_reqs)) != NULL && req->ccr_done) {
+		list_remove(&ccn->ccn_reqs, req);
+		ccn->ccn_nreqs--;
+
+		cconn_req_flush(ccn, req);
+		cbufq_free(req->ccr_sendq);
+		cbuf_free(req->ccr_frame);
+		free(req);
+		nrele++;
+	}
+
 	/*
-	 * Abort all connections.
+	 * There may be frames that were held back while the pipeline was
+	 * full.
+	 */
+	if (nrele > 0 && ccn->ccn_state == CCONN_ST_WAITING_FOR_LINE) {
+		cconn_hold(ccn);
+		ccn_handle_incoming_data(ccn);
+		cconn_rele(ccn);
+	}
+
+	/*
+	 * The consumer finished sending while responses were outstanding.
+	 */
+	if (ccn->ccn_fin_held && list_is_empty(&ccn->ccn_reqs)) {
+		ccn->ccn_fin_held = B_FALSE;
+		if (cconn_fin(ccn) != 0 && ccn->ccn_state != CCONN_ST_CLOSED) {
+			warn("cconn_fin");
+			cconn_advance_state(ccn, CCONN_ST_ERROR);
+		}
+	}
+
+	while (nrele-- > 0) {
+		cconn_rele(ccn);
+	}
+}
+
+/*
+ * Relaying.  Each side of a relay forwards what it receives to its peer,
+ * either by moving buffers from its receive queue to the peer's send queue,
+ * or (where splice(2) is available) through a pipe of its own.
+ */
+static boolean_t
+cconn_relay_full(cconn_t *ccn)
+{
+	cconn_t *peer = ccn->ccn_relay;
+
+#ifdef	CCONN_HAVE_SPLICE
+	if (ccn->ccn_relay_piped > 0) {
+		return (B_TRUE);
+	}
+#endif
+
+	return (peer->ccn_sendq_hiwat != 0 &&
+	    peer->ccn_sendq_bytes >= peer->ccn_sendq_hiwat ? B_TRUE : B_FALSE);
+}
+
+/*
+ * Pass on the end of a relayed stream, once everything before it has been
+ * queued on the peer.
+ */
+static void
+cconn_relay_eof(cconn_t *ccn)
+{
+	cconn_t *peer = ccn->ccn_relay;
+
+	if (!peer->ccn_sendq_end && cconn_fin(peer) != 0) {
+		warn("cconn relay fin");
+		cconn_advance_state(peer, CCONN_ST_ERROR);
+		return;
+	}
+
+	if (ccn->ccn_state == CCONN_ST_WAITING_FOR_LINE) {
+		cconn_advance_state(ccn, CCONN_ST_READ_EOF);
+	}
+}
+
+/*
+ * Move everything in the receive queue to the peer's send queue.  Buffers
+ * change hands without being copied, unless the peer compresses its sends.
+ */
+static void
+cconn_relay_forward(cconn_t *ccn)
+{
+	cconn_t *peer = ccn->ccn_relay;
+	cbuf_t *cbuf;
+	size_t len;
+	void *ptr;
+
+again:
+	while ((cbuf = cbufq_deq(&ccn->ccn_recvq)) != NULL) {
+		if ((len = cbuf_available(cbuf)) == 0 || peer->ccn_sendq_end) {
+			/*
+			 * The peer's consumer has finished sending, so there
+			 * is nowhere for this data to go.
+			 */
+			cbuf_free(cbuf);
+			continue;
+		}
+
+		if (peer->ccn_zout != NULL) {
+			VERIFY0(cbuf_get_ptr(cbuf, 0, len, &ptr));
+			if (cconn_send_deflate(peer, ptr, len,
+			    CDEFLATE_FLUSH_SYNC) != 0) {
+				warn("cconn relay compress");
+				cbuf_free(cbuf);
+				cconn_advance_state(peer, CCONN_ST_ERROR);
+				return;
+			}
+			cbuf_free(cbuf);
+			continue;
+		}
+
+		peer->ccn_sendq_resv = NULL;
+		cbufq_enq(&peer->ccn_sendq, cbuf);
+		cconn_sendq_add(peer, len);
+	}
+	ccn->ccn_recvq_bytes = 0;
+	if (peer->ccn_sendq_bytes > 0) {
+		cconn_want_write(peer);
+	}
+
+	if (cconn_relay_full(ccn)) {
+		/*
+		 * cconn_relay_resume() brings us back here.
+		 */
+		ccn->ccn_relay_blocked = B_TRUE;
+		return;
+	}
+
+	/*
+	 * Compressed data is decompressed in batches no larger than the
+	 * receive queue limit.
+	 */
+	if (CCONN_ZIN(ccn) && ccn->ccn_zrecvq_bytes > 0) {
+		if (cconn_inflate(ccn) != 0) {
+			warn("cconn decompress");
+			cconn_advance_state(ccn, CCONN_ST_ERROR);
+			return;
+		}
+		if (ccn->ccn_recvq_bytes > 0) {
+			goto again;
+		}
+	}
+
+	if (ccn->ccn_recvq_end) {
+		cconn_relay_eof(ccn);
+	} else {
+		cconn_want_read(ccn);
+	}
+}
+
+/*
+ * Called as the send queue of "ccn" drains: resume reading from the other
+ * side of the relay, if it stopped because this side was backed up.
+ */
+static void
+cconn_relay_resume(cconn_t *ccn)
+{
+	cconn_t *src = ccn->ccn_relay;
+
+	if (src == NULL || !src->ccn_relay_blocked ||
+	    ccn->ccn_sendq_bytes > ccn->ccn_sendq_lowat) {
+		return;
+	}
+
+	src->ccn_relay_blocked = B_FALSE;
+	if (src->ccn_state == CCONN_ST_WAITING_FOR_LINE) {
+		cconn_hold(src);
+		ccn_handle_incoming_data(src);
+		cconn_rele(src);
+	}
+}
+
+#ifdef	CCONN_HAVE_SPLICE
+static void
+cconn_relay_splice_setup(cconn_t *ccn)
+{
+	cconn_t *peer = ccn->ccn_relay;
+
+	if (ccn->ccn_tls != NULL || ccn->ccn_zin != NULL ||
+	    ccn->ccn_zin_pending || peer->ccn_tls != NULL ||
+	    peer->ccn_zout != NULL) {
+		return;
+	}
+
+	/*
+	 * Without a pipe, the data is copied through the queues instead.
 	 */
-	while (!list_is_empty(&csrv->csrv_connections)) {
-		cconn_abort(list_head(&csrv->csrv_connections));
+	if (pipe2(ccn->ccn_relay_pipe, O_NONBLOCK | O_CLOEXEC) != 0) {
+		return;
+	}
+	ccn->ccn_relay_splice = B_TRUE;
+	ccn->ccn_relay_piped = 0;
+}
+
+static void
+cconn_relay_splice_close(cconn_t *ccn)
+{
+	if (!ccn->ccn_relay_splice) {
+		return;
+	}
+
+	VERIFY0(close(ccn->ccn_relay_pipe[0]));
+	VERIFY0(close(ccn->ccn_relay_pipe[1]));
+	ccn->ccn_relay_splice = B_FALSE;
+	ccn->ccn_relay_piped = 0;
+}
+
+/*
+ * Fill the (empty) pipe from the socket, and pass what we get on to the peer.
+ */
+static void
+cconn_relay_splice_in(cconn_t *ccn)
+{
+	ssize_t n;
+
+	if (ccn->ccn_relay_piped > 0) {
+		/*
+		 * The peer has yet to take what is already in the pipe.
+		 */
+		return;
+	}
+
+retry:
+	ccn->ccn_stats.ccs_syscalls++;
+	if ((n = splice(cloop_ent_fd(ccn->ccn_clent), NULL,
+	    ccn->ccn_relay_pipe[1], NULL, CCONN_RELAY_SPLICE_MAX,
+	    SPLICE_F_MOVE | SPLICE_F_NONBLOCK)) < 0) {
+		switch (errno) {
+		case EINTR:
+			goto retry;
+
+		case EAGAIN:
+			cloop_ent_want(ccn->ccn_clent, CLOOP_CB_READ);
+			return;
+
+		default:
+			if (cserver_debug) {
+				fprintf(stderr, "CCONN[%p] SPLICE IN: %s\n",
+				    ccn, strerror(errno));
+			}
+			cconn_advance_state(ccn, CCONN_ST_ERROR);
+			return;
+		}
+	}
+
+	if (n == 0) {
+		ccn->ccn_recvq_end = B_TRUE;
+		if (cserver_debug) {
+			fprintf(stderr, "CCONN[%p] READ EOF\n", ccn);
+		}
+	}
+	ccn->ccn_relay_piped += (size_t)n;
+	ccn->ccn_stats.ccs_bytes_in += (size_t)n;
+
+	cconn_relay_splice_out(ccn);
+}
+
+/*
+ * Empty the pipe into the peer's socket, once everything queued on the peer
+ * before it has been written.  While the pipe holds data, the socket is not
+ * read.  The caller must hold the connection.
+ */
+static void
+cconn_relay_splice_out(cconn_t *ccn)
+{
+	cconn_t *peer = ccn->ccn_relay;
+	ssize_t n;
+
+	while (ccn->ccn_relay_piped > 0) {
+		if (peer->ccn_state == CCONN_ST_CONNECTING ||
+		    peer->ccn_state == CCONN_ST_HANDSHAKE ||
+		    peer->ccn_sendq_bytes > 0) {
+			/*
+			 * The peer's cconn_flush() will call us again.
+			 */
+			cloop_ent_want(peer->ccn_clent, CLOOP_CB_WRITE);
+			return;
+		}
+
+		peer->ccn_stats.ccs_syscalls++;
+		if ((n = splice(ccn->ccn_relay_pipe[0], NULL,
+		    cloop_ent_fd(peer->ccn_clent), NULL, ccn->ccn_relay_piped,
+		    SPLICE_F_MOVE | SPLICE_F_NONBLOCK)) < 0) {
+			switch (errno) {
+			case EINTR:
+				continue;
+
+			case EAGAIN:
+				cloop_ent_want(peer->ccn_clent, CLOOP_CB_WRITE);
+				return;
+
+			default:
+				if (cserver_debug) {
+					fprintf(stderr, "CCONN[%p] SPLICE OUT: "
+					    "%s\n", peer, strerror(errno));
+				}
+				cconn_advance_state(peer, CCONN_ST_ERROR);
+				return;
+			}
+		}
+
+		VERIFY3U((size_t)n, <=, ccn->ccn_relay_piped);
+		ccn->ccn_relay_piped -= (size_t)n;
+		peer->ccn_stats.ccs_bytes_out += (size_t)n;
+	}
+
+	if (ccn->ccn_recvq_end) {
+		cconn_relay_eof(ccn);
+	} else {
+		cconn_want_read(ccn);
+	}
+}
+#endif
+
+/*
+ * Undo a relay when either side is destroyed.  The peer is aborted, unless
+ * it has already finished in both directions and is only waiting for its
+ * send queue to drain.
+ */
+static void
+cconn_relay_break(cconn_t *ccn)
+{
+	cconn_t *peer = ccn->ccn_relay;
+
+	if (peer == NULL) {
+		return;
+	}
+
+#ifdef	CCONN_HAVE_SPLICE
+	cconn_relay_splice_close(ccn);
+	cconn_relay_splice_close(peer);
+#endif
+	ccn->ccn_relay = NULL;
+	peer->ccn_relay = NULL;
+
+	if (!peer->ccn_recvq_end || !peer->ccn_sendq_end) {
+		(void) cconn_abort(peer);
+	}
+}
+
+static boolean_t
+cconn_relay_ok(cconn_t *ccn)
+{
+	switch (ccn->ccn_state) {
+	case CCONN_ST_CONNECTING:
+	case CCONN_ST_HANDSHAKE:
+	case CCONN_ST_LINE_AVAILABLE:
+	case CCONN_ST_WAITING_FOR_LINE:
+	case CCONN_ST_READ_EOF:
+		return (ccn->ccn_relay == NULL ? B_TRUE : B_FALSE);
+
+	default:
+		return (B_FALSE);
+	}
+}
+
+/*
+ * Start forwarding whatever has been received so far.  A connection that is
+ * still being established starts once it reaches CCONN_ST_WAITING_FOR_LINE.
+ */
+static void
+cconn_relay_start(cconn_t *ccn)
+{
+	switch (ccn->ccn_state) {
+	case CCONN_ST_LINE_AVAILABLE:
+		cconn_next(ccn);
+		break;
+
+	case CCONN_ST_WAITING_FOR_LINE:
+		ccn_handle_incoming_data(ccn);
+		break;
+
+	case CCONN_ST_READ_EOF:
+		cconn_relay_forward(ccn);
+		break;
+
+	default:
+		break;
+	}
+}
+
+/*
+ * Join two connections, so that everything received on each is sent on the
+ * other.
+ */
+int
+cconn_relay(cconn_t *a, cconn_t *b)
+{
+	if (a == b || !cconn_relay_ok(a) || !cconn_relay_ok(b)) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	a->ccn_relay = b;
+	b->ccn_relay = a;
+#ifdef	CCONN_HAVE_SPLICE
+	cconn_relay_splice_setup(a);
+	cconn_relay_splice_setup(b);
+#endif
+
+	/*
+	 * Either connection may be closed by the time we are done.
+	 */
+	cconn_hold(a);
+	cconn_hold(b);
+	cconn_relay_start(a);
+	if (b->ccn_relay == a) {
+		cconn_relay_start(b);
 	}
+	cconn_rele(b);
+	cconn_rele(a);
+	return (0);
 }
@@ -0,0 +1,359 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <err.h>
+#include <limits.h>
+#include <sys/debug.h>
+#include <sys/types.h>
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+#include "libcbuf_impl.h"
+#include "libcbuf.h"
+#include "libcloop.h"
+#include "ctls.h"
+
+/*
+ * TLS SESSIONS
+ *
+ * Each session wraps the connection's socket descriptor directly, so that
+ * the TLS library can install the session keys in the kernel (TCP_ULP "tls"
+ * on Linux) once the handshake completes.  Each direction is offloaded
+ * independently, depending on what the kernel supports.  In an offloaded
+ * direction the ordinary read(2), writev(2) and sendfile paths are used,
+ * with the kernel framing and encrypting records on our behalf.  Otherwise
+ * records pass through the TLS library, at the cost of a copy.
+ */
+
+/*
+ * The largest TLS record payload.  File-backed buffers are sent through a
+ * bounce buffer of this size when records are built in user space.
+ */
+#define	CTLS_RECORD_MAX		16384
+
+struct ctls_ctx {
+	SSL_CTX *ctx_ssl;
+};
+
+struct ctls {
+	SSL *ct_ssl;
+	int ct_fd;
+	boolean_t ct_ktls_send;
+	boolean_t ct_ktls_recv;
+	boolean_t ct_closed;			/* close_notify sent */
+};
+
+int
+ctls_ctx_alloc(ctls_ctx_t **ctxp, const char *certfile, const char *keyfile)
+{
+	ctls_ctx_t *ctx;
+	SSL_CTX *ssl;
+
+	*ctxp = NULL;
+
+	if ((ctx = calloc(1, sizeof (*ctx))) == NULL) {
+		return (-1);
+	}
+
+	if ((ssl = SSL_CTX_new(TLS_server_method())) == NULL) {
+		free(ctx);
+		errno = ENOMEM;
+		return (-1);
+	}
+	ctx->ctx_ssl = ssl;
+
+	(void) SSL_CTX_set_min_proto_version(ssl, TLS1_2_VERSION);
+	(void) SSL_CTX_set_options(ssl, SSL_OP_NO_RENEGOTIATION);
+#ifdef	SSL_OP_ENABLE_KTLS
+	(void) SSL_CTX_set_options(ssl, SSL_OP_ENABLE_KTLS);
+#endif
+
+	/*
+	 * The send queue may grow, or a retried write may come from a fresh
+	 * bounce buffer, between the attempts to write one record.  Record
+	 * buffers are released whenever a session is idle.
+	 */
+	(void) SSL_CTX_set_mode(ssl, SSL_MODE_ENABLE_PARTIAL_WRITE |
+	    SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER | SSL_MODE_RELEASE_BUFFERS);
+
+	if (SSL_CTX_use_certificate_chain_file(ssl, certfile) != 1 ||
+	    SSL_CTX_use_PrivateKey_file(ssl, keyfile, SSL_FILETYPE_PEM) != 1 ||
+	    SSL_CTX_check_private_key(ssl) != 1) {
+		warnx("TLS certificate %s, key %s: %s", certfile, keyfile,
+		    ERR_error_string(ERR_get_error(), NULL));
+		ctls_ctx_free(ctx);
+		errno = EINVAL;
+		return (-1);
+	}
+
+	*ctxp = ctx;
+	return (0);
+}
+
+void
+ctls_ctx_free(ctls_ctx_t *ctx)
+{
+	if (ctx == NULL) {
+		return;
+	}
+
+	SSL_CTX_free(ctx->ctx_ssl);
+	free(ctx);
+}
+
+int
+ctls_alloc(ctls_t **ctlsp, ctls_ctx_t *ctx, int fd)
+{
+	ctls_t *ctls;
+
+	*ctlsp = NULL;
+
+	if ((ctls = calloc(1, sizeof (*ctls))) == NULL) {
+		return (-1);
+	}
+
+	if ((ctls->ct_ssl = SSL_new(ctx->ctx_ssl)) == NULL ||
+	    SSL_set_fd(ctls->ct_ssl, fd) != 1) {
+		ctls_free(ctls);
+		errno = ENOMEM;
+		return (-1);
+	}
+	ctls->ct_fd = fd;
+	SSL_set_accept_state(ctls->ct_ssl);
+
+	*ctlsp = ctls;
+	return (0);
+}
+
+void
+ctls_free(ctls_t *ctls)
+{
+	if (ctls == NULL) {
+		return;
+	}
+
+	SSL_free(ctls->ct_ssl);
+	free(ctls);
+}
+
+/*
+ * Translate the result of a TLS library call into errno.  A peer that
+ * violates the protocol, or closes the socket without a close_notify, is
+ * reported as a reset connection.
+ */
+static int
+ctls_error(ctls_t *ctls, int r, int *eventp)
+{
+	int e = errno;
+
+	switch (SSL_get_error(ctls->ct_ssl, r)) {
+	case SSL_ERROR_WANT_READ:
+		if (eventp != NULL) {
+			*eventp = CLOOP_CB_READ;
+		}
+		errno = EAGAIN;
+		break;
+
+	case SSL_ERROR_WANT_WRITE:
+		if (eventp != NULL) {
+			*eventp = CLOOP_CB_WRITE;
+		}
+		errno = EAGAIN;
+		break;
+
+	case SSL_ERROR_SYSCALL:
+		errno = e != 0 ? e : ECONNRESET;
+		break;
+
+	default:
+		errno = ECONNRESET;
+		break;
+	}
+
+	ERR_clear_error();
+	return (-1);
+}
+
+int
+ctls_handshake(ctls_t *ctls, int *eventp)
+{
+	int r;
+
+	ERR_clear_error();
+	errno = 0;
+	if ((r = SSL_do_handshake(ctls->ct_ssl)) != 1) {
+		return (ctls_error(ctls, r, eventp));
+	}
+
+#ifdef	SSL_OP_ENABLE_KTLS
+	ctls->ct_ktls_send = BIO_get_ktls_send(SSL_get_wbio(ctls->ct_ssl)) ?
+	    B_TRUE : B_FALSE;
+	ctls->ct_ktls_recv = BIO_get_ktls_recv(SSL_get_rbio(ctls->ct_ssl)) ?
+	    B_TRUE : B_FALSE;
+#endif
+	return (0);
+}
+
+/*
+ * Returns B_TRUE if records are framed and encrypted by the kernel in both
+ * directions.
+ */
+boolean_t
+ctls_kernel(ctls_t *ctls)
+{
+	return (ctls->ct_ktls_send && ctls->ct_ktls_recv);
+}
+
+int
+ctls_read(ctls_t *ctls, cbuf_t *cbuf, size_t want, size_t *actual)
+{
+	size_t pos = cbuf_position(cbuf);
+	int r;
+
+	if (ctls->ct_ktls_recv) {
+		if (cbuf_sys_read(cbuf, ctls->ct_fd, want, actual) != 0) {
+			/*
+			 * The kernel fails reads that arrive at a record
+			 * other than application data, such as an alert.
+			 */
+			if (errno == EIO) {
+				errno = ECONNRESET;
+			}
+			return (-1);
+		}
+		return (0);
+	}
+
+	if (cbuf_readonly(cbuf)) {
+		errno = EROFS;
+		return (-1);
+	}
+
+	if (want == CBUF_SYSREAD_ENTIRE) {
+		want = cbuf_available(cbuf);
+	}
+	if (want == 0 || want > cbuf_available(cbuf)) {
+		errno = want == 0 ? EINVAL : ENOSPC;
+		return (-1);
+	}
+	if (want > INT_MAX) {
+		want = INT_MAX;
+	}
+
+	ERR_clear_error();
+	errno = 0;
+	if ((r = SSL_read(ctls->ct_ssl, &cbuf->cbuf_data[pos],
+	    (int)want)) <= 0) {
+		if (SSL_get_error(ctls->ct_ssl, r) == SSL_ERROR_ZERO_RETURN) {
+			/*
+			 * The peer sent a close_notify: this is end-of-file.
+			 */
+			ERR_clear_error();
+			*actual = 0;
+			return (0);
+		}
+		return (ctls_error(ctls, r, NULL));
+	}
+	VERIFY0(cbuf_position_set(cbuf, pos + (size_t)r));
+
+	*actual = (size_t)r;
+	return (0);
+}
+
+/*
+ * Decrypted data held by the TLS library, which will not be signalled by
+ * the socket becoming readable.
+ */
+size_t
+ctls_pending(ctls_t *ctls)
+{
+	if (ctls->ct_ktls_recv) {
+		return (0);
+	}
+
+	return ((size_t)SSL_pending(ctls->ct_ssl));
+}
+
+/*
+ * Write one record's worth of the queue.  Unlike cbufq_sys_write(), buffers
+ * are not gathered, as each becomes at least one record of its own.
+ */
+int
+ctls_write(ctls_t *ctls, cbufq_t *cbufq, size_t want, size_t *actual)
+{
+	uint8_t bounce[CTLS_RECORD_MAX];
+	cbuf_t *cbuf;
+	void *ptr;
+	size_t len;
+	int r;
+
+	if (ctls->ct_ktls_send) {
+		return (cbufq_sys_write(cbufq, ctls->ct_fd, want, actual));
+	}
+
+	*actual = 0;
+
+	for (cbuf = cbufq_first(cbufq); cbuf != NULL &&
+	    cbuf_available(cbuf) == 0; cbuf = cbufq_next(cbufq, cbuf)) {
+		continue;
+	}
+	if (cbuf == NULL) {
+		return (0);
+	}
+
+	len = cbuf_available(cbuf);
+	if (want != CBUF_SYSREAD_ENTIRE && len > want) {
+		len = want;
+	}
+	if (CBUF_IS_FILE(cbuf)) {
+		ssize_t rsz;
+
+		if (len > sizeof (bounce)) {
+			len = sizeof (bounce);
+		}
+		if ((rsz = pread(cbuf->cbuf_fd, bounce, len, cbuf->cbuf_fdoff +
+		    (off_t)cbuf_position(cbuf))) < 0) {
+			return (-1);
+		} else if (rsz == 0) {
+			errno = EIO;
+			return (-1);
+		}
+		ptr = bounce;
+		len = (size_t)rsz;
+	} else {
+		ptr = cbuf->cbuf_data + cbuf_position(cbuf);
+		if (len > INT_MAX) {
+			len = INT_MAX;
+		}
+	}
+
+	ERR_clear_error();
+	errno = 0;
+	if ((r = SSL_write(ctls->ct_ssl, ptr, (int)len)) <= 0) {
+		return (ctls_error(ctls, r, NULL));
+	}
+
+	*actual = (size_t)r;
+	return (cbufq_discard(cbufq, (size_t)r));
+}
+
+/*
+ * Tell the peer that we have finished sending, before the socket is shut
+ * down for writing.  This is best effort: if the alert cannot be written
+ * now, the peer sees a truncated stream instead.
+ */
+void
+ctls_close_notify(ctls_t *ctls)
+{
+	if (ctls->ct_closed) {
+		return;
+	}
+	ctls->ct_closed = B_TRUE;
+
+	ERR_clear_error();
+	(void) SSL_shutdown(ctls->ct_ssl);
+	ERR_clear_error();
+}
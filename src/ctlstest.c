@@ -0,0 +1,337 @@
+/*
+ * ctlstest: exercise TLS termination over loopback.
+ *
+ * A self-signed certificate is generated at startup for a cserver in this
+ * process.  A child process then completes a handshake with it and has one
+ * line echoed back, after which a client that connects but never sends a
+ * ClientHello is opened, and must be disconnected by the handshake timeout.
+ * The exit status is zero if both checks pass.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <err.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/debug.h>
+#include <errno.h>
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+
+#include "libcbuf.h"
+#include "libcloop.h"
+
+#define	CTLSTEST_ADDR		"127.0.0.1"
+#define	CTLSTEST_PORT		"5598"
+
+/*
+ * How long to wait for a stalled handshake to be given up on.  This must
+ * exceed the server's handshake timeout.
+ */
+#define	CTLSTEST_STALL_WAIT	30
+
+static const char ctlstest_line[] = "hello, TLS\n";
+
+static custr_t *reply;
+static unsigned long naccepted;
+static unsigned long nlines;
+static boolean_t tls_ok = B_TRUE;
+
+static void
+ctlstest_on_line(cconn_t *ccn, int event)
+{
+	custr_t *line;
+
+	VERIFY(event == CCONN_CB_LINE_AVAILABLE);
+
+	if (cconn_tls(ccn) == CCONN_TLS_NONE) {
+		tls_ok = B_FALSE;
+	}
+
+	custr_reset(reply);
+	if ((line = cconn_line(ccn)) == NULL ||
+	    custr_append(reply, custr_cstr(line)) != 0 ||
+	    custr_appendc(reply, '\n') != 0) {
+		err(1, "custr");
+	}
+	cconn_next(ccn);
+	nlines++;
+
+	if (cconn_send(ccn, reply) != 0) {
+		warn("cconn_send");
+		(void) cconn_abort(ccn);
+	}
+}
+
+static void
+ctlstest_on_end(cconn_t *ccn, int event)
+{
+	VERIFY(event == CCONN_CB_END);
+
+	(void) cconn_fin(ccn);
+}
+
+static void
+ctlstest_on_incoming(cserver_t *srv, int event)
+{
+	cconn_t *ccn;
+
+	VERIFY(event == CSERVER_CB_INCOMING);
+
+	while (cserver_accept(srv, &ccn) == 0) {
+		cconn_on(ccn, CCONN_CB_LINE_AVAILABLE, ctlstest_on_line);
+		cconn_on(ccn, CCONN_CB_END, ctlstest_on_end);
+		naccepted++;
+	}
+	if (errno != EAGAIN) {
+		warn("cserver_accept");
+	}
+}
+
+/*
+ * Write a new P-256 key, and a certificate for "localhost" signed with it,
+ * to the PEM files named by "certfile" and "keyfile".
+ */
+static void
+ctlstest_mkcert(const char *certfile, const char *keyfile)
+{
+	EVP_PKEY_CTX *pctx;
+	EVP_PKEY *pkey = NULL;
+	X509 *x509;
+	X509_NAME *name;
+	FILE *f;
+
+	if ((pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL)) == NULL ||
+	    EVP_PKEY_keygen_init(pctx) != 1 ||
+	    EVP_PKEY_CTX_set_ec_paramgen_curve_nid(pctx,
+	    NID_X9_62_prime256v1) != 1 ||
+	    EVP_PKEY_keygen(pctx, &pkey) != 1) {
+		errx(1, "key generation: %s",
+		    ERR_error_string(ERR_get_error(), NULL));
+	}
+	EVP_PKEY_CTX_free(pctx);
+
+	if ((x509 = X509_new()) == NULL) {
+		errx(1, "X509_new");
+	}
+	name = X509_get_subject_name(x509);
+	if (X509_set_version(x509, 2) != 1 ||
+	    ASN1_INTEGER_set(X509_get_serialNumber(x509), 1) != 1 ||
+	    X509_gmtime_adj(X509_getm_notBefore(x509), 0) == NULL ||
+	    X509_gmtime_adj(X509_getm_notAfter(x509), 24 * 60 * 60) == NULL ||
+	    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+	    (const unsigned char *)"localhost", -1, -1, 0) != 1 ||
+	    X509_set_issuer_name(x509, name) != 1 ||
+	    X509_set_pubkey(x509, pkey) != 1 ||
+	    X509_sign(x509, pkey, EVP_sha256()) == 0) {
+		errx(1, "certificate: %s",
+		    ERR_error_string(ERR_get_error(), NULL));
+	}
+
+	if ((f = fopen(certfile, "w")) == NULL) {
+		err(1, "fopen %s", certfile);
+	}
+	if (PEM_write_X509(f, x509) != 1) {
+		errx(1, "PEM_write_X509");
+	}
+	VERIFY0(fclose(f));
+
+	if ((f = fopen(keyfile, "w")) == NULL) {
+		err(1, "fopen %s", keyfile);
+	}
+	if (PEM_write_PrivateKey(f, pkey, NULL, NULL, 0, NULL, NULL) != 1) {
+		errx(1, "PEM_write_PrivateKey");
+	}
+	VERIFY0(fclose(f));
+
+	X509_free(x509);
+	EVP_PKEY_free(pkey);
+}
+
+static int
+ctlstest_connect(const struct sockaddr_in *sin)
+{
+	int fd;
+
+	if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+		err(1, "socket");
+	}
+	if (connect(fd, (struct sockaddr *)sin, sizeof (*sin)) != 0) {
+		err(1, "connect");
+	}
+
+	return (fd);
+}
+
+/*
+ * The client, run in a child process: complete a handshake, send one line,
+ * and check that the same line comes back.  The certificate is not verified,
+ * as it is self-signed.
+ */
+static int
+ctlstest_client(const struct sockaddr_in *sin)
+{
+	char buf[sizeof (ctlstest_line)];
+	size_t got = 0;
+	SSL_CTX *ctx;
+	SSL *ssl;
+	int fd, r;
+
+	if ((ctx = SSL_CTX_new(TLS_client_method())) == NULL ||
+	    (ssl = SSL_new(ctx)) == NULL) {
+		warnx("SSL_CTX_new");
+		return (1);
+	}
+
+	fd = ctlstest_connect(sin);
+	if (SSL_set_fd(ssl, fd) != 1 || SSL_connect(ssl) != 1) {
+		warnx("handshake: %s", ERR_error_string(ERR_get_error(), NULL));
+		return (1);
+	}
+
+	if (SSL_write(ssl, ctlstest_line, sizeof (ctlstest_line) - 1) !=
+	    (int)(sizeof (ctlstest_line) - 1)) {
+		warnx("SSL_write");
+		return (1);
+	}
+	while (got < sizeof (ctlstest_line) - 1) {
+		if ((r = SSL_read(ssl, buf + got,
+		    sizeof (ctlstest_line) - 1 - got)) <= 0) {
+			warnx("SSL_read: short reply (%zu bytes)", got);
+			return (1);
+		}
+		got += r;
+	}
+	if (memcmp(buf, ctlstest_line, got) != 0) {
+		warnx("reply does not match");
+		return (1);
+	}
+
+	(void) SSL_shutdown(ssl);
+	SSL_free(ssl);
+	SSL_CTX_free(ctx);
+	VERIFY0(close(fd));
+	return (0);
+}
+
+int
+main(int argc, char *argv[])
+{
+	char certfile[] = "/tmp/ctlstest.cert.XXXXXX";
+	char keyfile[] = "/tmp/ctlstest.key.XXXXXX";
+	struct sockaddr_in sin;
+	cserver_t *csrv;
+	cloop_t *cloop;
+	unsigned int again;
+	hrtime_t start;
+	pid_t pid;
+	ssize_t n;
+	char c;
+	int status;
+	int fd;
+	int fail = 0;
+
+	if ((fd = mkstemp(certfile)) < 0) {
+		err(1, "mkstemp");
+	}
+	VERIFY0(close(fd));
+	if ((fd = mkstemp(keyfile)) < 0) {
+		err(1, "mkstemp");
+	}
+	VERIFY0(close(fd));
+	ctlstest_mkcert(certfile, keyfile);
+
+	bzero(&sin, sizeof (sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons((in_port_t)atoi(CTLSTEST_PORT));
+	VERIFY(inet_pton(AF_INET, CTLSTEST_ADDR, &sin.sin_addr) == 1);
+
+	if (custr_alloc(&reply) != 0) {
+		err(1, "custr_alloc");
+	}
+
+	if (cloop_alloc(&cloop) != 0) {
+		err(1, "cloop_alloc");
+	}
+	if (cserver_alloc(&csrv) != 0) {
+		err(1, "cserver_alloc");
+	}
+	cserver_on(csrv, CSERVER_CB_INCOMING, ctlstest_on_incoming);
+	if (cserver_tls_set(csrv, certfile, keyfile) != 0) {
+		err(1, "cserver_tls_set");
+	}
+	if (cserver_listen_tcp(csrv, cloop, CTLSTEST_ADDR,
+	    CTLSTEST_PORT) != 0) {
+		err(1, "cserver_listen_tcp");
+	}
+	(void) unlink(certfile);
+	(void) unlink(keyfile);
+
+	/*
+	 * Echo one line for a client in a child process.
+	 */
+	if ((pid = fork()) < 0) {
+		err(1, "fork");
+	} else if (pid == 0) {
+		_exit(ctlstest_client(&sin));
+	}
+	for (;;) {
+		pid_t w;
+
+		if ((w = waitpid(pid, &status, WNOHANG)) < 0) {
+			err(1, "waitpid");
+		} else if (w == pid) {
+			break;
+		}
+		if (cloop_run(cloop, &again) != 0 || !again) {
+			errx(1, "event loop stopped");
+		}
+	}
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0 || nlines != 1 ||
+	    !tls_ok) {
+		warnx("FAIL: echo over TLS");
+		fail = 1;
+	} else {
+		printf("ok: echo over TLS\n");
+	}
+
+	/*
+	 * Connect without ever starting the handshake.  The server must give
+	 * up on us; once it has, reading our end sees EOF or a reset.
+	 */
+	fd = ctlstest_connect(&sin);
+	start = gethrtime();
+	while (naccepted < 2 || cserver_connection_count(csrv) != 0) {
+		if (gethrtime() - start > CTLSTEST_STALL_WAIT * NANOSEC) {
+			break;
+		}
+		if (cloop_run(cloop, &again) != 0 || !again) {
+			errx(1, "event loop stopped");
+		}
+	}
+	n = read(fd, &c, 1);
+	if (naccepted < 2 || cserver_connection_count(csrv) != 0 ||
+	    (n != 0 && (n != -1 || errno != ECONNRESET))) {
+		warnx("FAIL: stalled handshake not disconnected");
+		fail = 1;
+	} else {
+		printf("ok: stalled handshake disconnected after %lld ms\n",
+		    (long long)((gethrtime() - start) / (NANOSEC / 1000)));
+	}
+	VERIFY0(close(fd));
+
+	cserver_free(csrv);
+	cloop_free(cloop);
+	custr_free(reply);
+	return (fail);
+}
@@ -81,17 +81,15 @@ custr_cstr(custr_t *cus)
 	return (cus->cus_data);
 }
 
+/*
+ * Ensure there is room to append "len" bytes, and a NUL terminator.
+ */
 static int
-custr_append_vprintf(custr_t *cus, const char *fmt, va_list ap)
+custr_grow(custr_t *cus, size_t len)
 {
-	int len = vsnprintf(NULL, 0, fmt, ap);
 	size_t chunksz = STRING_CHUNK_SIZE;
 
-	if (len < 0) {
-		return (-1);
-	}
-
-	while (chunksz < (size_t)len) {
+	while (chunksz < len) {
 		chunksz *= 2;
 	}
 
@@ -127,6 +125,19 @@ custr_append_vprintf(custr_t *cus, const char *fmt, va_list ap)
 		cus->cus_data = new_data;
 		cus->cus_datalen = new_datalen;
 	}
+
+	return (0);
+}
+
+static int
+custr_append_vprintf(custr_t *cus, const char *fmt, va_list ap)
+{
+	int len = vsnprintf(NULL, 0, fmt, ap);
+
+	if (len < 0 || custr_grow(cus, (size_t)len) != 0) {
+		return (-1);
+	}
+
 	/*
 	 * Append new string to existing string:
 	 */
@@ -164,6 +175,20 @@ custr_append(custr_t *cus, const char *name)
 	return (custr_append_printf(cus, "%s", name));
 }
 
+int
+custr_append_buf(custr_t *cus, const void *buf, size_t len)
+{
+	if (custr_grow(cus, len) != 0) {
+		return (-1);
+	}
+
+	(void) memcpy(cus->cus_data + cus->cus_strlen, buf, len);
+	cus->cus_strlen += len;
+	cus->cus_data[cus->cus_strlen] = '\0';
+
+	return (0);
+}
+
 int
 custr_alloc(custr_t **cus)
 {